@@ -0,0 +1,298 @@
+/**
+ * @file bench_bigroom.c
+ * @brief Latency of a message to a large room as a function of the number of
+ * event loops.
+ *
+ * The members of a room are spread round-robin over 1, 4 and 16 running
+ * event loops, and a thread that owns none of them sends them a message at
+ * a time. The message is either collected in a delivery for every loop, the
+ * sender walking every member, or handed to every loop as the range of the
+ * snapshot of the room holding its members. The time the sender is busy and
+ * the time until every member has written the message are measured. The
+ * connections write to /dev/null, so every member costs a real system call
+ * but no socket buffer is involved.
+ *
+ * Usage: bench_bigroom [members] [broadcasts per configuration]
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+/* Connections, event loops and rooms */
+#include "connection.h"
+#include "eventloop.h"
+#include "clientlist.h"
+#include "epoch.h"
+#include "msgbuf.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+
+/** Default number of members of the room */
+#define DEFAULTMEMBERS 20000
+/** Default number of broadcasts measured for every configuration */
+#define DEFAULTROUNDS 50
+/** Length of the message sent */
+#define PAYLEN 64
+/** Number of event loops started, the configurations use the first ones */
+#define MAXLOOPS 16
+
+/**
+ * Number of event loops owning the members in every configuration.
+ */
+static const int loop_counts[] = { 1, 4, MAXLOOPS };
+
+/**
+ * Room sizes measured, the last one is replaced by the number of members.
+ */
+static int room_sizes[] = { 100, 1000, DEFAULTMEMBERS };
+
+/**
+ * Running event loops.
+ */
+static struct EventLoop loops[MAXLOOPS];
+
+/**
+ * List whose only room is the one measured.
+ */
+static struct LinkedList client_list;
+
+/**
+ * Room measured.
+ */
+static struct Room *room;
+
+/**
+ * @brief Returns the current time in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Batch handler of the loops, the connections are never closed.
+ */
+static int on_batch(void) {
+	return -1;
+}
+
+/**
+ * Callbacks of the loops, they never accept nor read a connection.
+ */
+static const struct LoopHandlers handlers = {
+	.on_batch = on_batch
+};
+
+/**
+ * @brief Returns the loop owning a member, the partition of the room.
+ */
+static int owner_loop(const struct ClientInfo *cl_info) {
+	return ((const struct Connection *)cl_info)->loop->index;
+}
+
+/**
+ * @brief Returns the number of messages written by the loops so far.
+ */
+static unsigned long written(void) {
+	unsigned long total = 0;
+	for(int i = 0; i < MAXLOOPS; i++) {
+		total += atomic_load_explicit(&loops[i].stats.written,
+			memory_order_relaxed);
+	}
+	return total;
+}
+
+/**
+ * @brief Send a message to the room collecting its members in a delivery
+ * for every loop.
+ *
+ * @param buf
+ * Encoded frame.
+ */
+static void send_fanout(struct MsgBuf *buf) {
+	struct Fanout fanout;
+	fanout_init(&fanout, buf);
+	epoch_enter();
+	struct RoomSnapshot *snap = room_snapshot(room);
+	for(int i = 0; snap != NULL && i < snap->size; i++) {
+		if(fanout_add(&fanout, (struct Connection *)snap->members[i]) == -1) {
+			perror("bench_bigroom: send");
+		}
+	}
+	fanout_flush(&fanout);
+	epoch_exit();
+}
+
+/**
+ * @brief Send a message to the room handing every loop the range of its
+ * members, as the server does for the large rooms.
+ *
+ * @param buf
+ * Encoded frame.
+ */
+static void send_ranges(struct MsgBuf *buf) {
+	epoch_enter();
+	struct RoomSnapshot *snap = room_snapshot(room);
+	for(int p = 0; snap != NULL && p < snap->nparts; p++) {
+		int first = snap->part_start[p];
+		int count = snap->part_start[p + 1] - first;
+		if(count == 0) continue;
+		room_snapshot_ref(snap);
+		if(fanout_shared(buf, &loops[p], &snap->members[first], count, NULL,
+			room_snapshot_unref, snap) == -1) {
+			perror("bench_bigroom: send");
+		}
+	}
+	epoch_exit();
+}
+
+/**
+ * @brief Compare two latencies, for \c qsort().
+ */
+static int compare_latency(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Measure a way of sending a message to the room.
+ *
+ * @param name
+ * Name of the method, printed in the results.
+ * @param send
+ * Method to measure.
+ * @param buf
+ * Encoded frame.
+ * @param nloops
+ * Number of loops owning the members.
+ * @param members
+ * Number of members.
+ * @param rounds
+ * Number of broadcasts measured.
+ */
+static void measure(const char *name, void (*send)(struct MsgBuf *),
+	struct MsgBuf *buf, int nloops, int members, int rounds) {
+	uint64_t *latencies = malloc(rounds * sizeof(uint64_t));
+	uint64_t start, sender = 0;
+	unsigned long target;
+	for(int r = -1; r < rounds; r++) {
+		target = written() + members;
+		start = now_ns();
+		send(buf);
+		uint64_t sent = now_ns();
+		/* the loops need the only processor of a small machine */
+		while(written() < target) sched_yield();
+		/* the first round warms up the queues */
+		if(r < 0) continue;
+		sender += sent - start;
+		latencies[r] = now_ns() - start;
+		epoch_poll();
+	}
+	qsort(latencies, rounds, sizeof(uint64_t), compare_latency);
+	printf("%-8s %6d %8d %12.1f %12.1f %12.1f\n", name, nloops, members,
+		sender / 1e3 / rounds, latencies[rounds / 2] / 1e3,
+		latencies[rounds * 99 / 100] / 1e3);
+	free(latencies);
+}
+
+/**
+ * @brief Make the first connections the members of the room.
+ *
+ * @param conns
+ * Array of connections.
+ * @param members
+ * Number of members.
+ * @param nloops
+ * Number of loops owning the members, round-robin.
+ */
+static void build_room(struct Connection **conns, int members, int nloops) {
+	list_init(&client_list);
+	list_set_partitions(&client_list, nloops, owner_loop);
+	for(int i = 0; i < members; i++) {
+		conns[i]->loop = &loops[i % nloops];
+		if(list_insert(&client_list, &conns[i]->client_info) == -1
+			|| (room = list_join(&client_list, &conns[i]->client_info,
+			"bench")) == NULL) {
+			perror("bench_bigroom: list");
+			exit(1);
+		}
+	}
+	list_publish(&client_list);
+}
+
+int main(int argc, char *argv[]) {
+	int members = argc > 1 ? atoi(argv[1]) : DEFAULTMEMBERS;
+	int rounds = argc > 2 ? atoi(argv[2]) : DEFAULTROUNDS;
+	int listenfds[MAXLOOPS], nullfd;
+	struct Connection **conns;
+	struct Packet packet;
+	char payload[PAYLEN + 1];
+
+	if(members <= 0 || rounds <= 0) {
+		fprintf(stderr, "usage: %s [members] [broadcasts]\n", argv[0]);
+		return 1;
+	}
+	room_sizes[sizeof room_sizes / sizeof room_sizes[0] - 1] = members;
+	if((nullfd = open("/dev/null", O_WRONLY)) == -1) {
+		perror("bench_bigroom: /dev/null");
+		return 1;
+	}
+	/* the loops never accept, this thread sends from outside them */
+	for(int i = 0; i < MAXLOOPS; i++) listenfds[i] = -1;
+	if(epoch_register() == -1
+		|| eventloop_start(loops, MAXLOOPS, listenfds, &handlers,
+		&epoll_backend, 1) == -1) {
+		return 1;
+	}
+	conns = malloc(members * sizeof(struct Connection *));
+	for(int i = 0; i < members; i++) {
+		if((conns[i] = conn_create(nullfd, &loops[0])) == NULL) {
+			perror("bench_bigroom: malloc");
+			return 1;
+		}
+	}
+
+	memset(payload, 'x', PAYLEN);
+	payload[PAYLEN] = '\0';
+	memset(&packet, 0, sizeof(struct Packet));
+	packet.action = MSG;
+	strcpy(packet.alias, DEFAULTALIAS);
+	packet.payload = payload;
+	packet.len = PAYLEN;
+	struct MsgBuf *buf = msgbuf_encode(&packet);
+	if(buf == NULL) {
+		perror("bench_bigroom: malloc");
+		return 1;
+	}
+
+	printf("# %ld processors online, %d broadcasts of %zu bytes per row\n",
+		sysconf(_SC_NPROCESSORS_ONLN), rounds, packet_size(&packet));
+	printf("%-8s %6s %8s %12s %12s %12s\n", "method", "loops", "members",
+		"sender-us", "p50-us", "p99-us");
+	for(size_t s = 0; s < sizeof room_sizes / sizeof room_sizes[0]; s++) {
+		if(room_sizes[s] > members) continue;
+		for(size_t l = 0; l < sizeof loop_counts / sizeof loop_counts[0];
+			l++) {
+			build_room(conns, room_sizes[s], loop_counts[l]);
+			measure("fanout", send_fanout, buf, loop_counts[l], room_sizes[s],
+				rounds);
+			measure("ranges", send_ranges, buf, loop_counts[l], room_sizes[s],
+				rounds);
+			list_release(&client_list);
+		}
+	}
+	msgbuf_unref(buf);
+	return 0;
+}
@@ -0,0 +1,331 @@
+/**
+ * @file bench_fanout.c
+ * @brief Benchmark of the cost of a broadcast as a function of the number of
+ * recipients.
+ *
+ * A message is queued for every member of a room of 10, 100, 1000 and 10000
+ * connections, first encoding a copy of the frame for every recipient and
+ * then encoding it once in a shared buffer. The queues are emptied after
+ * every broadcast without touching any socket, so only the work done by the
+ * loop owning the recipients is measured.
+ *
+ * Then every connection is in the client list, and the room is a real room
+ * of the list: a message to it walks the snapshot of its members, while
+ * finding the members among all the clients walks the whole list.
+ *
+ * Usage: bench_fanout [payload length] [broadcasts per size]
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+/* Connections and their output queues */
+#include "connection.h"
+#include "eventloop.h"
+#include "msgbuf.h"
+
+/* Rooms of the client list */
+#include "clientlist.h"
+#include "epoch.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Default length of the broadcast message */
+#define DEFAULTPAYLEN 64
+/** Default number of broadcasts measured for every room size */
+#define DEFAULTROUNDS 200
+
+/**
+ * Number of recipients of the broadcasts measured.
+ */
+static const int room_sizes[] = { 10, 100, 1000, 10000 };
+
+/**
+ * List of all the connections.
+ */
+static struct LinkedList client_list;
+
+/**
+ * Room measured, its members are the first connections.
+ */
+static struct Room *room;
+
+/**
+ * @brief Returns the current time in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Empty the output queues as if the event loop had written them.
+ *
+ * @param loop
+ * Event loop owning the connections.
+ * @param conns
+ * Array of connections.
+ * @param n
+ * Number of connections.
+ */
+static void drain(struct EventLoop *loop, struct Connection **conns, int n) {
+	for(int i = 0; i < n; i++) {
+		outqueue_consume(&conns[i]->outq, conns[i]->outq.bytes, NULL);
+		conns[i]->flush_scheduled = 0;
+	}
+	loop->flush_list = NULL;
+}
+
+/**
+ * @brief Broadcast a packet encoding a copy of it for every recipient.
+ *
+ * @param conns
+ * Array of recipients.
+ * @param n
+ * Number of recipients.
+ * @param packet
+ * Packet to send.
+ */
+static void broadcast_copy(struct Connection **conns, int n,
+	const struct Packet *packet) {
+	for(int i = 0; i < n; i++) {
+		if(conn_send_packet(conns[i], packet) == -1) {
+			perror("bench_fanout: send");
+		}
+	}
+}
+
+/**
+ * @brief Broadcast a packet encoding it once in a buffer shared by all the
+ * recipients.
+ *
+ * @param conns
+ * Array of recipients.
+ * @param n
+ * Number of recipients.
+ * @param packet
+ * Packet to send.
+ */
+static void broadcast_shared(struct Connection **conns, int n,
+	const struct Packet *packet) {
+	struct MsgBuf *buf = msgbuf_encode(packet);
+	if(buf == NULL) {
+		perror("bench_fanout: malloc");
+		return;
+	}
+	for(int i = 0; i < n; i++) {
+		if(conn_send_buf(conns[i], buf) == -1) {
+			perror("bench_fanout: send");
+		}
+	}
+	msgbuf_unref(buf);
+}
+
+/**
+ * @brief Broadcast a packet to the members of the room as the server does,
+ * walking the snapshot of the room.
+ *
+ * @param conns
+ * Unused, the members are found in the room.
+ * @param n
+ * Unused, the members are found in the room.
+ * @param packet
+ * Packet to send.
+ */
+static void broadcast_room(struct Connection **conns, int n,
+	const struct Packet *packet) {
+	struct MsgBuf *buf = msgbuf_encode(packet);
+	struct Fanout fanout;
+	(void)conns;
+	(void)n;
+	if(buf == NULL) {
+		perror("bench_fanout: malloc");
+		return;
+	}
+	fanout_init(&fanout, buf);
+	epoch_enter();
+	struct RoomSnapshot *snap = room_snapshot(room);
+	for(int i = 0; snap != NULL && i < snap->size; i++) {
+		if(fanout_add(&fanout, (struct Connection *)snap->members[i]) == -1) {
+			perror("bench_fanout: send");
+		}
+	}
+	fanout_flush(&fanout);
+	epoch_exit();
+	msgbuf_unref(buf);
+}
+
+/**
+ * @brief Broadcast a packet to the members of the room finding them among
+ * all the clients of the list.
+ *
+ * @param conns
+ * Unused, the members are found in the list.
+ * @param n
+ * Unused, the members are found in the list.
+ * @param packet
+ * Packet to send.
+ */
+static void broadcast_scan(struct Connection **conns, int n,
+	const struct Packet *packet) {
+	struct MsgBuf *buf = msgbuf_encode(packet);
+	struct Fanout fanout;
+	(void)conns;
+	(void)n;
+	if(buf == NULL) {
+		perror("bench_fanout: malloc");
+		return;
+	}
+	fanout_init(&fanout, buf);
+	epoch_enter();
+	struct ClientSnapshot *snap = list_snapshot(&client_list);
+	for(int i = 0; snap != NULL && i < snap->size; i++) {
+		struct Connection *conn =
+			(struct Connection *)snap->entries[i].client_info;
+		if(conn->room == room && fanout_add(&fanout, conn) == -1) {
+			perror("bench_fanout: send");
+		}
+	}
+	fanout_flush(&fanout);
+	epoch_exit();
+	msgbuf_unref(buf);
+}
+
+/**
+ * @brief Measure a broadcast method on a room.
+ *
+ * @param name
+ * Name of the method, printed in the results.
+ * @param broadcast
+ * Method to measure.
+ * @param loop
+ * Event loop owning the connections.
+ * @param conns
+ * Array of recipients.
+ * @param n
+ * Number of recipients.
+ * @param packet
+ * Packet to send.
+ * @param rounds
+ * Number of broadcasts measured.
+ */
+static void measure(const char *name,
+	void (*broadcast)(struct Connection **, int, const struct Packet *),
+	struct EventLoop *loop, struct Connection **conns, int n,
+	const struct Packet *packet, int rounds) {
+	uint64_t total = 0, start;
+	size_t framelen = packet_size(packet);
+	/* warm up the queues, allocating their rings */
+	broadcast(conns, n, packet);
+	drain(loop, conns, n);
+	for(int r = 0; r < rounds; r++) {
+		start = now_ns();
+		broadcast(conns, n, packet);
+		total += now_ns() - start;
+		drain(loop, conns, n);
+	}
+	printf("%-8s %8d %14.0f %12.1f %12zu\n", name, n,
+		(double)total / rounds, (double)total / rounds / n,
+		broadcast == broadcast_copy ? framelen * n : framelen);
+}
+
+int main(int argc, char *argv[]) {
+	int paylen = argc > 1 ? atoi(argv[1]) : DEFAULTPAYLEN;
+	int rounds = argc > 2 ? atoi(argv[2]) : DEFAULTROUNDS;
+	int maxsize = room_sizes[sizeof room_sizes / sizeof room_sizes[0] - 1];
+	struct EventLoop loop;
+	struct Connection **conns;
+	struct Packet packet;
+	char *payload;
+
+	if(paylen < 0 || paylen > MAXPAYLEN || rounds <= 0) {
+		fprintf(stderr, "usage: %s [payload length] [broadcasts]\n", argv[0]);
+		return 1;
+	}
+
+	/* an event loop that is never started, driven by this thread as if the
+	broadcasts came from one of its connections */
+	memset(&loop, 0, sizeof(struct EventLoop));
+	if(eventloop_init(&loop, 0, -1, NULL, &epoll_backend) == -1) {
+		return 1;
+	}
+	eventloop_attach(&loop);
+	conns = malloc(maxsize * sizeof(struct Connection *));
+	for(int i = 0; i < maxsize; i++) {
+		if((conns[i] = conn_create(-1, &loop)) == NULL) {
+			perror("bench_fanout: malloc");
+			return 1;
+		}
+	}
+
+	payload = malloc(paylen + 1);
+	memset(payload, 'x', paylen);
+	payload[paylen] = '\0';
+	memset(&packet, 0, sizeof(struct Packet));
+	packet.action = MSG;
+	strcpy(packet.alias, DEFAULTALIAS);
+	packet.payload = payload;
+	packet.len = paylen;
+
+	printf("# frame %zu bytes, %d broadcasts per size\n", packet_size(&packet),
+		rounds);
+	printf("%-8s %8s %14s %12s %12s\n", "method", "members", "ns/broadcast",
+		"ns/member", "heap bytes");
+	for(size_t s = 0; s < sizeof room_sizes / sizeof room_sizes[0]; s++) {
+		measure("copy", broadcast_copy, &loop, conns, room_sizes[s], &packet,
+			rounds);
+		measure("shared", broadcast_shared, &loop, conns, room_sizes[s],
+			&packet, rounds);
+	}
+
+	/* every connection is a client, the room grows to the sizes measured */
+	if(epoch_register() == -1) {
+		return 1;
+	}
+	list_init(&client_list);
+	for(int i = 0; i < maxsize; i++) {
+		if(list_insert(&client_list, &conns[i]->client_info) == -1) {
+			perror("bench_fanout: list_insert");
+			return 1;
+		}
+	}
+	printf("# room of the members among %d clients\n", maxsize);
+	for(size_t s = 0, joined = 0; s < sizeof room_sizes / sizeof room_sizes[0];
+		s++) {
+		for(; joined < (size_t)room_sizes[s]; joined++) {
+			room = list_join(&client_list, &conns[joined]->client_info,
+				"bench");
+			if(room == NULL) {
+				perror("bench_fanout: list_join");
+				return 1;
+			}
+			conns[joined]->room = room;
+		}
+		list_publish(&client_list);
+		measure("room", broadcast_room, &loop, conns, room_sizes[s], &packet,
+			rounds);
+		measure("scan", broadcast_scan, &loop, conns, room_sizes[s], &packet,
+			rounds);
+	}
+	list_release(&client_list);
+	epoch_poll();
+
+	for(int i = 0; i < maxsize; i++) {
+		conn_destroy(conns[i]);
+	}
+	free(conns);
+	free(payload);
+	close(loop.wakefd);
+	close(loop.epollfd);
+	return 0;
+}
@@ -0,0 +1,192 @@
+/**
+ * @file bench_idle.c
+ * @brief Load test holding many idle connections to a running server and
+ * reporting the memory it uses.
+ *
+ * The connections are opened from the loopback addresses 127.0.0.1,
+ * 127.0.0.2, ... in turn, so that their number is not bounded by the
+ * ephemeral ports of a single source address. When the pid of a local server
+ * is given, its resident memory is read from \c /proc before and after the
+ * connections are established.
+ *
+ * The connections never send anything, so the server has to be started
+ * with \c "-h 0 -i 0": otherwise it closes them after its handshake
+ * timeout, and the memory measured and the connections held are the ones of
+ * a server that has already dropped them.
+ *
+ * Usage: bench_idle [-n connections] [-p server pid] [-a address]
+ * [-P port] [-t seconds to hold]
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+/* Networking libraries */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/** Default number of connections */
+#define DEFAULTCONNS 50000
+/** Default address of the server */
+#define DEFAULTADDR "127.0.0.1"
+/** Default port of the server */
+#define DEFAULTPORT 3495
+/** Connections opened from every source address */
+#define CONNSPERADDR 20000
+/** Connections opened before pausing, so that the server's accept queue
+does not overflow and the kernel does not retry the handshakes later */
+#define CONNSPERBURST 1024
+/** Length of the pause between two bursts, in microseconds */
+#define BURSTPAUSE 20000
+
+/**
+ * @brief Read the resident memory of a process.
+ *
+ * @param pid
+ * Process identifier.
+ *
+ * @return The resident memory in KiB, \c -1 if it could not be read.
+ */
+static long read_rss(pid_t pid) {
+	char path[64], line[256];
+	long rss = -1;
+	FILE *file;
+	snprintf(path, sizeof path, "/proc/%d/status", (int)pid);
+	if((file = fopen(path, "r")) == NULL) return -1;
+	while(fgets(line, sizeof line, file) != NULL) {
+		if(sscanf(line, "VmRSS: %ld kB", &rss) == 1) break;
+	}
+	fclose(file);
+	return rss;
+}
+
+/**
+ * @brief Open a connection to the server from a given loopback address.
+ *
+ * @param server
+ * Address of the server.
+ * @param source
+ * Index of the loopback address used as source, \c 0 is 127.0.0.1.
+ *
+ * @return The socket file descriptor, \c -1 if an error occours.
+ */
+static int open_connection(const struct sockaddr_in *server, int source) {
+	struct sockaddr_in local;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd == -1) return -1;
+	/* only a loopback server can be reached from 127.0.0.x */
+	if((ntohl(server->sin_addr.s_addr) >> 24) == 127) {
+		memset(&local, 0, sizeof local);
+		local.sin_family = AF_INET;
+		local.sin_addr.s_addr = htonl(0x7f000001 + source);
+		/* let connect() choose the port, knowing the destination */
+		int yes = 1;
+		setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &yes, sizeof yes);
+		if(bind(fd, (struct sockaddr *)&local, sizeof local) == -1) {
+			close(fd);
+			return -1;
+		}
+	}
+	if(connect(fd, (const struct sockaddr *)server, sizeof *server) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main(int argc, char *argv[]) {
+	int nconns = DEFAULTCONNS, hold = 0, opened = 0, opt;
+	pid_t pid = 0;
+	const char *addr = DEFAULTADDR;
+	int port = DEFAULTPORT;
+	struct sockaddr_in server;
+	struct rlimit fdlimit;
+	struct timespec start, end;
+	long rss_before = -1, rss_after = -1;
+	int *fds;
+
+	while((opt = getopt(argc, argv, "n:p:a:P:t:")) != -1) {
+		switch(opt) {
+			case 'n' : nconns = atoi(optarg); break;
+			case 'p' : pid = atoi(optarg); break;
+			case 'a' : addr = optarg; break;
+			case 'P' : port = atoi(optarg); break;
+			case 't' : hold = atoi(optarg); break;
+			default :
+				fprintf(stderr, "usage: %s [-n connections] [-p server pid] "
+					"[-a address] [-P port] [-t seconds]\n"
+					"the server must run with -h 0 -i 0\n", argv[0]);
+				return 1;
+		}
+	}
+	memset(&server, 0, sizeof server);
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	if(inet_pton(AF_INET, addr, &server.sin_addr) != 1) {
+		fprintf(stderr, "bench_idle: invalid address %s\n", addr);
+		return 1;
+	}
+
+	/* every connection needs a file descriptor */
+	if(getrlimit(RLIMIT_NOFILE, &fdlimit) == 0) {
+		fdlimit.rlim_cur = fdlimit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &fdlimit);
+		if(fdlimit.rlim_cur < (rlim_t)nconns + 16) {
+			fprintf(stderr, "bench_idle: only %ld file descriptors "
+				"available\n", (long)fdlimit.rlim_cur);
+		}
+	}
+	if((fds = malloc(nconns * sizeof(int))) == NULL) {
+		perror("bench_idle: malloc");
+		return 1;
+	}
+
+	if(pid > 0) rss_before = read_rss(pid);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(; opened < nconns; opened++) {
+		if((fds[opened] = open_connection(&server,
+			opened / CONNSPERADDR)) == -1) {
+			perror("bench_idle: connect");
+			break;
+		}
+		if((opened + 1) % CONNSPERBURST == 0) usleep(BURSTPAUSE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	/* give the server the time to accept the last connections */
+	sleep(1);
+	if(pid > 0) rss_after = read_rss(pid);
+
+	printf("connections %d\n", opened);
+	printf("connect_seconds %.3f\n", (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9);
+	if(rss_before >= 0 && rss_after >= 0) {
+		printf("server_rss_before_kib %ld\n", rss_before);
+		printf("server_rss_after_kib %ld\n", rss_after);
+		if(opened > 0) {
+			printf("server_bytes_per_connection %.0f\n",
+				(rss_after - rss_before) * 1024.0 / opened);
+		}
+	}
+	fflush(stdout);
+
+	if(hold > 0) sleep(hold);
+	for(int i = 0; i < opened; i++) {
+		close(fds[i]);
+	}
+	free(fds);
+	return opened == nconns ? 0 : 1;
+}
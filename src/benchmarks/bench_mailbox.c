@@ -0,0 +1,133 @@
+/**
+ * @file bench_mailbox.c
+ * @brief Memory cost and drain rate of the mailboxes of the offline aliases.
+ *
+ * Whispers of a given length are stored in the mailboxes of many aliases,
+ * then every mailbox is emptied as when its alias connects again. The
+ * memory allocated per message waiting is reported together with the time
+ * taken to store a message and the rate the mailboxes are drained at, both
+ * for mailboxes kept in memory and for mailboxes spilling to a file.
+ *
+ * Usage: bench_mailbox [aliases]
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+/* Structure measured */
+#include "mailbox.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+/** Default number of aliases */
+#define DEFAULTALIASES 1000
+
+/**
+ * Length of the messages measured.
+ */
+static const int payload_sizes[] = { 16, 256 };
+
+/**
+ * Messages stored in every mailbox, the largest ones spill to a file.
+ */
+static const int mailbox_sizes[] = { 10, 50, 500 };
+
+/**
+ * @brief Returns the current time in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Fill and drain the mailboxes of many aliases.
+ *
+ * @param naliases
+ * Number of aliases.
+ * @param paylen
+ * Length of the messages.
+ * @param count
+ * Messages stored in every mailbox.
+ */
+static void bench(int naliases, int paylen, int count) {
+	char alias[ALIASLEN], *payload = malloc(paylen + 1);
+	struct Packet packet;
+	size_t bytes, waiting, spilled, taken = 0, n;
+	uint64_t start, store_ns, take_ns;
+	memset(payload, 'x', paylen);
+	payload[paylen] = '\0';
+	memset(&packet, 0, sizeof(struct Packet));
+	packet.action = MSG;
+	strcpy(packet.alias, "sender");
+	packet.payload = payload;
+	packet.len = paylen;
+
+	start = now_ns();
+	for(int m = 0; m < count; m++) {
+		for(int i = 0; i < naliases; i++) {
+			snprintf(alias, ALIASLEN, "offline%d", i);
+			if(mailbox_store(alias, &packet) == -1) {
+				perror("bench_mailbox: mailbox_store");
+				exit(1);
+			}
+		}
+	}
+	store_ns = now_ns() - start;
+	bytes = mailbox_footprint(&waiting, &spilled);
+
+	start = now_ns();
+	for(int i = 0; i < naliases; i++) {
+		snprintf(alias, ALIASLEN, "offline%d", i);
+		struct MsgBuf *buf = mailbox_take(alias, &n);
+		if(buf == NULL) {
+			perror("bench_mailbox: mailbox_take");
+			exit(1);
+		}
+		taken += n;
+		msgbuf_unref(buf);
+	}
+	take_ns = now_ns() - start;
+
+	printf("%8d %8d %10zu %10.1f %10.1f %10.1f %12.0f\n", paylen, count,
+		waiting, (double)bytes / waiting, (double)spilled / waiting,
+		(double)store_ns / waiting, taken / (take_ns / 1e9));
+	free(payload);
+}
+
+int main(int argc, char *argv[]) {
+	int naliases = argc > 1 ? atoi(argv[1]) : DEFAULTALIASES;
+	char alias[ALIASLEN];
+	if(naliases <= 0) {
+		fprintf(stderr, "usage: %s [aliases]\n", argv[0]);
+		return 1;
+	}
+	for(int i = 0; i < naliases; i++) {
+		snprintf(alias, ALIASLEN, "offline%d", i);
+		if(mailbox_register(alias) == -1) {
+			perror("bench_mailbox: mailbox_register");
+			return 1;
+		}
+	}
+	printf("# memory and disk bytes are per message waiting, spilled past "
+		"%d bytes per mailbox\n", MAILMEMBYTES);
+	printf("%8s %8s %10s %10s %10s %10s %12s\n", "paylen", "per-box",
+		"messages", "mem-B/msg", "disk-B/msg", "store-ns", "drain-msg/s");
+	for(size_t p = 0; p < sizeof payload_sizes / sizeof payload_sizes[0];
+		p++) {
+		for(size_t s = 0; s < sizeof mailbox_sizes / sizeof mailbox_sizes[0];
+			s++) {
+			bench(naliases, payload_sizes[p], mailbox_sizes[s]);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,429 @@
+/**
+ * @file bench_micro.c
+ * @brief Microbenchmarks of the client list and of the packet codec.
+ *
+ * Every operation is measured in isolation on lists of 10 up to 100000
+ * clients, or on payloads of 16 up to 60000 bytes, and reported with its
+ * time and the number of allocations and releases of memory it makes. The
+ * calls to the allocator are counted by wrapping them at link time, so an
+ * operation leaking memory shows more allocations than releases.
+ *
+ * Usage: bench_micro [operations per measurement]
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+/* Structures measured */
+#include "clientlist.h"
+#include "packetcodec.h"
+#include "msgbuf.h"
+#include "epoch.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+/** Default number of operations of every measurement */
+#define DEFAULTOPS 200000
+/** Frames decoded by a single call to decoder_feed() */
+#define FEEDFRAMES 16
+
+/**
+ * Number of clients of the lists measured.
+ */
+static const int list_sizes[] = { 10, 100, 1000, 10000, 100000 };
+
+/**
+ * Length of the payloads measured.
+ */
+static const int payload_sizes[] = { 16, 256, 4096, 60000 };
+
+/**
+ * Calls to the allocator returning new memory since the start.
+ */
+static unsigned long allocs;
+/**
+ * Calls to the allocator releasing memory since the start.
+ */
+static unsigned long frees;
+
+/* The allocator, called by the wrappers */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+/**
+ * @brief Count the allocation and call \c malloc().
+ */
+void *__wrap_malloc(size_t size) {
+	allocs++;
+	return __real_malloc(size);
+}
+
+/**
+ * @brief Count the allocation and call \c calloc().
+ */
+void *__wrap_calloc(size_t nmemb, size_t size) {
+	allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+/**
+ * @brief Count the allocation, if any, and call \c realloc().
+ */
+void *__wrap_realloc(void *ptr, size_t size) {
+	if(ptr == NULL) allocs++;
+	return __real_realloc(ptr, size);
+}
+
+/**
+ * @brief Count the release, if any, and call \c free().
+ */
+void __wrap_free(void *ptr) {
+	if(ptr != NULL) frees++;
+	__real_free(ptr);
+}
+
+/**
+ * @struct Measure
+ *
+ * @brief Time and allocations of the operations being measured.
+ *
+ * @var Measure::ns
+ * Nanoseconds elapsed in the measured sections.
+ * @var Measure::allocs
+ * Allocations made in the measured sections.
+ * @var Measure::frees
+ * Releases made in the measured sections.
+ * @var Measure::start
+ * Beginning of the section in progress.
+ * @var Measure::start_allocs
+ * Allocations counted at the beginning of the section in progress.
+ * @var Measure::start_frees
+ * Releases counted at the beginning of the section in progress.
+ */
+struct Measure {
+	uint64_t ns;
+	unsigned long allocs;
+	unsigned long frees;
+	uint64_t start;
+	unsigned long start_allocs;
+	unsigned long start_frees;
+};
+
+/**
+ * @brief Returns the current time in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Begin a measured section.
+ *
+ * @param m
+ * Pointer to the measure.
+ */
+static void measure_begin(struct Measure *m) {
+	m->start_allocs = allocs;
+	m->start_frees = frees;
+	m->start = now_ns();
+}
+
+/**
+ * @brief End a measured section, adding its cost to the measure.
+ *
+ * @param m
+ * Pointer to the measure.
+ */
+static void measure_end(struct Measure *m) {
+	m->ns += now_ns() - m->start;
+	m->allocs += allocs - m->start_allocs;
+	m->frees += frees - m->start_frees;
+}
+
+/**
+ * @brief Print the cost of an operation.
+ *
+ * @param name
+ * Name of the operation.
+ * @param size
+ * Number of clients or length of the payload.
+ * @param m
+ * Pointer to the measure.
+ * @param ops
+ * Number of operations measured.
+ */
+static void report(const char *name, int size, const struct Measure *m,
+	long ops) {
+	printf("%-16s %8d %12.1f %12.3f %12.3f\n", name, size,
+		(double)m->ns / ops, (double)m->allocs / ops, (double)m->frees / ops);
+}
+
+/**
+ * @brief Fill a list with clients.
+ *
+ * @param ll
+ * Pointer to the list, already initialized.
+ * @param clients
+ * Array of clients.
+ * @param n
+ * Number of clients.
+ */
+static void fill_list(struct LinkedList *ll, struct ClientInfo *clients,
+	int n) {
+	for(int i = 0; i < n; i++) {
+		if(list_insert(ll, &clients[i]) == -1) {
+			fprintf(stderr, "bench_micro: cannot insert %s\n",
+				clients[i].alias);
+			exit(1);
+		}
+	}
+}
+
+/**
+ * @brief Measure the operations of a list of a given size.
+ *
+ * @param clients
+ * Array of clients, with distinct aliases and sockets.
+ * @param order
+ * Random permutation of the clients.
+ * @param n
+ * Number of clients.
+ * @param ops
+ * Approximate number of operations of every measurement.
+ */
+static void bench_list(struct ClientInfo *clients, const int *order, int n,
+	long ops) {
+	struct LinkedList ll;
+	struct Measure insert, delete, find, snapfind, idfind, publish, listing;
+	struct Measure rosterbuild, roster;
+	int rounds = ops / n > 0 ? ops / n : 1;
+	long found = 0;
+	memset(&insert, 0, sizeof(struct Measure));
+	delete = find = snapfind = idfind = publish = listing = insert;
+	rosterbuild = roster = insert;
+
+	/* the whole list is built and emptied in every round, the clients leave
+	in a different order than they joined */
+	for(int r = 0; r < rounds; r++) {
+		list_init(&ll);
+		measure_begin(&insert);
+		fill_list(&ll, clients, n);
+		measure_end(&insert);
+		measure_begin(&delete);
+		for(int i = 0; i < n; i++) {
+			list_delete(&ll, &clients[order[i]]);
+		}
+		measure_end(&delete);
+		list_release(&ll);
+	}
+	report("list_insert", n, &insert, (long)rounds * n);
+	report("list_delete", n, &delete, (long)rounds * n);
+
+	list_init(&ll);
+	fill_list(&ll, clients, n);
+	measure_begin(&find);
+	for(long i = 0; i < ops; i++) {
+		found += list_find_alias(&ll, clients[order[i % n]].alias) != NULL;
+	}
+	measure_end(&find);
+	report("list_find_alias", n, &find, ops);
+
+	/* the lookups of the server read the latest snapshot */
+	list_publish(&ll);
+	measure_begin(&snapfind);
+	for(long i = 0; i < ops; i++) {
+		found += snapshot_find_alias(list_snapshot(&ll),
+			clients[order[i % n]].alias) != NULL;
+	}
+	measure_end(&snapfind);
+	report("snapshot_find", n, &snapfind, ops);
+
+	/* the whispers by session ID read the table of the sessions */
+	measure_begin(&idfind);
+	for(long i = 0; i < ops; i++) {
+		found += list_find_id(&ll, clients[order[i % n]].id) != NULL;
+	}
+	measure_end(&idfind);
+	report("list_find_id", n, &idfind, ops);
+
+	for(int r = 0; r < rounds; r++) {
+		atomic_store(&ll.dirty, 1);
+		measure_begin(&publish);
+		list_publish(&ll);
+		measure_end(&publish);
+		/* the snapshots replaced have no reader */
+		epoch_poll();
+	}
+	report("list_publish", n, &publish, rounds);
+
+	for(int r = 0; r < rounds; r++) {
+		measure_begin(&listing);
+		char **aliases = list_clients(&ll);
+		found += aliases != NULL && aliases[n - 1][0] != '\0';
+		free(aliases);
+		measure_end(&listing);
+	}
+	report("list_clients", n, &listing, rounds);
+
+	/* the answer to a list request is encoded by the first request after
+	every change, the following ones share it */
+	for(int r = 0; r < rounds; r++) {
+		atomic_store(&ll.dirty, 1);
+		list_publish(&ll);
+		epoch_poll();
+		measure_begin(&rosterbuild);
+		found += snapshot_roster(list_snapshot(&ll)) != NULL;
+		measure_end(&rosterbuild);
+	}
+	report("roster_build", n, &rosterbuild, rounds);
+	measure_begin(&roster);
+	for(long i = 0; i < ops; i++) {
+		struct MsgBuf *buf = snapshot_roster(list_snapshot(&ll));
+		found += buf != NULL;
+		msgbuf_unref(msgbuf_ref(buf));
+	}
+	measure_end(&roster);
+	report("roster_cached", n, &roster, ops);
+
+	list_release(&ll);
+	for(int i = 0; i < 3; i++) epoch_poll();
+	if(found != 4 * ops + 2 * rounds) {
+		fprintf(stderr, "bench_micro: %ld lookups failed\n",
+			4 * ops + 2 * rounds - found);
+	}
+}
+
+/**
+ * @brief Measure the encoding and the decoding of a packet.
+ *
+ * @param paylen
+ * Length of the payload.
+ * @param ops
+ * Number of operations of every measurement.
+ */
+static void bench_codec(int paylen, long ops) {
+	struct Measure encode, decode, stream, shared;
+	struct Packet packet, decoded;
+	struct FrameDecoder decoder;
+	char *payload = malloc(paylen + 1);
+	size_t framelen;
+	char *frames;
+	long ok = 0;
+	memset(&encode, 0, sizeof(struct Measure));
+	decode = stream = shared = encode;
+
+	memset(payload, 'x', paylen);
+	payload[paylen] = '\0';
+	memset(&packet, 0, sizeof(struct Packet));
+	packet.action = MSG;
+	strcpy(packet.alias, DEFAULTALIAS);
+	packet.payload = payload;
+	packet.len = paylen;
+	framelen = packet_size(&packet);
+	frames = malloc(framelen * FEEDFRAMES);
+
+	measure_begin(&encode);
+	for(long i = 0; i < ops; i++) {
+		packet_encode(&packet, frames);
+	}
+	measure_end(&encode);
+	report("packet_encode", paylen, &encode, ops);
+
+	measure_begin(&shared);
+	for(long i = 0; i < ops; i++) {
+		msgbuf_unref(msgbuf_encode(&packet));
+	}
+	measure_end(&shared);
+	report("msgbuf_encode", paylen, &shared, ops);
+
+	measure_begin(&decode);
+	for(long i = 0; i < ops; i++) {
+		ok += packet_decode(frames, framelen, &decoded) == (ssize_t)framelen;
+	}
+	measure_end(&decode);
+	report("packet_decode", paylen, &decode, ops);
+
+	/* the frames arrive in chunks, as from a socket */
+	for(int i = 1; i < FEEDFRAMES; i++) {
+		memcpy(&frames[i * framelen], frames, framelen);
+	}
+	decoder_init(&decoder);
+	measure_begin(&stream);
+	for(long i = 0; i < ops; i += FEEDFRAMES) {
+		if(decoder_feed(&decoder, frames, framelen * FEEDFRAMES) == -1) {
+			perror("bench_micro: decoder_feed");
+			break;
+		}
+		while(decoder_next(&decoder, &decoded) == 1) ok++;
+	}
+	measure_end(&stream);
+	decoder_release(&decoder);
+	report("decoder_next", paylen, &stream,
+		(ops + FEEDFRAMES - 1) / FEEDFRAMES * FEEDFRAMES);
+
+	if(ok < 2 * ops) {
+		fprintf(stderr, "bench_micro: %ld frames not decoded\n", 2 * ops - ok);
+	}
+	free(frames);
+	free(payload);
+}
+
+int main(int argc, char *argv[]) {
+	long ops = argc > 1 ? atol(argv[1]) : DEFAULTOPS;
+	int maxsize = list_sizes[sizeof list_sizes / sizeof list_sizes[0] - 1];
+	struct ClientInfo *clients;
+	int *order;
+
+	if(ops <= 0) {
+		fprintf(stderr, "usage: %s [operations per measurement]\n", argv[0]);
+		return 1;
+	}
+	clients = malloc(maxsize * sizeof(struct ClientInfo));
+	order = malloc(maxsize * sizeof(int));
+	if(clients == NULL || order == NULL) {
+		perror("bench_micro: malloc");
+		return 1;
+	}
+
+	printf("%-16s %8s %12s %12s %12s\n", "operation", "size", "ns/op",
+		"allocs/op", "frees/op");
+	printf("# client list, size is the number of clients\n");
+	for(size_t s = 0; s < sizeof list_sizes / sizeof list_sizes[0]; s++) {
+		int n = list_sizes[s];
+		srand(n);
+		for(int i = 0; i < n; i++) {
+			clients[i].sockfd = i + 3;
+			snprintf(clients[i].alias, ALIASLEN, "client%d", i);
+			order[i] = i;
+		}
+		/* Fisher-Yates shuffle */
+		for(int i = n - 1; i > 0; i--) {
+			int j = rand() % (i + 1), tmp = order[i];
+			order[i] = order[j];
+			order[j] = tmp;
+		}
+		bench_list(clients, order, n, ops);
+	}
+
+	printf("# packet codec, size is the length of the payload\n");
+	for(size_t s = 0; s < sizeof payload_sizes / sizeof payload_sizes[0];
+		s++) {
+		bench_codec(payload_sizes[s], ops);
+	}
+
+	free(clients);
+	free(order);
+	return 0;
+}
@@ -0,0 +1,240 @@
+/**
+ * @file bench_search.c
+ * @brief Indexing lag, query latency and memory of the search index.
+ *
+ * Messages made of words drawn from a Zipf distribution are appended to a
+ * history in a temporary directory while the indexer runs. The number of
+ * messages not indexed yet is sampled during the appends, then the time the
+ * indexer takes to catch up is measured. Afterwards queries for rare, common
+ * and pairs of words are timed, and the memory of the index is reported.
+ *
+ * Usage: bench_search [messages]
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+/* Structures measured */
+#include "history.h"
+#include "search.h"
+#include "msgbuf.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+
+/** Default number of messages */
+#define DEFAULTMESSAGES 10000000
+/** Number of distinct words */
+#define VOCABULARY 50000
+/** Number of distinct senders */
+#define SENDERS 1000
+/** Queries timed for every kind */
+#define QUERIES 1000
+/** Appends between two samples of the indexing lag */
+#define LAGSAMPLE 100000
+
+/**
+ * Cumulative probability of the words, the word of rank \c i is drawn with
+ * probability proportional to 1 / (i + 1).
+ */
+static double cumulative[VOCABULARY];
+
+/**
+ * @brief Returns the current time in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Write the word of a given rank.
+ *
+ * @param rank
+ * Rank of the word, \c 0 is the most frequent.
+ * @param out
+ * Buffer that will contain the word.
+ *
+ * @return The length of the word.
+ */
+static int word(int rank, char *out) {
+	int len = 0;
+	/* distinct words of two to four letters */
+	for(rank += 26; rank > 0; rank /= 26) out[len++] = 'a' + rank % 26;
+	out[len] = '\0';
+	return len;
+}
+
+/**
+ * @brief Returns the rank of a word drawn from the Zipf distribution.
+ */
+static int draw(void) {
+	double p = (double)rand() / RAND_MAX;
+	int lo = 0, hi = VOCABULARY - 1;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(cumulative[mid] < p) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * @brief Compare two latencies, for \c qsort().
+ */
+static int compare(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Time the queries built from pairs of ranks drawn in a range.
+ *
+ * @param name
+ * Name of the kind of query.
+ * @param lo
+ * Lowest rank.
+ * @param hi
+ * Highest rank, excluded.
+ * @param nwords
+ * Words per query.
+ */
+static void bench_queries(const char *name, int lo, int hi, int nwords) {
+	static uint64_t latencies[QUERIES];
+	char query[64], *out = malloc(MAXPAYLEN);
+	size_t bytes = 0;
+	uint64_t start;
+	int found = 0;
+	for(int q = 0; q < QUERIES; q++) {
+		int len = 0;
+		for(int w = 0; w < nwords; w++) {
+			len += word(lo + rand() % (hi - lo), &query[len]);
+			query[len++] = ' ';
+		}
+		query[len] = '\0';
+		start = now_ns();
+		size_t n = search_query(query, out, MAXPAYLEN);
+		latencies[q] = now_ns() - start;
+		bytes += n;
+		found += n > 0;
+	}
+	qsort(latencies, QUERIES, sizeof(uint64_t), compare);
+	printf("%-12s %8d %10.1f %10.1f %10.1f %12zu\n", name, found,
+		latencies[QUERIES / 2] / 1e3, latencies[QUERIES * 99 / 100] / 1e3,
+		latencies[QUERIES - 1] / 1e3, bytes / QUERIES);
+	free(out);
+}
+
+/**
+ * @brief Remove the temporary history.
+ *
+ * @param dir
+ * Directory of the history.
+ */
+static void remove_history(const char *dir) {
+	char path[256];
+	struct dirent *entry;
+	DIR *d = opendir(dir);
+	while(d != NULL && (entry = readdir(d)) != NULL) {
+		if(entry->d_name[0] == '.') continue;
+		if(snprintf(path, sizeof path, "%s/%s", dir, entry->d_name)
+			< (int)sizeof path) {
+			unlink(path);
+		}
+	}
+	if(d != NULL) closedir(d);
+	rmdir(dir);
+}
+
+int main(int argc, char *argv[]) {
+	long messages = argc > 1 ? atol(argv[1]) : DEFAULTMESSAGES;
+	char dir[] = "/tmp/bench_search.XXXXXX", payload[128];
+	struct Packet packet;
+	unsigned long lag, maxlag = 0, lagsum = 0, samples = 0;
+	uint64_t start, appended_ns, caught_ns;
+	size_t terms, postings, bytes;
+	double sum = 0;
+	if(messages <= 0) {
+		fprintf(stderr, "usage: %s [messages]\n", argv[0]);
+		return 1;
+	}
+	for(int i = 0; i < VOCABULARY; i++) cumulative[i] = sum += 1.0 / (i + 1);
+	for(int i = 0; i < VOCABULARY; i++) cumulative[i] /= sum;
+	if(mkdtemp(dir) == NULL
+		|| history_open(dir, HISTMAXSEGMENTS, 0) == -1
+		|| search_start() == -1) {
+		perror("bench_search: history");
+		return 1;
+	}
+
+	memset(&packet, 0, sizeof(struct Packet));
+	packet.action = MSG;
+	packet.payload = payload;
+	srand(1);
+	start = now_ns();
+	for(long m = 0; m < messages; m++) {
+		/* three to seven words */
+		int len = 0, nwords = 3 + rand() % 5;
+		for(int w = 0; w < nwords; w++) {
+			len += word(draw(), &payload[len]);
+			payload[len++] = ' ';
+		}
+		payload[--len] = '\0';
+		packet.len = len;
+		snprintf(packet.alias, ALIASLEN, "user%d", rand() % SENDERS);
+		struct MsgBuf *buf = msgbuf_encode(&packet);
+		if(buf == NULL || history_append(buf) == -1) {
+			perror("bench_search: append");
+			return 1;
+		}
+		msgbuf_unref(buf);
+		if((m + 1) % LAGSAMPLE == 0) {
+			lag = m + 1 - search_indexed();
+			maxlag = lag > maxlag ? lag : maxlag;
+			lagsum += lag;
+			samples++;
+		}
+	}
+	appended_ns = now_ns() - start;
+	while(search_indexed() < (unsigned long)messages) usleep(1000);
+	caught_ns = now_ns() - start;
+
+	printf("messages %ld\n", messages);
+	printf("append_rate %.0f\n", messages / (appended_ns / 1e9));
+	printf("index_rate %.0f\n", messages / (caught_ns / 1e9));
+	printf("lag_mean_messages %.0f\n", samples > 0
+		? (double)lagsum / samples : 0.0);
+	printf("lag_max_messages %lu\n", maxlag);
+	printf("catch_up_ms %.1f\n", (caught_ns - appended_ns) / 1e6);
+	/* the segments beyond the retention limit are dropped with their
+	postings */
+	usleep(2 * SEARCHINDEXMS * 1000);
+	bytes = search_footprint(&terms, &postings);
+	printf("index_terms %zu\n", terms);
+	printf("index_postings %zu\n", postings);
+	printf("index_mib %.1f\n", bytes / 1048576.0);
+	printf("index_bytes_per_posting %.2f\n", (double)bytes / postings);
+
+	printf("%-12s %8s %10s %10s %10s %12s\n", "query", "found", "p50-us",
+		"p99-us", "max-us", "result-B");
+	bench_queries("rare", VOCABULARY - 10000, VOCABULARY, 1);
+	bench_queries("mid", 100, 1000, 1);
+	bench_queries("common", 0, 10, 1);
+	bench_queries("mid-pair", 100, 1000, 2);
+	bench_queries("common-pair", 0, 10, 2);
+
+	search_stop();
+	history_close();
+	remove_history(dir);
+	return 0;
+}
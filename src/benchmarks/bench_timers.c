@@ -0,0 +1,163 @@
+/**
+ * @file bench_timers.c
+ * @brief Cost of the timeouts of many connections, kept in a timing wheel or
+ * checked by walking every connection.
+ *
+ * Every connection has a timer re-armed at each expiration, like the
+ * heartbeat of an idle client, with a period spread between one and two
+ * times the given one. The time is simulated, so the run only measures the
+ * bookkeeping: the cost of arming the timers, and the cost of every tick of
+ * the wheel against a walk of the deadlines of every connection at every
+ * tick.
+ *
+ * Usage: bench_timers [connections] [period in seconds] [simulated seconds]
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+/* Timing wheel */
+#include "timerwheel.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/** Default number of connections */
+#define DEFAULTCONNS 100000
+/** Default period of the timers, in seconds */
+#define DEFAULTPERIOD 30
+/** Default simulated time, in seconds */
+#define DEFAULTSECONDS 300
+
+/**
+ * @struct BenchConn
+ *
+ * @brief Connection owning a timer.
+ *
+ * @var BenchConn::timer
+ * Timer in the wheel.
+ * @var BenchConn::deadline
+ * Expiration checked by the walk, in milliseconds.
+ * @var BenchConn::period
+ * Period of the timer, in milliseconds.
+ */
+struct BenchConn {
+	struct Timer timer;
+	uint64_t deadline;
+	uint64_t period;
+};
+
+/**
+ * Wheel holding the timers.
+ */
+static struct TimerWheel wheel;
+
+/**
+ * Simulated time, in milliseconds.
+ */
+static uint64_t now_ms;
+
+/**
+ * Number of expirations handled.
+ */
+static unsigned long expired;
+
+/**
+ * @brief Returns the current time in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Re-arm the timer of a connection, as the server does when it sends
+ * a heartbeat.
+ */
+static void on_expire(struct Timer *timer) {
+	struct BenchConn *c = (struct BenchConn *)((char *)timer
+		- offsetof(struct BenchConn, timer));
+	expired++;
+	timer_schedule(&wheel, timer, now_ms + c->period);
+}
+
+int main(int argc, char *argv[]) {
+	int nconns = argc > 1 ? atoi(argv[1]) : DEFAULTCONNS;
+	int period = argc > 2 ? atoi(argv[2]) : DEFAULTPERIOD;
+	int seconds = argc > 3 ? atoi(argv[3]) : DEFAULTSECONDS;
+	struct BenchConn *conns;
+	uint64_t start, armed, wheel_ns, walk_ns, worst = 0;
+	unsigned long ticks, walked = 0;
+
+	if(nconns <= 0 || period <= 0 || seconds <= 0) {
+		fprintf(stderr, "usage: %s [connections] [period] [seconds]\n",
+			argv[0]);
+		return 1;
+	}
+	if((conns = malloc(nconns * sizeof(struct BenchConn))) == NULL) {
+		perror("bench_timers: malloc");
+		return 1;
+	}
+	srand(1);
+	now_ms = 1000000;
+	timerwheel_init(&wheel, now_ms);
+	for(int i = 0; i < nconns; i++) {
+		conns[i].period = period * 1000 + rand() % (period * 1000);
+		timer_init(&conns[i].timer, on_expire);
+	}
+
+	/* the connections arrive in a burst */
+	start = now_ns();
+	for(int i = 0; i < nconns; i++) {
+		timer_schedule(&wheel, &conns[i].timer, now_ms + conns[i].period);
+	}
+	armed = now_ns() - start;
+
+	/* the wheel only visits the slot expiring at every tick */
+	ticks = (unsigned long)seconds * 1000 / TIMERTICKMS;
+	wheel_ns = 0;
+	for(unsigned long t = 0; t < ticks; t++) {
+		now_ms += TIMERTICKMS;
+		start = now_ns();
+		timerwheel_advance(&wheel, now_ms);
+		uint64_t elapsed = now_ns() - start;
+		wheel_ns += elapsed;
+		if(elapsed > worst) worst = elapsed;
+	}
+
+	/* the walk checks the deadline of every connection at every tick */
+	now_ms = 1000000;
+	for(int i = 0; i < nconns; i++) {
+		conns[i].deadline = now_ms + conns[i].period;
+	}
+	start = now_ns();
+	for(unsigned long t = 0; t < ticks; t++) {
+		now_ms += TIMERTICKMS;
+		for(int i = 0; i < nconns; i++) {
+			if(conns[i].deadline > now_ms) continue;
+			conns[i].deadline = now_ms + conns[i].period;
+			walked++;
+		}
+	}
+	walk_ns = now_ns() - start;
+
+	printf("# %d connections, period %d-%d s, %d s simulated in %lu ticks "
+		"of %d ms\n", nconns, period, 2 * period, seconds, ticks,
+		TIMERTICKMS);
+	printf("arm:   %8.1f ns per timer\n", (double)armed / nconns);
+	printf("wheel: %8.1f us per tick (worst %.1f us), %8.1f ns per "
+		"expiration, %lu expirations\n", wheel_ns / 1e3 / ticks, worst / 1e3,
+		expired > 0 ? (double)wheel_ns / expired : 0.0, expired);
+	printf("walk:  %8.1f us per tick, %lu expirations\n",
+		walk_ns / 1e3 / ticks, walked);
+	free(conns);
+	return 0;
+}
@@ -0,0 +1,675 @@
+/**
+ * @file chatbench.c
+ * @brief Load generator simulating many clients of a running server.
+ *
+ * The clients connect, choose the aliases bench0, bench1, ... and then send
+ * SHOUT, WHISPER, LIST_Q and MULTICAST packets in the proportions given, at
+ * a target rate shared by all of them. A multicast reaches a group of
+ * distinct clients, so its cost can be compared with the one of as many
+ * whispers. The payload of every message starts with the
+ * time it has been sent at, so the latency of each delivery is measured
+ * when a client receives it; the latency of a list is measured from the
+ * request to its answer. The results are printed one per line as
+ * \c "key value", so that the runs of two versions of the server can be
+ * compared.
+ *
+ * A share of the clients can be slow readers: they never read nor send
+ * anything after choosing their alias, and their receive buffer is small,
+ * so the server has to deal with their output queues filling up while the
+ * latency of the other clients is measured.
+ *
+ * Usage: chatbench [-n connections] [-r messages per second]
+ * [-t seconds] [-m shout:whisper:list[:multicast]] [-g recipients of a
+ * multicast] [-l payload length] [-a address] [-P port] [-S seed]
+ * [-s percentage of slow readers]
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+/* Encoding and decoding of the packets */
+#include "packetcodec.h"
+
+/* Utility methods to handle network objects */
+#include "networkutil.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+/* Networking libraries */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/** Default number of connections */
+#define DEFAULTCONNS 1000
+/** Default number of messages sent every second by all the clients */
+#define DEFAULTRATE 1000
+/** Default length of the measurement, in seconds */
+#define DEFAULTSECONDS 10
+/** Default length of the payload of the messages */
+#define DEFAULTPAYLEN 64
+/** Default number of recipients of a multicast */
+#define DEFAULTGROUP 5
+/** Default address of the server */
+#define DEFAULTADDR "127.0.0.1"
+/** Default port of the server */
+#define DEFAULTPORT 3495
+/** Connections opened from every source address */
+#define CONNSPERADDR 20000
+/** Time given to the server to register the aliases before the
+measurement, in milliseconds */
+#define SETTLEMS 500
+/** Time given to the last messages to be delivered after the measurement,
+in milliseconds */
+#define DRAINMS 2000
+/** Receive buffer of the slow readers, in bytes */
+#define SLOWRCVBUF 4096
+/** Maximum number of events handled by a call to epoll_wait() */
+#define MAXEVENTS 256
+/** Sub-buckets of every power of two of a latency histogram, the
+percentiles are accurate within 1/HISTSUB */
+#define HISTSUB 32
+/** Powers of two covered by a latency histogram, in nanoseconds */
+#define HISTPOWERS 40
+
+/**
+ * @struct Histogram
+ *
+ * @brief Distribution of latencies, with a bucket for every 1/HISTSUB of
+ * every power of two of nanoseconds.
+ *
+ * @var Histogram::buckets
+ * Number of samples in every bucket.
+ * @var Histogram::count
+ * Total number of samples.
+ * @var Histogram::max
+ * Largest sample.
+ */
+struct Histogram {
+	uint64_t buckets[HISTPOWERS * HISTSUB];
+	uint64_t count;
+	uint64_t max;
+};
+
+/**
+ * @struct BenchClient
+ *
+ * @brief Simulated client.
+ *
+ * @var BenchClient::fd
+ * Socket connected to the server.
+ * @var BenchClient::alias
+ * Alias of the client.
+ * @var BenchClient::decoder
+ * Packets being received.
+ * @var BenchClient::out
+ * Bytes the socket has not accepted yet.
+ * @var BenchClient::outlen
+ * Number of bytes in \c out.
+ * @var BenchClient::outcap
+ * Capacity of \c out.
+ * @var BenchClient::list_sent
+ * Time the pending list request has been sent at, \c 0 if none is pending.
+ * @var BenchClient::slow
+ * \c 1 if the client never reads.
+ */
+struct BenchClient {
+	int fd;
+	char alias[ALIASLEN];
+	struct FrameDecoder decoder;
+	char *out;
+	size_t outlen;
+	size_t outcap;
+	uint64_t list_sent;
+	int slow;
+};
+
+/**
+ * @struct BenchStats
+ *
+ * @brief Counters of a run.
+ *
+ * @var BenchStats::shouts
+ * SHOUT packets sent.
+ * @var BenchStats::whispers
+ * WHISPER packets sent.
+ * @var BenchStats::lists
+ * LIST_Q packets sent.
+ * @var BenchStats::multicasts
+ * MULTICAST packets sent.
+ * @var BenchStats::delivered
+ * Messages received.
+ * @var BenchStats::answered
+ * List answers received.
+ * @var BenchStats::not_found
+ * Whispers and multicasts with a recipient not found.
+ * @var BenchStats::bytes
+ * Bytes received.
+ * @var BenchStats::lost
+ * Connections lost during the run.
+ * @var BenchStats::delivery
+ * Latency of the messages received.
+ * @var BenchStats::list
+ * Latency of the list answers.
+ */
+struct BenchStats {
+	uint64_t shouts;
+	uint64_t whispers;
+	uint64_t lists;
+	uint64_t multicasts;
+	uint64_t delivered;
+	uint64_t answered;
+	uint64_t not_found;
+	uint64_t bytes;
+	uint64_t lost;
+	struct Histogram delivery;
+	struct Histogram list;
+};
+
+/**
+ * @brief Returns the current time in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Add a sample to a latency histogram.
+ *
+ * @param hist
+ * Pointer to the histogram.
+ * @param ns
+ * Latency in nanoseconds.
+ */
+static void hist_record(struct Histogram *hist, uint64_t ns) {
+	int power = 0;
+	size_t index;
+	/* the values below 2 * HISTSUB are stored exactly */
+	while((ns >> power) >= 2 * HISTSUB) power++;
+	index = power == 0 ? ns
+		: (power + 1) * HISTSUB + ((ns >> power) - HISTSUB);
+	if(index >= HISTPOWERS * HISTSUB) index = HISTPOWERS * HISTSUB - 1;
+	hist->buckets[index]++;
+	hist->count++;
+	if(ns > hist->max) hist->max = ns;
+}
+
+/**
+ * @brief Returns a percentile of a latency histogram.
+ *
+ * @param hist
+ * Pointer to the histogram.
+ * @param percentile
+ * Percentile requested, between \c 0 and \c 100.
+ *
+ * @return The upper bound of the bucket containing the percentile, in
+ * nanoseconds, \c 0 if the histogram is empty.
+ */
+static uint64_t hist_percentile(const struct Histogram *hist,
+	double percentile) {
+	uint64_t rank = (uint64_t)(hist->count * percentile / 100.0), seen = 0;
+	if(hist->count == 0) return 0;
+	if(rank >= hist->count) rank = hist->count - 1;
+	for(size_t i = 0; i < HISTPOWERS * HISTSUB; i++) {
+		seen += hist->buckets[i];
+		if(seen > rank) {
+			if(i < 2 * HISTSUB) return i;
+			int power = i / HISTSUB - 1;
+			uint64_t upper = ((i % HISTSUB + HISTSUB + 1) << power) - 1;
+			return upper < hist->max ? upper : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+/**
+ * @brief Print the percentiles of a latency histogram.
+ *
+ * @param name
+ * Prefix of the keys printed.
+ * @param hist
+ * Pointer to the histogram.
+ */
+static void hist_print(const char *name, const struct Histogram *hist) {
+	printf("%s_samples %llu\n", name, (unsigned long long)hist->count);
+	printf("%s_p50_us %.1f\n", name, hist_percentile(hist, 50) / 1e3);
+	printf("%s_p99_us %.1f\n", name, hist_percentile(hist, 99) / 1e3);
+	printf("%s_p999_us %.1f\n", name, hist_percentile(hist, 99.9) / 1e3);
+	printf("%s_max_us %.1f\n", name, hist->max / 1e3);
+}
+
+/**
+ * @brief Open a connection to the server from a given loopback address.
+ *
+ * @param server
+ * Address of the server.
+ * @param source
+ * Index of the loopback address used as source, \c 0 is 127.0.0.1.
+ *
+ * @return The socket file descriptor, \c -1 if an error occours.
+ */
+static int open_connection(const struct sockaddr_in *server, int source) {
+	struct sockaddr_in local;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd == -1) return -1;
+	/* only a loopback server can be reached from 127.0.0.x */
+	if((ntohl(server->sin_addr.s_addr) >> 24) == 127) {
+		memset(&local, 0, sizeof local);
+		local.sin_family = AF_INET;
+		local.sin_addr.s_addr = htonl(0x7f000001 + source);
+		/* let connect() choose the port, knowing the destination */
+		int yes = 1;
+		setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &yes, sizeof yes);
+		if(bind(fd, (struct sockaddr *)&local, sizeof local) == -1) {
+			close(fd);
+			return -1;
+		}
+	}
+	if(connect(fd, (const struct sockaddr *)server, sizeof *server) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * @brief Write as many queued bytes of a client as the socket accepts.
+ *
+ * @param client
+ * Pointer to the client.
+ *
+ * @return \c 0 if successful, \c -1 if the connection has been lost.
+ */
+static int client_flush(struct BenchClient *client) {
+	size_t sent = 0;
+	while(sent < client->outlen) {
+		ssize_t n = send(client->fd, client->out + sent,
+			client->outlen - sent, MSG_NOSIGNAL);
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return -1;
+		}
+		sent += n;
+	}
+	memmove(client->out, client->out + sent, client->outlen - sent);
+	client->outlen -= sent;
+	return 0;
+}
+
+/**
+ * @brief Queue a packet on a client and write it if possible.
+ *
+ * @param client
+ * Pointer to the client.
+ * @param packet
+ * Packet to send.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+static int client_send(struct BenchClient *client,
+	const struct Packet *packet) {
+	size_t size = packet_size(packet);
+	if(client->outlen + size > client->outcap) {
+		size_t newcap = client->outcap ? client->outcap : 4096;
+		char *newbuf;
+		while(newcap < client->outlen + size) newcap *= 2;
+		if((newbuf = realloc(client->out, newcap)) == NULL) return -1;
+		client->out = newbuf;
+		client->outcap = newcap;
+	}
+	client->outlen += packet_encode(packet, client->out + client->outlen);
+	return client_flush(client);
+}
+
+/**
+ * @brief Send a message of a random kind from a client.
+ *
+ * @param clients
+ * Array of clients.
+ * @param nclients
+ * Number of clients.
+ * @param sender
+ * Index of the client sending the message.
+ * @param mix
+ * Weights of SHOUT, WHISPER, LIST_Q and MULTICAST.
+ * @param group
+ * Number of recipients of a multicast, lower than \c nclients.
+ * @param payload
+ * Buffer of the payload, it is filled with the time and the padding.
+ * @param paylen
+ * Length of the payload.
+ * @param seed
+ * State of the random generator.
+ * @param stats
+ * Counters of the run.
+ *
+ * @return \c 0 if successful, \c -1 if the connection has been lost.
+ */
+static int send_message(struct BenchClient *clients, int nclients, int sender,
+	const int mix[4], int group, char *payload, int paylen,
+	unsigned int *seed, struct BenchStats *stats) {
+	struct BenchClient *client = &clients[sender];
+	struct Packet packet;
+	int pick = rand_r(seed) % (mix[0] + mix[1] + mix[2] + mix[3]);
+	int len = 0;
+	memset(&packet, 0, sizeof(struct Packet));
+	strcpy(packet.alias, client->alias);
+	packet.payload = payload;
+	if(pick >= mix[0] + mix[1] + mix[2]) {
+		/* the recipients are the clients following a random one, skipping
+		the sender */
+		if(nclients < 2) return 0;
+		if(group > nclients - 1) group = nclients - 1;
+		int first = rand_r(seed) % (nclients - 1);
+		packet.action = MULTICAST;
+		for(int j = 0; j < group; j++) {
+			int target = (sender + 1 + (first + j) % (nclients - 1))
+				% nclients;
+			len += sprintf(&payload[len], "%s%c", clients[target].alias,
+				j < group - 1 ? ',' : ' ');
+		}
+		stats->multicasts++;
+	}
+	else if(pick >= mix[0] + mix[1]) {
+		/* a client waits for its list before asking another one */
+		if(client->list_sent != 0) return 0;
+		packet.action = LIST_Q;
+		client->list_sent = now_ns();
+		stats->lists++;
+		return client_send(client, &packet);
+	}
+	else if(pick >= mix[0]) {
+		/* the recipient is any other client */
+		int target = rand_r(seed) % (nclients > 1 ? nclients - 1 : 1);
+		if(nclients > 1 && target >= sender) target++;
+		packet.action = WHISPER;
+		len = sprintf(payload, "%s ", clients[target].alias);
+		stats->whispers++;
+	}
+	else {
+		packet.action = SHOUT;
+		stats->shouts++;
+	}
+	/* the recipient reads the time back from the beginning of the message,
+	which is padded to the same length whatever its recipients */
+	int head = len;
+	len += sprintf(&payload[len], "%llu ", (unsigned long long)now_ns());
+	if(len < head + paylen) {
+		memset(&payload[len], 'x', head + paylen - len);
+		len = head + paylen;
+	}
+	payload[len] = '\0';
+	packet.len = len;
+	return client_send(client, &packet);
+}
+
+/**
+ * @brief Handle the packets received by a client.
+ *
+ * @param client
+ * Pointer to the client.
+ * @param stats
+ * Counters of the run.
+ *
+ * @return \c 0 if successful, \c -1 if the connection has been lost.
+ */
+static int client_receive(struct BenchClient *client,
+	struct BenchStats *stats) {
+	struct Packet packet;
+	ssize_t n;
+	int ret;
+	while((n = decoder_recv(&client->decoder, client->fd)) > 0) {
+		stats->bytes += n;
+		while((ret = decoder_next(&client->decoder, &packet)) == 1) {
+			uint64_t now = now_ns();
+			switch(packet.action) {
+				case MSG :
+					if(packet.payload != NULL) {
+						uint64_t sent = strtoull(packet.payload, NULL, 10);
+						if(sent != 0 && sent <= now) {
+							hist_record(&stats->delivery, now - sent);
+						}
+					}
+					stats->delivered++;
+					break;
+				case LIST_A :
+					if(client->list_sent != 0) {
+						hist_record(&stats->list, now - client->list_sent);
+						client->list_sent = 0;
+					}
+					stats->answered++;
+					break;
+				case UNF :
+					stats->not_found++;
+					break;
+			}
+		}
+		if(ret == -1) return -1;
+	}
+	if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return -1;
+	return 0;
+}
+
+/**
+ * @brief Handle the events of the clients until a deadline.
+ *
+ * @param epollfd
+ * epoll instance watching the clients.
+ * @param clients
+ * Array of clients.
+ * @param timeout
+ * Maximum time waited for an event, in milliseconds.
+ * @param stats
+ * Counters of the run.
+ */
+static void poll_clients(int epollfd, struct BenchClient *clients,
+	int timeout, struct BenchStats *stats) {
+	struct epoll_event events[MAXEVENTS];
+	int n = epoll_wait(epollfd, events, MAXEVENTS, timeout);
+	for(int i = 0; i < n; i++) {
+		struct BenchClient *client = &clients[events[i].data.u32];
+		if(client->fd == -1) continue;
+		if(((events[i].events & EPOLLOUT) && client_flush(client) == -1)
+			|| ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			&& client_receive(client, stats) == -1)) {
+			close(client->fd);
+			client->fd = -1;
+			stats->lost++;
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int nconns = DEFAULTCONNS, rate = DEFAULTRATE, seconds = DEFAULTSECONDS;
+	int paylen = DEFAULTPAYLEN, port = DEFAULTPORT, opened = 0, opt;
+	int slow_percent = 0, slow = 0, turn = 0, group = DEFAULTGROUP;
+	int mix[4] = { 10, 80, 10, 0 };
+	unsigned int seed = 1;
+	const char *addr = DEFAULTADDR;
+	struct sockaddr_in server;
+	struct rlimit fdlimit;
+	struct BenchClient *clients;
+	struct BenchStats *stats;
+	struct epoll_event ev;
+	uint64_t start, end, deadline, sent = 0;
+	char *payload;
+	int epollfd;
+
+	while((opt = getopt(argc, argv, "n:r:t:m:g:l:a:P:S:s:")) != -1) {
+		switch(opt) {
+			case 'n' : nconns = atoi(optarg); break;
+			case 'r' : rate = atoi(optarg); break;
+			case 't' : seconds = atoi(optarg); break;
+			case 'm' :
+				mix[3] = 0;
+				if(sscanf(optarg, "%d:%d:%d:%d", &mix[0], &mix[1], &mix[2],
+					&mix[3]) < 3) {
+					mix[0] = -1;
+				}
+				break;
+			case 'g' : group = atoi(optarg); break;
+			case 'l' : paylen = atoi(optarg); break;
+			case 'a' : addr = optarg; break;
+			case 'P' : port = atoi(optarg); break;
+			case 'S' : seed = atoi(optarg); break;
+			case 's' : slow_percent = atoi(optarg); break;
+			default : mix[0] = -1;
+		}
+	}
+	if(nconns <= 0 || rate <= 0 || seconds <= 0 || paylen < 0
+		|| paylen > MAXPAYLEN - MAXRECIPIENTS * ALIASLEN || mix[0] < 0
+		|| mix[1] < 0 || mix[2] < 0 || mix[3] < 0
+		|| mix[0] + mix[1] + mix[2] + mix[3] == 0 || group <= 0
+		|| group > MAXRECIPIENTS || slow_percent < 0 || slow_percent >= 100) {
+		fprintf(stderr, "usage: %s [-n connections] [-r messages per second] "
+			"[-t seconds] [-m shout:whisper:list[:multicast]] [-g recipients "
+			"of a multicast] [-l payload length] [-a address] [-P port] "
+			"[-S seed] [-s percentage of slow readers]\n", argv[0]);
+		return 1;
+	}
+	memset(&server, 0, sizeof server);
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	if(inet_pton(AF_INET, addr, &server.sin_addr) != 1) {
+		fprintf(stderr, "chatbench: invalid address %s\n", addr);
+		return 1;
+	}
+
+	/* every connection needs a file descriptor */
+	if(getrlimit(RLIMIT_NOFILE, &fdlimit) == 0) {
+		fdlimit.rlim_cur = fdlimit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &fdlimit);
+	}
+	clients = calloc(nconns, sizeof(struct BenchClient));
+	stats = calloc(1, sizeof(struct BenchStats));
+	/* room for the aliases of a multicast, the time and the termination */
+	payload = malloc(paylen + MAXRECIPIENTS * ALIASLEN + 32);
+	if(clients == NULL || stats == NULL || payload == NULL
+		|| (epollfd = epoll_create1(0)) == -1) {
+		perror("chatbench: setup");
+		return 1;
+	}
+
+	/* connect every client and choose its alias */
+	start = now_ns();
+	for(; opened < nconns; opened++) {
+		struct BenchClient *client = &clients[opened];
+		struct Packet packet;
+		if((client->fd = open_connection(&server,
+			opened / CONNSPERADDR)) == -1) {
+			perror("chatbench: connect");
+			break;
+		}
+		snprintf(client->alias, ALIASLEN, "bench%d", opened);
+		decoder_init(&client->decoder);
+		/* the slow readers are spread evenly among the clients */
+		client->slow = opened % 100 < slow_percent;
+		if(client->slow) {
+			int rcvbuf = SLOWRCVBUF;
+			setsockopt(client->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+				sizeof rcvbuf);
+			slow++;
+		}
+		memset(&packet, 0, sizeof(struct Packet));
+		packet.action = ALIAS;
+		strcpy(packet.alias, client->alias);
+		if(packet_send(client->fd, &packet) == -1
+			|| set_nonblocking(client->fd) == -1) {
+			perror("chatbench: send");
+			close(client->fd);
+			break;
+		}
+		if(client->slow) continue;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.u32 = opened;
+		epoll_ctl(epollfd, EPOLL_CTL_ADD, client->fd, &ev);
+	}
+	end = now_ns();
+	if(opened == slow) return 1;
+	printf("connections %d\n", opened);
+	printf("slow_readers %d\n", slow);
+	printf("connect_seconds %.3f\n", (end - start) / 1e9);
+	printf("connect_rate %.0f\n", opened / ((end - start) / 1e9));
+	fflush(stdout);
+
+	/* the server publishes the aliases after a while */
+	deadline = now_ns() + (uint64_t)SETTLEMS * 1000000;
+	while(now_ns() < deadline) {
+		poll_clients(epollfd, clients, 10, stats);
+	}
+	memset(stats, 0, sizeof(struct BenchStats));
+
+	/* send the messages at the target rate, in turn from every client */
+	start = now_ns();
+	end = start + (uint64_t)seconds * 1000000000;
+	for(uint64_t now = start; now < end; now = now_ns()) {
+		uint64_t due = (now - start) * rate / 1000000000;
+		for(; sent < due; sent++) {
+			int sender;
+			/* the slow readers are silent, the turn goes to the next
+			client */
+			do sender = turn++ % opened; while(clients[sender].slow);
+			if(clients[sender].fd != -1 && send_message(clients, opened,
+				sender, mix, group, payload, paylen, &seed, stats) == -1) {
+				close(clients[sender].fd);
+				clients[sender].fd = -1;
+				stats->lost++;
+			}
+		}
+		poll_clients(epollfd, clients, 1, stats);
+	}
+	end = now_ns();
+	/* the messages still travelling are received but not counted in the
+	rates */
+	struct BenchStats measured = *stats;
+	deadline = end + (uint64_t)DRAINMS * 1000000;
+	while(now_ns() < deadline) {
+		poll_clients(epollfd, clients, 10, stats);
+	}
+
+	double elapsed = (end - start) / 1e9;
+	printf("seconds %.3f\n", elapsed);
+	printf("target_rate %d\n", rate);
+	printf("sent_shout %llu\n", (unsigned long long)stats->shouts);
+	printf("sent_whisper %llu\n", (unsigned long long)stats->whispers);
+	printf("sent_list %llu\n", (unsigned long long)stats->lists);
+	printf("sent_multicast %llu\n", (unsigned long long)stats->multicasts);
+	printf("send_rate %.0f\n", (stats->shouts + stats->whispers
+		+ stats->lists + stats->multicasts) / elapsed);
+	printf("delivered %llu\n", (unsigned long long)stats->delivered);
+	printf("delivery_rate %.0f\n", measured.delivered / elapsed);
+	printf("received_mib_per_second %.2f\n",
+		measured.bytes / elapsed / (1 << 20));
+	printf("list_answered %llu\n", (unsigned long long)stats->answered);
+	printf("whisper_not_found %llu\n", (unsigned long long)stats->not_found);
+	printf("connections_lost %llu\n", (unsigned long long)stats->lost);
+	hist_print("delivery", &stats->delivery);
+	hist_print("list", &stats->list);
+
+	for(int i = 0; i < opened; i++) {
+		if(clients[i].fd != -1) close(clients[i].fd);
+		decoder_release(&clients[i].decoder);
+		free(clients[i].out);
+	}
+	close(epollfd);
+	free(clients);
+	free(stats);
+	free(payload);
+	return 0;
+}
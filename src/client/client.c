@@ -16,6 +16,9 @@
 /* Utility methods to handle network objects */
 #include "networkutil.h"
 
+/* Encoding of the packets */
+#include "packetcodec.h"
+
 /* Standard libraries */
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,6 +49,10 @@ int serversfd;
  * Alias of the client
  */
 char myalias[ALIASLEN];
+/**
+ * Room joined, empty if none
+ */
+char myroom[ALIASLEN];
 /**
  * Server's IP
  */
@@ -81,6 +88,15 @@ static int connect_server(char *ip, char *port);
  */
 static int setalias(char name[]);
 
+/**
+ * @brief Send a heartbeat packet to the server.
+ *
+ * @param action \c PING or \c PONG.
+ *
+ * @return \c 0 if successful, \c -1 if an error occurred.
+ */
+static int sendheartbeat(int action);
+
 /**
  * @brief Login to a server specifying its address and the desired alias.
  *
@@ -95,13 +111,25 @@ static int login(char *ip, char *port, char *name);
 /**
  * @brief Send a message to a specific client.
  *
- * @param target String containing the target client's alias.
+ * @param target String containing the target client's alias, or the ID of
+ * its session after a '#'.
  * @param msg String containing the message.
  *
  * @return \c 0 if successful, \c -1 if an error occurred.
  */
 static int send_msg(char target[], char msg[]);
 
+/**
+ * @brief Send a message to a list of clients.
+ *
+ * @param targets String containing the aliases of the clients, or the IDs
+ * of their sessions after a '#', separated by commas.
+ * @param msg String containing the message.
+ *
+ * @return \c 0 if successful, \c -1 if an error occurred.
+ */
+static int send_multicast(char targets[], char msg[]);
+
 /**
  * @brief Send a message to every client connected to the server.
  *
@@ -118,6 +146,31 @@ static int broadcast_msg(char msg[]);
  */
 static int askforlist();
 
+/**
+ * @brief Search the messages shouted and kept by the server.
+ *
+ * @param terms String containing the terms every message found contains.
+ *
+ * @return \c 0 if successful, \c -1 if an error occurred.
+ */
+static int search(char terms[]);
+
+/**
+ * @brief Join a room, the messages shouted reach only its members.
+ *
+ * @param name String containing the name of the room.
+ *
+ * @return \c 0 if successful, \c -1 if an error occurred.
+ */
+static int joinroom(char name[]);
+
+/**
+ * @brief Leave the room joined, the messages shouted reach every client.
+ *
+ * @return \c 0 if successful, \c -1 if an error occurred.
+ */
+static int partroom();
+
 /**
  * @brief Interrupt the connection with the server.
  *
@@ -157,7 +210,7 @@ int main(int argc, char *argv[])
 	printf(
 		"Setting up the client, write \"/help\" to see a list of commands\n");
 	/* Create the buffer where to store the user's input */
-	int buflen = 64; // PAYLEN; // set the input buffer length properly
+	int buflen = 64; // set the input buffer length properly
 	while(1) {
 		/* Read a string from standard input */
 		char input[buflen];
@@ -242,8 +295,7 @@ int main(int argc, char *argv[])
 				/* Acquire the first parameter */
 				char *alias = strtok(NULL, " ");
 				/* Create a string containing just the message */
-				char msg[PAYLEN];
-				strcpy(msg, getmsg(input));
+				char *msg = getmsg(input);
 				if(alias != NULL && msg != NULL) {
 					/* Make sure that the alias is a proper string */
 					alias[ALIASLEN-1] = '\0';
@@ -255,10 +307,52 @@ int main(int argc, char *argv[])
 						"Usage: \"/whisp [RECIPIENT] [MESSAGE]\"\n");
 				}
 			}
+			/* Send a message to a list of clients */
+			else if(!strcmp(command, "/mcast")) {
+				/* Acquire the first parameter */
+				char *targets = strtok(NULL, " ");
+				/* Create a string containing just the message */
+				char *msg = getmsg(input);
+				if(targets != NULL && msg != NULL) {
+					send_multicast(targets, msg);
+				}
+				else {
+					fprintf(stderr, "Usage: \"/mcast [RECIPIENT],"
+						"[RECIPIENT]... [MESSAGE]\"\n");
+				}
+			}
 			/* List the clients currently connected */
 			else if(!strncmp(input, "/list", 5)) {
 				askforlist();
 			}
+			/* Join a room */
+			else if(!strcmp(command, "/join")) {
+				/* Acquire the parameter */
+				char *room = strtok(NULL, " ");
+				if(room != NULL) {
+					/* If the name is too long, truncate it */
+					room[ALIASLEN - 1] = '\0';
+					joinroom(room);
+				}
+				else {
+					fprintf(stderr, "Usage: \"/join [ROOM]\"\n");
+				}
+			}
+			/* Leave the room */
+			else if(!strcmp(command, "/part")) {
+				partroom();
+			}
+			/* Search the history of the messages shouted */
+			else if(!strcmp(command, "/search")) {
+				/* Acquire every term */
+				char *terms = strtok(NULL, "");
+				if(terms != NULL) {
+					search(terms);
+				}
+				else {
+					fprintf(stderr, "Usage: \"/search [TERMS]\"\n");
+				}
+			}
 			/* Terminate the connection */
 			else if(!strcmp(command, "/logout")) {
 				logout();
@@ -287,8 +381,16 @@ int main(int argc, char *argv[])
 static void *receiver() {
 	/* This packet will be used to contain the received data */
 	struct Packet packet;
+	/* Decoder extracting the packets from the received data */
+	struct FrameDecoder decoder;
+	/* List of clients gathered from the packets of a long list */
+	char *list = NULL;
+	int listlen = 0;
+	int ret = 0;
+	decoder_init(&decoder);
 	while(1) {
-		if(!(recv(serversfd, (void *)&packet, sizeof(struct Packet), 0))) {
+		/* Extract the next packet, receive more data if necessary */
+		if(ret != 1 && decoder_recv(&decoder, serversfd) <= 0) {
 			/* When recv returns 0, it means that the connection was
 			interrupted */
 			fprintf(stderr, "client: connection lost from server\n");
@@ -296,6 +398,15 @@ static void *receiver() {
 			close(serversfd);
 			break;
 		}
+		if((ret = decoder_next(&decoder, &packet)) != 1) {
+			if(ret == -1) {
+				fprintf(stderr, "client: malformed packet from server\n");
+				connected = 0;
+				close(serversfd);
+				break;
+			}
+			continue;
+		}
 		switch (packet.action) {
 			/* Message to display received */
 			case MSG :
@@ -304,24 +415,117 @@ static void *receiver() {
 				break;
 			/* List of clients received */
 			case LIST_A : ;
-				/* Display the clients connected to the server */
-				printf("There are %d clients connected:\n", packet.len);
-				for(int i = 0; i < packet.len; i++) {
-					printf("[%d] %s\n", i+1, &packet.payload[ALIASLEN*i]);
+				/* A long list is split in several packets, displayed once
+				the last one is received */
+				char *more = realloc(list, listlen + packet.len + 1);
+				if(more == NULL) {
+					perror("client: realloc");
+					free(list);
+					list = NULL;
+					listlen = 0;
+					break;
+				}
+				list = more;
+				memcpy(&list[listlen], packet.payload, packet.len);
+				listlen += packet.len;
+				list[listlen] = '\0';
+				if(packet.flags & FLAGMORE) break;
+				/* Count the aliases, one per line */
+				int count = 0;
+				for(int i = 0; i < listlen; i++) {
+					if(list[i] == '\n') count++;
+				}
+				/* Display the clients connected to the server, or the
+				members of the room joined */
+				if(myroom[0] != '\0') {
+					printf("There are %d clients in #%s:\n", count, myroom);
+				} else {
+					printf("There are %d clients connected:\n", count);
+				}
+				/* Every alias is followed by the ID of its session */
+				char *line = list;
+				for(int i = 0; i < count; i++) {
+					char *end = strchr(line, '\n');
+					char *tab = memchr(line, '\t', end - line);
+					if(tab != NULL) {
+						printf("[%d] %.*s (#%.*s)\n", i+1, (int)(tab - line),
+							line, (int)(end - tab - 1), tab + 1);
+					} else {
+						printf("[%d] %.*s\n", i+1, (int)(end - line), line);
+					}
+					line = end + 1;
+				}
+				free(list);
+				list = NULL;
+				listlen = 0;
+				break;
+			/* Messages found in the history, one per line */
+			case SEARCH_A :
+				if(packet.len == 0) {
+					printf("No messages found\n");
+					break;
+				}
+				printf("Messages found:\n");
+				char *result = packet.payload;
+				for(char *end; (end = strchr(result, '\n')) != NULL;
+					result = end + 1) {
+					/* the alias is followed by a tab */
+					char *tab = memchr(result, '\t', end - result);
+					if(tab == NULL) continue;
+					printf(KYEL "[%.*s]" KNRM ": %.*s\n", (int)(tab - result),
+						result, (int)(end - tab - 1), tab + 1);
 				}
 				break;
 			/* There are no clients with the alias specifie in the whisper
 			command */
 			case UNF :
-				printf(
-					"Client \"%s\" not found. Type /list to see the clients connected\n",
-					packet.alias);
+				/* The recipients of a multicast not found are listed one per
+				line */
+				for(char *result = packet.payload, *end;
+					(end = strchr(result, '\n')) != NULL; result = end + 1) {
+					printf("Client \"%.*s\" not found\n", (int)(end - result),
+						result);
+				}
+				if(packet.len == 0) {
+					printf(
+						"Client \"%s\" not found. Type /list to see the clients connected\n",
+						packet.alias);
+				}
+				else {
+					printf("Type /list to see the clients connected\n");
+				}
+				break;
+			/* The alias requested is used by another client */
+			case AIU :
+				printf("Alias \"%s\" already in use, you are still \"%s\"\n",
+					packet.alias, packet.payload);
+				/* Keep using the alias known by the server */
+				memset(myalias, 0, sizeof(char) * ALIASLEN);
+				strncpy(myalias, packet.payload, ALIASLEN - 1);
+				break;
+			/* The server confirms the room joined */
+			case JOIN :
+				memset(myroom, 0, sizeof(char) * ALIASLEN);
+				if(packet.len == 0) {
+					printf("Could not join the room, you are in no room\n");
+					break;
+				}
+				strncpy(myroom, packet.payload, ALIASLEN - 1);
+				printf("Joined #%s, your messages reach only its members\n",
+					myroom);
+				break;
+			/* ID of the session, the other clients can whisper to it */
+			case SESSION :
+				printf("Your session ID is #%s\n", packet.payload);
+				break;
+			/* The server checks that the client is still alive */
+			case PING :
+				sendheartbeat(PONG);
 				break;
 		}
-
-		/* Clean the packet */
-		memset(&packet, 0, sizeof(struct Packet));
 	}
+	free(list);
+	decoder_release(&decoder);
 	return NULL;
 }
 
@@ -386,7 +590,26 @@ static int setalias(char name[]) {
 	packet.action = ALIAS;
 	strcpy(packet.alias, name);
 	/* Send the packet */
-	if(send(serversfd, (void *)&packet, sizeof(struct Packet), 0) == -1) {
+	if(packet_send(serversfd, &packet) == -1) {
+		perror("client: send");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Send a heartbeat packet to the server.
+ *
+ * @param action \c PING or \c PONG.
+ *
+ * @return \c 0 if successful, \c -1 if an error occurred.
+ */
+static int sendheartbeat(int action) {
+	struct Packet packet;
+	memset(&packet, 0, sizeof(struct Packet));
+	packet.action = action;
+	strcpy(packet.alias, myalias);
+	if(packet_send(serversfd, &packet) == -1) {
 		perror("client: send");
 		return -1;
 	}
@@ -418,10 +641,13 @@ static int login(char *ip, char *port, char *name) {
 	if(sockfd >= 0) {
 		connected = 1;
 		serversfd = sockfd;
+		myroom[0] = '\0';
 		if(name != NULL) {
 			setalias(name);
 		} else {
 			strcpy(myalias, DEFAULTALIAS);
+			/* The first packet completes the handshake */
+			sendheartbeat(PING);
 		}
 		/* Start a thread to handle the packages' reception */
 		pthread_t receive;
@@ -440,13 +666,14 @@ static int login(char *ip, char *port, char *name) {
 /**
  * @brief Send a message to a specific client.
  *
- * @param target String containing the target client's alias.
+ * @param target String containing the target client's alias, or the ID of
+ * its session after a '#'.
  * @param msg String containing the message.
  *
  * @return \c 0 if successful, \c -1 if an error occurred.
  */
 static int send_msg(char target[], char msg[]) {
-	int sent, targetlen;
+	int targetlen, msglen;
 	struct Packet packet;
 
 	if(target == NULL || msg == NULL) {
@@ -460,14 +687,64 @@ static int send_msg(char target[], char msg[]) {
 	memset(&packet, 0, sizeof(struct Packet)); // make sure the packet is clean
 	packet.action = WHISPER;
 	strcpy(packet.alias, myalias);
+	/* A target like "#12" is the ID of a session */
+	if(target[0] == '#' && target[1] != '\0'
+		&& strspn(&target[1], "0123456789") == strlen(&target[1])) {
+		packet.flags = FLAGSESSIONID;
+		target++;
+	}
 	/* In the packet's payload insert the target's alias and the message */
-	strcpy(packet.payload, target);
 	targetlen = strlen(target);
+	msglen = strlen(msg);
+	char payload[targetlen + msglen + 2];
+	strcpy(payload, target);
 	/* Add a space to separate the target from the message's body */
-	strcpy(&packet.payload[targetlen], " ");
-	strcpy(&packet.payload[targetlen+1], msg);
+	strcpy(&payload[targetlen], " ");
+	strcpy(&payload[targetlen+1], msg);
+	packet.payload = payload;
+	packet.len = targetlen + msglen + 1;
 	/* Send the packet */
-	if (send(serversfd, (void *)&packet, sizeof(struct Packet), 0) == -1) {
+	if (packet_send(serversfd, &packet) == -1) {
+		perror("client: send");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Send a message to a list of clients.
+ *
+ * @param targets String containing the aliases of the clients, or the IDs
+ * of their sessions after a '#', separated by commas.
+ * @param msg String containing the message.
+ *
+ * @return \c 0 if successful, \c -1 if an error occurred.
+ */
+static int send_multicast(char targets[], char msg[]) {
+	int targetslen, msglen;
+	struct Packet packet;
+
+	if(targets == NULL || msg == NULL) {
+		return 0;
+	}
+	if(!connected) {
+		fprintf(stderr, "You are not connected\n");
+		return -1;
+	}
+	/* Build the packet */
+	memset(&packet, 0, sizeof(struct Packet)); // make sure the packet is clean
+	packet.action = MULTICAST;
+	strcpy(packet.alias, myalias);
+	/* In the packet's payload insert the targets and the message, separated
+	by a space */
+	targetslen = strlen(targets);
+	msglen = strlen(msg);
+	char payload[targetslen + msglen + 2];
+	sprintf(payload, "%s %s", targets, msg);
+	packet.payload = payload;
+	packet.len = targetslen + msglen + 1;
+	/* Send the packet */
+	if (packet_send(serversfd, &packet) == -1) {
 		perror("client: send");
 		return -1;
 	}
@@ -495,9 +772,10 @@ static int broadcast_msg(char msg[]) {
 	packet.action = SHOUT;
 	strcpy(packet.alias, myalias);
 	/* In the packet's payload insert the message */
-	strcpy(packet.payload, msg);
+	packet.payload = msg;
+	packet.len = strlen(msg);
 	/* Send the packet */
-	if (send(serversfd, (void *)&packet, sizeof(struct Packet), 0) == -1) {
+	if (packet_send(serversfd, &packet) == -1) {
 		perror("client: send");
 		return -1;
 	}
@@ -521,10 +799,99 @@ static int askforlist() {
 	memset(&packet, 0, sizeof(struct Packet)); // make sure the packet is clean
 	packet.action = LIST_Q;
 	strcpy(packet.alias, myalias);
-	if (send(serversfd, (void *)&packet, sizeof(struct Packet), 0) == -1) {
+	if (packet_send(serversfd, &packet) == -1) {
+		perror("client: send");
+		return -1;
+	}
+}
+
+/**
+ * @brief Search the messages shouted and kept by the server.
+ *
+ * @param terms String containing the terms every message found contains.
+ *
+ * @return \c 0 if successful, \c -1 if an error occurred.
+ */
+static int search(char terms[]) {
+	struct Packet packet;
+
+	if(!connected) {
+		fprintf(stderr, "You are not connected\n");
+		return -1;
+	}
+
+	/* Build the packet */
+	memset(&packet, 0, sizeof(struct Packet)); // make sure the packet is clean
+	packet.action = SEARCH_Q;
+	strcpy(packet.alias, myalias);
+	/* In the packet's payload insert the terms */
+	packet.payload = terms;
+	packet.len = strlen(terms);
+	if (packet_send(serversfd, &packet) == -1) {
+		perror("client: send");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Join a room, the messages shouted reach only its members.
+ *
+ * @param name String containing the name of the room.
+ *
+ * @return \c 0 if successful, \c -1 if an error occurred.
+ */
+static int joinroom(char name[]) {
+	struct Packet packet;
+
+	if(!connected) {
+		fprintf(stderr, "You are not connected\n");
+		return -1;
+	}
+
+	/* Build the packet */
+	memset(&packet, 0, sizeof(struct Packet)); // make sure the packet is clean
+	packet.action = JOIN;
+	strcpy(packet.alias, myalias);
+	/* In the packet's payload insert the name of the room */
+	packet.payload = name;
+	packet.len = strlen(name);
+	if (packet_send(serversfd, &packet) == -1) {
 		perror("client: send");
 		return -1;
 	}
+	/* The room is displayed once the server confirms the join */
+	return 0;
+}
+
+/**
+ * @brief Leave the room joined, the messages shouted reach every client.
+ *
+ * @return \c 0 if successful, \c -1 if an error occurred.
+ */
+static int partroom() {
+	struct Packet packet;
+
+	if(!connected) {
+		fprintf(stderr, "You are not connected\n");
+		return -1;
+	}
+	if(myroom[0] == '\0') {
+		fprintf(stderr, "You are not in a room\n");
+		return -1;
+	}
+
+	/* Build the packet */
+	memset(&packet, 0, sizeof(struct Packet)); // make sure the packet is clean
+	packet.action = PART;
+	strcpy(packet.alias, myalias);
+	if (packet_send(serversfd, &packet) == -1) {
+		perror("client: send");
+		return -1;
+	}
+	printf("Left #%s\n", myroom);
+	myroom[0] = '\0';
+	return 0;
 }
 
 /**
@@ -546,7 +913,7 @@ static int logout() {
 	strcpy(packet.alias, myalias);
 
 	/* Send the request to close this connection */
-	if (send(serversfd, (void *)&packet, sizeof(struct Packet), 0) == -1) {
+	if (packet_send(serversfd, &packet) == -1) {
 		perror("client: send");
 		return -1;
 	}
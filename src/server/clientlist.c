@@ -12,24 +12,597 @@
 
 #include "clientlist.h"
 
+/* Reclamation of the snapshots */
+#include "epoch.h"
+
+/* Asynchronous logging */
+#include "log.h"
+
+/* Encoding of the answers to the requests of the list */
+#include "packetcodec.h"
+
 /* Standard libraries */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+
+/** Mask selecting the slot of a session ID */
+#define SESSIONMASK (MAXSESSIONS - 1)
+/** Mask of the generation of a slot, after the shift */
+#define GENERATIONMASK ((1u << (32 - SESSIONBITS)) - 1)
 
 /**
- * @brief Compare two \c ClientInfo struct, checking if they share the same
- * connection socket.
+ * @brief Compare two \c ClientInfo struct, checking if they belong to the
+ * same session.
  *
  * @param a
  * Pointer to the first ClientInfo struct.
  * @param b
  * Pointer to the second ClientInfo struct.
  *
- * @return \c 0 if they have the same connection socket.
+ * @return \c 0 if they have the same session ID.
  */
 int compare(struct ClientInfo *a, struct ClientInfo *b) {
-	return a->sockfd - b->sockfd;
+	return (a->id > b->id) - (a->id < b->id);
+}
+
+/**
+ * @brief Hash an alias with the FNV-1a function.
+ *
+ * @param alias
+ * Alias to hash.
+ *
+ * @return The hash of the alias.
+ */
+static unsigned int hash_alias(const char *alias) {
+	unsigned int h = 2166136261u;
+	for(int i = 0; i < ALIASLEN && alias[i] != '\0'; i++) {
+		h = (h ^ (unsigned char)alias[i]) * 16777619u;
+	}
+	return h;
+}
+
+/**
+ * @brief Check if an alias has to be indexed, the default one is shared by
+ * many clients.
+ *
+ * @param alias
+ * Alias to check.
+ *
+ * @return \c 1 if the alias is indexed, \c 0 otherwise.
+ */
+static int alias_indexed(const char *alias) {
+	return strcmp(alias, DEFAULTALIAS) != 0;
+}
+
+/**
+ * @brief Add a node to the alias index.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param node
+ * Node to add.
+ */
+static void index_alias(struct LinkedList *ll, struct LLNode *node) {
+	if(!alias_indexed(node->client_info->alias)) return;
+	struct LLNode **bucket =
+		&ll->alias_index[hash_alias(node->client_info->alias) & (ll->buckets - 1)];
+	node->next_alias = *bucket;
+	*bucket = node;
+}
+
+/**
+ * @brief Remove a node from the alias index.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param node
+ * Node to remove.
+ */
+static void unindex_alias(struct LinkedList *ll, struct LLNode *node) {
+	if(!alias_indexed(node->client_info->alias)) return;
+	struct LLNode **curr =
+		&ll->alias_index[hash_alias(node->client_info->alias) & (ll->buckets - 1)];
+	for(; *curr != NULL; curr = &(*curr)->next_alias) {
+		if(*curr == node) {
+			*curr = node->next_alias;
+			return;
+		}
+	}
+}
+
+/**
+ * @brief Find the node of a client through the slot of its session.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param cl_info
+ * Pointer to the \c ClientInfo structure of the client.
+ *
+ * @return A pointer to the node, \c NULL if it is not in the list.
+ */
+static struct LLNode *find_node(struct LinkedList *ll,
+	const struct ClientInfo *cl_info) {
+	struct SessionTable *table = atomic_load_explicit(&ll->sessions,
+		memory_order_relaxed);
+	uint32_t slot = cl_info->id & SESSIONMASK;
+	struct LLNode *node;
+	if(cl_info->id == 0 || table == NULL || slot >= (uint32_t)table->cap) {
+		return NULL;
+	}
+	node = ll->session_slots[slot].node;
+	return node != NULL && node->client_info == cl_info ? node : NULL;
+}
+
+/**
+ * @brief Double the slots of the sessions, publishing a larger copy of the
+ * table.
+ *
+ * @param ll
+ * Pointer to the linked list, whose slots are all taken.
+ *
+ * @return \c 0 if successful, \c -1 if every session is open or the memory
+ * could not be allocated.
+ */
+static int grow_sessions(struct LinkedList *ll) {
+	struct SessionTable *old = atomic_load_explicit(&ll->sessions,
+		memory_order_relaxed), *table;
+	struct SessionSlot *slots;
+	int oldcap = old != NULL ? old->cap : 0;
+	int cap = oldcap > 0 ? oldcap * 2 : INDEXMIN;
+	if(cap > MAXSESSIONS) {
+		errno = ENOSPC;
+		return -1;
+	}
+	table = malloc(sizeof(struct SessionTable)
+		+ cap * sizeof(_Atomic(struct ClientInfo *)));
+	if(table == NULL) return -1;
+	slots = realloc(ll->session_slots, cap * sizeof(struct SessionSlot));
+	if(slots == NULL) {
+		free(table);
+		return -1;
+	}
+	ll->session_slots = slots;
+	table->cap = cap;
+	for(int i = 0; i < oldcap; i++) {
+		atomic_init(&table->slots[i], atomic_load_explicit(&old->slots[i],
+			memory_order_relaxed));
+	}
+	for(int i = oldcap; i < cap; i++) {
+		atomic_init(&table->slots[i], NULL);
+		slots[i].node = NULL;
+		slots[i].generation = 1;
+		slots[i].next_free = i + 1 < cap ? i + 1 : -1;
+	}
+	ll->free_head = oldcap;
+	ll->free_tail = cap - 1;
+	/* the readers still using the previous table find the same clients */
+	atomic_store_explicit(&ll->sessions, table, memory_order_release);
+	if(old != NULL) epoch_retire(old, free);
+	return 0;
+}
+
+/**
+ * @brief Give a node the first free slot of the sessions, setting the ID of
+ * its client.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param node
+ * Node of the client.
+ *
+ * @return \c 0 if successful, \c -1 if every session is open or the memory
+ * could not be allocated.
+ */
+static int open_session(struct LinkedList *ll, struct LLNode *node) {
+	struct SessionTable *table;
+	struct SessionSlot *slot;
+	int pos;
+	if(ll->free_head == -1 && grow_sessions(ll) == -1) return -1;
+	pos = ll->free_head;
+	slot = &ll->session_slots[pos];
+	ll->free_head = slot->next_free;
+	slot->node = node;
+	node->client_info->id = slot->generation << SESSIONBITS | (uint32_t)pos;
+	/* the ID is set before a reader can find the client */
+	table = atomic_load_explicit(&ll->sessions, memory_order_relaxed);
+	atomic_store_explicit(&table->slots[pos], node->client_info,
+		memory_order_release);
+	return 0;
+}
+
+/**
+ * @brief Free the slot of the session of a node.
+ *
+ * The slot is reused only after every other free slot, and with the next
+ * generation, so a stale ID reaches nobody until the generations of its slot
+ * have wrapped around.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param node
+ * Node of the client, holding its slot.
+ */
+static void close_session(struct LinkedList *ll, struct LLNode *node) {
+	int pos = node->client_info->id & SESSIONMASK;
+	struct SessionSlot *slot = &ll->session_slots[pos];
+	struct SessionTable *table = atomic_load_explicit(&ll->sessions,
+		memory_order_relaxed);
+	atomic_store_explicit(&table->slots[pos], NULL, memory_order_release);
+	slot->node = NULL;
+	/* no ID is 0 */
+	slot->generation = (slot->generation + 1) & GENERATIONMASK;
+	if(slot->generation == 0) slot->generation = 1;
+	slot->next_free = -1;
+	if(ll->free_head == -1) {
+		ll->free_head = pos;
+	} else {
+		ll->session_slots[ll->free_tail].next_free = pos;
+	}
+	ll->free_tail = pos;
+}
+
+/**
+ * @brief Allocate the index with a given number of buckets, adding all the
+ * nodes of the list to it.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param buckets
+ * Number of buckets, a power of two.
+ *
+ * @return \c 0 if successful, \c -1 if the memory could not be allocated.
+ */
+static int rebuild_index(struct LinkedList *ll, int buckets) {
+	struct LLNode **alias_index = calloc(buckets, sizeof(struct LLNode *));
+	struct LLNode *curr;
+	if(alias_index == NULL) return -1;
+	free(ll->alias_index);
+	ll->alias_index = alias_index;
+	ll->buckets = buckets;
+	for(curr = ll->head; curr != NULL; curr = curr->next) {
+		index_alias(ll, curr);
+	}
+	return 0;
+}
+
+/**
+ * @brief Find a room by name.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param name
+ * Name of the room.
+ *
+ * @return A pointer to the room, \c NULL if nobody is in it.
+ */
+static struct Room *find_room(struct LinkedList *ll, const char *name) {
+	struct Room *curr;
+	if(ll->rooms == NULL) return NULL;
+	curr = ll->rooms[hash_alias(name) & (ll->room_buckets - 1)];
+	for(; curr != NULL; curr = curr->next) {
+		if(strncmp(curr->name, name, ROOMLEN) == 0) return curr;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Chain a room to the ones to publish.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param room
+ * Room whose members have changed.
+ */
+static void mark_room(struct LinkedList *ll, struct Room *room) {
+	if(!room->dirty) {
+		room->dirty = 1;
+		room->next_dirty = ll->dirty_rooms;
+		ll->dirty_rooms = room;
+	}
+	atomic_store(&ll->dirty, 1);
+}
+
+/**
+ * @brief Create a room and add it to the index of the rooms.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param name
+ * Name of the room, at most \c ROOMLEN - 1 characters.
+ *
+ * @return A pointer to the empty room, able to hold \c ROOMMIN members,
+ * \c NULL if the memory could not be allocated.
+ */
+static struct Room *create_room(struct LinkedList *ll, const char *name) {
+	struct Room *room, **bucket;
+	/* Keep the load of the index below one room per bucket */
+	if(ll->nrooms >= ll->room_buckets) {
+		int buckets = ll->room_buckets ? ll->room_buckets * 2 : INDEXMIN;
+		struct Room **rooms = calloc(buckets, sizeof(struct Room *));
+		if(rooms == NULL) return NULL;
+		for(int i = 0; i < ll->room_buckets; i++) {
+			for(struct Room *curr = ll->rooms[i], *next; curr != NULL;
+				curr = next) {
+				next = curr->next;
+				bucket = &rooms[hash_alias(curr->name) & (buckets - 1)];
+				curr->next = *bucket;
+				*bucket = curr;
+			}
+		}
+		free(ll->rooms);
+		ll->rooms = rooms;
+		ll->room_buckets = buckets;
+	}
+	/* a room is created with its first member */
+	if((room = calloc(1, sizeof(struct Room))) == NULL) return NULL;
+	if((room->members = malloc(ROOMMIN * sizeof(struct LLNode *))) == NULL) {
+		free(room);
+		return NULL;
+	}
+	room->cap = ROOMMIN;
+	strcpy(room->name, name);
+	atomic_init(&room->snapshot, NULL);
+	bucket = &ll->rooms[hash_alias(name) & (ll->room_buckets - 1)];
+	room->next = *bucket;
+	*bucket = room;
+	ll->nrooms++;
+	return room;
+}
+
+/**
+ * @brief Remove an empty room from the index of the rooms, it is released
+ * once published.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param room
+ * Room without members.
+ */
+static void drop_room(struct LinkedList *ll, struct Room *room) {
+	struct Room **curr;
+	/* an empty room leaves the index at once, a new one is created if
+	somebody joins it again */
+	curr = &ll->rooms[hash_alias(room->name) & (ll->room_buckets - 1)];
+	while(*curr != room) {
+		curr = &(*curr)->next;
+	}
+	*curr = room->next;
+	ll->nrooms--;
+	mark_room(ll, room);
+}
+
+/**
+ * @brief Remove a node from the members of its room, releasing the room
+ * once published if it is left empty.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param node
+ * Node of the client.
+ */
+static void leave_room(struct LinkedList *ll, struct LLNode *node) {
+	struct Room *room = node->room;
+	if(room == NULL) return;
+	/* the last member takes the place of the one leaving */
+	room->members[node->room_pos] = room->members[--room->size];
+	room->members[node->room_pos]->room_pos = node->room_pos;
+	node->room = NULL;
+	mark_room(ll, room);
+	if(room->size == 0) drop_room(ll, room);
+}
+
+/**
+ * @brief Returns the partition of a member of a room.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param node
+ * Node of the member.
+ */
+static int member_partition(struct LinkedList *ll, struct LLNode *node) {
+	return ll->partition_of != NULL ? ll->partition_of(node->client_info) : 0;
+}
+
+/**
+ * @brief Release a snapshot of the list and its encoded answer.
+ *
+ * @param snap
+ * Pointer to the snapshot.
+ */
+static void snapshot_free(void *snap) {
+	struct ClientSnapshot *s = snap;
+	struct MsgBuf *roster = atomic_load_explicit(&s->roster,
+		memory_order_relaxed);
+	if(roster != NULL) msgbuf_unref(roster);
+	free(s);
+}
+
+/**
+ * @brief Find the end of the part of a list sent in a single LIST_A packet.
+ *
+ * @param payload
+ * List of the clients, one per line.
+ * @param start
+ * Beginning of the part.
+ * @param len
+ * Length of the list.
+ *
+ * @return The end of the last whole line fitting in \c MAXPAYLEN bytes.
+ */
+static int roster_split(const char *payload, int start, int len) {
+	int end = start + MAXPAYLEN;
+	if(end >= len) return len;
+	while(payload[end - 1] != '\n') end--;
+	return end;
+}
+
+/**
+ * @brief Encode the answer to a request of the list and store it in a
+ * snapshot, unless another reader has stored one meanwhile.
+ *
+ * A list longer than \c MAXPAYLEN is split in several LIST_A packets, all
+ * but the last one flagged with \c FLAGMORE, stored in the same buffer.
+ *
+ * @param roster
+ * Field of the snapshot holding the answer.
+ * @param payload
+ * List of the clients, released by this function.
+ * @param len
+ * Length of the list.
+ *
+ * @return A pointer to the answer stored, \c NULL if the memory could not be
+ * allocated.
+ */
+static struct MsgBuf *store_roster(_Atomic(struct MsgBuf *) *roster,
+	char *payload, int len) {
+	struct MsgBuf *buf, *stored = NULL;
+	struct Packet packet;
+	size_t size = 0;
+	int start = 0, end;
+	memset(&packet, 0, sizeof(struct Packet));
+	packet.action = LIST_A;
+	do {
+		end = roster_split(payload, start, len);
+		packet.len = end - start;
+		size += packet_size(&packet);
+		start = end;
+	} while(start < len);
+	if((buf = msgbuf_alloc(size)) == NULL) {
+		free(payload);
+		return NULL;
+	}
+	size = start = 0;
+	do {
+		end = roster_split(payload, start, len);
+		packet.flags = end < len ? FLAGMORE : 0;
+		packet.payload = &payload[start];
+		packet.len = end - start;
+		size += packet_encode(&packet, &buf->data[size]);
+		start = end;
+	} while(start < len);
+	free(payload);
+	/* the answer outlives the request that built it */
+	buf->trace = 0;
+	buf->stamp = 0;
+	/* the readers racing on the first request keep the same answer */
+	if(!atomic_compare_exchange_strong_explicit(roster, &stored, buf,
+		memory_order_acq_rel, memory_order_acquire)) {
+		msgbuf_unref(buf);
+		return stored;
+	}
+	return buf;
+}
+
+/**
+ * @brief Publish a snapshot of the members of a room, retiring the previous
+ * one. An empty room is released.
+ *
+ * The members are sorted by partition with a counting sort, so that every
+ * partition is a contiguous range of the snapshot.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param room
+ * Pointer to the room.
+ */
+static void publish_room(struct LinkedList *ll, struct Room *room) {
+	struct RoomSnapshot *snap = NULL, *old;
+	int next[MAXPARTITIONS + 1], nparts = ll->nparts;
+	if(room->size > 0) {
+		snap = malloc(sizeof(struct RoomSnapshot)
+			+ room->size * (sizeof(struct ClientInfo *) + ALIASLEN)
+			+ (nparts + 1) * sizeof(int));
+		if(snap == NULL) {
+			LOG(LOGERROR, "server: malloc: %m\n");
+		} else {
+			atomic_init(&snap->refs, 1);
+			snap->size = room->size;
+			snap->nparts = nparts;
+			atomic_init(&snap->roster, NULL);
+			snap->part_start = (int *)&snap->members[room->size];
+			snap->aliases = (char (*)[ALIASLEN])&snap->part_start[nparts + 1];
+			/* count the members of every partition, then place them after
+			the ones of the previous partitions */
+			memset(next, 0, (nparts + 1) * sizeof(int));
+			for(int i = 0; i < room->size; i++) {
+				next[member_partition(ll, room->members[i]) + 1]++;
+			}
+			for(int p = 1; p <= nparts; p++) next[p] += next[p - 1];
+			memcpy(snap->part_start, next, (nparts + 1) * sizeof(int));
+			for(int i = 0; i < room->size; i++) {
+				int pos = next[member_partition(ll, room->members[i])]++;
+				snap->members[pos] = room->members[i]->client_info;
+				strcpy(snap->aliases[pos], snap->members[pos]->alias);
+			}
+		}
+	}
+	old = atomic_exchange_explicit(&room->snapshot, snap, memory_order_acq_rel);
+	if(old != NULL) {
+		epoch_retire(old, room_snapshot_unref);
+	}
+	room->dirty = 0;
+	if(room->size == 0) {
+		free(room->members);
+		free(room);
+	}
+}
+
+/**
+ * @brief Publish a snapshot of the list if it has changed since the last
+ * one, retiring the previous snapshot. The rooms changed are published as
+ * well.
+ *
+ * If the memory is exhausted an empty snapshot is published, so that a
+ * removed client is never reachable.
+ *
+ * @param ll
+ * Pointer to the linked list, the lock protecting it must be held.
+ */
+void list_publish(struct LinkedList *ll) {
+	struct ClientSnapshot *snap = NULL, *old;
+	struct LLNode *curr;
+	if(!atomic_load(&ll->dirty)) return;
+	for(struct Room *room = ll->dirty_rooms, *next; room != NULL;
+		room = next) {
+		next = room->next_dirty;
+		publish_room(ll, room);
+	}
+	ll->dirty_rooms = NULL;
+	if(ll->size > 0) {
+		int buckets = 2;
+		while(buckets < ll->size * 2) buckets *= 2;
+		snap = malloc(sizeof(struct ClientSnapshot) +
+			ll->size * sizeof(struct ClientEntry) + buckets * sizeof(int));
+		if(snap == NULL) {
+			LOG(LOGERROR, "server: malloc: %m\n");
+		} else {
+			snap->size = ll->size;
+			snap->buckets = buckets;
+			atomic_init(&snap->roster, NULL);
+			snap->alias_table = (int *)&snap->entries[ll->size];
+			memset(snap->alias_table, 0, buckets * sizeof(int));
+			int i = 0;
+			for(curr = ll->head; curr != NULL; curr = curr->next, i++) {
+				struct ClientEntry *entry = &snap->entries[i];
+				entry->client_info = curr->client_info;
+				strcpy(entry->alias, curr->client_info->alias);
+				if(!alias_indexed(entry->alias)) continue;
+				/* linear probing, the table is at most half full */
+				unsigned int slot = hash_alias(entry->alias);
+				while(snap->alias_table[slot & (buckets - 1)] != 0) slot++;
+				snap->alias_table[slot & (buckets - 1)] = i + 1;
+			}
+		}
+	}
+	old = atomic_exchange_explicit(&ll->snapshot, snap, memory_order_acq_rel);
+	if(old != NULL) {
+		epoch_retire(old, snapshot_free);
+	}
+	/* cleared only now, so that a clean list means that the removed clients
+	are unreachable from the latest snapshot */
+	atomic_store_explicit(&ll->dirty, 0, memory_order_release);
 }
 
 /**
@@ -41,6 +614,53 @@ int compare(struct ClientInfo *a, struct ClientInfo *b) {
 void list_init(struct LinkedList *ll) {
 	ll->head = ll->tail = NULL;
 	ll->size = 0;
+	ll->alias_index = NULL;
+	ll->buckets = 0;
+	atomic_init(&ll->snapshot, NULL);
+	atomic_init(&ll->dirty, 0);
+	slab_init(&ll->nodes, sizeof(struct LLNode), SLABCHUNK);
+	ll->rooms = NULL;
+	ll->room_buckets = ll->nrooms = 0;
+	ll->dirty_rooms = NULL;
+	ll->nparts = 1;
+	ll->partition_of = NULL;
+	atomic_init(&ll->sessions, NULL);
+	ll->session_slots = NULL;
+	ll->free_head = ll->free_tail = -1;
+}
+
+/**
+ * @brief Release the memory used by a list, which can be initialized again
+ * afterwards.
+ *
+ * The \c ClientInfo structures referenced are not released, and no reader
+ * may access the latest snapshot anymore.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ */
+void list_release(struct LinkedList *ll) {
+	for(struct LLNode *curr = ll->head; curr != NULL; curr = curr->next) {
+		leave_room(ll, curr);
+	}
+	for(struct Room *room = ll->dirty_rooms, *next; room != NULL;
+		room = next) {
+		next = room->next_dirty;
+		if(atomic_load(&room->snapshot) != NULL) {
+			room_snapshot_unref(atomic_load(&room->snapshot));
+		}
+		free(room->members);
+		free(room);
+	}
+	free(ll->rooms);
+	free(ll->alias_index);
+	if(atomic_load(&ll->snapshot) != NULL) {
+		snapshot_free(atomic_load(&ll->snapshot));
+	}
+	free(atomic_load(&ll->sessions));
+	free(ll->session_slots);
+	slab_release(&ll->nodes);
+	list_init(ll);
 }
 
 /**
@@ -49,30 +669,42 @@ void list_init(struct LinkedList *ll) {
  * @param ll
  * Pointer to the linked list.
  * @param cl_info
- * Pointer to the \c ClientInfo structure that will be contained in the new
- * node.
+ * Pointer to the \c ClientInfo structure that will be referenced by the new
+ * node. The structure is not copied, so it must stay valid until it is
+ * removed from the list. Its \c id is set to the ID of the new session.
  *
- * @return \c 0 if successful, \c -1 if the list is full or an error occours.
+ * @return \c 0 if successful, \c -1 if the alias is already in use, every
+ * session is open or an error occours.
  */
 int list_insert(struct LinkedList *ll, struct ClientInfo *cl_info) {
-	if(ll->size == MAXCLIENTS) return -1; // check if the list is full
-	/* If the list is empty, create the node and make head and tail
-	point to it */
+	struct LLNode *node;
+	if(list_find_alias(ll, cl_info->alias) != NULL) return -1;
+	/* Keep the load of the indexes below one node per bucket */
+	if(ll->size >= ll->buckets && rebuild_index(ll,
+		ll->buckets ? ll->buckets * 2 : INDEXMIN) == -1) {
+		return -1;
+	}
+	node = slab_alloc(&ll->nodes);
+	if(node == NULL) return -1;
+	node->client_info = cl_info;
+	if(open_session(ll, node) == -1) {
+		slab_free(&ll->nodes, node);
+		return -1;
+	}
+	node->room = NULL;
+	node->next = NULL;
+	node->prev = ll->tail;
+	/* If the list is empty make head and tail point to the node, otherwise
+	make the tail point to it */
 	if(ll->head == NULL) {
-		ll->head = (struct LLNode *)malloc(sizeof(struct LLNode));
-		ll->head->client_info = *cl_info;
-		ll->head->next = NULL;
-		ll->tail = ll->head;
-	}
-	/* If the list isn't empty, create a new node and make the tail
-	point to it */
-	else {
-		ll->tail->next = (struct LLNode *)malloc(sizeof(struct LLNode));
-		ll->tail->next->client_info = *cl_info;
-		ll->tail->next->next = NULL;
-		ll->tail = ll->tail->next;
+		ll->head = node;
+	} else {
+		ll->tail->next = node;
 	}
+	ll->tail = node;
+	index_alias(ll, node);
 	ll->size++;
+	atomic_store(&ll->dirty, 1);
 	return 0;
 }
 
@@ -88,39 +720,337 @@ int list_insert(struct LinkedList *ll, struct ClientInfo *cl_info) {
  * @return \c 0 if successful, \c -1 if the list is empty or an error occours.
  */
 int list_delete(struct LinkedList *ll, struct ClientInfo *cl_info) {
-	struct LLNode *curr, *tmp;
+	struct LLNode *node;
 	if(ll->head == NULL) return -1; // check if the structure is empty
-	/* Handle the case where the element to remove is the first */
-	if(!compare(cl_info, &ll->head->client_info)) {
-		/* store the element in a temporary variable to free the memory */
-		tmp = ll->head;
-		ll->head = ll->head->next;
-		/* If the list is empty after the deletion, handle it correctly */
-		if(ll->head == NULL) {
-			ll->tail = ll->head;
+	if((node = find_node(ll, cl_info)) == NULL) return -1;
+	leave_room(ll, node);
+	/* Remove the node from the index and from the sessions */
+	unindex_alias(ll, node);
+	close_session(ll, node);
+	/* Unlink the node, handling the cases where it is the first or the
+	last */
+	if(node->prev == NULL) {
+		ll->head = node->next;
+	} else {
+		node->prev->next = node->next;
+	}
+	if(node->next == NULL) {
+		ll->tail = node->prev;
+	} else {
+		node->next->prev = node->prev;
+	}
+	slab_free(&ll->nodes, node);
+	ll->size--;
+	atomic_store(&ll->dirty, 1);
+	return 0;
+}
+
+/**
+ * @brief Find the client using an alias.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param alias
+ * Alias to search.
+ *
+ * @return A pointer to the \c ClientInfo structure of the client, \c NULL if
+ * no client uses the alias or it is \c DEFAULTALIAS.
+ */
+struct ClientInfo *list_find_alias(struct LinkedList *ll, const char *alias) {
+	struct LLNode *curr;
+	if(ll->alias_index == NULL || !alias_indexed(alias)) return NULL;
+	curr = ll->alias_index[hash_alias(alias) & (ll->buckets - 1)];
+	for(; curr != NULL; curr = curr->next_alias) {
+		if(strncmp(curr->client_info->alias, alias, ALIASLEN) == 0) {
+			return curr->client_info;
 		}
-		free(tmp);
-		ll->size--;
-		return 0;
-	}
-	/* Search for the element to remove through the list */
-	for(curr = ll->head; curr->next != NULL; curr = curr->next) {
-		if(!compare(cl_info, &curr->next->client_info)) {
-			/* store the element in a temporary variable to free the memory */
-			tmp = curr->next;
-			/* Handle the case where the element to remove is the last */
-			if(tmp == ll->tail) {
-				ll->tail = curr;
-				curr->next = NULL;
-			} else {
-				curr->next = curr->next->next;
-			}
-			free(tmp);
-			ll->size--;
-			return 0;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Find the client of a session, without locking the list.
+ *
+ * Must be called between epoch_enter() and epoch_exit(), the client is
+ * reachable until epoch_exit().
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param id
+ * ID of the session.
+ *
+ * @return A pointer to the \c ClientInfo structure of the client, \c NULL if
+ * the session is closed.
+ */
+struct ClientInfo *list_find_id(struct LinkedList *ll, uint32_t id) {
+	struct SessionTable *table = atomic_load_explicit(&ll->sessions,
+		memory_order_acquire);
+	uint32_t slot = id & SESSIONMASK;
+	struct ClientInfo *cl_info;
+	if(table == NULL || slot >= (uint32_t)table->cap) return NULL;
+	cl_info = atomic_load_explicit(&table->slots[slot], memory_order_acquire);
+	/* a later session in the same slot has another generation */
+	return cl_info != NULL && cl_info->id == id ? cl_info : NULL;
+}
+
+/**
+ * @brief Change the alias of a client in the list, keeping the index
+ * consistent.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param cl_info
+ * Pointer to the \c ClientInfo structure of a client in the list.
+ * @param alias
+ * New alias, truncated to \c ALIASLEN - 1 characters.
+ *
+ * @return \c 0 if successful, \c -1 if the alias is used by another client.
+ */
+int list_set_alias(struct LinkedList *ll, struct ClientInfo *cl_info,
+	const char *alias) {
+	struct LLNode *node = find_node(ll, cl_info);
+	struct ClientInfo *owner;
+	char newalias[ALIASLEN];
+	strncpy(newalias, alias, ALIASLEN - 1);
+	newalias[ALIASLEN - 1] = '\0';
+	owner = list_find_alias(ll, newalias);
+	if(owner != NULL && owner != cl_info) return -1;
+	if(node != NULL) unindex_alias(ll, node);
+	strcpy(cl_info->alias, newalias);
+	if(node != NULL) {
+		index_alias(ll, node);
+		atomic_store(&ll->dirty, 1);
+		/* the snapshot of the room holds the aliases as well */
+		if(node->room != NULL) mark_room(ll, node->room);
+	}
+	return 0;
+}
+
+/**
+ * @brief Move a client to a room, leaving the one it was in. The room is
+ * created if nobody is in it.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param cl_info
+ * Pointer to the \c ClientInfo structure of a client in the list.
+ * @param name
+ * Name of the room, truncated to \c ROOMLEN - 1 characters.
+ *
+ * @return A pointer to the room, \c NULL if the client is not in the list or
+ * the memory could not be allocated: the client is then in no room.
+ */
+struct Room *list_join(struct LinkedList *ll, struct ClientInfo *cl_info,
+	const char *name) {
+	struct LLNode *node = find_node(ll, cl_info);
+	struct Room *room;
+	char roomname[ROOMLEN];
+	if(node == NULL) return NULL;
+	strncpy(roomname, name, ROOMLEN - 1);
+	roomname[ROOMLEN - 1] = '\0';
+	if(node->room != NULL && !strcmp(node->room->name, roomname)) {
+		return node->room;
+	}
+	leave_room(ll, node);
+	if((room = find_room(ll, roomname)) == NULL
+		&& (room = create_room(ll, roomname)) == NULL) {
+		return NULL;
+	}
+	if(room->size == room->cap) {
+		int cap = room->cap * 2;
+		struct LLNode **members = realloc(room->members,
+			cap * sizeof(struct LLNode *));
+		if(members == NULL) {
+			/* a room just created is not left behind empty */
+			if(room->size == 0) drop_room(ll, room);
+			return NULL;
+		}
+		room->members = members;
+		room->cap = cap;
+	}
+	node->room = room;
+	node->room_pos = room->size;
+	room->members[room->size++] = node;
+	mark_room(ll, room);
+	return room;
+}
+
+/**
+ * @brief Remove a client from the room it is in, if any.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param cl_info
+ * Pointer to the \c ClientInfo structure of a client in the list.
+ */
+void list_part(struct LinkedList *ll, struct ClientInfo *cl_info) {
+	struct LLNode *node = find_node(ll, cl_info);
+	if(node != NULL) leave_room(ll, node);
+}
+
+/**
+ * @brief Returns the latest snapshot of the members of a room.
+ *
+ * Must be called between epoch_enter() and epoch_exit(), the snapshot is
+ * valid until epoch_exit().
+ *
+ * @param room
+ * Pointer to the room, must not be released meanwhile.
+ *
+ * @return A pointer to the snapshot, \c NULL if the room has not been
+ * published yet.
+ */
+struct RoomSnapshot *room_snapshot(struct Room *room) {
+	return atomic_load_explicit(&room->snapshot, memory_order_acquire);
+}
+
+/**
+ * @brief Take a reference to a snapshot of the members of a room, so that it
+ * stays valid after epoch_exit().
+ *
+ * Must be called between epoch_enter() and epoch_exit().
+ *
+ * @param snap
+ * Pointer to the snapshot.
+ */
+void room_snapshot_ref(struct RoomSnapshot *snap) {
+	/* the room holds its own reference until the grace period ends */
+	atomic_fetch_add_explicit(&snap->refs, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Release a reference to a snapshot of the members of a room, the
+ * snapshot is released with the last one.
+ *
+ * @param snap
+ * Pointer to the snapshot.
+ */
+void room_snapshot_unref(void *snap) {
+	struct RoomSnapshot *s = snap;
+	if(atomic_fetch_sub_explicit(&s->refs, 1, memory_order_acq_rel) == 1) {
+		struct MsgBuf *roster = atomic_load_explicit(&s->roster,
+			memory_order_relaxed);
+		if(roster != NULL) msgbuf_unref(roster);
+		free(s);
+	}
+}
+
+/**
+ * @brief Returns the LIST_A packets listing the members of a snapshot of a
+ * room, one alias and session ID per line, encoded by the first call.
+ *
+ * Must be called between epoch_enter() and epoch_exit(). The buffer belongs
+ * to the snapshot, a reference must be taken with msgbuf_ref() to use it
+ * after epoch_exit().
+ *
+ * @param snap
+ * Pointer to the snapshot.
+ *
+ * @return A pointer to the buffer, \c NULL if the memory could not be
+ * allocated.
+ */
+struct MsgBuf *room_snapshot_roster(struct RoomSnapshot *snap) {
+	struct MsgBuf *roster = atomic_load_explicit(&snap->roster,
+		memory_order_acquire);
+	char *payload;
+	int len = 0;
+	if(roster != NULL) return roster;
+	/* an alias, a tab, up to 10 digits and a newline for every member */
+	if((payload = malloc(snap->size * (ALIASLEN + 11) + 1)) == NULL) {
+		return NULL;
+	}
+	for(int i = 0; i < snap->size; i++) {
+		len += sprintf(&payload[len], "%s\t%u\n", snap->aliases[i],
+			snap->members[i]->id);
+	}
+	return store_roster(&snap->roster, payload, len);
+}
+
+/**
+ * @brief Choose how the members of the rooms are partitioned in their
+ * snapshots, from the next ones published.
+ *
+ * @param ll
+ * Pointer to the linked list, the lock protecting it must be held.
+ * @param nparts
+ * Number of partitions, between \c 1 and \c MAXPARTITIONS.
+ * @param partition_of
+ * Returns the partition of a client, lower than \c nparts. \c NULL if there
+ * is a single partition.
+ */
+void list_set_partitions(struct LinkedList *ll, int nparts,
+	int (*partition_of)(const struct ClientInfo *cl_info)) {
+	ll->nparts = nparts;
+	ll->partition_of = partition_of;
+}
+
+/**
+ * @brief Returns the latest snapshot of the list.
+ *
+ * Must be called between epoch_enter() and epoch_exit(), the snapshot is
+ * valid until epoch_exit().
+ *
+ * @param ll
+ * Pointer to the linked list.
+ *
+ * @return A pointer to the snapshot, \c NULL if the list is empty.
+ */
+struct ClientSnapshot *list_snapshot(struct LinkedList *ll) {
+	return atomic_load_explicit(&ll->snapshot, memory_order_acquire);
+}
+
+/**
+ * @brief Find the client using an alias in a snapshot of the list.
+ *
+ * @param snap
+ * Pointer to the snapshot, may be \c NULL.
+ * @param alias
+ * Alias to search.
+ *
+ * @return A pointer to the entry of the client, \c NULL if no client uses
+ * the alias or it is \c DEFAULTALIAS.
+ */
+const struct ClientEntry *snapshot_find_alias(
+	const struct ClientSnapshot *snap, const char *alias) {
+	if(snap == NULL || !alias_indexed(alias)) return NULL;
+	for(unsigned int slot = hash_alias(alias); ; slot++) {
+		int pos = snap->alias_table[slot & (snap->buckets - 1)];
+		if(pos == 0) return NULL;
+		if(strncmp(snap->entries[pos - 1].alias, alias, ALIASLEN) == 0) {
+			return &snap->entries[pos - 1];
 		}
 	}
-	return -1;
+}
+
+/**
+ * @brief Returns the LIST_A packets listing the clients of a snapshot of the
+ * list, one alias and session ID per line, encoded by the first call.
+ *
+ * Must be called between epoch_enter() and epoch_exit(). The buffer belongs
+ * to the snapshot, a reference must be taken with msgbuf_ref() to use it
+ * after epoch_exit().
+ *
+ * @param snap
+ * Pointer to the snapshot.
+ *
+ * @return A pointer to the buffer, \c NULL if the memory could not be
+ * allocated.
+ */
+struct MsgBuf *snapshot_roster(struct ClientSnapshot *snap) {
+	struct MsgBuf *roster = atomic_load_explicit(&snap->roster,
+		memory_order_acquire);
+	char *payload;
+	int len = 0;
+	if(roster != NULL) return roster;
+	/* an alias, a tab, up to 10 digits and a newline for every client */
+	if((payload = malloc(snap->size * (ALIASLEN + 11) + 1)) == NULL) {
+		return NULL;
+	}
+	for(int i = 0; i < snap->size; i++) {
+		len += sprintf(&payload[len], "%s\t%u\n", snap->entries[i].alias,
+			snap->entries[i].client_info->id);
+	}
+	return store_roster(&snap->roster, payload, len);
 }
 
 /**
@@ -134,8 +1064,14 @@ void list_dump(struct LinkedList *ll) {
 	struct ClientInfo *cl_info;
 	printf("Connection count: %d\n", ll->size);
 	for(curr = ll->head; curr != NULL; curr = curr->next) {
-		cl_info = &curr->client_info;
-		printf("[%d] %s\n", cl_info->sockfd, cl_info->alias);
+		cl_info = curr->client_info;
+		if(curr->room != NULL) {
+			printf("[%d] %s (%u) in #%s\n", cl_info->sockfd, cl_info->alias,
+				cl_info->id, curr->room->name);
+		} else {
+			printf("[%d] %s (%u)\n", cl_info->sockfd, cl_info->alias,
+				cl_info->id);
+		}
 	}
 }
 
@@ -155,7 +1091,8 @@ int list_size(struct LinkedList *ll) {
  * @brief Returns an array of strings containing the client's aliases.
  *
  * This method allocate the memory necessary to store the list, so make sure to
- * deallocate using the pointer returned.
+ * deallocate using the pointer returned. The aliases are stored in the same
+ * block of memory as the array, a single \c free() releases both.
  *
  * @param ll
  * Pointer to the linked list.
@@ -164,13 +1101,15 @@ int list_size(struct LinkedList *ll) {
  * \c ClientInfo in the list.
  */
 char **list_clients(struct LinkedList *ll) {
-	char ** list_str = malloc(ll->size * sizeof(char*));
+	/* the array of pointers is followed by the strings they point to */
+	char **list_str = malloc(ll->size * (sizeof(char*) + ALIASLEN));
+	char *aliases = (char *)&list_str[ll->size];
 	struct LLNode *curr;
-	struct ClientInfo *cl_info;
 	int i = 0;
+	if(list_str == NULL) return NULL;
 	for(curr = ll->head; curr != NULL; curr = curr->next) {
-		list_str[i] = malloc(ALIASLEN * sizeof(char));
-		strcpy(list_str[i++], curr->client_info.alias);
+		list_str[i] = &aliases[i * ALIASLEN];
+		strcpy(list_str[i++], curr->client_info->alias);
 	}
 	return list_str;
 }
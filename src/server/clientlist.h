@@ -3,6 +3,33 @@
  * @brief Linked list implementation where every node represent a connection
  * with a client.
  *
+ * The nodes are also chained in a hash index by alias, so that a client can
+ * be found in constant time. The aliases are unique, except for
+ * \c DEFAULTALIAS that is shared by the clients that have not chosen one and
+ * is not indexed.
+ *
+ * Every client is given the ID of a session when it is inserted: the low
+ * \c SESSIONBITS bits are its slot in a table of the sessions, the others
+ * count the times the slot has been reused, so that the ID of a closed
+ * session does not reach the next client taking the slot. The table is read
+ * without locking, a lookup by ID is a single array access.
+ *
+ * The list is modified only while holding a lock. The changes are then
+ * published at once by list_publish() as an immutable snapshot of the
+ * clients, so that the readers can walk it without locking, inside an epoch
+ * critical section; the previous snapshot is destroyed once no reader can
+ * access it.
+ *
+ * A client can join a room, whose members are kept in a contiguous array
+ * and published together with the list as a snapshot of their own, so that
+ * a message to the room only touches its members. The members of a snapshot
+ * are grouped by partition, for example by the event loop owning them, so
+ * that the recipients of a large room are handed out as whole ranges.
+ *
+ * The answer to a request of the list is encoded once for every snapshot,
+ * by the first request, and shared by the following ones until a client
+ * joins, leaves or changes its alias and a new snapshot is published.
+ *
  * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
  * @version 1.0
  * @since 1.0
@@ -10,22 +37,217 @@
  * @copyright Copyright (c) 2016-2017, Enrico Vianello
  */
 
+#ifndef CLIENTLIST_H
+#define CLIENTLIST_H
+
 /* Necessary for the definition of the struct ClientInfo */
 #include "networkdef.h"
 
+/* Allocation of the nodes */
+#include "slab.h"
+
+/* Encoded answers to the requests of the list */
+#include "msgbuf.h"
+
+/* Standard libraries */
+#include <stdatomic.h>
+
+/** Initial number of buckets of the alias index and of slots of the
+sessions, always a power of two */
+#define INDEXMIN 64
+/** Maximum length of the name of a room, including the termination */
+#define ROOMLEN ALIASLEN
+/** Initial number of members a room can hold */
+#define ROOMMIN 8
+/** Maximum number of partitions of the members of a room */
+#define MAXPARTITIONS 64
+/** Bits of a session ID selecting its slot in the table of the sessions,
+the others hold the generation of the slot */
+#define SESSIONBITS 20
+/** Maximum number of sessions open at the same time */
+#define MAXSESSIONS (1 << SESSIONBITS)
+
+struct Room;
+
 /**
  * @struct LLNode
  *
  * @brief Node of the linked list, representing a connection.
  *
  * @var LLNode::client_info
- * \c ClientInfo struct containing the actual informations.
+ * Pointer to the \c ClientInfo struct containing the actual informations.
  * @var LLNode::next
  * Pointer to the next node of the list.
+ * @var LLNode::prev
+ * Pointer to the previous node of the list.
+ * @var LLNode::next_alias
+ * Pointer to the next node in the same bucket of the alias index.
+ * @var LLNode::room
+ * Room joined by the client, \c NULL if none.
+ * @var LLNode::room_pos
+ * Position of the node among the members of the room.
  */
 struct LLNode {
-	struct ClientInfo client_info;
-	struct LLNode *next;
+	struct ClientInfo *client_info;
+	struct LLNode *next, *prev;
+	struct LLNode *next_alias;
+	struct Room *room;
+	int room_pos;
+};
+
+/**
+ * @struct RoomSnapshot
+ *
+ * @brief Immutable copy of the members of a room shared by the lock-free
+ * readers.
+ *
+ * The snapshot is counted: the room holds a reference until it is retired,
+ * and a reader can take more to use it after epoch_exit().
+ *
+ * @var RoomSnapshot::refs
+ * Number of references to the snapshot.
+ * @var RoomSnapshot::size
+ * Number of members.
+ * @var RoomSnapshot::nparts
+ * Number of partitions of the members.
+ * @var RoomSnapshot::part_start
+ * Array of \c nparts + 1 positions, the members of the partition \c p are
+ * the ones from \c part_start[p] to \c part_start[p + 1] excluded.
+ * @var RoomSnapshot::aliases
+ * Aliases of the members when the snapshot has been taken, in the order of
+ * \c members.
+ * @var RoomSnapshot::roster
+ * LIST_A packets listing the members, encoded by the first request and
+ * released with the snapshot, \c NULL until then.
+ * @var RoomSnapshot::members
+ * Pointers to the \c ClientInfo struct of the members, valid until the
+ * snapshot is released. They are kept apart from the aliases so that a
+ * message to the room only walks the pointers.
+ */
+struct RoomSnapshot {
+	atomic_int refs;
+	int size;
+	int nparts;
+	int *part_start;
+	char (*aliases)[ALIASLEN];
+	_Atomic(struct MsgBuf *) roster;
+	struct ClientInfo *members[];
+};
+
+/**
+ * @struct Room
+ *
+ * @brief Group of clients receiving the messages sent to it.
+ *
+ * The room is released when its last member leaves, so it stays valid as
+ * long as the client referencing it is a member.
+ *
+ * @var Room::name
+ * Name of the room.
+ * @var Room::next
+ * Next room in the same bucket of the index of the rooms.
+ * @var Room::next_dirty
+ * Next room whose members have changed since the latest snapshot.
+ * @var Room::dirty
+ * \c 1 if the room is chained to the rooms changed.
+ * @var Room::size
+ * Number of members.
+ * @var Room::cap
+ * Number of members \c members can hold.
+ * @var Room::members
+ * Nodes of the members, contiguous.
+ * @var Room::snapshot
+ * Latest snapshot of the members published, \c NULL if the room is empty.
+ */
+struct Room {
+	char name[ROOMLEN];
+	struct Room *next;
+	struct Room *next_dirty;
+	int dirty;
+	int size, cap;
+	struct LLNode **members;
+	_Atomic(struct RoomSnapshot *) snapshot;
+};
+
+/**
+ * @struct SessionTable
+ *
+ * @brief Clients by slot of their session, shared by the lock-free readers.
+ *
+ * The table is replaced by a larger copy when it is full, the previous one
+ * is destroyed once no reader can access it.
+ *
+ * @var SessionTable::cap
+ * Number of slots.
+ * @var SessionTable::slots
+ * Pointer to the \c ClientInfo struct of the client holding every slot,
+ * \c NULL if the slot is free.
+ */
+struct SessionTable {
+	int cap;
+	_Atomic(struct ClientInfo *) slots[];
+};
+
+/**
+ * @struct SessionSlot
+ *
+ * @brief State of a slot of the sessions, only accessed by the writers.
+ *
+ * @var SessionSlot::node
+ * Node of the client holding the slot, \c NULL if the slot is free.
+ * @var SessionSlot::generation
+ * Generation of the session holding the slot, or of the next one if it is
+ * free.
+ * @var SessionSlot::next_free
+ * Next free slot, \c -1 if it is the last one.
+ */
+struct SessionSlot {
+	struct LLNode *node;
+	uint32_t generation;
+	int next_free;
+};
+
+/**
+ * @struct ClientEntry
+ *
+ * @brief A client in a snapshot of the list.
+ *
+ * @var ClientEntry::client_info
+ * Pointer to the \c ClientInfo struct of the client, valid until the
+ * snapshot is released.
+ * @var ClientEntry::alias
+ * Alias of the client when the snapshot has been taken.
+ */
+struct ClientEntry {
+	struct ClientInfo *client_info;
+	char alias[ALIASLEN];
+};
+
+/**
+ * @struct ClientSnapshot
+ *
+ * @brief Immutable copy of the list shared by the lock-free readers.
+ *
+ * @var ClientSnapshot::size
+ * Number of clients.
+ * @var ClientSnapshot::buckets
+ * Number of slots of the alias table, a power of two at least twice the
+ * number of clients.
+ * @var ClientSnapshot::alias_table
+ * Open addressing table of the indexed aliases, every slot contains the
+ * position of a client in \c entries plus one, or \c 0 if it is empty.
+ * @var ClientSnapshot::roster
+ * LIST_A packets listing the clients, encoded by the first request and
+ * released with the snapshot, \c NULL until then.
+ * @var ClientSnapshot::entries
+ * Clients in the order of the list.
+ */
+struct ClientSnapshot {
+	int size;
+	int buckets;
+	int *alias_table;
+	_Atomic(struct MsgBuf *) roster;
+	struct ClientEntry entries[];
 };
 
 /**
@@ -39,22 +261,68 @@ struct LLNode {
  * Pointer to the last node of the list.
  * @var LinkedList::size
  * Number of nodes in the list.
+ * @var LinkedList::alias_index
+ * Buckets of the index by alias, allocated with the first node.
+ * @var LinkedList::buckets
+ * Number of buckets of the index, doubled when it is exceeded by the size.
+ * @var LinkedList::snapshot
+ * Latest snapshot published, \c NULL if the list is empty.
+ * @var LinkedList::dirty
+ * \c 1 if the list has changed since the latest snapshot was published.
+ * @var LinkedList::nodes
+ * Pool the nodes are allocated from.
+ * @var LinkedList::rooms
+ * Buckets of the index of the rooms by name, allocated with the first room.
+ * @var LinkedList::room_buckets
+ * Number of buckets of the index of the rooms.
+ * @var LinkedList::nrooms
+ * Number of rooms.
+ * @var LinkedList::dirty_rooms
+ * Rooms whose members have changed since the latest snapshot.
+ * @var LinkedList::nparts
+ * Number of partitions of the members of the rooms.
+ * @var LinkedList::partition_of
+ * Returns the partition of a client, \c NULL if there is a single one.
+ * @var LinkedList::sessions
+ * Table of the sessions read by the lookups by ID, \c NULL until the first
+ * node is inserted.
+ * @var LinkedList::session_slots
+ * State of the slots of the sessions, as many as the slots of the table.
+ * @var LinkedList::free_head
+ * First free slot, reused before the others, \c -1 if the table is full.
+ * @var LinkedList::free_tail
+ * Last free slot, the slots freed are appended after it so that a slot is
+ * reused as late as possible.
  */
 struct LinkedList {
 	struct LLNode *head, *tail;
 	int size;
+	struct LLNode **alias_index;
+	int buckets;
+	_Atomic(struct ClientSnapshot *) snapshot;
+	atomic_int dirty;
+	struct Slab nodes;
+	struct Room **rooms;
+	int room_buckets;
+	int nrooms;
+	struct Room *dirty_rooms;
+	int nparts;
+	int (*partition_of)(const struct ClientInfo *cl_info);
+	_Atomic(struct SessionTable *) sessions;
+	struct SessionSlot *session_slots;
+	int free_head, free_tail;
 };
 
 /**
- * @brief Compare two \c ClientInfo struct, checking if they share the same
- * connection socket.
+ * @brief Compare two \c ClientInfo struct, checking if they belong to the
+ * same session.
  *
  * @param a
  * Pointer to the first ClientInfo struct.
  * @param b
  * Pointer to the second ClientInfo struct.
  *
- * @return \c 0 if they have the same connection socket.
+ * @return \c 0 if they have the same session ID.
  */
 int compare(struct ClientInfo *a, struct ClientInfo *b);
 
@@ -66,16 +334,30 @@ int compare(struct ClientInfo *a, struct ClientInfo *b);
  */
 void list_init(struct LinkedList *ll);
 
+/**
+ * @brief Release the memory used by a list, which can be initialized again
+ * afterwards.
+ *
+ * The \c ClientInfo structures referenced are not released, and no reader
+ * may access the latest snapshot anymore.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ */
+void list_release(struct LinkedList *ll);
+
 /**
  * @brief Insert a new element to the list.
  *
  * @param ll
  * Pointer to the linked list.
  * @param cl_info
- * Pointer to the \c ClientInfo structure that will be contained in the new
- * node.
+ * Pointer to the \c ClientInfo structure that will be referenced by the new
+ * node. The structure is not copied, so it must stay valid until it is
+ * removed from the list. Its \c id is set to the ID of the new session.
  *
- * @return \c 0 if successful, \c -1 if the list is full or an error occours.
+ * @return \c 0 if successful, \c -1 if the alias is already in use, every
+ * session is open or an error occours.
  */
 int list_insert(struct LinkedList *ll, struct ClientInfo *cl_info);
 
@@ -92,6 +374,199 @@ int list_insert(struct LinkedList *ll, struct ClientInfo *cl_info);
  */
 int list_delete(struct LinkedList *ll, struct ClientInfo *cl_info);
 
+/**
+ * @brief Find the client using an alias.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param alias
+ * Alias to search.
+ *
+ * @return A pointer to the \c ClientInfo structure of the client, \c NULL if
+ * no client uses the alias or it is \c DEFAULTALIAS.
+ */
+struct ClientInfo *list_find_alias(struct LinkedList *ll, const char *alias);
+
+/**
+ * @brief Find the client of a session, without locking the list.
+ *
+ * Must be called between epoch_enter() and epoch_exit(), the client is
+ * reachable until epoch_exit().
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param id
+ * ID of the session.
+ *
+ * @return A pointer to the \c ClientInfo structure of the client, \c NULL if
+ * the session is closed.
+ */
+struct ClientInfo *list_find_id(struct LinkedList *ll, uint32_t id);
+
+/**
+ * @brief Change the alias of a client in the list, keeping the index
+ * consistent.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param cl_info
+ * Pointer to the \c ClientInfo structure of a client in the list.
+ * @param alias
+ * New alias, truncated to \c ALIASLEN - 1 characters.
+ *
+ * @return \c 0 if successful, \c -1 if the alias is used by another client.
+ */
+int list_set_alias(struct LinkedList *ll, struct ClientInfo *cl_info,
+	const char *alias);
+
+/**
+ * @brief Move a client to a room, leaving the one it was in. The room is
+ * created if nobody is in it.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param cl_info
+ * Pointer to the \c ClientInfo structure of a client in the list.
+ * @param name
+ * Name of the room, truncated to \c ROOMLEN - 1 characters.
+ *
+ * @return A pointer to the room, \c NULL if the client is not in the list or
+ * the memory could not be allocated: the client is then in no room.
+ */
+struct Room *list_join(struct LinkedList *ll, struct ClientInfo *cl_info,
+	const char *name);
+
+/**
+ * @brief Remove a client from the room it is in, if any.
+ *
+ * @param ll
+ * Pointer to the linked list.
+ * @param cl_info
+ * Pointer to the \c ClientInfo structure of a client in the list.
+ */
+void list_part(struct LinkedList *ll, struct ClientInfo *cl_info);
+
+/**
+ * @brief Returns the latest snapshot of the members of a room.
+ *
+ * Must be called between epoch_enter() and epoch_exit(), the snapshot is
+ * valid until epoch_exit().
+ *
+ * @param room
+ * Pointer to the room, must not be released meanwhile.
+ *
+ * @return A pointer to the snapshot, \c NULL if the room has not been
+ * published yet.
+ */
+struct RoomSnapshot *room_snapshot(struct Room *room);
+
+/**
+ * @brief Take a reference to a snapshot of the members of a room, so that it
+ * stays valid after epoch_exit().
+ *
+ * Must be called between epoch_enter() and epoch_exit().
+ *
+ * @param snap
+ * Pointer to the snapshot.
+ */
+void room_snapshot_ref(struct RoomSnapshot *snap);
+
+/**
+ * @brief Release a reference to a snapshot of the members of a room, the
+ * snapshot is released with the last one.
+ *
+ * @param snap
+ * Pointer to the snapshot.
+ */
+void room_snapshot_unref(void *snap);
+
+/**
+ * @brief Returns the LIST_A packets listing the members of a snapshot of a
+ * room, one alias and session ID per line, encoded by the first call.
+ *
+ * Must be called between epoch_enter() and epoch_exit(). The buffer belongs
+ * to the snapshot, a reference must be taken with msgbuf_ref() to use it
+ * after epoch_exit().
+ *
+ * @param snap
+ * Pointer to the snapshot.
+ *
+ * @return A pointer to the buffer, \c NULL if the memory could not be
+ * allocated.
+ */
+struct MsgBuf *room_snapshot_roster(struct RoomSnapshot *snap);
+
+/**
+ * @brief Choose how the members of the rooms are partitioned in their
+ * snapshots, from the next ones published.
+ *
+ * @param ll
+ * Pointer to the linked list, the lock protecting it must be held.
+ * @param nparts
+ * Number of partitions, between \c 1 and \c MAXPARTITIONS.
+ * @param partition_of
+ * Returns the partition of a client, lower than \c nparts. \c NULL if there
+ * is a single partition.
+ */
+void list_set_partitions(struct LinkedList *ll, int nparts,
+	int (*partition_of)(const struct ClientInfo *cl_info));
+
+/**
+ * @brief Publish a snapshot of the list if it has changed since the last
+ * one, retiring the previous snapshot. The rooms changed are published as
+ * well.
+ *
+ * If the memory is exhausted an empty snapshot is published, so that a
+ * removed client is never reachable.
+ *
+ * @param ll
+ * Pointer to the linked list, the lock protecting it must be held.
+ */
+void list_publish(struct LinkedList *ll);
+
+/**
+ * @brief Returns the latest snapshot of the list.
+ *
+ * Must be called between epoch_enter() and epoch_exit(), the snapshot is
+ * valid until epoch_exit().
+ *
+ * @param ll
+ * Pointer to the linked list.
+ *
+ * @return A pointer to the snapshot, \c NULL if the list is empty.
+ */
+struct ClientSnapshot *list_snapshot(struct LinkedList *ll);
+
+/**
+ * @brief Find the client using an alias in a snapshot of the list.
+ *
+ * @param snap
+ * Pointer to the snapshot, may be \c NULL.
+ * @param alias
+ * Alias to search.
+ *
+ * @return A pointer to the entry of the client, \c NULL if no client uses
+ * the alias or it is \c DEFAULTALIAS.
+ */
+const struct ClientEntry *snapshot_find_alias(
+	const struct ClientSnapshot *snap, const char *alias);
+
+/**
+ * @brief Returns the LIST_A packets listing the clients of a snapshot of the
+ * list, one alias and session ID per line, encoded by the first call.
+ *
+ * Must be called between epoch_enter() and epoch_exit(). The buffer belongs
+ * to the snapshot, a reference must be taken with msgbuf_ref() to use it
+ * after epoch_exit().
+ *
+ * @param snap
+ * Pointer to the snapshot.
+ *
+ * @return A pointer to the buffer, \c NULL if the memory could not be
+ * allocated.
+ */
+struct MsgBuf *snapshot_roster(struct ClientSnapshot *snap);
+
 /**
  * @brief Print the list in a readable format.
  *
@@ -114,7 +589,8 @@ int list_size(struct LinkedList *ll);
  * @brief Returns an array of strings containing the client's aliases.
  *
  * This method allocate the memory necessary to store the list, so make sure to
- * deallocate using the pointer returned.
+ * deallocate using the pointer returned. The aliases are stored in the same
+ * block of memory as the array, a single \c free() releases both.
  *
  * @param ll
  * Pointer to the linked list.
@@ -123,3 +599,5 @@ int list_size(struct LinkedList *ll);
  * \c ClientInfo in the list.
  */
 char **list_clients(struct LinkedList *ll);
+
+#endif
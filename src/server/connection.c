@@ -0,0 +1,352 @@
+/**
+ * @file connection.c
+ * @brief Server-side state of a single client connection.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#include "connection.h"
+
+/* Reactor owning the connections */
+#include "eventloop.h"
+
+/* Encoding of the packets */
+#include "packetcodec.h"
+
+/* Allocation of the connection records */
+#include "slab.h"
+
+/* Tracing of the writes */
+#include "trace.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Scatter/gather I/O */
+#include <sys/uio.h>
+
+/**
+ * Pool of the connection records.
+ */
+static struct Slab conn_slab =
+	SLAB_INITIALIZER(sizeof(struct Connection), SLABCHUNK);
+
+/**
+ * Maximum number of bytes waiting in an output queue.
+ */
+static size_t limit_bytes = OUTQUEUEBYTES;
+
+/**
+ * Maximum number of messages waiting in an output queue.
+ */
+static size_t limit_messages = OUTQUEUELEN;
+
+/**
+ * What happens to a message for a full output queue.
+ */
+static int slow_policy = SLOWDROPNEWEST;
+
+/**
+ * Time a queue can stay full before its connection is closed, in
+ * nanoseconds.
+ */
+static uint64_t slow_grace = (uint64_t)SLOWGRACEMS * 1000000;
+
+/**
+ * @brief Allocate and initialize the state of a new connection.
+ *
+ * @param sockfd
+ * Socket file descriptor of the connection, already set as non-blocking.
+ * @param loop
+ * Event loop that will own the connection.
+ *
+ * @return A pointer to the new connection, \c NULL if an error occours.
+ */
+struct Connection *conn_create(int sockfd, struct EventLoop *loop) {
+	struct Connection *conn = slab_alloc(&conn_slab);
+	if(conn == NULL) return NULL;
+	memset(conn, 0, sizeof(struct Connection));
+	conn->client_info.sockfd = sockfd;
+	strcpy(conn->client_info.alias, DEFAULTALIAS);
+	conn->loop = loop;
+	decoder_init(&conn->decoder);
+	outqueue_init(&conn->outq);
+	return conn;
+}
+
+/**
+ * @brief Release the memory used by a connection.
+ *
+ * The socket is not closed by this method.
+ *
+ * @param conn
+ * Pointer to the connection.
+ */
+void conn_destroy(struct Connection *conn) {
+	decoder_release(&conn->decoder);
+	stats_add(&conn->loop->stats.discarded, outqueue_release(&conn->outq));
+	slab_free(&conn_slab, conn);
+}
+
+/**
+ * @brief Returns the memory allocated for the connection records.
+ *
+ * @param count
+ * If not \c NULL, set to the number of connections allocated.
+ *
+ * @return The number of bytes allocated for the records, their buffers
+ * excluded.
+ */
+size_t conn_footprint(size_t *count) {
+	return slab_footprint(&conn_slab, count);
+}
+
+/**
+ * @brief Choose the limits of the output queues and what happens to the
+ * connections exceeding them, before the event loops start.
+ *
+ * @param bytes
+ * Maximum number of bytes waiting in a queue, a single message is always
+ * accepted by an empty queue.
+ * @param messages
+ * Maximum number of messages waiting in a queue, at most \c OUTQUEUELEN.
+ * @param policy
+ * \c SLOWDROPNEWEST, \c SLOWDROPOLDEST or \c SLOWDISCONNECT.
+ * @param grace_ms
+ * Time a queue can stay full before its connection is closed, in
+ * milliseconds, with \c SLOWDISCONNECT.
+ */
+void conn_set_limits(size_t bytes, size_t messages, int policy, int grace_ms) {
+	limit_bytes = bytes;
+	limit_messages = messages < OUTQUEUELEN ? messages : OUTQUEUELEN;
+	slow_policy = policy;
+	slow_grace = (uint64_t)grace_ms * 1000000;
+}
+
+/**
+ * @brief Returns the policy for the slow consumers with a given name.
+ *
+ * @param name
+ * "drop-newest", "drop-oldest" or "disconnect".
+ *
+ * @return The policy, \c -1 if the name is unknown.
+ */
+int conn_parse_policy(const char *name) {
+	if(strcmp(name, "drop-newest") == 0) return SLOWDROPNEWEST;
+	if(strcmp(name, "drop-oldest") == 0) return SLOWDROPOLDEST;
+	if(strcmp(name, "disconnect") == 0) return SLOWDISCONNECT;
+	return -1;
+}
+
+/**
+ * @brief Returns \c 1 if a message does not fit in the output queue of a
+ * connection.
+ *
+ * @param conn
+ * Pointer to the connection.
+ * @param len
+ * Length of the message.
+ */
+static int queue_full(const struct Connection *conn, size_t len) {
+	size_t count = outqueue_len(&conn->outq);
+	return count > 0 && (count >= limit_messages
+		|| conn->outq.bytes + len > limit_bytes);
+}
+
+/**
+ * @brief Apply the policy for the slow consumers to a connection whose
+ * output queue is full.
+ *
+ * @param conn
+ * Pointer to the connection.
+ * @param len
+ * Length of the message being queued.
+ *
+ * @return \c 0 if the message now fits in the queue, \c -1 if it has to be
+ * refused.
+ */
+static int slow_consumer(struct Connection *conn, size_t len) {
+	struct EventLoop *loop = conn->loop;
+	uint64_t now = stats_now();
+	/* the messages being written stay, even a partially written one */
+	size_t keep = conn->inflight > 0 ? conn->inflight
+		: conn->outq.offset > 0;
+	if(conn->stalled_since == 0) {
+		conn->stalled_since = now;
+		stats_add(&loop->stats.stalls, 1);
+	}
+	switch(slow_policy) {
+		case SLOWDROPOLDEST :
+			while(queue_full(conn, len)
+				&& outqueue_drop(&conn->outq, keep) == 0) {
+				stats_add(&loop->stats.dropped, 1);
+			}
+			return queue_full(conn, len) ? -1 : 0;
+		case SLOWDISCONNECT :
+			/* the loop closes it after the batch, not while it may be
+			reading from it */
+			if(now - conn->stalled_since >= slow_grace && !conn->evicting) {
+				conn->evicting = 1;
+				conn->next_evict = loop->evict_list;
+				loop->evict_list = conn;
+			}
+			return -1;
+		default :
+			return -1;
+	}
+}
+
+/**
+ * @brief Queue an encoded frame on a connection, only from the owner loop.
+ *
+ * A connection whose output queue is full is a slow consumer: the message
+ * is refused, or makes room dropping the oldest ones, depending on the
+ * policy chosen with conn_set_limits().
+ *
+ * @param conn
+ * Pointer to the connection.
+ * @param buf
+ * Encoded frame, the reference passed is released by this method if the
+ * frame is not accepted.
+ *
+ * @return \c 0 if successful, \c -1 if the connection is closed (\c EPIPE),
+ * its output queue is full (\c ENOBUFS) or an error occours.
+ */
+int conn_queue(struct Connection *conn, struct MsgBuf *buf) {
+	/* a reader of an old snapshot of the client list may still reach a
+	connection being closed */
+	if(conn->closed) {
+		msgbuf_unref(buf);
+		errno = EPIPE;
+		return -1;
+	}
+	if(!queue_full(conn, buf->len)) {
+		conn->stalled_since = 0;
+	}
+	else if(slow_consumer(conn, buf->len) == -1) {
+		stats_add(&conn->loop->stats.refused, 1);
+		msgbuf_unref(buf);
+		errno = ENOBUFS;
+		return -1;
+	}
+	if(outqueue_push(&conn->outq, buf) == -1) {
+		stats_add(&conn->loop->stats.refused, 1);
+		msgbuf_unref(buf);
+		return -1;
+	}
+	stats_add(&conn->loop->stats.queued, 1);
+	stats_add(&conn->loop->stats.packets_out[(unsigned char)buf->frame[1]
+		< STATSACTIONS ? (unsigned char)buf->frame[1] : STATSACTIONS], 1);
+	/* the connection is written once after all the messages queued */
+	if(!conn->flush_scheduled) {
+		conn->flush_scheduled = 1;
+		eventloop_schedule_flush(conn->loop, conn);
+	}
+	return 0;
+}
+
+/**
+ * @brief Queue a frame on a connection, or post it to the owner loop if
+ * called from another thread.
+ *
+ * @param conn
+ * Pointer to the connection.
+ * @param buf
+ * Encoded frame, the reference passed is released by this method if the
+ * frame is not accepted.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+static int send_frame(struct Connection *conn, struct MsgBuf *buf) {
+	if(eventloop_current() == conn->loop) {
+		return conn_queue(conn, buf);
+	}
+	return eventloop_post(conn->loop, conn, buf);
+}
+
+/**
+ * @brief Queue an encoded frame to be sent through a connection.
+ *
+ * The frame is not copied: the connection's output queue takes a new
+ * reference to it, so the same buffer can be queued for any number of
+ * connections. It is written later by the owning event loop, so this method
+ * never performs a system call other than waking up the loop. Called from
+ * another thread, the frame is posted to the inbox of the owner: a full
+ * queue is then reported by the owner.
+ *
+ * @param conn
+ * Pointer to the connection.
+ * @param buf
+ * Encoded frame, the caller keeps its own reference.
+ *
+ * @return \c 0 if successful, \c -1 if the output queue is full or an
+ * error occours.
+ */
+int conn_send_buf(struct Connection *conn, struct MsgBuf *buf) {
+	return send_frame(conn, msgbuf_ref(buf));
+}
+
+/**
+ * @brief Encode a packet and queue it to be sent through a connection.
+ *
+ * @param conn
+ * Pointer to the connection.
+ * @param packet
+ * Pointer to the packet.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+int conn_send_packet(struct Connection *conn, const struct Packet *packet) {
+	struct MsgBuf *buf = msgbuf_encode(packet);
+	if(buf == NULL) return -1;
+	return send_frame(conn, buf);
+}
+
+/**
+ * @brief Write the queued messages of a connection to its socket.
+ *
+ * All the messages queued are coalesced in a single \c writev(), until the
+ * queue is empty or the socket cannot accept more data. Must be called only
+ * by the owning event loop.
+ *
+ * @param conn
+ * Pointer to the connection.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+int conn_flush(struct Connection *conn) {
+	struct iovec iov[WRITEVLEN];
+	int cnt;
+	ssize_t n;
+	uint32_t id;
+	uint64_t start;
+	while(1) {
+		cnt = outqueue_iov(&conn->outq, iov, WRITEVLEN);
+		if(cnt == 0) return 0;
+		/* the write is traced if it carries a traced message */
+		id = trace_enabled() ? outqueue_trace(&conn->outq, cnt) : 0;
+		start = id != 0 ? stats_now() : 0;
+		n = writev(conn->client_info.sockfd, iov, cnt);
+		if(id != 0) trace_span("write", id, start, stats_now());
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			/* the rest is written when the socket becomes writable */
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			/* the connection is broken, the owner will notice it while
+			reading and close it */
+			stats_add(&conn->loop->stats.discarded,
+				outqueue_release(&conn->outq));
+			return -1;
+		}
+		stats_add(&conn->loop->stats.bytes_out, n);
+		stats_add(&conn->loop->stats.written, outqueue_consume(&conn->outq,
+			n, &conn->loop->stats.send));
+	}
+}
@@ -0,0 +1,297 @@
+/**
+ * @file connection.h
+ * @brief Server-side state of a single client connection.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+/* Necessary for the definition of the struct ClientInfo and struct Packet */
+#include "networkdef.h"
+
+/* Decoding of the received frames */
+#include "packetcodec.h"
+
+/* Queue of the messages to send */
+#include "outqueue.h"
+
+/* Shared encoded frames */
+#include "msgbuf.h"
+
+/* Inboxes of the event loops */
+#include "mpscqueue.h"
+
+/* Timeouts of the connections */
+#include "timerwheel.h"
+
+/* Standard libraries */
+#include <stddef.h>
+
+/** Default maximum number of bytes waiting in the output queue of a
+connection */
+#define OUTQUEUEBYTES (1024 * 1024)
+/** Default time a slow consumer is kept before being disconnected, in
+milliseconds */
+#define SLOWGRACEMS 5000
+
+/** A full output queue refuses the new messages */
+#define SLOWDROPNEWEST 0
+/** A full output queue drops its oldest messages to make room for the new
+ones */
+#define SLOWDROPOLDEST 1
+/** A full output queue refuses the new messages, and its connection is
+closed if it is still full after the grace period */
+#define SLOWDISCONNECT 2
+
+struct EventLoop;
+struct Connection;
+struct UringSend;
+struct Room;
+
+/**
+ * @struct Delivery
+ *
+ * @brief Message posted by another thread to the inbox of the event loop
+ * owning its recipients.
+ *
+ * The array of recipients follows the structure in the same allocation,
+ * unless the delivery borrows a range of the members of a room.
+ *
+ * @var Delivery::node
+ * Link in the inbox.
+ * @var Delivery::buf
+ * Encoded frame, the delivery owns one of its references. \c NULL if the
+ * delivery asks the loop to release the memory of a retired connection.
+ * @var Delivery::count
+ * Number of recipients.
+ * @var Delivery::cap
+ * Number of recipients that the allocation can hold.
+ * @var Delivery::conns
+ * Recipients, all owned by the same loop.
+ * @var Delivery::members
+ * Recipients borrowed from the owner of the delivery instead of \c conns,
+ * \c NULL if none.
+ * @var Delivery::except
+ * Member skipped, the sender of the message.
+ * @var Delivery::done
+ * Called with \c owner once the members have been queued.
+ * @var Delivery::owner
+ * Structure holding the members borrowed.
+ */
+struct Delivery {
+	struct MpscNode node;
+	struct MsgBuf *buf;
+	int count, cap;
+	struct Connection **conns;
+	struct ClientInfo *const *members;
+	const struct ClientInfo *except;
+	void (*done)(void *owner);
+	void *owner;
+};
+
+/**
+ * @struct Connection
+ *
+ * @brief Structure containing the state of a non-blocking connection handled
+ * by an event loop.
+ *
+ * A connection is owned by the event loop that accepted it: only that loop
+ * reads from the socket, writes to it, queues messages for it and closes it.
+ * Any thread can send messages to it through conn_send_buf() while it is
+ * reachable from a snapshot of the client list: they are posted to the inbox
+ * of the owner loop, which queues them. The memory is released by the owner
+ * once no snapshot can reach it, after every message posted before.
+ *
+ * @var Connection::client_info
+ * Informations about the client, must be the first field so that a pointer
+ * to it can be converted back to the connection.
+ * @var Connection::loop
+ * Event loop owning this connection.
+ * @var Connection::decoder
+ * Decoder extracting the packets from the received bytes.
+ * @var Connection::outq
+ * Messages accepted by conn_send_buf() but not yet written to the socket.
+ * @var Connection::flush_scheduled
+ * \c 1 if the connection is in the flush list of its loop.
+ * @var Connection::next_flush
+ * Next connection in the flush list of the loop.
+ * @var Connection::closed
+ * \c 1 once the connection is being closed, no message is queued anymore.
+ * @var Connection::release
+ * Delivery posted to the owner loop to release the connection once it has
+ * been retired.
+ * @var Connection::pending_ops
+ * Number of requests of the io_uring backend using the connection, it is
+ * released only once they have all completed.
+ * @var Connection::released
+ * \c 1 if the connection has been retired while some requests were pending.
+ * @var Connection::sending
+ * Send request of the io_uring backend in progress, \c NULL if none.
+ * @var Connection::room
+ * Room joined by the client, \c NULL if none. Only the owner loop changes
+ * it, so it reads it without locking.
+ * @var Connection::inflight
+ * Number of messages at the beginning of the output queue being sent by the
+ * io_uring backend, they cannot be dropped.
+ * @var Connection::stalled_since
+ * Time the output queue has been found full at, \c 0 if it was not full
+ * when the latest message was queued.
+ * @var Connection::evicting
+ * \c 1 if the connection is in the list of the slow consumers that its loop
+ * has to close.
+ * @var Connection::next_evict
+ * Next connection in the list of the slow consumers to close.
+ * @var Connection::timer
+ * Timer of the connection in the wheel of its loop.
+ * @var Connection::last_active
+ * Time the latest packet has been received at, in milliseconds, \c 0 if
+ * none has been received yet.
+ */
+struct Connection {
+	struct ClientInfo client_info;
+	struct EventLoop *loop;
+	struct FrameDecoder decoder;
+	struct OutQueue outq;
+	int flush_scheduled;
+	struct Connection *next_flush;
+	int closed;
+	struct Delivery release;
+	int pending_ops;
+	int released;
+	struct UringSend *sending;
+	struct Room *room;
+	size_t inflight;
+	uint64_t stalled_since;
+	int evicting;
+	struct Connection *next_evict;
+	struct Timer timer;
+	uint64_t last_active;
+};
+
+/**
+ * @brief Allocate and initialize the state of a new connection.
+ *
+ * @param sockfd
+ * Socket file descriptor of the connection, already set as non-blocking.
+ * @param loop
+ * Event loop that will own the connection.
+ *
+ * @return A pointer to the new connection, \c NULL if an error occours.
+ */
+struct Connection *conn_create(int sockfd, struct EventLoop *loop);
+
+/**
+ * @brief Release the memory used by a connection.
+ *
+ * The socket is not closed by this method.
+ *
+ * @param conn
+ * Pointer to the connection.
+ */
+void conn_destroy(struct Connection *conn);
+
+/**
+ * @brief Returns the memory allocated for the connection records.
+ *
+ * @param count
+ * If not \c NULL, set to the number of connections allocated.
+ *
+ * @return The number of bytes allocated for the records, their buffers
+ * excluded.
+ */
+size_t conn_footprint(size_t *count);
+
+/**
+ * @brief Choose the limits of the output queues and what happens to the
+ * connections exceeding them, before the event loops start.
+ *
+ * @param bytes
+ * Maximum number of bytes waiting in a queue, a single message is always
+ * accepted by an empty queue.
+ * @param messages
+ * Maximum number of messages waiting in a queue, at most \c OUTQUEUELEN.
+ * @param policy
+ * \c SLOWDROPNEWEST, \c SLOWDROPOLDEST or \c SLOWDISCONNECT.
+ * @param grace_ms
+ * Time a queue can stay full before its connection is closed, in
+ * milliseconds, with \c SLOWDISCONNECT.
+ */
+void conn_set_limits(size_t bytes, size_t messages, int policy, int grace_ms);
+
+/**
+ * @brief Returns the policy for the slow consumers with a given name.
+ *
+ * @param name
+ * "drop-newest", "drop-oldest" or "disconnect".
+ *
+ * @return The policy, \c -1 if the name is unknown.
+ */
+int conn_parse_policy(const char *name);
+
+/**
+ * @brief Queue an encoded frame to be sent through a connection.
+ *
+ * The frame is not copied: the connection's output queue takes a new
+ * reference to it, so the same buffer can be queued for any number of
+ * connections. It is written later by the owning event loop, so this method
+ * never performs a system call other than waking up the loop. Called from
+ * another thread, the frame is posted to the inbox of the owner: a full
+ * queue is then reported by the owner.
+ *
+ * @param conn
+ * Pointer to the connection.
+ * @param buf
+ * Encoded frame, the caller keeps its own reference.
+ *
+ * @return \c 0 if successful, \c -1 if the output queue is full or an
+ * error occours.
+ */
+int conn_send_buf(struct Connection *conn, struct MsgBuf *buf);
+
+/**
+ * @brief Queue an encoded frame on a connection, only from the owner loop.
+ *
+ * @param conn
+ * Pointer to the connection.
+ * @param buf
+ * Encoded frame, the reference passed is released by this method if the
+ * frame is not accepted.
+ *
+ * @return \c 0 if successful, \c -1 if the connection is closed (\c EPIPE),
+ * its output queue is full (\c ENOBUFS) or an error occours.
+ */
+int conn_queue(struct Connection *conn, struct MsgBuf *buf);
+
+/**
+ * @brief Encode a packet and queue it to be sent through a connection.
+ *
+ * @param conn
+ * Pointer to the connection.
+ * @param packet
+ * Pointer to the packet.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+int conn_send_packet(struct Connection *conn, const struct Packet *packet);
+
+/**
+ * @brief Write the queued messages of a connection to its socket.
+ *
+ * All the messages queued are coalesced in a single \c writev(), until the
+ * queue is empty or the socket cannot accept more data. Must be called only
+ * by the owning event loop.
+ *
+ * @param conn
+ * Pointer to the connection.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+int conn_flush(struct Connection *conn);
+
+#endif
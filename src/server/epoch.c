@@ -0,0 +1,211 @@
+/**
+ * @file epoch.c
+ * @brief Epoch-based reclamation of the memory shared with lock-free readers.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#include "epoch.h"
+
+/* Asynchronous logging */
+#include "log.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+/* Thread library */
+#include <pthread.h>
+
+/**
+ * @struct EpochRecord
+ *
+ * @brief State of a registered thread.
+ *
+ * @var EpochRecord::epoch
+ * Global epoch observed when the thread entered its critical section, \c 0
+ * if it is not in one.
+ * @var EpochRecord::used
+ * \c 1 if the record is assigned to a thread.
+ */
+struct EpochRecord {
+	atomic_ulong epoch;
+	atomic_int used;
+};
+
+/**
+ * @struct Retired
+ *
+ * @brief Object waiting to be destroyed.
+ *
+ * @var Retired::ptr
+ * Pointer to the object.
+ * @var Retired::destroy
+ * Method releasing the object.
+ * @var Retired::epoch
+ * Global epoch when the object has been retired.
+ * @var Retired::next
+ * Next object retired.
+ */
+struct Retired {
+	void *ptr;
+	void (*destroy)(void *);
+	unsigned long epoch;
+	struct Retired *next;
+};
+
+/**
+ * Global epoch, never \c 0.
+ */
+static atomic_ulong global_epoch = 1;
+
+/**
+ * Records of the registered threads.
+ */
+static struct EpochRecord records[EPOCHTHREADS];
+
+/**
+ * Record of the calling thread.
+ */
+static _Thread_local struct EpochRecord *self;
+
+/**
+ * Objects waiting to be destroyed, the most recent first.
+ */
+static struct Retired *limbo;
+
+/**
+ * Mutual exclusion variable protecting the registration and the objects
+ * waiting to be destroyed.
+ */
+static pthread_mutex_t limbo_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Register the calling thread as a reader.
+ *
+ * Must be called once by every thread using epoch_enter().
+ *
+ * @return \c 0 if successful, \c -1 if too many threads are registered.
+ */
+int epoch_register(void) {
+	pthread_mutex_lock(&limbo_mutex);
+	for(int i = 0; i < EPOCHTHREADS; i++) {
+		if(!atomic_load(&records[i].used)) {
+			atomic_store(&records[i].epoch, 0);
+			atomic_store(&records[i].used, 1);
+			self = &records[i];
+			pthread_mutex_unlock(&limbo_mutex);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&limbo_mutex);
+	return -1;
+}
+
+/**
+ * @brief Unregister the calling thread.
+ */
+void epoch_unregister(void) {
+	if(self == NULL) return;
+	atomic_store(&self->epoch, 0);
+	atomic_store(&self->used, 0);
+	self = NULL;
+}
+
+/**
+ * @brief Enter a read-side critical section.
+ *
+ * The shared objects loaded until epoch_exit() will not be destroyed. The
+ * critical sections cannot be nested.
+ */
+void epoch_enter(void) {
+	/* the epoch must be visible to the writers before any shared object is
+	loaded */
+	atomic_store(&self->epoch, atomic_load(&global_epoch));
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+/**
+ * @brief Leave a read-side critical section.
+ */
+void epoch_exit(void) {
+	atomic_store_explicit(&self->epoch, 0, memory_order_release);
+}
+
+/**
+ * @brief Destroy an object once no reader can access it anymore.
+ *
+ * The object must already be unreachable for the readers entering a
+ * critical section from now on.
+ *
+ * @param ptr
+ * Pointer to the object.
+ * @param destroy
+ * Method releasing the object.
+ */
+void epoch_retire(void *ptr, void (*destroy)(void *)) {
+	struct Retired *retired = malloc(sizeof(struct Retired));
+	if(retired == NULL) {
+		/* leaking is the only safe option */
+		LOG(LOGERROR, "server: malloc: %m\n");
+		return;
+	}
+	retired->ptr = ptr;
+	retired->destroy = destroy;
+	pthread_mutex_lock(&limbo_mutex);
+	retired->epoch = atomic_load(&global_epoch);
+	retired->next = limbo;
+	limbo = retired;
+	pthread_mutex_unlock(&limbo_mutex);
+}
+
+/**
+ * @brief Advance the global epoch if possible and destroy the objects that
+ * are not accessible anymore.
+ *
+ * Must be called periodically by a thread outside of a critical section.
+ */
+void epoch_poll(void) {
+	struct Retired **curr, *expired = NULL, *next;
+	unsigned long epoch = atomic_load(&global_epoch);
+	int empty;
+	pthread_mutex_lock(&limbo_mutex);
+	empty = limbo == NULL;
+	pthread_mutex_unlock(&limbo_mutex);
+	if(empty) return;
+	/* the epoch advances only when every thread in a critical section has
+	observed the current one */
+	int advance = 1;
+	for(int i = 0; i < EPOCHTHREADS && advance; i++) {
+		if(!atomic_load(&records[i].used)) continue;
+		unsigned long e = atomic_load(&records[i].epoch);
+		if(e != 0 && e != epoch) advance = 0;
+	}
+	if(advance && atomic_compare_exchange_strong(&global_epoch, &epoch,
+		epoch + 1)) {
+		epoch++;
+	}
+	/* the objects retired two epochs ago cannot be reached anymore */
+	pthread_mutex_lock(&limbo_mutex);
+	for(curr = &limbo; *curr != NULL; ) {
+		if((*curr)->epoch + 2 <= epoch) {
+			next = (*curr)->next;
+			(*curr)->next = expired;
+			expired = *curr;
+			*curr = next;
+		} else {
+			curr = &(*curr)->next;
+		}
+	}
+	pthread_mutex_unlock(&limbo_mutex);
+	for(; expired != NULL; expired = next) {
+		next = expired->next;
+		expired->destroy(expired->ptr);
+		free(expired);
+	}
+}
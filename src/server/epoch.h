@@ -0,0 +1,72 @@
+/**
+ * @file epoch.h
+ * @brief Epoch-based reclamation of the memory shared with lock-free readers.
+ *
+ * A thread reading shared objects without holding a lock does it between
+ * epoch_enter() and epoch_exit(). An object unlinked by a writer is passed to
+ * epoch_retire() and destroyed only after every thread that might still be
+ * reading it has left its critical section, that is after the global epoch
+ * has advanced twice.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/** Maximum number of threads registered as readers */
+#define EPOCHTHREADS 64
+
+/**
+ * @brief Register the calling thread as a reader.
+ *
+ * Must be called once by every thread using epoch_enter().
+ *
+ * @return \c 0 if successful, \c -1 if too many threads are registered.
+ */
+int epoch_register(void);
+
+/**
+ * @brief Unregister the calling thread.
+ */
+void epoch_unregister(void);
+
+/**
+ * @brief Enter a read-side critical section.
+ *
+ * The shared objects loaded until epoch_exit() will not be destroyed. The
+ * critical sections cannot be nested.
+ */
+void epoch_enter(void);
+
+/**
+ * @brief Leave a read-side critical section.
+ */
+void epoch_exit(void);
+
+/**
+ * @brief Destroy an object once no reader can access it anymore.
+ *
+ * The object must already be unreachable for the readers entering a
+ * critical section from now on.
+ *
+ * @param ptr
+ * Pointer to the object.
+ * @param destroy
+ * Method releasing the object.
+ */
+void epoch_retire(void *ptr, void (*destroy)(void *));
+
+/**
+ * @brief Advance the global epoch if possible and destroy the objects that
+ * are not accessible anymore.
+ *
+ * Must be called periodically by a thread outside of a critical section.
+ */
+void epoch_poll(void);
+
+#endif
@@ -0,0 +1,242 @@
+/**
+ * @file epollloop.c
+ * @brief Portable event loop backend, waiting for the readiness of the
+ * sockets with epoll and performing the I/O with plain system calls.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+/* Necessary for accept4() */
+#define _GNU_SOURCE
+
+#include "eventloop.h"
+
+/* Asynchronous logging */
+#include "log.h"
+
+/* Sampled tracing of the reads */
+#include "trace.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+
+/* Networking libraries */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+/**
+ * @brief The epoll backend is available on every Linux kernel.
+ *
+ * @return Always \c 1.
+ */
+static int epoll_supported(void) {
+	return 1;
+}
+
+/**
+ * @brief Create the epoll instance of a loop, watching its wake up file
+ * descriptor and its listener.
+ *
+ * @param loop
+ * Event loop being initialized.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+static int epoll_init(struct EventLoop *loop) {
+	struct epoll_event ev;
+	if((loop->epollfd = epoll_create1(0)) == -1) {
+		perror("server: epoll_create1");
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = loop;
+	if(epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, loop->wakefd, &ev) == -1) {
+		perror("server: epoll_ctl");
+		return -1;
+	}
+	if(loop->listenfd == -1) return 0;
+	/* the listener is not shared with the other loops, the kernel chooses
+	the one receiving every connection */
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = NULL;
+	if(epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, loop->listenfd, &ev) == -1) {
+		perror("server: epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Stop watching a connection and close its socket.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection.
+ */
+static void epoll_close(struct EventLoop *loop, struct Connection *conn) {
+	epoll_ctl(loop->epollfd, EPOLL_CTL_DEL, conn->client_info.sockfd, NULL);
+	close(conn->client_info.sockfd);
+}
+
+/**
+ * @brief Write the messages queued for a connection.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection.
+ */
+static void epoll_flush(struct EventLoop *loop, struct Connection *conn) {
+	(void)loop;
+	conn_flush(conn);
+}
+
+/**
+ * @brief Accept every pending connection of the listening socket.
+ *
+ * @param loop
+ * Event loop that will own the new connections.
+ */
+static void accept_connections(struct EventLoop *loop) {
+	struct sockaddr_storage client_addr;
+	socklen_t sin_size;
+	int new_fd;
+	while(1) {
+		sin_size = sizeof client_addr;
+		new_fd = accept4(loop->listenfd, (struct sockaddr *)&client_addr,
+			&sin_size, SOCK_NONBLOCK);
+		if(new_fd == -1) {
+			if(errno == EINTR || errno == ECONNABORTED) continue;
+			/* no more pending connections */
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+			LOG(LOGERROR, "server: accept: %m\n");
+			return;
+		}
+		struct Connection *conn = eventloop_accept(loop, new_fd, &client_addr);
+		if(conn == NULL) continue;
+		/* watch both directions: EPOLLOUT is reported when the socket
+		becomes writable again after a partial send */
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = conn;
+		if(epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, new_fd, &ev) == -1) {
+			LOG(LOGERROR, "server: epoll_ctl: %m\n");
+			eventloop_close(loop, conn);
+		}
+	}
+}
+
+/**
+ * @brief Read every packet available on a connection.
+ *
+ * Since the connection is edge-triggered, the socket is read until the kernel
+ * has no more data. Every read fills the connection's decoder with as many
+ * bytes as possible, then all the complete frames received are dispatched.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection.
+ *
+ * @return \c 0 if the connection is still open, \c -1 if it has to be
+ * closed.
+ */
+static int read_packets(struct EventLoop *loop, struct Connection *conn) {
+	ssize_t n;
+	uint64_t start;
+	while(1) {
+		trace_sample();
+		start = trace_begin();
+		n = decoder_recv(&conn->decoder, conn->client_info.sockfd);
+		trace_end("receive", start);
+		if(n == 0) {
+			/* Connection with the client lost */
+			return -1;
+		}
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			LOG(LOGERROR, "server: recv: %m\n");
+			return -1;
+		}
+		stats_add(&loop->stats.bytes_in, n);
+		if(eventloop_dispatch(loop, conn) == -1) return -1;
+		/* write what the packets produced before reading more, so that a
+		fast sender does not fill the queues of the recipients */
+		eventloop_flush(loop);
+	}
+}
+
+/**
+ * @brief Routine executed by every event loop thread.
+ *
+ * @param param Pointer to the \c EventLoop structure of the thread.
+ *
+ * @return Always a \c NULL pointer.
+ */
+static void *epoll_run(void *param) {
+	struct EventLoop *loop = param;
+	struct epoll_event events[MAXEVENTS];
+	int timeout = -1;
+	if(eventloop_begin(loop) == -1) return NULL;
+	while(1) {
+		int n = epoll_wait(loop->epollfd, events, MAXEVENTS, timeout);
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			LOG(LOGERROR, "server: epoll_wait: %m\n");
+			break;
+		}
+		for(int i = 0; i < n; i++) {
+			struct Connection *conn = events[i].data.ptr;
+			/* the listener is the only file descriptor without a
+			connection */
+			if(conn == NULL) {
+				accept_connections(loop);
+				continue;
+			}
+			/* the wake up file descriptor is identified by the loop, the
+			inbox is read after the events */
+			if(events[i].data.ptr == loop) {
+				uint64_t count;
+				if(read(loop->wakefd, &count, sizeof count) == -1
+					&& errno != EAGAIN) {
+					LOG(LOGERROR, "server: eventfd read: %m\n");
+				}
+				continue;
+			}
+			if(events[i].events & EPOLLOUT) {
+				conn_flush(conn);
+			}
+			if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				if(read_packets(loop, conn) == -1) {
+					eventloop_close(loop, conn);
+				}
+				trace_stop();
+			}
+		}
+		timeout = eventloop_end_batch(loop);
+	}
+	return NULL;
+}
+
+/**
+ * Portable backend, waiting for the readiness of the sockets with epoll.
+ */
+const struct LoopBackend epoll_backend = {
+	.name = "epoll",
+	.supported = epoll_supported,
+	.init = epoll_init,
+	.run = epoll_run,
+	.flush = epoll_flush,
+	.close = epoll_close
+};
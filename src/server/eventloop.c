@@ -0,0 +1,752 @@
+/**
+ * @file eventloop.c
+ * @brief Event loops handling the server's connections on a fixed set of
+ * threads.
+ *
+ * Every loop is a shard with its own listening socket and its own slice of
+ * the connections. The loops never share a lock on the hot path: the
+ * messages for the connections of another shard are posted to its lock-free
+ * inbox. The system calls waiting for the events and performing the I/O are
+ * made by a backend, epoll or io_uring, chosen at startup.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+/* Necessary for pthread_setaffinity_np() */
+#define _GNU_SOURCE
+
+#include "eventloop.h"
+
+/* Deferred release of the connections */
+#include "epoch.h"
+
+/* Asynchronous logging */
+#include "log.h"
+
+/* Sampled tracing of the reads */
+#include "trace.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sched.h>
+
+/* Wake up of the loops */
+#include <sys/eventfd.h>
+
+/**
+ * Event loop run by the calling thread.
+ */
+static _Thread_local struct EventLoop *current_loop;
+
+/**
+ * @brief Wake up a loop after posting to its inbox.
+ *
+ * @param loop
+ * Event loop to wake up.
+ */
+static void signal_loop(struct EventLoop *loop) {
+	uint64_t one = 1;
+	/* the loop reads its whole inbox once woken up, the next messages do not
+	need to wake it again */
+	if(atomic_exchange(&loop->inbox_signaled, 1) == 1) return;
+	if(write(loop->wakefd, &one, sizeof one) == -1 && errno != EAGAIN) {
+		LOG(LOGERROR, "server: eventfd write: %m\n");
+	}
+}
+
+/**
+ * @brief Ask the owner loop to release the memory of a retired connection.
+ *
+ * The release is posted after any message that the readers of the client
+ * list posted for the connection before it was retired, so the owner
+ * releases it only once it has no reference left.
+ *
+ * @param conn
+ * Pointer to the connection.
+ */
+static void release_connection(void *conn) {
+	struct Connection *c = conn;
+	c->release.buf = NULL;
+	mpsc_push(&c->loop->inbox, &c->release.node);
+	signal_loop(c->loop);
+}
+
+/**
+ * @brief Queue a message for a range of members of a room.
+ *
+ * @param buf
+ * Encoded frame, every recipient takes one of its references.
+ * @param members
+ * Recipients, all owned by the calling loop.
+ * @param count
+ * Number of recipients.
+ * @param except
+ * Member skipped, \c NULL if none.
+ */
+static void queue_members(struct MsgBuf *buf, struct ClientInfo *const *members,
+	int count, const struct ClientInfo *except) {
+	for(int i = 0; i < count; i++) {
+		if(members[i] == except) continue;
+		/* the messages refused to a slow consumer are counted by the loop */
+		if(conn_queue((struct Connection *)members[i], msgbuf_ref(buf)) == -1
+			&& errno != EPIPE && errno != ENOBUFS) {
+			LOG(LOGWARN, "server: send: %m\n");
+		}
+	}
+}
+
+/**
+ * @brief Queue the deliveries posted to a loop by the other threads.
+ *
+ * @param loop
+ * Event loop reading its inbox.
+ */
+static void read_inbox(struct EventLoop *loop) {
+	struct MpscNode *node;
+	struct Delivery *d;
+	/* a message posted from now on wakes the loop up again, even if it is
+	not complete yet when the inbox is read */
+	atomic_store(&loop->inbox_signaled, 0);
+	while((node = mpsc_pop(&loop->inbox)) != NULL) {
+		d = (struct Delivery *)((char *)node
+			- offsetof(struct Delivery, node));
+		if(d->buf == NULL) {
+			struct Connection *conn = (struct Connection *)((char *)d
+				- offsetof(struct Connection, release));
+			/* the backend may still have requests using the connection,
+			it releases it when they complete */
+			if(conn->pending_ops > 0) {
+				conn->released = 1;
+			}
+			else {
+				conn_destroy(conn);
+			}
+			continue;
+		}
+		/* the recipients of a traced message on this shard are part of its
+		fan-out */
+		uint64_t start = d->buf->trace != 0 ? stats_now() : 0;
+		if(d->members != NULL) {
+			queue_members(d->buf, d->members, d->count, d->except);
+			d->done(d->owner);
+		}
+		else {
+			for(int i = 0; i < d->count; i++) {
+				if(conn_queue(d->conns[i], msgbuf_ref(d->buf)) == -1
+					&& errno != EPIPE && errno != ENOBUFS) {
+					LOG(LOGWARN, "server: send: %m\n");
+				}
+			}
+		}
+		if(d->buf->trace != 0) {
+			trace_span("fan-out", d->buf->trace, start, stats_now());
+		}
+		msgbuf_unref(d->buf);
+		free(d);
+	}
+}
+
+/**
+ * @brief Allocate a delivery of a message.
+ *
+ * @param buf
+ * Encoded frame, the delivery takes one of its references.
+ * @param cap
+ * Number of recipients that the delivery can hold.
+ *
+ * @return A pointer to the delivery, \c NULL if an error occours.
+ */
+static struct Delivery *delivery_alloc(struct MsgBuf *buf, int cap) {
+	struct Delivery *d = malloc(sizeof(struct Delivery)
+		+ cap * sizeof(struct Connection *));
+	if(d == NULL) return NULL;
+	d->buf = msgbuf_ref(buf);
+	d->count = 0;
+	d->cap = cap;
+	d->conns = (struct Connection **)(d + 1);
+	d->members = NULL;
+	return d;
+}
+
+/**
+ * @brief Close a connection, its memory is released once it is not
+ * reachable anymore.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection.
+ */
+void eventloop_close(struct EventLoop *loop, struct Connection *conn) {
+	struct Connection **curr;
+	/* after this no new snapshot of the client list contains the
+	connection */
+	loop->handlers->on_close(conn);
+	stats_add(&loop->stats.closes, 1);
+	timer_cancel(&loop->timers, &conn->timer);
+	/* the messages still reaching the connection are refused, and the loop
+	will not try to flush it */
+	conn->closed = 1;
+	if(conn->flush_scheduled) {
+		for(curr = &loop->flush_list; *curr != NULL;
+			curr = &(*curr)->next_flush) {
+			if(*curr == conn) {
+				*curr = conn->next_flush;
+				break;
+			}
+		}
+	}
+	loop->backend->close(loop, conn);
+	/* the connection is retired once the handlers have made it
+	unreachable */
+	conn->next_flush = loop->closed_list;
+	loop->closed_list = conn;
+}
+
+/**
+ * @brief Call the handler of a connection whose timer has expired.
+ *
+ * @param timer
+ * Timer of the connection.
+ */
+static void connection_timer(struct Timer *timer) {
+	struct Connection *conn = (struct Connection *)((char *)timer
+		- offsetof(struct Connection, timer));
+	struct EventLoop *loop = conn->loop;
+	int ms = loop->handlers->on_timer(conn);
+	if(ms == -1) {
+		eventloop_close(loop, conn);
+	}
+	else if(ms > 0) {
+		eventloop_set_timer(loop, conn, ms);
+	}
+}
+
+/**
+ * @brief Register a connection accepted by a backend.
+ *
+ * @param loop
+ * Event loop that will own the connection.
+ * @param sockfd
+ * Socket file descriptor of the connection.
+ * @param addr
+ * Address of the client.
+ *
+ * @return A pointer to the new connection, \c NULL if it has been refused:
+ * its socket is then closed.
+ */
+struct Connection *eventloop_accept(struct EventLoop *loop, int sockfd,
+	struct sockaddr_storage *addr) {
+	struct Connection *conn = conn_create(sockfd, loop);
+	if(conn == NULL) {
+		LOG(LOGERROR, "server: out of memory, connection refused\n");
+		close(sockfd);
+		return NULL;
+	}
+	timer_init(&conn->timer, connection_timer);
+	if(loop->handlers->on_accept(conn, addr) == -1) {
+		timer_cancel(&loop->timers, &conn->timer);
+		close(sockfd);
+		conn_destroy(conn);
+		return NULL;
+	}
+	stats_add(&loop->stats.accepts, 1);
+	return conn;
+}
+
+/**
+ * @brief Dispatch every complete packet received on a connection to the
+ * handlers.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection, its decoder holds the bytes received.
+ *
+ * @return \c 0 if the connection is still open, \c -1 if it has to be
+ * closed.
+ */
+int eventloop_dispatch(struct EventLoop *loop, struct Connection *conn) {
+	struct Packet packet;
+	uint64_t received = stats_now(), start = trace_begin();
+	int ret;
+	while((ret = decoder_next(&conn->decoder, &packet)) == 1) {
+		trace_end("decode", start);
+		/* the timeouts of the connection count from its latest packet */
+		conn->last_active = received / 1000000;
+		stats_add(&loop->stats.packets_in[packet.action < STATSACTIONS
+			? packet.action : STATSACTIONS], 1);
+		start = trace_begin();
+		ret = loop->handlers->on_packet(conn, &packet);
+		trace_end("handle", start);
+		if(ret == -1) return -1;
+		/* the packets received together wait for the ones before them */
+		stats_record(&loop->stats.dispatch, stats_now() - received);
+		start = trace_begin();
+	}
+	if(ret == -1) {
+		LOG(LOGWARN, "Malformed frame from [%d] %s\n",
+			conn->client_info.sockfd, conn->client_info.alias);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Write the messages queued for the connections in the flush list.
+ *
+ * @param loop
+ * Event loop owning the connections.
+ */
+void eventloop_flush(struct EventLoop *loop) {
+	struct Connection *conn, *next;
+	/* take the whole list, the connections queued from now on will be
+	added to a new one */
+	conn = loop->flush_list;
+	loop->flush_list = NULL;
+	for(; conn != NULL; conn = next) {
+		next = conn->next_flush;
+		conn->flush_scheduled = 0;
+		loop->backend->flush(loop, conn);
+	}
+}
+
+/**
+ * @brief Close the slow consumers whose grace period has expired.
+ *
+ * @param loop
+ * Event loop owning the connections.
+ */
+static void evict_connections(struct EventLoop *loop) {
+	for(struct Connection *conn = loop->evict_list, *next; conn != NULL;
+		conn = next) {
+		next = conn->next_evict;
+		conn->evicting = 0;
+		if(conn->closed) continue;
+		LOG(LOGINFO, "server: disconnecting slow consumer %s (%zu bytes "
+			"waiting)\n", conn->client_info.alias, conn->outq.bytes);
+		stats_add(&loop->stats.evicted, 1);
+		eventloop_close(loop, conn);
+	}
+	loop->evict_list = NULL;
+}
+
+/**
+ * @brief Complete a batch of events: queue the messages posted by the other
+ * threads, expire the timers, write the connections, close the slow
+ * consumers and retire the connections closed.
+ *
+ * @param loop
+ * Event loop ending the batch.
+ *
+ * @return The number of milliseconds to wait at most for the next events,
+ * \c -1 to wait indefinitely.
+ */
+int eventloop_end_batch(struct EventLoop *loop) {
+	int timeout, next_timer;
+	uint64_t now = eventloop_now();
+	/* write what has been queued while handling the events, or posted by
+	the other threads, and by the handlers of the timers */
+	read_inbox(loop);
+	timerwheel_advance(&loop->timers, now);
+	eventloop_flush(loop);
+	evict_connections(loop);
+	/* the memory of the connections closed is released once no reader can
+	access it, the handlers may ask to be called again later */
+	if((timeout = loop->handlers->on_batch()) == -1) {
+		for(struct Connection *conn = loop->closed_list, *next;
+			conn != NULL; conn = next) {
+			next = conn->next_flush;
+			epoch_retire(conn, release_connection);
+		}
+		loop->closed_list = NULL;
+	}
+	epoch_poll();
+	/* the loop wakes up for the earliest of the handlers and the timers */
+	next_timer = timerwheel_timeout(&loop->timers, now);
+	if(timeout == -1 || (next_timer != -1 && next_timer < timeout)) {
+		timeout = next_timer;
+	}
+	/* the connections whose write could not be started are flushed again
+	as soon as the requests pending have been submitted */
+	if(loop->flush_list != NULL) {
+		timeout = 0;
+	}
+	return timeout;
+}
+
+/**
+ * @brief Returns the time read by the loops' timers.
+ *
+ * @return The monotonic time, in milliseconds.
+ */
+uint64_t eventloop_now(void) {
+	return stats_now() / 1000000;
+}
+
+/**
+ * @brief Set the timer of a connection, replacing the previous one.
+ *
+ * When it expires, the \c on_timer handler is called on the loop owning the
+ * connection. Must be called only by the owning loop.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection.
+ * @param ms
+ * Number of milliseconds after which the timer expires, \c 0 to unset it.
+ */
+void eventloop_set_timer(struct EventLoop *loop, struct Connection *conn,
+	int ms) {
+	if(ms <= 0) {
+		timer_cancel(&loop->timers, &conn->timer);
+		return;
+	}
+	/* the wheel may not have been advanced while the loop was waiting, the
+	expiration is read from the clock */
+	timer_schedule(&loop->timers, &conn->timer, eventloop_now() + ms);
+}
+
+/**
+ * @brief Ask a loop to write the messages queued for one of its connections.
+ *
+ * Must be called only by the owning loop.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection, must not be in the flush list already.
+ */
+void eventloop_schedule_flush(struct EventLoop *loop, struct Connection *conn) {
+	conn->next_flush = loop->flush_list;
+	loop->flush_list = conn;
+}
+
+/**
+ * @brief Post a message to the inbox of the loop owning a connection.
+ *
+ * The loop is woken up only if it has not been signaled since it last read
+ * its inbox, so a burst of messages costs a single wake up.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection, reachable by the caller until the message is
+ * posted.
+ * @param buf
+ * Encoded frame, the reference passed is released by this method if the
+ * message cannot be posted.
+ *
+ * @return \c 0 if successful, \c -1 if the memory could not be allocated.
+ */
+int eventloop_post(struct EventLoop *loop, struct Connection *conn,
+	struct MsgBuf *buf) {
+	struct Delivery *d = delivery_alloc(buf, 1);
+	msgbuf_unref(buf);
+	if(d == NULL) return -1;
+	d->conns[d->count++] = conn;
+	mpsc_push(&loop->inbox, &d->node);
+	signal_loop(loop);
+	return 0;
+}
+
+/**
+ * @brief Start sending a message to many connections.
+ *
+ * @param fanout
+ * Pointer to the structure collecting the recipients.
+ * @param buf
+ * Encoded frame, the caller keeps its own reference.
+ */
+void fanout_init(struct Fanout *fanout, struct MsgBuf *buf) {
+	fanout->buf = buf;
+	memset(fanout->pending, 0, sizeof fanout->pending);
+}
+
+/**
+ * @brief Add a recipient to a message being sent to many connections.
+ *
+ * @param fanout
+ * Pointer to the structure collecting the recipients.
+ * @param conn
+ * Pointer to the recipient, reachable by the caller until fanout_flush().
+ *
+ * @return \c 0 if successful, \c -1 if the message could not be queued.
+ */
+int fanout_add(struct Fanout *fanout, struct Connection *conn) {
+	struct Delivery **pending, *d;
+	if(conn->loop == current_loop) {
+		return conn_queue(conn, msgbuf_ref(fanout->buf));
+	}
+	pending = &fanout->pending[conn->loop->index];
+	if(*pending == NULL) {
+		if((*pending = delivery_alloc(fanout->buf, DELIVERYMIN)) == NULL) {
+			return -1;
+		}
+	}
+	else if((*pending)->count == (*pending)->cap) {
+		d = realloc(*pending, sizeof(struct Delivery)
+			+ 2 * (*pending)->cap * sizeof(struct Connection *));
+		if(d == NULL) return -1;
+		d->cap *= 2;
+		d->conns = (struct Connection **)(d + 1);
+		*pending = d;
+	}
+	(*pending)->conns[(*pending)->count++] = conn;
+	return 0;
+}
+
+/**
+ * @brief Post a message to the loops owning its recipients.
+ *
+ * @param fanout
+ * Pointer to the structure collecting the recipients.
+ */
+void fanout_flush(struct Fanout *fanout) {
+	for(int i = 0; i < MAXSHARDS; i++) {
+		struct Delivery *d = fanout->pending[i];
+		if(d == NULL) continue;
+		fanout->pending[i] = NULL;
+		struct EventLoop *loop = d->conns[0]->loop;
+		mpsc_push(&loop->inbox, &d->node);
+		signal_loop(loop);
+	}
+}
+
+/**
+ * @brief Send a message to a range of members of a room owned by a single
+ * loop, without copying the range.
+ *
+ * The range is queued at once if the calling thread runs the loop, else it
+ * is posted to the loop as a single delivery, so that the loop queues the
+ * message for all of them while the caller goes on.
+ *
+ * @param buf
+ * Encoded frame, the caller keeps its own reference.
+ * @param loop
+ * Event loop owning the members.
+ * @param members
+ * Recipients, reachable until \c done is called.
+ * @param count
+ * Number of recipients.
+ * @param except
+ * Member skipped, the sender of the message.
+ * @param done
+ * Called with \c owner once the members have been queued, or if the message
+ * cannot be posted.
+ * @param owner
+ * Structure holding the members, such as a reference to a snapshot.
+ *
+ * @return \c 0 if successful, \c -1 if the memory could not be allocated.
+ */
+int fanout_shared(struct MsgBuf *buf, struct EventLoop *loop,
+	struct ClientInfo *const *members, int count,
+	const struct ClientInfo *except, void (*done)(void *owner), void *owner) {
+	struct Delivery *d;
+	if(loop == current_loop) {
+		queue_members(buf, members, count, except);
+		done(owner);
+		return 0;
+	}
+	if((d = delivery_alloc(buf, 0)) == NULL) {
+		done(owner);
+		return -1;
+	}
+	d->count = count;
+	d->members = members;
+	d->except = except;
+	d->done = done;
+	d->owner = owner;
+	mpsc_push(&loop->inbox, &d->node);
+	signal_loop(loop);
+	return 0;
+}
+
+/**
+ * @brief Make a loop the current one of the calling thread.
+ *
+ * Called by the loop threads when they start, and by the programs driving a
+ * loop without starting it.
+ *
+ * @param loop
+ * Event loop run by the calling thread.
+ */
+void eventloop_attach(struct EventLoop *loop) {
+	current_loop = loop;
+	stats_attach(&loop->stats);
+}
+
+/**
+ * @brief Returns the event loop run by the calling thread.
+ *
+ * @return A pointer to the loop, \c NULL if the thread is not a loop.
+ */
+struct EventLoop *eventloop_current(void) {
+	return current_loop;
+}
+
+/**
+ * @brief Prepare the calling thread to run a loop, called by the backends
+ * when their thread starts.
+ *
+ * @param loop
+ * Event loop run by the calling thread.
+ *
+ * @return \c 0 if successful, \c -1 if the loop cannot run.
+ */
+int eventloop_begin(struct EventLoop *loop) {
+	if(epoch_register() == -1) {
+		LOG(LOGERROR, "server: too many event loops\n");
+		return -1;
+	}
+	eventloop_attach(loop);
+	return 0;
+}
+
+/**
+ * @brief Initialize an event loop without starting its thread.
+ *
+ * @param loop
+ * Structure that will describe the loop.
+ * @param index
+ * Position of the loop among the started ones, lower than \c MAXSHARDS.
+ * @param listenfd
+ * Non-blocking socket listening for incoming connections, \c -1 if the loop
+ * does not accept connections.
+ * @param handlers
+ * Callbacks invoked on the connections' events.
+ * @param backend
+ * System calls used by the loop.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+int eventloop_init(struct EventLoop *loop, int index, int listenfd,
+	const struct LoopHandlers *handlers, const struct LoopBackend *backend) {
+	loop->index = index;
+	loop->listenfd = listenfd;
+	loop->handlers = handlers;
+	loop->backend = backend;
+	loop->epollfd = -1;
+	loop->uring = NULL;
+	loop->flush_list = NULL;
+	loop->closed_list = NULL;
+	loop->evict_list = NULL;
+	timerwheel_init(&loop->timers, eventloop_now());
+	stats_init(&loop->stats);
+	mpsc_init(&loop->inbox);
+	atomic_init(&loop->inbox_signaled, 0);
+	if((loop->wakefd = eventfd(0, EFD_NONBLOCK)) == -1) {
+		perror("server: eventfd");
+		return -1;
+	}
+	return backend->init(loop);
+}
+
+/**
+ * @brief Bind a loop thread to one of the CPUs available to the process.
+ *
+ * @param loop
+ * Event loop already started.
+ */
+static void pin_loop(struct EventLoop *loop) {
+	cpu_set_t available, cpu;
+	int count, n = 0;
+	if(sched_getaffinity(0, sizeof available, &available) == -1) {
+		perror("server: sched_getaffinity");
+		return;
+	}
+	count = CPU_COUNT(&available);
+	for(int c = 0; c < CPU_SETSIZE; c++) {
+		if(!CPU_ISSET(c, &available)) continue;
+		if(n++ != loop->index % count) continue;
+		CPU_ZERO(&cpu);
+		CPU_SET(c, &cpu);
+		if(pthread_setaffinity_np(loop->thread_ID, sizeof cpu, &cpu) != 0) {
+			fprintf(stderr, "server: cannot pin loop %d to CPU %d\n",
+				loop->index, c);
+		}
+		return;
+	}
+}
+
+/**
+ * @brief Start the event loop threads.
+ *
+ * Every loop watches its own listening socket, the kernel spreads the
+ * incoming connections among them.
+ *
+ * @param loops
+ * Array of \c nloops structures that will describe the started loops.
+ * @param nloops
+ * Number of threads to start, at most \c MAXSHARDS.
+ * @param listenfds
+ * Array of \c nloops non-blocking sockets listening for incoming connections
+ * on the same address.
+ * @param handlers
+ * Callbacks invoked on the connections' events.
+ * @param backend
+ * System calls used by the loops.
+ * @param pin
+ * If not \c 0, the loop \c i is bound to the \c i-th CPU available to the
+ * process, modulo their number.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+int eventloop_start(struct EventLoop *loops, int nloops, const int *listenfds,
+	const struct LoopHandlers *handlers, const struct LoopBackend *backend,
+	int pin) {
+	if(nloops > MAXSHARDS) {
+		fprintf(stderr, "server: at most %d event loops\n", MAXSHARDS);
+		return -1;
+	}
+	/* every loop can post to the others as soon as it starts */
+	for(int i = 0; i < nloops; i++) {
+		if(eventloop_init(&loops[i], i, listenfds[i], handlers, backend)
+			== -1) {
+			return -1;
+		}
+	}
+	for(int i = 0; i < nloops; i++) {
+		if(pthread_create(&loops[i].thread_ID, NULL, backend->run,
+			&loops[i]) != 0) {
+			perror("server: event loop creation");
+			return -1;
+		}
+		if(pin) pin_loop(&loops[i]);
+	}
+	return 0;
+}
+
+/**
+ * @brief Choose a backend by name, falling back to epoll if the kernel does
+ * not support it.
+ *
+ * @param name
+ * Name of the backend.
+ *
+ * @return A pointer to the backend, \c NULL if the name is unknown.
+ */
+const struct LoopBackend *eventloop_backend(const char *name) {
+	static const struct LoopBackend *backends[] = {
+		&epoll_backend, &uring_backend
+	};
+	for(size_t i = 0; i < sizeof backends / sizeof backends[0]; i++) {
+		if(strcmp(backends[i]->name, name) != 0) continue;
+		if(backends[i]->supported()) return backends[i];
+		fprintf(stderr, "server: %s not supported by the kernel, "
+			"using epoll\n", name);
+		return &epoll_backend;
+	}
+	return NULL;
+}
@@ -0,0 +1,480 @@
+/**
+ * @file eventloop.h
+ * @brief Event loops handling the server's connections on a fixed set of
+ * threads.
+ *
+ * Every loop is a shard with its own listening socket and its own slice of
+ * the connections. The loops never share a lock on the hot path: the
+ * messages for the connections of another shard are posted to its lock-free
+ * inbox. The system calls waiting for the events and performing the I/O are
+ * made by a backend, epoll or io_uring, chosen at startup.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+/* Necessary for the definition of the struct Connection */
+#include "connection.h"
+
+/* Inboxes of the event loops */
+#include "mpscqueue.h"
+
+/* Counters of the loop */
+#include "stats.h"
+
+/* Standard libraries */
+#include <stdatomic.h>
+
+/* Networking libraries */
+#include <sys/socket.h>
+
+/* Thread library */
+#include <pthread.h>
+
+/** Maximum number of events returned by a single epoll_wait() */
+#define MAXEVENTS 64
+/** Maximum number of event loops, each one is a reader of the client list */
+#define MAXSHARDS 64
+/** Initial number of recipients of a delivery to another loop */
+#define DELIVERYMIN 16
+/** Minimum number of members of a room whose messages are handed to the
+loops as whole ranges of its snapshot */
+#define FANOUTPARALLEL 1024
+/** Capacity of the submission queue of an io_uring loop */
+#define URINGENTRIES 1024
+/** Capacity of the completion queue of an io_uring loop */
+#define URINGCQENTRIES 8192
+/** Number of buffers provided to the kernel by an io_uring loop for the
+receives */
+#define URINGBUFS 256
+/** Length of every buffer provided for the receives */
+#define URINGBUFLEN 4096
+
+struct EventLoop;
+struct UringLoop;
+
+/**
+ * @struct LoopHandlers
+ *
+ * @brief Callbacks invoked by the event loops on the connections' events.
+ *
+ * The callbacks are executed on the thread of the event loop owning the
+ * connection.
+ *
+ * @var LoopHandlers::on_accept
+ * Called when a new connection has been accepted, before any packet is read
+ * from it. Returning \c -1 closes the connection.
+ * @var LoopHandlers::on_packet
+ * Called for every complete packet received. Returning \c -1 closes the
+ * connection.
+ * @var LoopHandlers::on_close
+ * Called when the connection is about to be closed.
+ * @var LoopHandlers::on_batch
+ * Called after every batch of events. Returns the number of milliseconds
+ * after which it has to be called again, or \c -1 if the connections closed
+ * are not reachable anymore: only then they are retired, and their memory is
+ * released once no reader can access them.
+ * @var LoopHandlers::on_timer
+ * Called when the timer of a connection set by eventloop_set_timer()
+ * expires. Returns the number of milliseconds after which it has to be
+ * called again, \c 0 to leave the timer unset, or \c -1 to close the
+ * connection.
+ */
+struct LoopHandlers {
+	int (*on_accept)(struct Connection *conn, struct sockaddr_storage *addr);
+	int (*on_packet)(struct Connection *conn, struct Packet *packet);
+	void (*on_close)(struct Connection *conn);
+	int (*on_batch)(void);
+	int (*on_timer)(struct Connection *conn);
+};
+
+/**
+ * @struct LoopBackend
+ *
+ * @brief System calls used by an event loop to wait for the events and to
+ * perform the I/O.
+ *
+ * The backends share the handling of the connections: they report the
+ * connections accepted through eventloop_accept(), the bytes received
+ * through eventloop_dispatch() and end every batch of events with
+ * eventloop_end_batch().
+ *
+ * @var LoopBackend::name
+ * Name used to choose the backend.
+ * @var LoopBackend::supported
+ * Returns \c 1 if the running kernel supports the backend.
+ * @var LoopBackend::init
+ * Prepare the backend of a loop. Returns \c -1 if an error occours.
+ * @var LoopBackend::run
+ * Routine of the loop thread.
+ * @var LoopBackend::flush
+ * Write the messages queued for a connection, or start writing them.
+ * @var LoopBackend::close
+ * Stop watching a connection and close its socket.
+ */
+struct LoopBackend {
+	const char *name;
+	int (*supported)(void);
+	int (*init)(struct EventLoop *loop);
+	void *(*run)(void *loop);
+	void (*flush)(struct EventLoop *loop, struct Connection *conn);
+	void (*close)(struct EventLoop *loop, struct Connection *conn);
+};
+
+/**
+ * Portable backend, waiting for the readiness of the sockets with epoll.
+ */
+extern const struct LoopBackend epoll_backend;
+
+/**
+ * Backend submitting the I/O to an io_uring instance.
+ */
+extern const struct LoopBackend uring_backend;
+
+/**
+ * @struct EventLoop
+ *
+ * @brief Structure representing a single event loop thread.
+ *
+ * @var EventLoop::thread_ID
+ * Thread running the loop.
+ * @var EventLoop::index
+ * Position of the loop among the started ones.
+ * @var EventLoop::backend
+ * System calls used to wait for the events and to perform the I/O.
+ * @var EventLoop::epollfd
+ * epoll instance watching the listener and the loop's connections, used by
+ * the epoll backend.
+ * @var EventLoop::uring
+ * State of the io_uring backend.
+ * @var EventLoop::listenfd
+ * Non-blocking socket listening for incoming connections, bound with
+ * \c SO_REUSEPORT to the same address as the listeners of the other loops.
+ * @var EventLoop::handlers
+ * Callbacks invoked on the connections' events.
+ * @var EventLoop::wakefd
+ * eventfd used by the other threads to wake up the loop.
+ * @var EventLoop::inbox
+ * Deliveries posted by the other threads.
+ * @var EventLoop::inbox_signaled
+ * \c 1 if the loop has been woken up and has not read its inbox yet.
+ * @var EventLoop::flush_list
+ * Connections having messages queued that the loop has to write.
+ * @var EventLoop::closed_list
+ * Connections closed but not retired yet, linked through their
+ * \c next_flush field.
+ * @var EventLoop::evict_list
+ * Slow consumers to close at the end of the batch.
+ * @var EventLoop::timers
+ * Timers of the loop's connections, advanced at the end of every batch.
+ * @var EventLoop::stats
+ * Counters updated by the loop.
+ */
+struct EventLoop {
+	pthread_t thread_ID;
+	int index;
+	const struct LoopBackend *backend;
+	int epollfd;
+	struct UringLoop *uring;
+	int listenfd;
+	const struct LoopHandlers *handlers;
+	int wakefd;
+	struct MpscQueue inbox;
+	atomic_int inbox_signaled;
+	struct Connection *flush_list;
+	struct Connection *closed_list;
+	struct Connection *evict_list;
+	struct TimerWheel timers;
+	struct Stats stats;
+};
+
+/**
+ * @struct Fanout
+ *
+ * @brief Message being sent to many connections, grouped by owner loop.
+ *
+ * The recipients owned by the calling loop are queued at once, the others
+ * are collected in a single delivery for every loop and posted by
+ * fanout_flush().
+ *
+ * @var Fanout::buf
+ * Encoded frame, the caller keeps its reference until fanout_flush().
+ * @var Fanout::pending
+ * Delivery being built for every loop, \c NULL if it has no recipient yet.
+ */
+struct Fanout {
+	struct MsgBuf *buf;
+	struct Delivery *pending[MAXSHARDS];
+};
+
+/**
+ * @brief Initialize an event loop without starting its thread.
+ *
+ * @param loop
+ * Structure that will describe the loop.
+ * @param index
+ * Position of the loop among the started ones, lower than \c MAXSHARDS.
+ * @param listenfd
+ * Non-blocking socket listening for incoming connections, \c -1 if the loop
+ * does not accept connections.
+ * @param handlers
+ * Callbacks invoked on the connections' events.
+ * @param backend
+ * System calls used by the loop.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+int eventloop_init(struct EventLoop *loop, int index, int listenfd,
+	const struct LoopHandlers *handlers, const struct LoopBackend *backend);
+
+/**
+ * @brief Start the event loop threads.
+ *
+ * Every loop watches its own listening socket, the kernel spreads the
+ * incoming connections among them.
+ *
+ * @param loops
+ * Array of \c nloops structures that will describe the started loops.
+ * @param nloops
+ * Number of threads to start, at most \c MAXSHARDS.
+ * @param listenfds
+ * Array of \c nloops non-blocking sockets listening for incoming connections
+ * on the same address.
+ * @param handlers
+ * Callbacks invoked on the connections' events.
+ * @param backend
+ * System calls used by the loops.
+ * @param pin
+ * If not \c 0, the loop \c i is bound to the \c i-th CPU available to the
+ * process, modulo their number.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+int eventloop_start(struct EventLoop *loops, int nloops, const int *listenfds,
+	const struct LoopHandlers *handlers, const struct LoopBackend *backend,
+	int pin);
+
+/**
+ * @brief Choose a backend by name, falling back to epoll if the kernel does
+ * not support it.
+ *
+ * @param name
+ * Name of the backend.
+ *
+ * @return A pointer to the backend, \c NULL if the name is unknown.
+ */
+const struct LoopBackend *eventloop_backend(const char *name);
+
+/**
+ * @brief Prepare the calling thread to run a loop, called by the backends
+ * when their thread starts.
+ *
+ * @param loop
+ * Event loop run by the calling thread.
+ *
+ * @return \c 0 if successful, \c -1 if the loop cannot run.
+ */
+int eventloop_begin(struct EventLoop *loop);
+
+/**
+ * @brief Register a connection accepted by a backend.
+ *
+ * @param loop
+ * Event loop that will own the connection.
+ * @param sockfd
+ * Socket file descriptor of the connection.
+ * @param addr
+ * Address of the client.
+ *
+ * @return A pointer to the new connection, \c NULL if it has been refused:
+ * its socket is then closed.
+ */
+struct Connection *eventloop_accept(struct EventLoop *loop, int sockfd,
+	struct sockaddr_storage *addr);
+
+/**
+ * @brief Dispatch every complete packet received on a connection to the
+ * handlers.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection, its decoder holds the bytes received.
+ *
+ * @return \c 0 if the connection is still open, \c -1 if it has to be
+ * closed.
+ */
+int eventloop_dispatch(struct EventLoop *loop, struct Connection *conn);
+
+/**
+ * @brief Close a connection, its memory is released once it is not
+ * reachable anymore.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection.
+ */
+void eventloop_close(struct EventLoop *loop, struct Connection *conn);
+
+/**
+ * @brief Write the messages queued for the connections in the flush list.
+ *
+ * @param loop
+ * Event loop owning the connections.
+ */
+void eventloop_flush(struct EventLoop *loop);
+
+/**
+ * @brief Complete a batch of events: queue the messages posted by the other
+ * threads, expire the timers, write the connections, close the slow
+ * consumers and retire the connections closed.
+ *
+ * @param loop
+ * Event loop ending the batch.
+ *
+ * @return The number of milliseconds to wait at most for the next events,
+ * \c -1 to wait indefinitely.
+ */
+int eventloop_end_batch(struct EventLoop *loop);
+
+/**
+ * @brief Returns the time read by the loops' timers.
+ *
+ * @return The monotonic time, in milliseconds.
+ */
+uint64_t eventloop_now(void);
+
+/**
+ * @brief Set the timer of a connection, replacing the previous one.
+ *
+ * When it expires, the \c on_timer handler is called on the loop owning the
+ * connection. Must be called only by the owning loop.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection.
+ * @param ms
+ * Number of milliseconds after which the timer expires, \c 0 to unset it.
+ */
+void eventloop_set_timer(struct EventLoop *loop, struct Connection *conn,
+	int ms);
+
+/**
+ * @brief Make a loop the current one of the calling thread.
+ *
+ * Called by the loop threads when they start, and by the programs driving a
+ * loop without starting it.
+ *
+ * @param loop
+ * Event loop run by the calling thread.
+ */
+void eventloop_attach(struct EventLoop *loop);
+
+/**
+ * @brief Returns the event loop run by the calling thread.
+ *
+ * @return A pointer to the loop, \c NULL if the thread is not a loop.
+ */
+struct EventLoop *eventloop_current(void);
+
+/**
+ * @brief Ask a loop to write the messages queued for one of its connections.
+ *
+ * Must be called only by the owning loop.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection, must not be in the flush list already.
+ */
+void eventloop_schedule_flush(struct EventLoop *loop, struct Connection *conn);
+
+/**
+ * @brief Post a message to the inbox of the loop owning a connection.
+ *
+ * The loop is woken up only if it has not been signaled since it last read
+ * its inbox, so a burst of messages costs a single wake up.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection, reachable by the caller until the message is
+ * posted.
+ * @param buf
+ * Encoded frame, the reference passed is released by this method if the
+ * message cannot be posted.
+ *
+ * @return \c 0 if successful, \c -1 if the memory could not be allocated.
+ */
+int eventloop_post(struct EventLoop *loop, struct Connection *conn,
+	struct MsgBuf *buf);
+
+/**
+ * @brief Start sending a message to many connections.
+ *
+ * @param fanout
+ * Pointer to the structure collecting the recipients.
+ * @param buf
+ * Encoded frame, the caller keeps its own reference.
+ */
+void fanout_init(struct Fanout *fanout, struct MsgBuf *buf);
+
+/**
+ * @brief Add a recipient to a message being sent to many connections.
+ *
+ * @param fanout
+ * Pointer to the structure collecting the recipients.
+ * @param conn
+ * Pointer to the recipient, reachable by the caller until fanout_flush().
+ *
+ * @return \c 0 if successful, \c -1 if the message could not be queued.
+ */
+int fanout_add(struct Fanout *fanout, struct Connection *conn);
+
+/**
+ * @brief Post a message to the loops owning its recipients.
+ *
+ * @param fanout
+ * Pointer to the structure collecting the recipients.
+ */
+void fanout_flush(struct Fanout *fanout);
+
+/**
+ * @brief Send a message to a range of members of a room owned by a single
+ * loop, without copying the range.
+ *
+ * The range is queued at once if the calling thread runs the loop, else it
+ * is posted to the loop as a single delivery, so that the loop queues the
+ * message for all of them while the caller goes on.
+ *
+ * @param buf
+ * Encoded frame, the caller keeps its own reference.
+ * @param loop
+ * Event loop owning the members.
+ * @param members
+ * Recipients, reachable until \c done is called.
+ * @param count
+ * Number of recipients.
+ * @param except
+ * Member skipped, the sender of the message.
+ * @param done
+ * Called with \c owner once the members have been queued, or if the message
+ * cannot be posted.
+ * @param owner
+ * Structure holding the members, such as a reference to a snapshot.
+ *
+ * @return \c 0 if successful, \c -1 if the memory could not be allocated.
+ */
+int fanout_shared(struct MsgBuf *buf, struct EventLoop *loop,
+	struct ClientInfo *const *members, int count,
+	const struct ClientInfo *except, void (*done)(void *owner), void *owner);
+
+#endif
@@ -0,0 +1,751 @@
+/**
+ * @file history.c
+ * @brief Persistent history of the messages shouted to every client.
+ *
+ * The encoded frames are appended one after the other to segment files of
+ * \c HISTSEGBYTES bytes mapped in memory, named after their sequence number.
+ * A background thread writes the appended data to the disk every
+ * \c HISTSYNCMS milliseconds, so many appends share a single synchronization,
+ * prepares the next segment and drops the segments beyond the retention
+ * limits. The latest messages are replayed as views of the mapped segments,
+ * without copying them.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#include "history.h"
+
+/* Length of the frames found in a segment */
+#include "packetcodec.h"
+
+/* Asynchronous logging */
+#include "log.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/* Thread library */
+#include <pthread.h>
+
+/** Length of the name of a segment file */
+#define HISTNAMELEN 32
+
+/**
+ * @struct HistSegment
+ *
+ * @brief Segment file mapped in memory.
+ *
+ * @var HistSegment::refs
+ * References to the segment, one held by the history while the segment is
+ * kept and one by every view.
+ * @var HistSegment::seq
+ * Sequence number of the segment.
+ * @var HistSegment::fd
+ * File descriptor of the segment file.
+ * @var HistSegment::base
+ * Mapping of the segment file.
+ * @var HistSegment::len
+ * Bytes appended to the segment.
+ * @var HistSegment::synced
+ * Bytes written to the disk, only accessed by the synchronizing thread.
+ * @var HistSegment::sealed
+ * Time the segment has been completely written at, \c 0 while it is the
+ * segment appended to.
+ */
+struct HistSegment {
+	atomic_int refs;
+	unsigned long seq;
+	int fd;
+	char *base;
+	size_t len;
+	size_t synced;
+	time_t sealed;
+};
+
+/**
+ * @struct HistEntry
+ *
+ * @brief Position of a recent message.
+ *
+ * @var HistEntry::seq
+ * Sequence number of the segment containing the message.
+ * @var HistEntry::offset
+ * Position of the frame in the segment.
+ * @var HistEntry::len
+ * Length of the frame.
+ */
+struct HistEntry {
+	unsigned long seq;
+	uint32_t offset;
+	uint32_t len;
+};
+
+/**
+ * Mutual exclusion variable protecting the segments and the recent
+ * messages.
+ */
+static pthread_mutex_t hist_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Directory containing the segment files.
+ */
+static int dirfd_hist = -1;
+
+/**
+ * Segments kept, from the oldest to the one appended to.
+ */
+static struct HistSegment *segs[HISTMAXSEGMENTS];
+
+/**
+ * Number of segments in \c segs.
+ */
+static int nsegs;
+
+/**
+ * Segment prepared to be appended to after the current one, \c NULL if not
+ * ready.
+ */
+static struct HistSegment *spare;
+
+/**
+ * Sequence number of the next segment created.
+ */
+static unsigned long next_seq;
+
+/**
+ * Ring of the positions of the latest messages.
+ */
+static struct HistEntry recent[HISTRECENT];
+
+/**
+ * Number of messages appended since the history has been opened.
+ */
+static unsigned long appended;
+
+/**
+ * Maximum number of segments kept.
+ */
+static int max_segments;
+
+/**
+ * Seconds after which a segment completely written is dropped, \c 0 if
+ * never.
+ */
+static int max_age;
+
+/**
+ * Whether the history is open.
+ */
+static atomic_int opened;
+
+/**
+ * Whether the synchronizing thread has to keep running.
+ */
+static atomic_int running;
+
+/**
+ * Thread synchronizing the segments.
+ */
+static pthread_t sync_thread;
+
+/**
+ * @brief Build the name of a segment file.
+ *
+ * @param seq
+ * Sequence number of the segment.
+ * @param name
+ * Will contain the name, at least \c HISTNAMELEN bytes.
+ */
+static void segment_name(unsigned long seq, char *name) {
+	snprintf(name, HISTNAMELEN, "%020lu.log", seq);
+}
+
+/**
+ * @brief Release a reference to a segment, unmapping it if it was the last
+ * one.
+ *
+ * @param owner
+ * Pointer to the segment.
+ */
+static void segment_unref(void *owner) {
+	struct HistSegment *seg = owner;
+	if(atomic_fetch_sub_explicit(&seg->refs, 1, memory_order_acq_rel) == 1) {
+		munmap(seg->base, HISTSEGBYTES);
+		close(seg->fd);
+		free(seg);
+	}
+}
+
+/**
+ * @brief Map a segment file in memory.
+ *
+ * @param fd
+ * File descriptor of the segment file, at least \c HISTSEGBYTES long.
+ * @param seq
+ * Sequence number of the segment.
+ *
+ * @return A pointer to the segment with a single reference, \c NULL if an
+ * error occours.
+ */
+static struct HistSegment *segment_map(int fd, unsigned long seq) {
+	struct HistSegment *seg = malloc(sizeof(struct HistSegment));
+	if(seg == NULL) return NULL;
+	seg->base = mmap(NULL, HISTSEGBYTES, PROT_READ | PROT_WRITE, MAP_SHARED,
+		fd, 0);
+	if(seg->base == MAP_FAILED) {
+		free(seg);
+		return NULL;
+	}
+	atomic_init(&seg->refs, 1);
+	seg->seq = seq;
+	seg->fd = fd;
+	seg->len = 0;
+	seg->synced = 0;
+	seg->sealed = 0;
+	return seg;
+}
+
+/**
+ * @brief Create an empty segment file and map it.
+ *
+ * The blocks of the file are allocated and its pages mapped in advance, so
+ * that the appends do not wait for them.
+ *
+ * @param seq
+ * Sequence number of the segment.
+ *
+ * @return A pointer to the segment with a single reference, \c NULL if an
+ * error occours.
+ */
+static struct HistSegment *segment_create(unsigned long seq) {
+	struct HistSegment *seg;
+	char name[HISTNAMELEN];
+	int fd, err;
+	segment_name(seq, name);
+	fd = openat(dirfd_hist, name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+		0644);
+	if(fd == -1) return NULL;
+	if((err = posix_fallocate(fd, 0, HISTSEGBYTES)) != 0) {
+		errno = err;
+	}
+	else if((seg = segment_map(fd, seq)) != NULL) {
+#ifdef MADV_POPULATE_WRITE
+		madvise(seg->base, HISTSEGBYTES, MADV_POPULATE_WRITE);
+#endif
+		/* the name of the file must survive a crash as well */
+		fsync(dirfd_hist);
+		return seg;
+	}
+	err = errno;
+	close(fd);
+	unlinkat(dirfd_hist, name, 0);
+	errno = err;
+	return NULL;
+}
+
+/**
+ * @brief Map an existing segment file and find the end of its frames.
+ *
+ * @param seq
+ * Sequence number of the segment.
+ *
+ * @return A pointer to the segment with a single reference, \c NULL if an
+ * error occours.
+ */
+static struct HistSegment *segment_load(unsigned long seq) {
+	struct HistSegment *seg;
+	struct stat st;
+	char name[HISTNAMELEN];
+	size_t off = 0;
+	ssize_t framelen;
+	int fd;
+	segment_name(seq, name);
+	if((fd = openat(dirfd_hist, name, O_RDWR | O_CLOEXEC)) == -1) return NULL;
+	if(fstat(fd, &st) == -1 || (st.st_size < HISTSEGBYTES
+		&& ftruncate(fd, HISTSEGBYTES) == -1)
+		|| (seg = segment_map(fd, seq)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	/* the frames end where the file is still zeroed, or where a crash
+	interrupted the last one */
+	while(off + HEADERLEN <= HISTSEGBYTES
+		&& (framelen = packet_framelen(&seg->base[off])) != -1
+		&& off + framelen <= HISTSEGBYTES) {
+		off += framelen;
+	}
+	seg->len = seg->synced = off;
+	seg->sealed = st.st_mtime;
+	return seg;
+}
+
+/**
+ * @brief Remember the position of the latest message appended.
+ *
+ * @param seq
+ * Sequence number of the segment containing the message.
+ * @param offset
+ * Position of the frame in the segment.
+ * @param len
+ * Length of the frame.
+ */
+static void remember(unsigned long seq, size_t offset, size_t len) {
+	struct HistEntry *entry = &recent[appended++ % HISTRECENT];
+	entry->seq = seq;
+	entry->offset = offset;
+	entry->len = len;
+}
+
+/**
+ * @brief Returns a segment kept, given its sequence number. The history must
+ * be locked.
+ *
+ * @param seq
+ * Sequence number of the segment.
+ *
+ * @return A pointer to the segment, \c NULL if it is not kept.
+ */
+static struct HistSegment *find_segment(unsigned long seq) {
+	/* the sequence numbers of the spares discarded are skipped */
+	for(int i = nsegs - 1; i >= 0 && segs[i]->seq >= seq; i--) {
+		if(segs[i]->seq == seq) return segs[i];
+	}
+	return NULL;
+}
+
+/**
+ * @brief Drop the oldest segment, deleting its file. The history must be
+ * locked.
+ */
+static void drop_oldest(void) {
+	char name[HISTNAMELEN];
+	struct HistSegment *seg = segs[0];
+	memmove(&segs[0], &segs[1], --nsegs * sizeof(struct HistSegment *));
+	segment_name(seg->seq, name);
+	unlinkat(dirfd_hist, name, 0);
+	/* the views of the segment keep it mapped */
+	segment_unref(seg);
+}
+
+/**
+ * @brief Start appending to a new segment. The history must be locked.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+static int rollover(void) {
+	struct HistSegment *seg = spare;
+	if(seg == NULL && (seg = segment_create(next_seq++)) == NULL) return -1;
+	spare = NULL;
+	segs[nsegs - 1]->sealed = time(NULL);
+	if(nsegs == max_segments) drop_oldest();
+	segs[nsegs++] = seg;
+	return 0;
+}
+
+/**
+ * @brief Compare two sequence numbers for \c qsort().
+ */
+static int compare_seq(const void *a, const void *b) {
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Load the segments found in the history's directory, deleting the
+ * ones beyond the retention limit.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+static int load_segments(void) {
+	unsigned long *seqs = NULL, seq;
+	size_t count = 0, cap = 0;
+	struct dirent *entry;
+	int fd = dup(dirfd_hist), pos;
+	DIR *dir = fd != -1 ? fdopendir(fd) : NULL;
+	if(dir == NULL) {
+		if(fd != -1) close(fd);
+		return -1;
+	}
+	while((entry = readdir(dir)) != NULL) {
+		pos = 0;
+		if(sscanf(entry->d_name, "%20lu.log%n", &seq, &pos) != 1
+			|| entry->d_name[pos] != '\0' || pos == 0) {
+			continue;
+		}
+		if(count == cap) {
+			unsigned long *grown = realloc(seqs,
+				(cap = cap > 0 ? cap * 2 : 16) * sizeof(unsigned long));
+			if(grown == NULL) {
+				free(seqs);
+				closedir(dir);
+				return -1;
+			}
+			seqs = grown;
+		}
+		seqs[count++] = seq;
+	}
+	closedir(dir);
+	if(count > 0) qsort(seqs, count, sizeof(unsigned long), compare_seq);
+	for(size_t i = 0; i < count; i++) {
+		char name[HISTNAMELEN];
+		struct HistSegment *seg;
+		next_seq = seqs[i] + 1;
+		if(count - i > (size_t)max_segments
+			|| (seg = segment_load(seqs[i])) == NULL) {
+			segment_name(seqs[i], name);
+			unlinkat(dirfd_hist, name, 0);
+			continue;
+		}
+		/* a spare left by a crash is empty, only the last one is kept */
+		if(nsegs > 0 && segs[nsegs - 1]->len == 0) {
+			segment_name(segs[nsegs - 1]->seq, name);
+			unlinkat(dirfd_hist, name, 0);
+			segment_unref(segs[--nsegs]);
+		}
+		segs[nsegs++] = seg;
+		/* the latest messages are found walking the frames again */
+		for(size_t off = 0; off < seg->len;
+			off += packet_framelen(&seg->base[off])) {
+			remember(seg->seq, off, packet_framelen(&seg->base[off]));
+		}
+	}
+	free(seqs);
+	/* the last segment found is appended to again */
+	if(nsegs > 0) segs[nsegs - 1]->sealed = 0;
+	return 0;
+}
+
+/**
+ * @brief Write to the disk the data appended to the segments since the last
+ * synchronization.
+ */
+static void sync_segments(void) {
+	struct HistSegment *dirty[HISTMAXSEGMENTS];
+	size_t upto[HISTMAXSEGMENTS];
+	long pagesize = sysconf(_SC_PAGESIZE);
+	int n = 0;
+	pthread_mutex_lock(&hist_mutex);
+	for(int i = 0; i < nsegs; i++) {
+		if(segs[i]->synced < segs[i]->len) {
+			atomic_fetch_add_explicit(&segs[i]->refs, 1, memory_order_relaxed);
+			dirty[n] = segs[i];
+			upto[n++] = segs[i]->len;
+		}
+	}
+	pthread_mutex_unlock(&hist_mutex);
+	/* a single synchronization covers every append made meanwhile */
+	for(int i = 0; i < n; i++) {
+		size_t start = dirty[i]->synced & ~(size_t)(pagesize - 1);
+		if(msync(dirty[i]->base + start, upto[i] - start, MS_SYNC) == -1) {
+			LOG(LOGERROR, "server: msync: %m\n");
+		}
+		else {
+			dirty[i]->synced = upto[i];
+		}
+		segment_unref(dirty[i]);
+	}
+}
+
+/**
+ * @brief Drop the segments older than the retention limit.
+ */
+static void expire_segments(void) {
+	time_t now = time(NULL);
+	if(max_age == 0) return;
+	pthread_mutex_lock(&hist_mutex);
+	while(nsegs > 1 && now - segs[0]->sealed > max_age) {
+		drop_oldest();
+	}
+	pthread_mutex_unlock(&hist_mutex);
+}
+
+/**
+ * @brief Prepare the segment appended to after the current one, if not
+ * ready yet.
+ */
+static void prepare_spare(void) {
+	struct HistSegment *seg;
+	char name[HISTNAMELEN];
+	unsigned long seq;
+	pthread_mutex_lock(&hist_mutex);
+	if(spare != NULL) {
+		pthread_mutex_unlock(&hist_mutex);
+		return;
+	}
+	seq = next_seq++;
+	pthread_mutex_unlock(&hist_mutex);
+	/* the file is created without blocking the appends */
+	if((seg = segment_create(seq)) == NULL) {
+		LOG(LOGERROR, "server: history segment: %m\n");
+		return;
+	}
+	pthread_mutex_lock(&hist_mutex);
+	/* a segment created meanwhile by an append comes after this one */
+	if(spare == NULL && seq > segs[nsegs - 1]->seq) {
+		spare = seg;
+		seg = NULL;
+	}
+	pthread_mutex_unlock(&hist_mutex);
+	if(seg != NULL) {
+		segment_name(seq, name);
+		unlinkat(dirfd_hist, name, 0);
+		segment_unref(seg);
+	}
+}
+
+/**
+ * @brief Routine of the thread synchronizing the segments.
+ *
+ * @param param Unused, it can be safely set as \c NULL pointer.
+ *
+ * @return Always a \c NULL pointer.
+ */
+static void *sync_routine(void *param) {
+	struct timespec interval = { 0, HISTSYNCMS * 1000000L };
+	(void)param;
+	while(atomic_load(&running)) {
+		nanosleep(&interval, NULL);
+		sync_segments();
+		expire_segments();
+		prepare_spare();
+	}
+	return NULL;
+}
+
+/**
+ * @brief Open the history stored in a directory, creating it if necessary,
+ * and start the thread synchronizing it.
+ *
+ * @param dir
+ * Directory containing the segments.
+ * @param segments
+ * Maximum number of segments kept, between \c 2 and \c HISTMAXSEGMENTS.
+ * @param maxage
+ * Seconds after which a segment completely written is dropped, \c 0 to keep
+ * the segments regardless of their age.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+int history_open(const char *dir, int segments, int maxage) {
+	if(segments < 2 || segments > HISTMAXSEGMENTS || maxage < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	max_segments = segments;
+	max_age = maxage;
+	if((mkdir(dir, 0755) == -1 && errno != EEXIST)
+		|| (dirfd_hist = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1
+		|| load_segments() == -1) {
+		return -1;
+	}
+	if(nsegs == 0) {
+		if((segs[0] = segment_create(next_seq++)) == NULL) return -1;
+		nsegs = 1;
+	}
+	atomic_store(&running, 1);
+	if(pthread_create(&sync_thread, NULL, sync_routine, NULL) != 0) {
+		atomic_store(&running, 0);
+		return -1;
+	}
+	atomic_store(&opened, 1);
+	atexit(history_close);
+	return 0;
+}
+
+/**
+ * @brief Write the data appended and close the history.
+ */
+void history_close(void) {
+	char name[HISTNAMELEN];
+	if(!atomic_exchange(&opened, 0)) return;
+	atomic_store(&running, 0);
+	pthread_join(sync_thread, NULL);
+	sync_segments();
+	/* the segments stay mapped for the views still in use */
+	if(spare != NULL) {
+		segment_name(spare->seq, name);
+		unlinkat(dirfd_hist, name, 0);
+	}
+}
+
+/**
+ * @brief Append a message to the history, if open.
+ *
+ * @param buf
+ * Encoded frame of the message.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+int history_append(const struct MsgBuf *buf) {
+	struct HistSegment *seg;
+	if(!atomic_load_explicit(&opened, memory_order_relaxed)) return 0;
+	if(buf->len > HISTSEGBYTES) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	pthread_mutex_lock(&hist_mutex);
+	seg = segs[nsegs - 1];
+	if(seg->len + buf->len > HISTSEGBYTES) {
+		if(rollover() == -1) {
+			pthread_mutex_unlock(&hist_mutex);
+			return -1;
+		}
+		seg = segs[nsegs - 1];
+	}
+	memcpy(&seg->base[seg->len], buf->frame, buf->len);
+	remember(seg->seq, seg->len, buf->len);
+	seg->len += buf->len;
+	pthread_mutex_unlock(&hist_mutex);
+	return 0;
+}
+
+/**
+ * @brief Returns the latest messages of the history.
+ *
+ * The messages of a segment are contiguous, so they are returned as a single
+ * view of the segment.
+ *
+ * @param count
+ * Number of messages requested, at most \c HISTRECENT.
+ * @param views
+ * Array of at least \c HISTMAXSEGMENTS elements, will contain the views of
+ * the messages from the oldest to the newest. Every view holds a reference
+ * the caller has to release.
+ *
+ * @return The number of views filled.
+ */
+int history_last(int count, struct MsgBuf **views) {
+	unsigned long i;
+	int n = 0;
+	if(!atomic_load_explicit(&opened, memory_order_relaxed) || count <= 0) {
+		return 0;
+	}
+	if(count > HISTRECENT) count = HISTRECENT;
+	pthread_mutex_lock(&hist_mutex);
+	i = appended > (unsigned long)count ? appended - count : 0;
+	/* the messages of the segments dropped are gone */
+	while(i < appended && recent[i % HISTRECENT].seq < segs[0]->seq) i++;
+	while(i < appended) {
+		const struct HistEntry *first = &recent[i % HISTRECENT];
+		struct HistSegment *seg = find_segment(first->seq);
+		size_t end = first->offset + first->len;
+		struct MsgBuf *view;
+		for(i++; i < appended && recent[i % HISTRECENT].seq == first->seq;
+			i++) {
+			end = recent[i % HISTRECENT].offset + recent[i % HISTRECENT].len;
+		}
+		atomic_fetch_add_explicit(&seg->refs, 1, memory_order_relaxed);
+		view = msgbuf_view(&seg->base[first->offset], end - first->offset,
+			segment_unref, seg);
+		if(view == NULL) {
+			segment_unref(seg);
+			continue;
+		}
+		views[n++] = view;
+	}
+	pthread_mutex_unlock(&hist_mutex);
+	return n;
+}
+
+/**
+ * @brief Pass the frames appended after a location to a function, without
+ * blocking the appends.
+ *
+ * @param from
+ * Location following the last frame scanned before, \c 0 at first. Set to
+ * the location following the last frame scanned now.
+ * @param max
+ * Maximum number of frames scanned.
+ * @param fn
+ * Function receiving the frames, in order.
+ * @param arg
+ * Argument of \c fn.
+ *
+ * @return The number of frames scanned.
+ */
+size_t history_scan(uint64_t *from, size_t max, HistoryScanner fn, void *arg) {
+	struct HistSegment *scan[HISTMAXSEGMENTS];
+	size_t upto[HISTMAXSEGMENTS], scanned = 0, off;
+	int n = 0;
+	if(!atomic_load_explicit(&opened, memory_order_relaxed)) return 0;
+	pthread_mutex_lock(&hist_mutex);
+	/* the frames appended are never modified, they are read unlocked */
+	for(int i = 0; i < nsegs; i++) {
+		if(history_location(segs[i]->seq, segs[i]->len) > *from) {
+			atomic_fetch_add_explicit(&segs[i]->refs, 1, memory_order_relaxed);
+			scan[n] = segs[i];
+			upto[n++] = segs[i]->len;
+		}
+	}
+	pthread_mutex_unlock(&hist_mutex);
+	for(int i = 0; i < n; i++) {
+		struct HistSegment *seg = scan[i];
+		/* the frames of the segments dropped meanwhile are skipped */
+		off = *from >> 32 == seg->seq ? (*from & 0xffffffff) : 0;
+		if(scanned < max) {
+			for(; off < upto[i] && scanned < max; scanned++) {
+				size_t len = packet_framelen(&seg->base[off]);
+				fn(arg, &seg->base[off], len, history_location(seg->seq, off));
+				off += len;
+			}
+			*from = history_location(seg->seq, off);
+		}
+		segment_unref(seg);
+	}
+	return scanned;
+}
+
+/**
+ * @brief Returns a single frame of the history.
+ *
+ * @param location
+ * Location of the frame.
+ *
+ * @return A view of the frame with a single reference, \c NULL if its
+ * segment has been dropped or an error occours.
+ */
+struct MsgBuf *history_frame(uint64_t location) {
+	struct HistSegment *seg;
+	struct MsgBuf *view = NULL;
+	size_t off = location & 0xffffffff;
+	if(!atomic_load_explicit(&opened, memory_order_relaxed)) return NULL;
+	pthread_mutex_lock(&hist_mutex);
+	if((seg = find_segment(location >> 32)) != NULL && off < seg->len) {
+		atomic_fetch_add_explicit(&seg->refs, 1, memory_order_relaxed);
+		view = msgbuf_view(&seg->base[off], packet_framelen(&seg->base[off]),
+			segment_unref, seg);
+		if(view == NULL) segment_unref(seg);
+	}
+	pthread_mutex_unlock(&hist_mutex);
+	return view;
+}
+
+/**
+ * @brief Returns the location of the oldest frame kept.
+ *
+ * @return The location, \c 0 if the history is not open.
+ */
+uint64_t history_oldest(void) {
+	uint64_t location = 0;
+	if(!atomic_load_explicit(&opened, memory_order_relaxed)) return 0;
+	pthread_mutex_lock(&hist_mutex);
+	if(nsegs > 0) location = history_location(segs[0]->seq, 0);
+	pthread_mutex_unlock(&hist_mutex);
+	return location;
+}
@@ -0,0 +1,155 @@
+/**
+ * @file history.h
+ * @brief Persistent history of the messages shouted to every client.
+ *
+ * The encoded frames are appended one after the other to segment files of
+ * \c HISTSEGBYTES bytes mapped in memory, named after their sequence number.
+ * A background thread writes the appended data to the disk every
+ * \c HISTSYNCMS milliseconds, so many appends share a single synchronization,
+ * prepares the next segment and drops the segments beyond the retention
+ * limits. The latest messages are replayed as views of the mapped segments,
+ * without copying them.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+/* Buffers viewing the segments */
+#include "msgbuf.h"
+
+/* Standard libraries */
+#include <stddef.h>
+#include <stdint.h>
+
+/** Size of a segment file, in bytes */
+#define HISTSEGBYTES (8 * 1024 * 1024)
+/** Maximum number of segments kept */
+#define HISTMAXSEGMENTS 64
+/** Segments kept by default */
+#define HISTSEGMENTS 16
+/** Maximum number of messages replayed */
+#define HISTRECENT 1024
+/** Messages replayed by default */
+#define HISTREPLAY 50
+/** Interval between two synchronizations of the segments, in milliseconds */
+#define HISTSYNCMS 20
+
+/**
+ * @brief Function receiving the frames of the history scanned.
+ *
+ * @param arg
+ * Argument given to \c history_scan().
+ * @param frame
+ * Encoded frame, valid until the function returns.
+ * @param len
+ * Length of the frame.
+ * @param location
+ * Location of the frame in the history.
+ */
+typedef void (*HistoryScanner)(void *arg, const char *frame, size_t len,
+	uint64_t location);
+
+/**
+ * @brief Returns the location of a frame in the history, increasing with the
+ * order of the appends.
+ *
+ * @param seq
+ * Sequence number of the segment containing the frame.
+ * @param offset
+ * Position of the frame in the segment.
+ */
+static inline uint64_t history_location(unsigned long seq, size_t offset) {
+	return (uint64_t)seq << 32 | offset;
+}
+
+/**
+ * @brief Open the history stored in a directory, creating it if necessary,
+ * and start the thread synchronizing it.
+ *
+ * @param dir
+ * Directory containing the segments.
+ * @param segments
+ * Maximum number of segments kept, between \c 2 and \c HISTMAXSEGMENTS.
+ * @param maxage
+ * Seconds after which a segment completely written is dropped, \c 0 to keep
+ * the segments regardless of their age.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+int history_open(const char *dir, int segments, int maxage);
+
+/**
+ * @brief Write the data appended and close the history.
+ */
+void history_close(void);
+
+/**
+ * @brief Append a message to the history, if open.
+ *
+ * @param buf
+ * Encoded frame of the message.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+int history_append(const struct MsgBuf *buf);
+
+/**
+ * @brief Returns the latest messages of the history.
+ *
+ * The messages of a segment are contiguous, so they are returned as a single
+ * view of the segment.
+ *
+ * @param count
+ * Number of messages requested, at most \c HISTRECENT.
+ * @param views
+ * Array of at least \c HISTMAXSEGMENTS elements, will contain the views of
+ * the messages from the oldest to the newest. Every view holds a reference
+ * the caller has to release.
+ *
+ * @return The number of views filled.
+ */
+int history_last(int count, struct MsgBuf **views);
+
+/**
+ * @brief Pass the frames appended after a location to a function, without
+ * blocking the appends.
+ *
+ * @param from
+ * Location following the last frame scanned before, \c 0 at first. Set to
+ * the location following the last frame scanned now.
+ * @param max
+ * Maximum number of frames scanned.
+ * @param fn
+ * Function receiving the frames, in order.
+ * @param arg
+ * Argument of \c fn.
+ *
+ * @return The number of frames scanned.
+ */
+size_t history_scan(uint64_t *from, size_t max, HistoryScanner fn, void *arg);
+
+/**
+ * @brief Returns a single frame of the history.
+ *
+ * @param location
+ * Location of the frame.
+ *
+ * @return A view of the frame with a single reference, \c NULL if its
+ * segment has been dropped or an error occours.
+ */
+struct MsgBuf *history_frame(uint64_t location);
+
+/**
+ * @brief Returns the location of the oldest frame kept.
+ *
+ * @return The location, \c 0 if the history is not open.
+ */
+uint64_t history_oldest(void);
+
+#endif
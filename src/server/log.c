@@ -0,0 +1,553 @@
+/**
+ * @file log.c
+ * @brief Asynchronous logging of the server's messages.
+ *
+ * Every thread appends its records to a ring of its own, without locking
+ * and without formatting them: a record only holds the format string and a
+ * binary copy of the arguments. A background thread drains the rings and
+ * formats the records on the standard output, or on the standard error for
+ * the warnings and the errors. A record that does not fit in the ring of its
+ * thread is dropped and counted, the count is reported by the writer.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#include "log.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+/* Thread library */
+#include <pthread.h>
+
+/**
+ * Size of the integer argument of a conversion.
+ */
+enum LogLength {
+	LENINT,
+	LENLONG,
+	LENLLONG,
+	LENSIZE,
+	LENMAX,
+	LENPTRDIFF,
+	LENLDOUBLE
+};
+
+/**
+ * @struct LogSpec
+ *
+ * @brief Conversion specification found in a format.
+ *
+ * @var LogSpec::start
+ * Position of the \c '%' in the format.
+ * @var LogSpec::length
+ * Position of the length modifier, or of the conversion if it has none.
+ * @var LogSpec::size
+ * Size of the argument.
+ * @var LogSpec::conv
+ * Conversion character.
+ */
+struct LogSpec {
+	const char *start;
+	const char *length;
+	enum LogLength size;
+	char conv;
+};
+
+/**
+ * Argument of a record, copied when the message is logged.
+ */
+union LogArg {
+	long long i;
+	unsigned long long u;
+	double d;
+	const void *p;
+	int str;
+};
+
+/**
+ * @struct LogRecord
+ *
+ * @brief Message waiting to be formatted.
+ *
+ * @var LogRecord::fmt
+ * Format of the message.
+ * @var LogRecord::level
+ * Level of the message.
+ * @var LogRecord::err
+ * Value of \c errno when the message has been logged.
+ * @var LogRecord::textlen
+ * Bytes of \c text used.
+ * @var LogRecord::args
+ * Arguments of the conversions, in order.
+ * @var LogRecord::text
+ * Copies of the string arguments, which store their offset.
+ */
+struct LogRecord {
+	const char *fmt;
+	int level;
+	int err;
+	int textlen;
+	union LogArg args[LOGARGS];
+	char text[LOGTEXTLEN];
+};
+
+/**
+ * @struct LogRing
+ *
+ * @brief Records of a thread, written by the thread and read by the writer.
+ *
+ * @var LogRing::records
+ * Slots of the ring.
+ * @var LogRing::head
+ * Number of records read by the writer.
+ * @var LogRing::tail
+ * Number of records appended by the thread.
+ * @var LogRing::dropped
+ * Number of records dropped because the ring was full.
+ * @var LogRing::reported
+ * Number of records dropped already reported by the writer.
+ */
+struct LogRing {
+	struct LogRecord records[LOGSLOTS];
+	atomic_ulong head;
+	atomic_ulong tail;
+	atomic_ulong dropped;
+	unsigned long reported;
+};
+
+/**
+ * Minimum level of the messages written.
+ */
+int log_level = LOGINFO;
+
+/**
+ * Names of the levels.
+ */
+static const char *level_names[] = { "debug", "info", "warn", "error" };
+
+/**
+ * Rings of the threads that have logged a message.
+ */
+static struct LogRing *rings[LOGTHREADS];
+
+/**
+ * Number of rings in \c rings.
+ */
+static atomic_int nrings;
+
+/**
+ * Mutual exclusion variable protecting the creation of the rings.
+ */
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Ring of the calling thread.
+ */
+static _Thread_local struct LogRing *own_ring;
+
+/**
+ * Whether the calling thread could not get a ring and writes its messages
+ * itself.
+ */
+static _Thread_local int no_ring;
+
+/**
+ * Whether the writer thread is running.
+ */
+static atomic_int running;
+
+/**
+ * Writer thread.
+ */
+static pthread_t writer_thread;
+
+/**
+ * @brief Returns the level with a given name.
+ *
+ * @param name
+ * One of \c "debug", \c "info", \c "warn" and \c "error".
+ *
+ * @return The level, \c -1 if the name is unknown.
+ */
+int log_parse_level(const char *name) {
+	for(int i = LOGDEBUG; i <= LOGERROR; i++) {
+		if(!strcmp(name, level_names[i])) return i;
+	}
+	return -1;
+}
+
+/**
+ * @brief Find the next conversion specification of a format.
+ *
+ * @param fmt
+ * Format, or the rest of it.
+ * @param spec
+ * Will contain the specification found.
+ *
+ * @return A pointer to the character following the specification, \c NULL
+ * if there are no more.
+ */
+static const char *next_spec(const char *fmt, struct LogSpec *spec) {
+	const char *p = strchr(fmt, '%');
+	if(p == NULL) return NULL;
+	spec->start = p++;
+	/* flags, field width and precision are kept as they are */
+	while(*p != '\0' && strchr("-+ #0'", *p) != NULL) p++;
+	while(*p >= '0' && *p <= '9') p++;
+	if(*p == '.') {
+		p++;
+		while(*p >= '0' && *p <= '9') p++;
+	}
+	spec->length = p;
+	spec->size = LENINT;
+	switch(*p) {
+		case 'h' : p += p[1] == 'h' ? 2 : 1; break;
+		case 'l' :
+			spec->size = p[1] == 'l' ? LENLLONG : LENLONG;
+			p += p[1] == 'l' ? 2 : 1;
+			break;
+		case 'z' : spec->size = LENSIZE; p++; break;
+		case 'j' : spec->size = LENMAX; p++; break;
+		case 't' : spec->size = LENPTRDIFF; p++; break;
+		case 'L' : spec->size = LENLDOUBLE; p++; break;
+	}
+	spec->conv = *p;
+	return *p != '\0' ? p + 1 : p;
+}
+
+/**
+ * @brief Copy the arguments of a message into a record.
+ *
+ * @param rec
+ * Pointer to the record, its format already set.
+ * @param ap
+ * Arguments of the message.
+ */
+static void fill_record(struct LogRecord *rec, va_list ap) {
+	struct LogSpec spec;
+	const char *p = rec->fmt;
+	int n = 0;
+	rec->textlen = 0;
+	while(n < LOGARGS && (p = next_spec(p, &spec)) != NULL) {
+		union LogArg *arg = &rec->args[n];
+		switch(spec.conv) {
+			case 'd' : case 'i' :
+				switch(spec.size) {
+					case LENLONG : arg->i = va_arg(ap, long); break;
+					case LENLLONG : arg->i = va_arg(ap, long long); break;
+					case LENSIZE : arg->i = va_arg(ap, ssize_t); break;
+					case LENMAX : arg->i = va_arg(ap, intmax_t); break;
+					case LENPTRDIFF : arg->i = va_arg(ap, ptrdiff_t); break;
+					default : arg->i = va_arg(ap, int);
+				}
+				n++;
+				break;
+			case 'u' : case 'o' : case 'x' : case 'X' :
+				switch(spec.size) {
+					case LENLONG : arg->u = va_arg(ap, unsigned long); break;
+					case LENLLONG :
+						arg->u = va_arg(ap, unsigned long long);
+						break;
+					case LENSIZE : arg->u = va_arg(ap, size_t); break;
+					case LENMAX : arg->u = va_arg(ap, uintmax_t); break;
+					case LENPTRDIFF : arg->u = va_arg(ap, ptrdiff_t); break;
+					default : arg->u = va_arg(ap, unsigned int);
+				}
+				n++;
+				break;
+			case 'c' :
+				arg->i = va_arg(ap, int);
+				n++;
+				break;
+			case 'p' :
+				arg->p = va_arg(ap, void *);
+				n++;
+				break;
+			case 'f' : case 'F' : case 'e' : case 'E' :
+			case 'g' : case 'G' : case 'a' : case 'A' :
+				arg->d = spec.size == LENLDOUBLE
+					? (double)va_arg(ap, long double) : va_arg(ap, double);
+				n++;
+				break;
+			case 's' : ; // empty statement necessary to compile
+				const char *str = va_arg(ap, const char *);
+				int room = LOGTEXTLEN - rec->textlen;
+				size_t len;
+				if(str == NULL) str = "(null)";
+				/* the strings that do not fit are truncated, the last
+				byte of a full text is the termination of its last string */
+				if(room == 0) {
+					arg->str = LOGTEXTLEN - 1;
+				}
+				else {
+					len = strnlen(str, room - 1);
+					memcpy(&rec->text[rec->textlen], str, len);
+					rec->text[rec->textlen + len] = '\0';
+					arg->str = rec->textlen;
+					rec->textlen += len + 1;
+				}
+				n++;
+				break;
+		}
+	}
+}
+
+/**
+ * @brief Format a record.
+ *
+ * @param stream
+ * Stream the message is written to.
+ * @param rec
+ * Pointer to the record.
+ */
+static void print_record(FILE *stream, const struct LogRecord *rec) {
+	struct LogSpec spec;
+	const char *p = rec->fmt, *next;
+	char conv[32];
+	int n = 0;
+	while((next = next_spec(p, &spec)) != NULL) {
+		int prefix = spec.length - spec.start;
+		fwrite(p, 1, spec.start - p, stream);
+		p = next;
+		if(spec.conv == '%') {
+			fputc('%', stream);
+			continue;
+		}
+		/* the flags, width and precision are kept, the arguments have been
+		widened */
+		if(prefix > (int)sizeof conv - 4) prefix = sizeof conv - 4;
+		memcpy(conv, spec.start, prefix);
+		if(spec.conv == 'm' || (strchr("diuoxXcpsfFeEgGaA", spec.conv) != NULL
+			&& n < LOGARGS)) {
+			switch(spec.conv) {
+				case 'd' : case 'i' :
+					snprintf(&conv[prefix], 4, "ll%c", spec.conv);
+					fprintf(stream, conv, rec->args[n++].i);
+					break;
+				case 'u' : case 'o' : case 'x' : case 'X' :
+					snprintf(&conv[prefix], 4, "ll%c", spec.conv);
+					fprintf(stream, conv, rec->args[n++].u);
+					break;
+				case 'c' :
+					snprintf(&conv[prefix], 4, "c");
+					fprintf(stream, conv, (int)rec->args[n++].i);
+					break;
+				case 'p' :
+					snprintf(&conv[prefix], 4, "p");
+					fprintf(stream, conv, rec->args[n++].p);
+					break;
+				case 's' :
+					snprintf(&conv[prefix], 4, "s");
+					fprintf(stream, conv, &rec->text[rec->args[n++].str]);
+					break;
+				case 'm' :
+					snprintf(&conv[prefix], 4, "s");
+					fprintf(stream, conv, strerror(rec->err));
+					break;
+				default :
+					snprintf(&conv[prefix], 4, "%c", spec.conv);
+					fprintf(stream, conv, rec->args[n++].d);
+			}
+		}
+		else {
+			/* the arguments beyond the ones recorded are not known */
+			fwrite(spec.start, 1, next - spec.start, stream);
+		}
+	}
+	fputs(p, stream);
+}
+
+/**
+ * @brief Format a record on the stream of its level.
+ *
+ * @param rec
+ * Pointer to the record.
+ */
+static void write_record(const struct LogRecord *rec) {
+	FILE *stream = rec->level >= LOGWARN ? stderr : stdout;
+	flockfile(stream);
+	print_record(stream, rec);
+	funlockfile(stream);
+}
+
+/**
+ * @brief Returns the ring of the calling thread, creating it the first time.
+ *
+ * @return A pointer to the ring, \c NULL if there are too many threads or
+ * the memory could not be allocated.
+ */
+static struct LogRing *thread_ring(void) {
+	struct LogRing *ring;
+	if(own_ring != NULL || no_ring) return own_ring;
+	pthread_mutex_lock(&rings_mutex);
+	int n = atomic_load(&nrings);
+	if(n < LOGTHREADS && (ring = malloc(sizeof(struct LogRing))) != NULL) {
+		atomic_init(&ring->head, 0);
+		atomic_init(&ring->tail, 0);
+		atomic_init(&ring->dropped, 0);
+		ring->reported = 0;
+		rings[n] = ring;
+		atomic_store_explicit(&nrings, n + 1, memory_order_release);
+		own_ring = ring;
+	}
+	else {
+		no_ring = 1;
+	}
+	pthread_mutex_unlock(&rings_mutex);
+	return own_ring;
+}
+
+/**
+ * @brief Append a message to the ring of the calling thread.
+ *
+ * Only the conversions of \c printf() without \c '*' and \c 'n' are
+ * supported, together with \c "%m" for the description of \c errno.
+ *
+ * @param level
+ * Level of the message.
+ * @param fmt
+ * Format of the message, it is formatted later so it must be a string
+ * literal.
+ */
+void log_write(enum LogLevel level, const char *fmt, ...) {
+	struct LogRing *ring = NULL;
+	struct LogRecord local, *rec = &local;
+	unsigned long tail = 0;
+	int err = errno;
+	va_list ap;
+	if(atomic_load_explicit(&running, memory_order_acquire)) {
+		ring = thread_ring();
+	}
+	if(ring != NULL) {
+		tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		/* never wait for the writer, the message is lost instead */
+		if(tail - atomic_load_explicit(&ring->head, memory_order_acquire)
+			>= LOGSLOTS) {
+			atomic_fetch_add_explicit(&ring->dropped, 1,
+				memory_order_relaxed);
+			return;
+		}
+		rec = &ring->records[tail & (LOGSLOTS - 1)];
+	}
+	rec->fmt = fmt;
+	rec->level = level;
+	rec->err = err;
+	va_start(ap, fmt);
+	fill_record(rec, ap);
+	va_end(ap);
+	if(ring == NULL) {
+		/* without the writer, the message is written immediately */
+		write_record(rec);
+	}
+	else {
+		atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	}
+	errno = err;
+}
+
+/**
+ * @brief Format the records of every ring and report the ones dropped.
+ */
+static void drain(void) {
+	int n = atomic_load_explicit(&nrings, memory_order_acquire);
+	for(int i = 0; i < n; i++) {
+		struct LogRing *ring = rings[i];
+		unsigned long head = atomic_load_explicit(&ring->head,
+			memory_order_relaxed);
+		unsigned long tail = atomic_load_explicit(&ring->tail,
+			memory_order_acquire);
+		unsigned long dropped;
+		for(; head != tail; head++) {
+			write_record(&ring->records[head & (LOGSLOTS - 1)]);
+		}
+		/* the slots read can be written again */
+		atomic_store_explicit(&ring->head, head, memory_order_release);
+		dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+		if(dropped != ring->reported) {
+			fprintf(stderr, "log: %lu messages dropped\n",
+				dropped - ring->reported);
+			ring->reported = dropped;
+		}
+	}
+	fflush(stdout);
+}
+
+/**
+ * @brief Routine of the writer thread, draining the rings periodically.
+ *
+ * @param param Unused, it can be safely set as \c NULL pointer.
+ *
+ * @return Always a \c NULL pointer.
+ */
+static void *writer(void *param) {
+	struct timespec pause = { 0, LOGFLUSHMS * 1000000L };
+	(void)param;
+	while(atomic_load(&running)) {
+		drain();
+		nanosleep(&pause, NULL);
+	}
+	drain();
+	return NULL;
+}
+
+/**
+ * @brief Start the thread writing the records.
+ *
+ * The messages logged before are written immediately by the calling thread.
+ *
+ * @return \c 0 if successful, \c -1 if the thread cannot be created.
+ */
+int log_start(void) {
+	static int registered;
+	if(atomic_load(&running)) return 0;
+	atomic_store(&running, 1);
+	if(pthread_create(&writer_thread, NULL, writer, NULL) != 0) {
+		atomic_store(&running, 0);
+		return -1;
+	}
+	/* the records left are written when the program exits */
+	if(!registered) {
+		atexit(log_stop);
+		registered = 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Write the records left and stop the writer thread.
+ *
+ * The messages logged afterwards are written immediately by the calling
+ * thread.
+ */
+void log_stop(void) {
+	if(!atomic_exchange(&running, 0)) return;
+	pthread_join(writer_thread, NULL);
+}
+
+/**
+ * @brief Returns the number of records dropped because the ring of their
+ * thread was full.
+ */
+unsigned long log_dropped(void) {
+	unsigned long dropped = 0;
+	int n = atomic_load_explicit(&nrings, memory_order_acquire);
+	for(int i = 0; i < n; i++) {
+		dropped += atomic_load_explicit(&rings[i]->dropped,
+			memory_order_relaxed);
+	}
+	return dropped;
+}
@@ -0,0 +1,107 @@
+/**
+ * @file log.h
+ * @brief Asynchronous logging of the server's messages.
+ *
+ * Every thread appends its records to a ring of its own, without locking
+ * and without formatting them: a record only holds the format string and a
+ * binary copy of the arguments. A background thread drains the rings and
+ * formats the records on the standard output, or on the standard error for
+ * the warnings and the errors. A record that does not fit in the ring of its
+ * thread is dropped and counted, the count is reported by the writer.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+/** Records held by the ring of every thread, a power of two */
+#define LOGSLOTS 1024
+/** Maximum number of threads with a ring */
+#define LOGTHREADS 64
+/** Maximum number of arguments of a record */
+#define LOGARGS 8
+/** Bytes available to the strings of a record, longer ones are truncated */
+#define LOGTEXTLEN 128
+/** Interval between two drains of the rings, in milliseconds */
+#define LOGFLUSHMS 10
+
+/**
+ * Importance of a message, the ones below the level of the log are
+ * discarded.
+ */
+enum LogLevel {
+	LOGDEBUG,
+	LOGINFO,
+	LOGWARN,
+	LOGERROR
+};
+
+/**
+ * Minimum level of the messages written, \c LOGINFO by default.
+ */
+extern int log_level;
+
+/**
+ * @brief Log a message if its level is enabled.
+ *
+ * The arguments are not evaluated if the level is disabled, so that a
+ * disabled message costs a comparison.
+ */
+#define LOG(level, ...) do { \
+		if((level) >= log_level) log_write((level), __VA_ARGS__); \
+	} while(0)
+
+/**
+ * @brief Returns the level with a given name.
+ *
+ * @param name
+ * One of \c "debug", \c "info", \c "warn" and \c "error".
+ *
+ * @return The level, \c -1 if the name is unknown.
+ */
+int log_parse_level(const char *name);
+
+/**
+ * @brief Start the thread writing the records.
+ *
+ * The messages logged before are written immediately by the calling thread.
+ *
+ * @return \c 0 if successful, \c -1 if the thread cannot be created.
+ */
+int log_start(void);
+
+/**
+ * @brief Write the records left and stop the writer thread.
+ *
+ * The messages logged afterwards are written immediately by the calling
+ * thread.
+ */
+void log_stop(void);
+
+/**
+ * @brief Append a message to the ring of the calling thread.
+ *
+ * Only the conversions of \c printf() without \c '*' and \c 'n' are
+ * supported, together with \c "%m" for the description of \c errno.
+ *
+ * @param level
+ * Level of the message.
+ * @param fmt
+ * Format of the message, it is formatted later so it must be a string
+ * literal.
+ */
+void log_write(enum LogLevel level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Returns the number of records dropped because the ring of their
+ * thread was full.
+ */
+unsigned long log_dropped(void);
+
+#endif
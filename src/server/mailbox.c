@@ -0,0 +1,427 @@
+/**
+ * @file mailbox.c
+ * @brief Whispers waiting for a known alias to connect again.
+ *
+ * Every alias used by a client gets a mailbox. The whispers sent to the
+ * alias while nobody uses it are encoded one after the other in a buffer of
+ * the mailbox, past \c MAILMEMBYTES bytes they are appended to a file
+ * instead. The whole content of a mailbox is handed over in a single buffer
+ * when a client takes the alias again.
+ *
+ * Every mailbox has a lock of its own, so that reading back the file of a
+ * mailbox only delays the whispers to the same alias. At most
+ * \c MAILMAXBOXES aliases get a mailbox.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+/* Necessary for O_TMPFILE */
+#define _GNU_SOURCE
+
+#include "mailbox.h"
+
+/* Encoding of the messages */
+#include "packetcodec.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+/* Thread library */
+#include <pthread.h>
+
+/**
+ * @struct Mailbox
+ *
+ * @brief Messages waiting for an alias.
+ *
+ * @var Mailbox::alias
+ * Alias the messages are sent to.
+ * @var Mailbox::mutex
+ * Lock protecting the messages.
+ * @var Mailbox::frames
+ * Encoded frames kept in memory, \c NULL if none.
+ * @var Mailbox::len
+ * Bytes of \c frames used.
+ * @var Mailbox::cap
+ * Bytes allocated for \c frames.
+ * @var Mailbox::count
+ * Messages waiting, the spilled ones included.
+ * @var Mailbox::spillfd
+ * File containing the frames following the ones in memory, \c -1 if none.
+ * @var Mailbox::spilled
+ * Bytes written to the file.
+ */
+struct Mailbox {
+	char alias[ALIASLEN];
+	pthread_mutex_t mutex;
+	char *frames;
+	size_t len;
+	size_t cap;
+	size_t count;
+	int spillfd;
+	size_t spilled;
+};
+
+/**
+ * Mutual exclusion variable protecting the table of the mailboxes, taken
+ * before the lock of a mailbox.
+ */
+static pthread_mutex_t mailbox_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Open addressing table of the mailboxes, by alias.
+ */
+static struct Mailbox **table;
+
+/**
+ * Number of slots of \c table, a power of two.
+ */
+static size_t slots;
+
+/**
+ * Number of mailboxes in \c table.
+ */
+static size_t used;
+
+/**
+ * Directory of the files the mailboxes spill to.
+ */
+static const char *spill_dir = P_tmpdir;
+
+/**
+ * @brief Set the directory of the files the mailboxes spill to.
+ *
+ * @param dir
+ * Directory, the files are unnamed and disappear with the server.
+ */
+void mailbox_init(const char *dir) {
+	spill_dir = dir;
+}
+
+/**
+ * @brief Returns the hash of an alias.
+ *
+ * @param alias
+ * Alias hashed.
+ *
+ * @return The FNV-1a hash of the alias.
+ */
+static size_t hash_alias(const char *alias) {
+	uint32_t hash = 2166136261u;
+	for(; *alias != '\0'; alias++) {
+		hash = (hash ^ (unsigned char)*alias) * 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * @brief Returns the slot of the table where an alias is or would be
+ * inserted. The table must be locked.
+ *
+ * @param alias
+ * Alias searched.
+ *
+ * @return A pointer to the slot, or \c NULL if the table is not allocated.
+ */
+static struct Mailbox **find_slot(const char *alias) {
+	if(table == NULL) return NULL;
+	for(size_t i = hash_alias(alias) & (slots - 1);; i = (i + 1) & (slots - 1)) {
+		if(table[i] == NULL || !strcmp(table[i]->alias, alias)) {
+			return &table[i];
+		}
+	}
+}
+
+/**
+ * @brief Double the slots of the table. The table must be locked.
+ *
+ * @return \c 0 if successful, \c -1 if the memory could not be allocated.
+ */
+static int grow_table(void) {
+	size_t newslots = slots > 0 ? slots * 2 : MAILMINSLOTS;
+	struct Mailbox **old = table, **newtable;
+	size_t oldslots = slots;
+	if((newtable = calloc(newslots, sizeof(struct Mailbox *))) == NULL) {
+		return -1;
+	}
+	table = newtable;
+	slots = newslots;
+	for(size_t i = 0; i < oldslots; i++) {
+		if(old[i] != NULL) *find_slot(old[i]->alias) = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+/**
+ * @brief Find the mailbox of an alias and lock it.
+ *
+ * @param alias
+ * Alias searched.
+ *
+ * @return A pointer to the mailbox, \c NULL if the alias has none.
+ */
+static struct Mailbox *lock_box(const char *alias) {
+	struct Mailbox **slot, *box = NULL;
+	pthread_mutex_lock(&mailbox_mutex);
+	if((slot = find_slot(alias)) != NULL && (box = *slot) != NULL) {
+		pthread_mutex_lock(&box->mutex);
+	}
+	pthread_mutex_unlock(&mailbox_mutex);
+	return box;
+}
+
+/**
+ * @brief Create the mailbox of an alias, if it has none.
+ *
+ * @param alias
+ * Alias taken by a client, the default one has no mailbox.
+ *
+ * @return \c 0 if successful, \c -1 if there are \c MAILMAXBOXES
+ * mailboxes already (\c ENOSPC) or the memory could not be allocated.
+ */
+int mailbox_register(const char *alias) {
+	struct Mailbox **slot, *box;
+	int ret = 0;
+	if(!strcmp(alias, DEFAULTALIAS)) return 0;
+	pthread_mutex_lock(&mailbox_mutex);
+	/* the table is kept at most 3/4 full */
+	if((used + 1) * 4 > slots * 3 && grow_table() == -1) {
+		ret = -1;
+	}
+	else if(*(slot = find_slot(alias)) == NULL) {
+		/* the mailboxes are never released, so their number is bounded */
+		if(used >= MAILMAXBOXES) {
+			errno = ENOSPC;
+			ret = -1;
+		}
+		else if((box = calloc(1, sizeof(struct Mailbox))) == NULL) {
+			ret = -1;
+		}
+		else {
+			strncpy(box->alias, alias, ALIASLEN - 1);
+			pthread_mutex_init(&box->mutex, NULL);
+			box->spillfd = -1;
+			*slot = box;
+			used++;
+		}
+	}
+	pthread_mutex_unlock(&mailbox_mutex);
+	return ret;
+}
+
+/**
+ * @brief Append a frame to the file of a mailbox, creating it the first
+ * time. The mailbox must be locked.
+ *
+ * @param box
+ * Pointer to the mailbox.
+ * @param frame
+ * Encoded frame.
+ * @param len
+ * Length of the frame.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+static int spill(struct Mailbox *box, const char *frame, size_t len) {
+	ssize_t n;
+	if(box->spillfd == -1
+		&& (box->spillfd = open(spill_dir, O_TMPFILE | O_RDWR | O_CLOEXEC,
+		0600)) == -1) {
+		return -1;
+	}
+	while(len > 0) {
+		if((n = pwrite(box->spillfd, frame, len, box->spilled)) == -1) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		frame += n;
+		len -= n;
+		box->spilled += n;
+	}
+	return 0;
+}
+
+/**
+ * @brief Store a message in the mailbox of an alias.
+ *
+ * @param alias
+ * Alias of the recipient.
+ * @param packet
+ * Pointer to the message, encoded in the mailbox.
+ *
+ * @return \c 0 if successful, \c -1 if the alias has no mailbox
+ * (\c ENOENT), the mailbox is full (\c ENOBUFS) or an error occours.
+ */
+int mailbox_store(const char *alias, const struct Packet *packet) {
+	size_t len = packet_size(packet);
+	struct Mailbox *box;
+	int ret = 0;
+	if((box = lock_box(alias)) == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	if(box->len + box->spilled + len > MAILMAXBYTES) {
+		errno = ENOBUFS;
+		ret = -1;
+	}
+	/* once a mailbox spills, the following messages go to the file as well
+	to keep their order */
+	else if(box->spillfd == -1 && box->len + len <= MAILMEMBYTES) {
+		if(box->len + len > box->cap) {
+			size_t cap = box->cap > 0 ? box->cap : MAILMINBYTES;
+			while(cap < box->len + len) cap *= 2;
+			char *frames = realloc(box->frames, cap);
+			if(frames == NULL) {
+				pthread_mutex_unlock(&box->mutex);
+				return -1;
+			}
+			box->frames = frames;
+			box->cap = cap;
+		}
+		packet_encode(packet, &box->frames[box->len]);
+		box->len += len;
+		box->count++;
+	}
+	else {
+		char *frame = malloc(len);
+		if(frame == NULL) {
+			ret = -1;
+		}
+		else {
+			packet_encode(packet, frame);
+			if((ret = spill(box, frame, len)) == 0) box->count++;
+			free(frame);
+		}
+	}
+	pthread_mutex_unlock(&box->mutex);
+	return ret;
+}
+
+/**
+ * @brief Empty the mailbox of an alias.
+ *
+ * @param alias
+ * Alias of the recipient.
+ * @param count
+ * Set to the number of messages taken.
+ *
+ * @return A buffer with a single reference containing every frame of the
+ * mailbox, \c NULL if the mailbox is empty or an error occours.
+ */
+struct MsgBuf *mailbox_take(const char *alias, size_t *count) {
+	struct Mailbox *box;
+	struct MsgBuf *buf = NULL;
+	size_t off = 0;
+	ssize_t n;
+	*count = 0;
+	if((box = lock_box(alias)) == NULL) return NULL;
+	if(box->count == 0
+		|| (buf = msgbuf_alloc(box->len + box->spilled)) == NULL) {
+		pthread_mutex_unlock(&box->mutex);
+		return NULL;
+	}
+	memcpy(buf->data, box->frames, box->len);
+	while(off < box->spilled) {
+		n = pread(box->spillfd, &buf->data[box->len + off],
+			box->spilled - off, off);
+		if(n == -1 && errno == EINTR) continue;
+		/* the messages are kept for the next attempt */
+		if(n <= 0) {
+			pthread_mutex_unlock(&box->mutex);
+			msgbuf_unref(buf);
+			return NULL;
+		}
+		off += n;
+	}
+	*count = box->count;
+	/* an empty mailbox only costs its record */
+	free(box->frames);
+	box->frames = NULL;
+	box->len = box->cap = box->count = 0;
+	if(box->spillfd != -1) {
+		close(box->spillfd);
+		box->spillfd = -1;
+		box->spilled = 0;
+	}
+	pthread_mutex_unlock(&box->mutex);
+	return buf;
+}
+
+/**
+ * @brief Give back to the mailbox of an alias the messages taken, when they
+ * could not be handed over. They are delivered before the ones stored
+ * meanwhile.
+ *
+ * @param alias
+ * Alias of the recipient.
+ * @param buf
+ * Buffer returned by mailbox_take(), the caller keeps its reference.
+ * @param count
+ * Number of messages in the buffer.
+ *
+ * @return \c 0 if successful, \c -1 if the alias has no mailbox
+ * (\c ENOENT) or the memory could not be allocated.
+ */
+int mailbox_restore(const char *alias, const struct MsgBuf *buf,
+	size_t count) {
+	struct Mailbox *box;
+	char *frames;
+	if((box = lock_box(alias)) == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	/* the messages taken go back in memory, before the ones stored
+	meanwhile, even past MAILMEMBYTES or MAILMAXBYTES */
+	if((frames = malloc(buf->len + box->len)) == NULL) {
+		pthread_mutex_unlock(&box->mutex);
+		return -1;
+	}
+	memcpy(frames, buf->frame, buf->len);
+	if(box->len > 0) memcpy(&frames[buf->len], box->frames, box->len);
+	free(box->frames);
+	box->frames = frames;
+	box->len += buf->len;
+	box->cap = box->len;
+	box->count += count;
+	pthread_mutex_unlock(&box->mutex);
+	return 0;
+}
+
+/**
+ * @brief Returns the memory allocated for the mailboxes.
+ *
+ * @param messages
+ * If not \c NULL, set to the number of messages waiting.
+ * @param spilled
+ * If not \c NULL, set to the number of bytes spilled to the files.
+ *
+ * @return The number of bytes allocated for the mailboxes and their table.
+ */
+size_t mailbox_footprint(size_t *messages, size_t *spilled) {
+	size_t bytes, count = 0, disk = 0;
+	pthread_mutex_lock(&mailbox_mutex);
+	bytes = slots * sizeof(struct Mailbox *);
+	for(size_t i = 0; i < slots; i++) {
+		if(table[i] == NULL) continue;
+		pthread_mutex_lock(&table[i]->mutex);
+		bytes += sizeof(struct Mailbox) + table[i]->cap;
+		count += table[i]->count;
+		disk += table[i]->spilled;
+		pthread_mutex_unlock(&table[i]->mutex);
+	}
+	pthread_mutex_unlock(&mailbox_mutex);
+	if(messages != NULL) *messages = count;
+	if(spilled != NULL) *spilled = disk;
+	return bytes;
+}
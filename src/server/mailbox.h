@@ -0,0 +1,121 @@
+/**
+ * @file mailbox.h
+ * @brief Whispers waiting for a known alias to connect again.
+ *
+ * Every alias used by a client gets a mailbox. The whispers sent to the
+ * alias while nobody uses it are encoded one after the other in a buffer of
+ * the mailbox, past \c MAILMEMBYTES bytes they are appended to a file
+ * instead. The whole content of a mailbox is handed over in a single buffer
+ * when a client takes the alias again.
+ *
+ * Every mailbox has a lock of its own, so that reading back the file of a
+ * mailbox only delays the whispers to the same alias. At most
+ * \c MAILMAXBOXES aliases get a mailbox.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+/* Necessary for the definition of the struct Packet */
+#include "networkdef.h"
+
+/* Buffers handed over to the connections */
+#include "msgbuf.h"
+
+/* Standard libraries */
+#include <stddef.h>
+
+/** Bytes kept in memory by a mailbox, the following ones are spilled to a
+file */
+#define MAILMEMBYTES 16384
+/** Maximum number of bytes waiting in a mailbox */
+#define MAILMAXBYTES (4 * 1024 * 1024)
+/** Initial size of the buffer of a mailbox */
+#define MAILMINBYTES 256
+/** Initial number of slots of the table of the mailboxes, a power of two */
+#define MAILMINSLOTS 64
+/** Maximum number of mailboxes, the aliases taken afterwards have none */
+#define MAILMAXBOXES 65536
+
+/**
+ * @brief Set the directory of the files the mailboxes spill to.
+ *
+ * @param dir
+ * Directory, the files are unnamed and disappear with the server.
+ */
+void mailbox_init(const char *dir);
+
+/**
+ * @brief Create the mailbox of an alias, if it has none.
+ *
+ * @param alias
+ * Alias taken by a client, the default one has no mailbox.
+ *
+ * @return \c 0 if successful, \c -1 if there are \c MAILMAXBOXES
+ * mailboxes already (\c ENOSPC) or the memory could not be allocated.
+ */
+int mailbox_register(const char *alias);
+
+/**
+ * @brief Store a message in the mailbox of an alias.
+ *
+ * @param alias
+ * Alias of the recipient.
+ * @param packet
+ * Pointer to the message, encoded in the mailbox.
+ *
+ * @return \c 0 if successful, \c -1 if the alias has no mailbox
+ * (\c ENOENT), the mailbox is full (\c ENOBUFS) or an error occours.
+ */
+int mailbox_store(const char *alias, const struct Packet *packet);
+
+/**
+ * @brief Empty the mailbox of an alias.
+ *
+ * @param alias
+ * Alias of the recipient.
+ * @param count
+ * Set to the number of messages taken.
+ *
+ * @return A buffer with a single reference containing every frame of the
+ * mailbox, \c NULL if the mailbox is empty or an error occours.
+ */
+struct MsgBuf *mailbox_take(const char *alias, size_t *count);
+
+/**
+ * @brief Give back to the mailbox of an alias the messages taken, when they
+ * could not be handed over. They are delivered before the ones stored
+ * meanwhile.
+ *
+ * @param alias
+ * Alias of the recipient.
+ * @param buf
+ * Buffer returned by mailbox_take(), the caller keeps its reference.
+ * @param count
+ * Number of messages in the buffer.
+ *
+ * @return \c 0 if successful, \c -1 if the alias has no mailbox
+ * (\c ENOENT) or the memory could not be allocated.
+ */
+int mailbox_restore(const char *alias, const struct MsgBuf *buf,
+	size_t count);
+
+/**
+ * @brief Returns the memory allocated for the mailboxes.
+ *
+ * @param messages
+ * If not \c NULL, set to the number of messages waiting.
+ * @param spilled
+ * If not \c NULL, set to the number of bytes spilled to the files.
+ *
+ * @return The number of bytes allocated for the mailboxes and their table.
+ */
+size_t mailbox_footprint(size_t *messages, size_t *spilled);
+
+#endif
@@ -0,0 +1,82 @@
+/**
+ * @file mpscqueue.c
+ * @brief Lock-free, unbounded, multi-producer single-consumer queue of
+ * intrusive nodes.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#include "mpscqueue.h"
+
+/* Standard libraries */
+#include <stddef.h>
+
+/**
+ * @brief Initialize an empty queue.
+ *
+ * @param q
+ * Pointer to the queue.
+ */
+void mpsc_init(struct MpscQueue *q) {
+	atomic_init(&q->stub.next, NULL);
+	atomic_init(&q->head, &q->stub);
+	q->tail = &q->stub;
+}
+
+/**
+ * @brief Append an item to a queue, from any thread.
+ *
+ * @param q
+ * Pointer to the queue.
+ * @param node
+ * Link of the item.
+ */
+void mpsc_push(struct MpscQueue *q, struct MpscNode *node) {
+	struct MpscNode *prev;
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	/* the item becomes the head, then it is linked to the previous one */
+	prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/**
+ * @brief Remove the oldest item from a queue, only from the consumer thread.
+ *
+ * An item whose push is still in progress is not returned yet: the producer
+ * is expected to notify the consumer after pushing.
+ *
+ * @param q
+ * Pointer to the queue.
+ *
+ * @return The link of the item, \c NULL if the queue is empty.
+ */
+struct MpscNode *mpsc_pop(struct MpscQueue *q) {
+	struct MpscNode *tail = q->tail;
+	struct MpscNode *next = atomic_load_explicit(&tail->next,
+		memory_order_acquire);
+	/* skip the placeholder */
+	if(tail == &q->stub) {
+		if(next == NULL) return NULL;
+		q->tail = tail = next;
+		next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	}
+	if(next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+	/* the last item can be returned only once the placeholder follows it */
+	if(tail != atomic_load_explicit(&q->head, memory_order_acquire)) {
+		return NULL;
+	}
+	mpsc_push(q, &q->stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if(next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
@@ -0,0 +1,84 @@
+/**
+ * @file mpscqueue.h
+ * @brief Lock-free, unbounded, multi-producer single-consumer queue of
+ * intrusive nodes.
+ *
+ * Any thread can push without taking a lock, with a single atomic exchange;
+ * only the owner of the queue pops. The queue never allocates memory: the
+ * nodes are embedded in the items queued.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+/* Standard libraries */
+#include <stdatomic.h>
+
+/**
+ * @struct MpscNode
+ *
+ * @brief Link embedded in every item of a queue.
+ *
+ * @var MpscNode::next
+ * Item pushed after this one.
+ */
+struct MpscNode {
+	_Atomic(struct MpscNode *) next;
+};
+
+/**
+ * @struct MpscQueue
+ *
+ * @brief Queue of items linked from the oldest to the newest.
+ *
+ * @var MpscQueue::head
+ * Newest item, where the producers push.
+ * @var MpscQueue::tail
+ * Oldest item, where the consumer pops.
+ * @var MpscQueue::stub
+ * Placeholder keeping the queue linked when it is empty.
+ */
+struct MpscQueue {
+	_Atomic(struct MpscNode *) head;
+	struct MpscNode *tail;
+	struct MpscNode stub;
+};
+
+/**
+ * @brief Initialize an empty queue.
+ *
+ * @param q
+ * Pointer to the queue.
+ */
+void mpsc_init(struct MpscQueue *q);
+
+/**
+ * @brief Append an item to a queue, from any thread.
+ *
+ * @param q
+ * Pointer to the queue.
+ * @param node
+ * Link of the item.
+ */
+void mpsc_push(struct MpscQueue *q, struct MpscNode *node);
+
+/**
+ * @brief Remove the oldest item from a queue, only from the consumer thread.
+ *
+ * An item whose push is still in progress is not returned yet: the producer
+ * is expected to notify the consumer after pushing.
+ *
+ * @param q
+ * Pointer to the queue.
+ *
+ * @return The link of the item, \c NULL if the queue is empty.
+ */
+struct MpscNode *mpsc_pop(struct MpscQueue *q);
+
+#endif
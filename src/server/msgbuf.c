@@ -0,0 +1,116 @@
+/**
+ * @file msgbuf.c
+ * @brief Immutable, reference-counted buffers containing an encoded frame.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#include "msgbuf.h"
+
+/* Encoding of the packets */
+#include "packetcodec.h"
+
+/* Time the buffers are allocated at */
+#include "stats.h"
+
+/* Read the buffers are produced by */
+#include "trace.h"
+
+/* Standard libraries */
+#include <stdlib.h>
+
+/**
+ * @brief Allocate a buffer with a single reference.
+ *
+ * @param len
+ * Length of the frame that will be stored.
+ *
+ * @return A pointer to the buffer, \c NULL if the memory could not be
+ * allocated.
+ */
+struct MsgBuf *msgbuf_alloc(size_t len) {
+	struct MsgBuf *buf = malloc(sizeof(struct MsgBuf) + len);
+	if(buf == NULL) return NULL;
+	atomic_init(&buf->refs, 1);
+	buf->trace = trace_id;
+	buf->len = len;
+	buf->stamp = stats_now();
+	buf->frame = buf->data;
+	buf->release = NULL;
+	buf->owner = NULL;
+	return buf;
+}
+
+/**
+ * @brief Encode a packet in a new buffer with a single reference.
+ *
+ * @param packet
+ * Pointer to the packet.
+ *
+ * @return A pointer to the buffer, \c NULL if the memory could not be
+ * allocated.
+ */
+struct MsgBuf *msgbuf_encode(const struct Packet *packet) {
+	struct MsgBuf *buf = msgbuf_alloc(packet_size(packet));
+	if(buf == NULL) return NULL;
+	packet_encode(packet, buf->data);
+	return buf;
+}
+
+/**
+ * @brief Create a buffer with a single reference viewing frames stored
+ * elsewhere, without copying them.
+ *
+ * @param frames
+ * Beginning of the frames.
+ * @param len
+ * Total length of the frames.
+ * @param release
+ * Function called with \c owner when the last reference is released.
+ * @param owner
+ * Object keeping the frames alive, a reference to it is transferred to the
+ * view.
+ *
+ * @return A pointer to the buffer, \c NULL if the memory could not be
+ * allocated.
+ */
+struct MsgBuf *msgbuf_view(const char *frames, size_t len,
+	void (*release)(void *owner), void *owner) {
+	struct MsgBuf *buf = msgbuf_alloc(0);
+	if(buf == NULL) return NULL;
+	buf->len = len;
+	buf->frame = frames;
+	buf->release = release;
+	buf->owner = owner;
+	return buf;
+}
+
+/**
+ * @brief Acquire a new reference to a buffer.
+ *
+ * @param buf
+ * Pointer to the buffer.
+ *
+ * @return The same pointer \c buf.
+ */
+struct MsgBuf *msgbuf_ref(struct MsgBuf *buf) {
+	atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+	return buf;
+}
+
+/**
+ * @brief Release a reference to a buffer, freeing it if it was the last one.
+ *
+ * @param buf
+ * Pointer to the buffer.
+ */
+void msgbuf_unref(struct MsgBuf *buf) {
+	if(atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1) {
+		if(buf->release != NULL) buf->release(buf->owner);
+		free(buf);
+	}
+}
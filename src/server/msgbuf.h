@@ -0,0 +1,123 @@
+/**
+ * @file msgbuf.h
+ * @brief Immutable, reference-counted buffers containing an encoded frame.
+ *
+ * A message sent to many clients is encoded once in a buffer that every
+ * recipient's output queue references, the buffer is freed when the last
+ * queue has written it. A buffer can also be a view of frames stored
+ * elsewhere, which stay alive as long as the view.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef MSGBUF_H
+#define MSGBUF_H
+
+/* Necessary for the definition of the struct Packet */
+#include "networkdef.h"
+
+/* Standard libraries */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/**
+ * @struct MsgBuf
+ *
+ * @brief Encoded frame shared by the output queues of many connections.
+ *
+ * @var MsgBuf::refs
+ * Number of references to the buffer.
+ * @var MsgBuf::trace
+ * Identifier of the traced read that produced the buffer, \c 0 if none.
+ * @var MsgBuf::len
+ * Length of the frame, or of the frames of a view.
+ * @var MsgBuf::stamp
+ * Time the buffer has been allocated at, in nanoseconds, \c 0 for a buffer
+ * cached and shared by many answers, which is left out of the latency.
+ * @var MsgBuf::frame
+ * Beginning of the frame, \c data unless the buffer is a view.
+ * @var MsgBuf::release
+ * Function releasing the memory viewed, \c NULL unless the buffer is a
+ * view.
+ * @var MsgBuf::owner
+ * Argument of \c release.
+ * @var MsgBuf::data
+ * Encoded frame, never modified once the buffer is shared.
+ */
+struct MsgBuf {
+	atomic_int refs;
+	uint32_t trace;
+	size_t len;
+	uint64_t stamp;
+	const char *frame;
+	void (*release)(void *owner);
+	void *owner;
+	char data[];
+};
+
+/**
+ * @brief Allocate a buffer with a single reference.
+ *
+ * @param len
+ * Length of the frame that will be stored.
+ *
+ * @return A pointer to the buffer, \c NULL if the memory could not be
+ * allocated.
+ */
+struct MsgBuf *msgbuf_alloc(size_t len);
+
+/**
+ * @brief Encode a packet in a new buffer with a single reference.
+ *
+ * @param packet
+ * Pointer to the packet.
+ *
+ * @return A pointer to the buffer, \c NULL if the memory could not be
+ * allocated.
+ */
+struct MsgBuf *msgbuf_encode(const struct Packet *packet);
+
+/**
+ * @brief Create a buffer with a single reference viewing frames stored
+ * elsewhere, without copying them.
+ *
+ * @param frames
+ * Beginning of the frames.
+ * @param len
+ * Total length of the frames.
+ * @param release
+ * Function called with \c owner when the last reference is released.
+ * @param owner
+ * Object keeping the frames alive, a reference to it is transferred to the
+ * view.
+ *
+ * @return A pointer to the buffer, \c NULL if the memory could not be
+ * allocated.
+ */
+struct MsgBuf *msgbuf_view(const char *frames, size_t len,
+	void (*release)(void *owner), void *owner);
+
+/**
+ * @brief Acquire a new reference to a buffer.
+ *
+ * @param buf
+ * Pointer to the buffer.
+ *
+ * @return The same pointer \c buf.
+ */
+struct MsgBuf *msgbuf_ref(struct MsgBuf *buf);
+
+/**
+ * @brief Release a reference to a buffer, freeing it if it was the last one.
+ *
+ * @param buf
+ * Pointer to the buffer.
+ */
+void msgbuf_unref(struct MsgBuf *buf);
+
+#endif
@@ -0,0 +1,208 @@
+/**
+ * @file outqueue.c
+ * @brief Bounded queue of the messages waiting to be written to a connection.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#include "outqueue.h"
+
+/* Standard libraries */
+#include <stdlib.h>
+#include <errno.h>
+
+/**
+ * @brief Initialize an empty output queue.
+ *
+ * @param q
+ * Pointer to the queue.
+ */
+void outqueue_init(struct OutQueue *q) {
+	q->entries = NULL;
+	q->cap = 0;
+	q->head = q->tail = 0;
+	q->offset = 0;
+	q->bytes = 0;
+}
+
+/**
+ * @brief Release the memory of an output queue and of the messages in it.
+ *
+ * @param q
+ * Pointer to the queue.
+ *
+ * @return The number of messages discarded.
+ */
+size_t outqueue_release(struct OutQueue *q) {
+	size_t discarded = q->tail - q->head;
+	for(size_t i = q->head; i != q->tail; i++) {
+		msgbuf_unref(q->entries[i & (q->cap - 1)].buf);
+	}
+	free(q->entries);
+	outqueue_init(q);
+	return discarded;
+}
+
+/**
+ * @brief Returns the number of messages in an output queue.
+ *
+ * @param q
+ * Pointer to the queue.
+ *
+ * @return The number of messages waiting to be written.
+ */
+size_t outqueue_len(const struct OutQueue *q) {
+	return q->tail - q->head;
+}
+
+/**
+ * @brief Append a message to an output queue.
+ *
+ * @param q
+ * Pointer to the queue.
+ * @param buf
+ * Encoded frame, the queue takes one of its references only if the message
+ * is accepted.
+ *
+ * @return \c 0 if successful, \c -1 if the queue is full or the memory
+ * could not be allocated.
+ */
+int outqueue_push(struct OutQueue *q, struct MsgBuf *buf) {
+	size_t count = outqueue_len(q);
+	if(count == q->cap) {
+		if(q->cap == OUTQUEUELEN) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		/* grow the ring keeping the messages in order */
+		size_t newcap = q->cap ? q->cap * 2 : OUTQUEUEMIN;
+		struct OutEntry *entries = malloc(newcap * sizeof(struct OutEntry));
+		if(entries == NULL) return -1;
+		for(size_t i = 0; i < count; i++) {
+			entries[i] = q->entries[(q->head + i) & (q->cap - 1)];
+		}
+		free(q->entries);
+		q->entries = entries;
+		q->cap = newcap;
+		q->head = 0;
+		q->tail = count;
+	}
+	q->entries[q->tail & (q->cap - 1)].buf = buf;
+	q->tail++;
+	q->bytes += buf->len;
+	return 0;
+}
+
+/**
+ * @brief Drop the oldest message of an output queue that is not being
+ * written.
+ *
+ * @param q
+ * Pointer to the queue.
+ * @param keep
+ * Number of messages at the beginning of the queue being written, which
+ * are kept.
+ *
+ * @return \c 0 if a message has been dropped, \c -1 if every message is
+ * being written.
+ */
+int outqueue_drop(struct OutQueue *q, size_t keep) {
+	size_t pos = q->head + keep;
+	if(keep >= outqueue_len(q)) return -1;
+	struct MsgBuf *buf = q->entries[pos & (q->cap - 1)].buf;
+	q->bytes -= buf->len;
+	msgbuf_unref(buf);
+	/* the messages kept move forward by one, the first one keeps its
+	offset */
+	for(size_t i = pos; i != q->head; i--) {
+		q->entries[i & (q->cap - 1)] = q->entries[(i - 1) & (q->cap - 1)];
+	}
+	q->head++;
+	return 0;
+}
+
+/**
+ * @brief Describe the first messages of an output queue for \c writev().
+ *
+ * @param q
+ * Pointer to the queue.
+ * @param iov
+ * Array that will describe the messages.
+ * @param max
+ * Number of elements of \c iov.
+ *
+ * @return The number of elements of \c iov filled.
+ */
+int outqueue_iov(const struct OutQueue *q, struct iovec *iov, int max) {
+	int n = 0;
+	size_t skip = q->offset;
+	for(size_t i = q->head; i != q->tail && n < max; i++, n++) {
+		struct MsgBuf *buf = q->entries[i & (q->cap - 1)].buf;
+		/* the first message may have been partially written */
+		iov[n].iov_base = (char *)buf->frame + skip;
+		iov[n].iov_len = buf->len - skip;
+		skip = 0;
+	}
+	return n;
+}
+
+/**
+ * @brief Returns the identifier of the traced read that produced one of the
+ * first messages of an output queue.
+ *
+ * @param q
+ * Pointer to the queue.
+ * @param max
+ * Number of messages examined.
+ *
+ * @return The identifier of the first traced message, \c 0 if none is
+ * traced.
+ */
+uint32_t outqueue_trace(const struct OutQueue *q, size_t max) {
+	for(size_t i = q->head; i != q->tail && max > 0; i++, max--) {
+		struct MsgBuf *buf = q->entries[i & (q->cap - 1)].buf;
+		if(buf->trace != 0) return buf->trace;
+	}
+	return 0;
+}
+
+/**
+ * @brief Remove the bytes written from the beginning of an output queue.
+ *
+ * @param q
+ * Pointer to the queue.
+ * @param written
+ * Number of bytes written, at most the number of bytes in the queue.
+ * @param latency
+ * Histogram receiving the time elapsed since the allocation of every message
+ * completely written but a shared one, can be \c NULL.
+ *
+ * @return The number of messages completely written.
+ */
+size_t outqueue_consume(struct OutQueue *q, size_t written,
+	struct Histogram *latency) {
+	uint64_t now = latency != NULL ? stats_now() : 0;
+	size_t completed = 0;
+	q->bytes -= written;
+	while(written > 0) {
+		struct MsgBuf *buf = q->entries[q->head & (q->cap - 1)].buf;
+		size_t left = buf->len - q->offset;
+		if(written < left) {
+			q->offset += written;
+			break;
+		}
+		written -= left;
+		if(latency != NULL && buf->stamp != 0) {
+			stats_record(latency, now > buf->stamp ? now - buf->stamp : 0);
+		}
+		msgbuf_unref(buf);
+		q->head++;
+		q->offset = 0;
+		completed++;
+	}
+	return completed;
+}
@@ -0,0 +1,178 @@
+/**
+ * @file outqueue.h
+ * @brief Bounded queue of the messages waiting to be written to a connection.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef OUTQUEUE_H
+#define OUTQUEUE_H
+
+/* Shared encoded frames */
+#include "msgbuf.h"
+
+/* Latency of the messages written */
+#include "stats.h"
+
+/* Standard libraries */
+#include <stddef.h>
+#include <stdint.h>
+
+/* Scatter/gather I/O */
+#include <sys/uio.h>
+
+/** Maximum number of messages waiting in the queue of a connection */
+#define OUTQUEUELEN 1024
+/** Initial number of messages that the queue of a connection can hold */
+#define OUTQUEUEMIN 8
+/** Maximum number of messages written with a single writev(), the IOV_MAX
+of Linux */
+#define WRITEVLEN 1024
+
+/**
+ * @struct OutEntry
+ *
+ * @brief A single message waiting in an output queue.
+ *
+ * @var OutEntry::buf
+ * Encoded frame, the queue owns one of its references.
+ */
+struct OutEntry {
+	struct MsgBuf *buf;
+};
+
+/**
+ * @struct OutQueue
+ *
+ * @brief Ring of messages waiting to be written to a connection.
+ *
+ * The ring grows from \c OUTQUEUEMIN up to \c OUTQUEUELEN messages, its
+ * memory is allocated with the first message.
+ *
+ * @var OutQueue::entries
+ * Ring of the messages, its capacity is always a power of two.
+ * @var OutQueue::cap
+ * Capacity of the ring.
+ * @var OutQueue::head
+ * Position of the first message, the next to be written.
+ * @var OutQueue::tail
+ * Position following the last message.
+ * @var OutQueue::offset
+ * Number of bytes of the first message already written.
+ * @var OutQueue::bytes
+ * Number of bytes waiting in the queue.
+ */
+struct OutQueue {
+	struct OutEntry *entries;
+	size_t cap;
+	size_t head, tail;
+	size_t offset;
+	size_t bytes;
+};
+
+/**
+ * @brief Initialize an empty output queue.
+ *
+ * @param q
+ * Pointer to the queue.
+ */
+void outqueue_init(struct OutQueue *q);
+
+/**
+ * @brief Release the memory of an output queue and of the messages in it.
+ *
+ * @param q
+ * Pointer to the queue.
+ *
+ * @return The number of messages discarded.
+ */
+size_t outqueue_release(struct OutQueue *q);
+
+/**
+ * @brief Returns the number of messages in an output queue.
+ *
+ * @param q
+ * Pointer to the queue.
+ *
+ * @return The number of messages waiting to be written.
+ */
+size_t outqueue_len(const struct OutQueue *q);
+
+/**
+ * @brief Append a message to an output queue.
+ *
+ * @param q
+ * Pointer to the queue.
+ * @param buf
+ * Encoded frame, the queue takes one of its references only if the message
+ * is accepted.
+ *
+ * @return \c 0 if successful, \c -1 if the queue is full or the memory
+ * could not be allocated.
+ */
+int outqueue_push(struct OutQueue *q, struct MsgBuf *buf);
+
+/**
+ * @brief Drop the oldest message of an output queue that is not being
+ * written.
+ *
+ * @param q
+ * Pointer to the queue.
+ * @param keep
+ * Number of messages at the beginning of the queue being written, which
+ * are kept.
+ *
+ * @return \c 0 if a message has been dropped, \c -1 if every message is
+ * being written.
+ */
+int outqueue_drop(struct OutQueue *q, size_t keep);
+
+/**
+ * @brief Describe the first messages of an output queue for \c writev().
+ *
+ * @param q
+ * Pointer to the queue.
+ * @param iov
+ * Array that will describe the messages.
+ * @param max
+ * Number of elements of \c iov.
+ *
+ * @return The number of elements of \c iov filled.
+ */
+int outqueue_iov(const struct OutQueue *q, struct iovec *iov, int max);
+
+/**
+ * @brief Returns the identifier of the traced read that produced one of the
+ * first messages of an output queue.
+ *
+ * @param q
+ * Pointer to the queue.
+ * @param max
+ * Number of messages examined.
+ *
+ * @return The identifier of the first traced message, \c 0 if none is
+ * traced.
+ */
+uint32_t outqueue_trace(const struct OutQueue *q, size_t max);
+
+/**
+ * @brief Remove the bytes written from the beginning of an output queue.
+ *
+ * @param q
+ * Pointer to the queue.
+ * @param written
+ * Number of bytes written, at most the number of bytes in the queue.
+ * @param latency
+ * Histogram receiving the time elapsed since the allocation of every message
+ * completely written, can be \c NULL.
+ *
+ * @return The number of messages completely written.
+ */
+size_t outqueue_consume(struct OutQueue *q, size_t written,
+	struct Histogram *latency);
+
+#endif
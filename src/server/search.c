@@ -0,0 +1,741 @@
+/**
+ * @file search.c
+ * @brief Inverted index of the messages kept in the history.
+ *
+ * A background thread scans the frames appended to the history and adds
+ * their location to the posting list of every term of the message. The
+ * locations of a posting list are increasing, so they are stored as the
+ * varint encoded differences between one and the previous, in blocks of
+ * \c SEARCHBLOCK locations starting with a whole one. The first location of
+ * every block is kept aside, so a query walks the lists from the newest
+ * message backwards and stops as soon as it has found enough, without
+ * decoding the older blocks. The blocks of the segments dropped from the
+ * history are trimmed as they go.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#include "search.h"
+
+/* Frames scanned and read back */
+#include "history.h"
+#include "packetcodec.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+
+/* Thread library */
+#include <pthread.h>
+
+/** Maximum length of a varint encoded location */
+#define VARINTLEN 10
+
+/**
+ * @struct SearchBlock
+ *
+ * @brief Start of a block of a posting list.
+ *
+ * @var SearchBlock::location
+ * First location of the block, encoded whole.
+ * @var SearchBlock::offset
+ * Position of the block in the posting list.
+ */
+struct SearchBlock {
+	uint64_t location;
+	uint32_t offset;
+};
+
+/**
+ * @struct SearchTerm
+ *
+ * @brief Posting list of a term.
+ *
+ * @var SearchTerm::last
+ * Location of the last message containing the term.
+ * @var SearchTerm::count
+ * Number of locations in the list, \c 0 if the list is empty.
+ * @var SearchTerm::len
+ * Bytes of \c postings used.
+ * @var SearchTerm::cap
+ * Bytes allocated for \c postings.
+ * @var SearchTerm::postings
+ * Locations of the messages in blocks of \c SEARCHBLOCK, the first one of a
+ * block followed by the difference of every other from the previous one,
+ * varint encoded.
+ * @var SearchTerm::nblocks
+ * Number of blocks of the list.
+ * @var SearchTerm::blockcap
+ * Number of elements allocated for \c blocks.
+ * @var SearchTerm::blocks
+ * Start of every block.
+ * @var SearchTerm::term
+ * Term, lowercase.
+ */
+struct SearchTerm {
+	uint64_t last;
+	uint32_t count;
+	uint32_t len;
+	uint32_t cap;
+	uint8_t *postings;
+	uint32_t nblocks;
+	uint32_t blockcap;
+	struct SearchBlock *blocks;
+	char term[SEARCHTERMLEN];
+};
+
+/**
+ * @struct PostingCursor
+ *
+ * @brief Position in a posting list walked backwards.
+ *
+ * @var PostingCursor::entry
+ * Term whose list is walked.
+ * @var PostingCursor::block
+ * Block decoded.
+ * @var PostingCursor::pos
+ * Position of the current location in \c decoded.
+ * @var PostingCursor::decoded
+ * Locations of the block decoded.
+ */
+struct PostingCursor {
+	const struct SearchTerm *entry;
+	uint32_t block;
+	int pos;
+	uint64_t decoded[SEARCHBLOCK];
+};
+
+/**
+ * Read-write lock protecting the index, taken for writing by the indexer
+ * and for reading by the queries.
+ */
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * Open addressing table of the terms.
+ */
+static struct SearchTerm **table;
+
+/**
+ * Number of slots of \c table, a power of two.
+ */
+static size_t slots;
+
+/**
+ * Number of terms in \c table.
+ */
+static size_t used;
+
+/**
+ * Location following the last frame indexed.
+ */
+static uint64_t indexed_upto;
+
+/**
+ * Number of messages indexed since the start.
+ */
+static atomic_ulong indexed;
+
+/**
+ * Whether the indexing thread has to keep running.
+ */
+static atomic_int running;
+
+/**
+ * Thread indexing the history.
+ */
+static pthread_t index_thread;
+
+/**
+ * @brief Extract the next term of a text.
+ *
+ * The terms are the sequences of letters, digits and non-ASCII bytes, the
+ * letters are turned lowercase.
+ *
+ * @param text
+ * Pointer to the text, moved past the term.
+ * @param end
+ * End of the text.
+ * @param term
+ * Buffer of \c SEARCHTERMLEN bytes that will contain the term.
+ *
+ * @return The length of the term, \c 0 if the text has no other term.
+ */
+static size_t next_term(const char **text, const char *end, char *term) {
+	const char *p = *text;
+	size_t len = 0;
+	unsigned char c;
+	/* skip the separators */
+	for(; p < end; p++) {
+		c = (unsigned char)*p;
+		if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+			|| (c >= '0' && c <= '9') || c >= 0x80) {
+			break;
+		}
+	}
+	for(; p < end; p++) {
+		c = (unsigned char)*p;
+		if(c >= 'A' && c <= 'Z') c += 'a' - 'A';
+		else if(!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')
+			|| c >= 0x80)) {
+			break;
+		}
+		if(len < SEARCHTERMLEN - 1) term[len++] = c;
+	}
+	term[len] = '\0';
+	*text = p;
+	return len;
+}
+
+/**
+ * @brief Returns the hash of a term.
+ *
+ * @param term
+ * Term hashed.
+ *
+ * @return The FNV-1a hash of the term.
+ */
+static size_t hash_term(const char *term) {
+	uint32_t hash = 2166136261u;
+	for(; *term != '\0'; term++) {
+		hash = (hash ^ (unsigned char)*term) * 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * @brief Returns the slot of a table where a term is or would be inserted.
+ *
+ * @param tab
+ * Table searched.
+ * @param nslots
+ * Number of slots of the table, a power of two.
+ * @param term
+ * Term searched.
+ *
+ * @return A pointer to the slot.
+ */
+static struct SearchTerm **find_slot(struct SearchTerm **tab, size_t nslots,
+	const char *term) {
+	for(size_t i = hash_term(term) & (nslots - 1);; i = (i + 1) & (nslots - 1)) {
+		if(tab[i] == NULL || !strcmp(tab[i]->term, term)) return &tab[i];
+	}
+}
+
+/**
+ * @brief Move the terms of the table to a new table, leaving the terms with
+ * an empty posting list out. The index must be locked for writing.
+ *
+ * @param newslots
+ * Number of slots of the new table, a power of two.
+ *
+ * @return \c 0 if successful, \c -1 if the memory could not be allocated.
+ */
+static int rebuild_table(size_t newslots) {
+	struct SearchTerm **newtable = calloc(newslots, sizeof(struct SearchTerm *));
+	if(newtable == NULL) return -1;
+	used = 0;
+	for(size_t i = 0; i < slots; i++) {
+		if(table[i] == NULL) continue;
+		if(table[i]->count == 0) {
+			free(table[i]->postings);
+			free(table[i]->blocks);
+			free(table[i]);
+			continue;
+		}
+		*find_slot(newtable, newslots, table[i]->term) = table[i];
+		used++;
+	}
+	free(table);
+	table = newtable;
+	slots = newslots;
+	return 0;
+}
+
+/**
+ * @brief Returns the term of the index, adding it if necessary. The index
+ * must be locked for writing.
+ *
+ * @param term
+ * Term searched.
+ *
+ * @return A pointer to the term, \c NULL if the memory could not be
+ * allocated.
+ */
+static struct SearchTerm *add_term(const char *term) {
+	struct SearchTerm **slot, *entry;
+	/* the table is kept at most 3/4 full */
+	if((used + 1) * 4 > slots * 3
+		&& rebuild_table(slots > 0 ? slots * 2 : SEARCHMINSLOTS) == -1) {
+		return NULL;
+	}
+	if(*(slot = find_slot(table, slots, term)) != NULL) return *slot;
+	if((entry = calloc(1, sizeof(struct SearchTerm))) == NULL) return NULL;
+	strcpy(entry->term, term);
+	*slot = entry;
+	used++;
+	return entry;
+}
+
+/**
+ * @brief Encode a number as a varint.
+ *
+ * @param value
+ * Number encoded.
+ * @param out
+ * Buffer of at least \c VARINTLEN bytes.
+ *
+ * @return The number of bytes written.
+ */
+static size_t varint_encode(uint64_t value, uint8_t *out) {
+	size_t len = 0;
+	for(; value >= 0x80; value >>= 7) out[len++] = (value & 0x7f) | 0x80;
+	out[len++] = value;
+	return len;
+}
+
+/**
+ * @brief Decode a varint.
+ *
+ * @param next
+ * Pointer to the first byte of the varint, moved past it.
+ *
+ * @return The number decoded.
+ */
+static uint64_t varint_decode(const uint8_t **next) {
+	uint64_t value = 0;
+	int shift = 0;
+	const uint8_t *p = *next;
+	for(; *p & 0x80; p++, shift += 7) value |= (uint64_t)(*p & 0x7f) << shift;
+	value |= (uint64_t)*p++ << shift;
+	*next = p;
+	return value;
+}
+
+/**
+ * @brief Append a location to the posting list of a term, once per message.
+ * The index must be locked for writing.
+ *
+ * @param entry
+ * Pointer to the term.
+ * @param location
+ * Location of the message, not lower than the last one of the list.
+ *
+ * @return \c 0 if successful, \c -1 if the memory could not be allocated.
+ */
+static int add_posting(struct SearchTerm *entry, uint64_t location) {
+	int start = entry->count % SEARCHBLOCK == 0;
+	if(entry->count > 0 && entry->last == location) return 0;
+	if(entry->len + VARINTLEN > entry->cap) {
+		uint32_t cap = entry->cap > 0 ? entry->cap * 2 : 2 * VARINTLEN;
+		uint8_t *postings = realloc(entry->postings, cap);
+		if(postings == NULL) return -1;
+		entry->postings = postings;
+		entry->cap = cap;
+	}
+	if(start && entry->nblocks == entry->blockcap) {
+		uint32_t blockcap = entry->blockcap > 0 ? entry->blockcap * 2 : 1;
+		struct SearchBlock *blocks = realloc(entry->blocks,
+			blockcap * sizeof(struct SearchBlock));
+		if(blocks == NULL) return -1;
+		entry->blocks = blocks;
+		entry->blockcap = blockcap;
+	}
+	/* a block starts with a whole location */
+	if(start) {
+		entry->blocks[entry->nblocks].location = location;
+		entry->blocks[entry->nblocks++].offset = entry->len;
+	}
+	entry->len += varint_encode(start ? location : location - entry->last,
+		&entry->postings[entry->len]);
+	entry->count++;
+	entry->last = location;
+	return 0;
+}
+
+/**
+ * @brief Add the terms of a message of the history to the index. The index
+ * must be locked for writing.
+ *
+ * @param arg Unused, it can be safely set as \c NULL pointer.
+ * @param frame
+ * Encoded frame of the message.
+ * @param len
+ * Length of the frame.
+ * @param location
+ * Location of the frame in the history.
+ */
+static void index_frame(void *arg, const char *frame, size_t len,
+	uint64_t location) {
+	char term[SEARCHTERMLEN];
+	size_t aliaslen = (unsigned char)frame[3];
+	const char *text = &frame[HEADERLEN + aliaslen], *end = &frame[len];
+	struct SearchTerm *entry;
+	(void)arg;
+	while(next_term(&text, end, term) > 0) {
+		if((entry = add_term(term)) == NULL
+			|| add_posting(entry, location) == -1) {
+			/* the message is left out of the lists it did not fit */
+			break;
+		}
+	}
+	atomic_fetch_add_explicit(&indexed, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Remove the blocks of the segments dropped from the history. The
+ * index must be locked for writing.
+ *
+ * A block is removed once the next one starts in a segment kept, the older
+ * locations left are skipped by the queries.
+ *
+ * @param oldest
+ * Location of the oldest frame kept.
+ */
+static void trim_index(uint64_t oldest) {
+	size_t empty = 0;
+	uint32_t drop, offset;
+	for(size_t i = 0; i < slots; i++) {
+		struct SearchTerm *entry = table[i];
+		if(entry == NULL || entry->count == 0) continue;
+		if(entry->last < oldest) {
+			free(entry->postings);
+			free(entry->blocks);
+			entry->postings = NULL;
+			entry->blocks = NULL;
+			entry->len = entry->cap = entry->count = 0;
+			entry->nblocks = entry->blockcap = 0;
+			empty++;
+			continue;
+		}
+		for(drop = 0; drop + 1 < entry->nblocks
+			&& entry->blocks[drop + 1].location <= oldest; drop++);
+		if(drop == 0) continue;
+		/* the blocks dropped are full */
+		offset = entry->blocks[drop].offset;
+		memmove(entry->postings, &entry->postings[offset], entry->len - offset);
+		entry->len -= offset;
+		entry->count -= drop * SEARCHBLOCK;
+		entry->nblocks -= drop;
+		memmove(entry->blocks, &entry->blocks[drop],
+			entry->nblocks * sizeof(struct SearchBlock));
+		for(uint32_t b = 0; b < entry->nblocks; b++) {
+			entry->blocks[b].offset -= offset;
+		}
+	}
+	/* the terms not used anymore leave the table */
+	if(empty > 0) rebuild_table(slots);
+}
+
+/**
+ * @brief Routine of the thread indexing the history.
+ *
+ * @param param Unused, it can be safely set as \c NULL pointer.
+ *
+ * @return Always a \c NULL pointer.
+ */
+static void *index_routine(void *param) {
+	struct timespec interval = { 0, SEARCHINDEXMS * 1000000L };
+	uint64_t trimmed = 0, oldest;
+	size_t scanned = 0;
+	(void)param;
+	while(atomic_load(&running)) {
+		/* a backlog is indexed in batches without waiting */
+		if(scanned < SEARCHBATCH) nanosleep(&interval, NULL);
+		pthread_rwlock_wrlock(&index_lock);
+		scanned = history_scan(&indexed_upto, SEARCHBATCH, index_frame, NULL);
+		if((oldest = history_oldest()) > trimmed) {
+			trim_index(oldest);
+			trimmed = oldest;
+		}
+		pthread_rwlock_unlock(&index_lock);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Start the thread indexing the history, which must be open. The
+ * thread is stopped at the exit.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+int search_start(void) {
+	int err;
+	atomic_store(&running, 1);
+	if((err = pthread_create(&index_thread, NULL, index_routine, NULL)) != 0) {
+		atomic_store(&running, 0);
+		errno = err;
+		return -1;
+	}
+	/* stopped before the history is closed */
+	atexit(search_stop);
+	return 0;
+}
+
+/**
+ * @brief Stop the thread indexing the history.
+ */
+void search_stop(void) {
+	if(!atomic_exchange(&running, 0)) return;
+	pthread_join(index_thread, NULL);
+}
+
+/**
+ * @brief Decode a block of a posting list into a cursor, which is placed on
+ * the last location of the block.
+ *
+ * @param cursor
+ * Pointer to the cursor.
+ * @param block
+ * Index of the block.
+ */
+static void cursor_decode(struct PostingCursor *cursor, uint32_t block) {
+	const struct SearchTerm *entry = cursor->entry;
+	const uint8_t *next = &entry->postings[entry->blocks[block].offset];
+	const uint8_t *end = block + 1 < entry->nblocks
+		? &entry->postings[entry->blocks[block + 1].offset]
+		: &entry->postings[entry->len];
+	uint64_t location = varint_decode(&next);
+	int n = 0;
+	cursor->decoded[n++] = location;
+	while(next < end) cursor->decoded[n++] = location += varint_decode(&next);
+	cursor->block = block;
+	cursor->pos = n - 1;
+}
+
+/**
+ * @brief Move a cursor to the highest location not higher than a given one.
+ *
+ * @param cursor
+ * Pointer to the cursor.
+ * @param location
+ * Location searched.
+ *
+ * @return \c 0 if found, \c -1 if the posting list starts after.
+ */
+static int cursor_seek(struct PostingCursor *cursor, uint64_t location) {
+	const struct SearchBlock *blocks = cursor->entry->blocks;
+	uint32_t lo = 0, hi = cursor->block;
+	if(cursor->decoded[cursor->pos] <= location) return 0;
+	/* the blocks skipped are not decoded */
+	if(blocks[cursor->block].location > location) {
+		if(blocks[0].location > location) return -1;
+		while(lo < hi) {
+			uint32_t mid = (lo + hi + 1) / 2;
+			if(blocks[mid].location <= location) lo = mid;
+			else hi = mid - 1;
+		}
+		cursor_decode(cursor, lo);
+	}
+	while(cursor->decoded[cursor->pos] > location) cursor->pos--;
+	return 0;
+}
+
+/**
+ * @brief Move a cursor to the previous location.
+ *
+ * @param cursor
+ * Pointer to the cursor.
+ *
+ * @return \c 0 if successful, \c -1 if the posting list starts here.
+ */
+static int cursor_prev(struct PostingCursor *cursor) {
+	if(cursor->pos > 0) cursor->pos--;
+	else if(cursor->block > 0) cursor_decode(cursor, cursor->block - 1);
+	else return -1;
+	return 0;
+}
+
+/**
+ * @brief Find the latest locations present in every posting list.
+ *
+ * @param cursors
+ * Cursors at the end of the posting lists.
+ * @param ncursors
+ * Number of cursors.
+ * @param lead
+ * Index of the cursor of the shortest list, which drives the intersection.
+ * @param results
+ * Array of \c SEARCHRESULTS elements, will contain the locations found from
+ * the newest to the oldest.
+ *
+ * @return The number of locations found.
+ */
+static int intersect(struct PostingCursor *cursors, int ncursors, int lead,
+	uint64_t *results) {
+	uint64_t target = cursors[lead].decoded[cursors[lead].pos];
+	int matches = 0, i;
+	while(matches < SEARCHRESULTS) {
+		/* a list without the target moves it to its previous location */
+		for(i = 0; i < ncursors; i++) {
+			if(cursor_seek(&cursors[i], target) == -1) return matches;
+			if(cursors[i].decoded[cursors[i].pos] < target) break;
+		}
+		if(i < ncursors) {
+			target = cursors[i].decoded[cursors[i].pos];
+			continue;
+		}
+		results[matches++] = target;
+		if(cursor_prev(&cursors[lead]) == -1) return matches;
+		target = cursors[lead].decoded[cursors[lead].pos];
+	}
+	return matches;
+}
+
+/**
+ * @brief Returns the length of the line of a message in the results.
+ *
+ * @param frame
+ * Encoded frame of the message.
+ */
+static size_t result_len(const char *frame) {
+	size_t aliaslen = (unsigned char)frame[3];
+	size_t len = packet_framelen(frame) - HEADERLEN - aliaslen;
+	/* the payload length includes its termination, replaced by the tab */
+	return aliaslen + (len > 0 ? len : 1) + 1;
+}
+
+/**
+ * @brief Write the line of a message in the results.
+ *
+ * @param frame
+ * Encoded frame of the message.
+ * @param out
+ * Buffer of at least \c result_len() bytes.
+ *
+ * @return The number of characters written.
+ */
+static size_t format_result(const char *frame, char *out) {
+	size_t aliaslen = (unsigned char)frame[3];
+	size_t len = result_len(frame);
+	memcpy(out, &frame[HEADERLEN], aliaslen);
+	out[aliaslen] = '\t';
+	memcpy(&out[aliaslen + 1], &frame[HEADERLEN + aliaslen],
+		len - aliaslen - 2);
+	/* a line per message */
+	for(size_t i = aliaslen + 1; i < len - 1; i++) {
+		if(out[i] == '\n') out[i] = ' ';
+	}
+	out[len - 1] = '\n';
+	return len;
+}
+
+/**
+ * @brief Search the messages containing every term of a query.
+ *
+ * @param query
+ * Terms searched, separated by any character other than a letter or a digit.
+ * The case is ignored.
+ * @param out
+ * Buffer that will contain the latest messages found, one "alias\tmessage"
+ * per line from the oldest to the newest, followed by a termination.
+ * @param outlen
+ * Size of \c out, the oldest messages that do not fit are left out.
+ *
+ * @return The number of characters written, the termination excluded.
+ */
+size_t search_query(const char *query, char *out, size_t outlen) {
+	char terms[SEARCHQUERYTERMS][SEARCHTERMLEN];
+	struct PostingCursor *cursors;
+	struct SearchTerm **slot;
+	struct MsgBuf *found[SEARCHRESULTS];
+	uint64_t results[SEARCHRESULTS];
+	uint32_t fewest = UINT32_MAX;
+	const char *end = query + strlen(query);
+	int nterms = 0, lead = 0, matches, nfound = 0, keep;
+	size_t len = 0;
+
+	if(outlen == 0) return 0;
+	out[0] = '\0';
+	while(nterms < SEARCHQUERYTERMS
+		&& next_term(&query, end, terms[nterms]) > 0) {
+		nterms++;
+	}
+	/* the blocks decoded do not fit in the stack of the event loops */
+	if(nterms == 0
+		|| (cursors = malloc(nterms * sizeof(struct PostingCursor))) == NULL) {
+		return 0;
+	}
+
+	pthread_rwlock_rdlock(&index_lock);
+	for(int i = 0; i < nterms; i++) {
+		if(table == NULL || *(slot = find_slot(table, slots, terms[i])) == NULL
+			|| (*slot)->count == 0) {
+			pthread_rwlock_unlock(&index_lock);
+			free(cursors);
+			return 0;
+		}
+		cursors[i].entry = *slot;
+		cursor_decode(&cursors[i], (*slot)->nblocks - 1);
+		if((*slot)->count < fewest) {
+			fewest = (*slot)->count;
+			lead = i;
+		}
+	}
+	matches = intersect(cursors, nterms, lead, results);
+	pthread_rwlock_unlock(&index_lock);
+	free(cursors);
+
+	/* the messages are read back from the history, the ones whose segment
+	has been dropped are left out */
+	for(int i = 0; i < matches; i++) {
+		struct MsgBuf *buf = history_frame(results[i]);
+		if(buf != NULL) found[nfound++] = buf;
+	}
+	/* the latest messages are kept, as many as fit, from the oldest */
+	for(keep = 0; keep < nfound
+		&& len + result_len(found[keep]->frame) < outlen; keep++) {
+		len += result_len(found[keep]->frame);
+	}
+	len = 0;
+	for(int i = nfound - 1; i >= 0; i--) {
+		if(i < keep) len += format_result(found[i]->frame, &out[len]);
+		msgbuf_unref(found[i]);
+	}
+	out[len] = '\0';
+	return len;
+}
+
+/**
+ * @brief Returns the number of messages indexed since the start.
+ */
+unsigned long search_indexed(void) {
+	return atomic_load_explicit(&indexed, memory_order_relaxed);
+}
+
+/**
+ * @brief Returns the memory allocated for the index.
+ *
+ * @param terms
+ * If not \c NULL, set to the number of terms indexed.
+ * @param postings
+ * If not \c NULL, set to the number of locations in the posting lists.
+ *
+ * @return The number of bytes allocated for the terms, their posting lists
+ * and their table.
+ */
+size_t search_footprint(size_t *terms, size_t *postings) {
+	size_t bytes, count = 0;
+	pthread_rwlock_rdlock(&index_lock);
+	bytes = slots * sizeof(struct SearchTerm *)
+		+ used * sizeof(struct SearchTerm);
+	for(size_t i = 0; i < slots; i++) {
+		if(table[i] == NULL) continue;
+		bytes += table[i]->cap
+			+ table[i]->blockcap * sizeof(struct SearchBlock);
+		count += table[i]->count;
+	}
+	if(terms != NULL) *terms = used;
+	pthread_rwlock_unlock(&index_lock);
+	if(postings != NULL) *postings = count;
+	return bytes;
+}
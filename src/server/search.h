@@ -0,0 +1,91 @@
+/**
+ * @file search.h
+ * @brief Inverted index of the messages kept in the history.
+ *
+ * A background thread scans the frames appended to the history and adds
+ * their location to the posting list of every term of the message. The
+ * locations of a posting list are increasing, so they are stored as the
+ * varint encoded differences between one and the previous, in blocks of
+ * \c SEARCHBLOCK locations starting with a whole one. The first location of
+ * every block is kept aside, so a query walks the lists from the newest
+ * message backwards and stops as soon as it has found enough, without
+ * decoding the older blocks. The blocks of the segments dropped from the
+ * history are trimmed as they go.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+/* Standard libraries */
+#include <stddef.h>
+
+/** Maximum length of a term, including the termination, the longer terms
+are truncated */
+#define SEARCHTERMLEN 24
+/** Locations of a block of a posting list, a query decodes a block at once */
+#define SEARCHBLOCK 128
+/** Maximum number of terms of a query */
+#define SEARCHQUERYTERMS 8
+/** Maximum number of messages returned by a query, the latest ones */
+#define SEARCHRESULTS 20
+/** Interval between two scans of the history, in milliseconds */
+#define SEARCHINDEXMS 10
+/** Maximum number of frames indexed at once, the queries wait for them */
+#define SEARCHBATCH 4096
+/** Initial number of slots of the table of the terms, a power of two */
+#define SEARCHMINSLOTS 1024
+
+/**
+ * @brief Start the thread indexing the history, which must be open. The
+ * thread is stopped at the exit.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+int search_start(void);
+
+/**
+ * @brief Stop the thread indexing the history.
+ */
+void search_stop(void);
+
+/**
+ * @brief Search the messages containing every term of a query.
+ *
+ * @param query
+ * Terms searched, separated by any character other than a letter or a digit.
+ * The case is ignored.
+ * @param out
+ * Buffer that will contain the latest messages found, one "alias\tmessage"
+ * per line from the oldest to the newest, followed by a termination.
+ * @param outlen
+ * Size of \c out, the oldest messages that do not fit are left out.
+ *
+ * @return The number of characters written, the termination excluded.
+ */
+size_t search_query(const char *query, char *out, size_t outlen);
+
+/**
+ * @brief Returns the number of messages indexed since the start.
+ */
+unsigned long search_indexed(void);
+
+/**
+ * @brief Returns the memory allocated for the index.
+ *
+ * @param terms
+ * If not \c NULL, set to the number of terms indexed.
+ * @param postings
+ * If not \c NULL, set to the number of locations in the posting lists.
+ *
+ * @return The number of bytes allocated for the terms, their posting lists
+ * and their table.
+ */
+size_t search_footprint(size_t *terms, size_t *postings);
+
+#endif
@@ -17,6 +17,33 @@
 /* Implementation of a list containing the client's informations */
 #include "clientlist.h"
 
+/* Reactor handling the connections */
+#include "eventloop.h"
+
+/* Frames encoded once and shared by many connections */
+#include "msgbuf.h"
+
+/* Lock-free reads of the client list */
+#include "epoch.h"
+
+/* Asynchronous logging */
+#include "log.h"
+
+/* Counters and latency histograms */
+#include "stats.h"
+
+/* Sampled tracing of the messages */
+#include "trace.h"
+
+/* Persistent history of the messages shouted */
+#include "history.h"
+
+/* Whispers waiting for their recipients */
+#include "mailbox.h"
+
+/* Inverted index of the messages kept in the history */
+#include "search.h"
+
 /* Standard libraries */
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,6 +51,7 @@
 #include <errno.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
 
 /* Networking libraries */
 #include <sys/types.h>
@@ -32,19 +60,20 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <signal.h>
 
 /* Thread library */
 #include <pthread.h>
 
 /**
- * Socket listening for incoming connections.
+ * Sockets listening for incoming connections, one for every shard.
  */
-static int sockfd;
+static int listenfds[MAXSHARDS];
 /**
- * Socket to perform actions.
+ * Number of shards.
  */
-int connectfd;
+static int nshards;
 /**
  * Structure used to set the preferencies for servinfo.
  */
@@ -61,6 +90,27 @@ struct LinkedList client_list;
  * Mutual exclusion variable preventing concurrent edits to the client list.
  */
 pthread_mutex_t clientlist_mutex;
+/**
+ * Event loops handling the connections, one for every shard.
+ */
+static struct EventLoop loops[MAXSHARDS];
+/**
+ * Seconds between two periodic dumps of the statistics, \c 0 if disabled.
+ */
+static int stats_interval;
+/**
+ * Number of messages of the history replayed to the clients connecting.
+ */
+static int replay_count = HISTREPLAY;
+/**
+ * Milliseconds after which a silent client is disconnected, \c 0 if never.
+ */
+static int idle_ms = IDLETIMEOUT * 1000;
+/**
+ * Milliseconds a new client has to send its first packet, \c 0 if
+ * unlimited.
+ */
+static int handshake_ms = HANDSHAKETIMEOUT * 1000;
 
 /**
  * @brief Display the available commands.
@@ -69,6 +119,29 @@ pthread_mutex_t clientlist_mutex;
  */
 int displayhelp();
 
+/**
+ * @brief Print the statistics of the server, added up over the shards.
+ *
+ * The rates are computed over the interval since the previous report.
+ */
+static void print_stats(void);
+
+/**
+ * @brief Routine that prints the statistics every \c stats_interval seconds.
+ *
+ * @param param Pointer to a structure containing execution parameters
+ * (currently unused, it can be safely set as \c NULL pointer).
+ *
+ * @return Always a \c NULL pointer.
+ */
+static void *stats_dumper(void *param);
+
+/**
+ * @brief Acquire the lock of the client list, counting the time waited for
+ * it.
+ */
+static void lock_clientlist(void);
+
 /**
  * @brief Routine that listens for server's commands.
  *
@@ -80,20 +153,206 @@ int displayhelp();
 void *server_handler(void *param);
 
 /**
- * @brief Routine that handles the connection with a client.
+ * @brief Open a socket listening on the server's port, shared with the
+ * listeners of the other shards.
  *
- * @param info Pointer to the \c ClientInfo structure relative to the connection
- * that has to be handled.
+ * @return The socket file descriptor, \c -1 if an error occurred.
+ */
+static int open_listener(void);
+
+/**
+ * @brief Returns the shard owning a client, the partition of the members of
+ * the rooms.
  *
- * @return Always a \c NULL pointer.
+ * @param cl_info Pointer to the \c ClientInfo struct of a connection.
  */
-void *client_handler(void *info);
+static int owner_shard(const struct ClientInfo *cl_info) {
+	return ((const struct Connection *)cl_info)->loop->index;
+}
+
+/**
+ * @brief Register a newly accepted connection.
+ *
+ * @param conn Pointer to the new connection.
+ * @param addr Address of the client.
+ *
+ * @return \c 0 if successful, \c -1 if the connection has to be refused.
+ */
+static int client_accept(struct Connection *conn, struct sockaddr_storage *addr);
+
+/**
+ * @brief Handle a packet received from a client.
+ *
+ * @param conn Pointer to the connection the packet has been received from.
+ * @param packet Pointer to the received packet.
+ *
+ * @return \c 0 if successful, \c -1 if the connection has to be closed.
+ */
+static int client_handler(struct Connection *conn, struct Packet *packet);
+
+/**
+ * @brief Unregister a connection that is being closed.
+ *
+ * @param conn Pointer to the connection.
+ */
+static void client_close(struct Connection *conn);
+
+/**
+ * @brief Publish the changes made to the client list.
+ *
+ * @return The number of milliseconds after which the changes not published
+ * yet have to be, \c -1 if every change has been published.
+ */
+static int client_batch(void);
+
+/**
+ * @brief Check the timeouts of a connection whose timer has expired.
+ *
+ * A client idle for a third of the idle timeout is sent a PING, so that it
+ * answers before being disconnected.
+ *
+ * @param conn Pointer to the connection.
+ *
+ * @return The number of milliseconds after which the timeouts have to be
+ * checked again, \c 0 if never, \c -1 if the connection has to be closed.
+ */
+static int client_timer(struct Connection *conn);
+
+/**
+ * Callbacks invoked by the event loops.
+ */
+static const struct LoopHandlers handlers = {
+	.on_accept = client_accept,
+	.on_packet = client_handler,
+	.on_close = client_close,
+	.on_batch = client_batch,
+	.on_timer = client_timer
+};
 
 int main(int argc, char *argv[]) {
+	/* one shard per CPU online, unless specified otherwise */
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nshards = ncpus > 0 ? (ncpus < MAXSHARDS ? ncpus : MAXSHARDS)
+		: DEFAULTSHARDS;
+	/* the portable backend, unless another one is chosen */
+	const struct LoopBackend *backend = &epoll_backend;
+	int pin = 0, opt;
+	/* the history is only kept if a directory is given */
+	const char *history_dir = NULL;
+	int history_segments = HISTSEGMENTS, history_age = 0;
+	/* the output queues of the slow consumers are bounded */
+	long out_bytes = OUTQUEUEBYTES, out_messages = OUTQUEUELEN;
+	int slow_policy = SLOWDROPNEWEST, slow_grace = SLOWGRACEMS;
+	while ((opt = getopt(argc, argv, "s:cb:l:S:t:H:r:k:a:q:B:M:w:g:i:h:"))
+		!= -1) {
+		switch (opt) {
+			case 's' : nshards = atoi(optarg); break;
+			case 'c' : pin = 1; break;
+			case 'b' :
+				if ((backend = eventloop_backend(optarg)) == NULL) {
+					fprintf(stderr, "server: unknown backend %s\n", optarg);
+					return -1;
+				}
+				break;
+			case 'l' :
+				if ((log_level = log_parse_level(optarg)) == -1) {
+					fprintf(stderr, "server: unknown log level %s\n", optarg);
+					return -1;
+				}
+				break;
+			case 'S' : stats_interval = atoi(optarg); break;
+			case 't' : atomic_store(&trace_rate, atoi(optarg)); break;
+			case 'H' : history_dir = optarg; break;
+			case 'r' : replay_count = atoi(optarg); break;
+			case 'k' : history_segments = atoi(optarg); break;
+			case 'a' : history_age = atoi(optarg); break;
+			case 'q' : mailbox_init(optarg); break;
+			case 'B' : out_bytes = atol(optarg); break;
+			case 'M' : out_messages = atol(optarg); break;
+			case 'w' :
+				if ((slow_policy = conn_parse_policy(optarg)) == -1) {
+					fprintf(stderr, "server: unknown policy %s\n", optarg);
+					return -1;
+				}
+				break;
+			case 'g' : slow_grace = atoi(optarg); break;
+			case 'i' : idle_ms = atoi(optarg) * 1000; break;
+			case 'h' : handshake_ms = atoi(optarg) * 1000; break;
+			default :
+				fprintf(stderr, "usage: %s [-s shards] [-c] "
+					"[-b epoll|io_uring] [-l debug|info|warn|error] "
+					"[-S seconds] [-t reads per trace] [-H history directory "
+					"[-r messages replayed] [-k segments kept] "
+					"[-a maximum age in seconds]] [-q mailbox directory] "
+					"[-B bytes queued] [-M messages queued] "
+					"[-w drop-newest|drop-oldest|disconnect "
+					"[-g grace in milliseconds]] [-i idle seconds] "
+					"[-h handshake seconds]\n", argv[0]);
+				return -1;
+		}
+	}
+	if (nshards < 1 || nshards > MAXSHARDS) {
+		fprintf(stderr, "server: the shards must be between 1 and %d\n",
+			MAXSHARDS);
+		return -1;
+	}
+
+	/* the messages of the event loops are written by a background thread */
+	if (log_start() == -1) {
+		fprintf(stderr, "server: cannot start the log writer\n");
+		return -1;
+	}
+
+	if (out_bytes < 1 || out_messages < 1 || out_messages > OUTQUEUELEN
+		|| slow_grace < 0) {
+		fprintf(stderr, "server: the messages queued must be between 1 and "
+			"%d, the bytes and the grace positive\n", OUTQUEUELEN);
+		return -1;
+	}
+	conn_set_limits(out_bytes, out_messages, slow_policy, slow_grace);
+
+	if (idle_ms < 0 || handshake_ms < 0) {
+		fprintf(stderr, "server: the timeouts cannot be negative\n");
+		return -1;
+	}
+
+	if (replay_count < 0 || replay_count > HISTRECENT) {
+		fprintf(stderr, "server: the messages replayed must be between 0 "
+			"and %d\n", HISTRECENT);
+		return -1;
+	}
+	/* load the messages shouted before the restart */
+	if (history_dir != NULL && history_open(history_dir, history_segments,
+		history_age) == -1) {
+		fprintf(stderr, "server: cannot open the history in %s: %s\n",
+			history_dir, strerror(errno));
+		return -1;
+	}
+	/* the messages kept are indexed in the background */
+	if (history_dir != NULL && search_start() == -1) {
+		fprintf(stderr, "server: cannot start the search indexer: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
 	/* initialize client list */
 	list_init(&client_list);
+	/* the members of the rooms are grouped by the shard owning them */
+	list_set_partitions(&client_list, nshards, owner_shard);
 	/* initiate mutex */
 	pthread_mutex_init(&clientlist_mutex, NULL);
+	/* a write to a closed connection must fail with EPIPE instead of
+	terminating the server */
+	signal(SIGPIPE, SIG_IGN);
+	/* every client needs a file descriptor, use as many as allowed */
+	struct rlimit fdlimit;
+	if (getrlimit(RLIMIT_NOFILE, &fdlimit) == 0
+		&& fdlimit.rlim_cur < fdlimit.rlim_max) {
+		fdlimit.rlim_cur = fdlimit.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &fdlimit) == -1) {
+			perror("server: setrlimit");
+		}
+	}
 
 	/* initiate thread for server controlling */
 	printf("Starting admin interface...\n");
@@ -102,11 +361,51 @@ int main(int argc, char *argv[]) {
 		perror("server: interface creation");
 		return -1;
 	}
+	/* initiate thread for periodic statistics, if requested */
+	if (stats_interval > 0) {
+		pthread_t dumper;
+		if (pthread_create(&dumper, NULL, stats_dumper, NULL) != 0) {
+			perror("server: statistics dumper creation");
+			return -1;
+		}
+	}
+
+	/*******************************
+	 * Set up the listener sockets *
+	 *******************************/
+
+	/* every shard accepts its own connections, the kernel spreads them among
+	the listeners bound to the port */
+	for (int i = 0; i < nshards; i++) {
+		if ((listenfds[i] = open_listener()) == -1) {
+			return -1;
+		}
+	}
+	printf("Waiting for connections on %d shard%s (%s)...\n", nshards,
+		nshards > 1 ? "s" : "", backend->name);
+
+	/************************
+	 * Connections handling *
+	 ************************/
+	if (eventloop_start(loops, nshards, listenfds, &handlers, backend,
+		pin) == -1) {
+		return -1;
+	}
+	for (int i = 0; i < nshards; i++) {
+		pthread_join(loops[i].thread_ID, NULL);
+	}
 
-	/******************************
-	 * Set up the listener socket *
-	 ******************************/
+	return 0;
+}
 
+/**
+ * @brief Open a socket listening on the server's port, shared with the
+ * listeners of the other shards.
+ *
+ * @return The socket file descriptor, \c -1 if an error occurred.
+ */
+static int open_listener(void) {
+	int sockfd = -1;
 	memset(&hints, 0, sizeof hints);	// make sure the struct is empty
 	hints.ai_family = AF_UNSPEC;		// use either IPv4 or IPv6
 	hints.ai_socktype = SOCK_STREAM;	// use TCP protocol for data
@@ -131,11 +430,16 @@ int main(int argc, char *argv[]) {
 			iteraction */
 			continue;
 		}
-		/* allow other sockets to bind this port when not listening */
+		/* allow other sockets to bind this port when not listening, and the
+		listeners of the other shards to bind it at the same time */
 		int yes = 1;
 		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))
-		 	== -1) {
+		 	== -1
+			|| setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int))
+			== -1) {
 			perror("server: setsockopt");
+			close(sockfd);
+			freeaddrinfo(servinfo);
 			return -1;
 		}
 		/* bind the socket to the address */
@@ -160,60 +464,16 @@ int main(int argc, char *argv[]) {
 	/* start listening */
 	if (listen(sockfd, BACKLOG) == -1) {
 		perror("server: listen");
+		close(sockfd);
 		return -1;
 	}
-	printf("Waiting for connections...\n");
-
-	/************************
-	 * Connections handling *
-	 ************************/
-	/* connector's address information */
-	struct sockaddr_storage client_addr;
-	/* dimension of the connector's sockaddr structure */
-	socklen_t sin_size;
-	/* temporary file descriptor for the incoming connections */
-	int new_fd = -1;
-
-	while(1) {  // main accept() loop
-		/* block the server till a pending connection request is present,
-		then accept it */
-		sin_size = sizeof client_addr;
-		new_fd = accept(sockfd, (struct sockaddr *)&client_addr, &sin_size);
-
-		/* if an error occours, print an error and go on with the next
-		iteration */
-		if (new_fd == -1) {
-			perror("server: accept");
-			continue;
-		}
-
-		/* convert the client address to a printable format, then print a
-		message */
-		char s[INET6_ADDRSTRLEN];
-		inet_ntop(client_addr.ss_family,
-			get_in_addr((struct sockaddr *)&client_addr), s, sizeof s);
-		printf("Got connection from %s\n", s);
-
-		/* Set the client data */
-		struct  ClientInfo client_info;
-		client_info.sockfd = new_fd;
-		strcpy(client_info.alias, DEFAULTALIAS);
-
-		/* Add the new client to the client list */
-		pthread_mutex_lock(&clientlist_mutex);
-		list_insert(&client_list, &client_info);
-		pthread_mutex_unlock(&clientlist_mutex);
-
-		/* Create a thread to handle the new client */
-		pthread_create(
-			&client_info.thread_ID,
-			NULL,
-			client_handler,
-			(void *)&client_info
-		);
+	/* the event loops accept the connections without blocking */
+	if (set_nonblocking(sockfd) == -1) {
+		perror("server: fcntl");
+		close(sockfd);
+		return -1;
 	}
-
-	return 0;
+	return sockfd;
 }
 
 /**
@@ -251,15 +511,61 @@ void *server_handler(void *param) {
 		if(!strcmp(command, "/exit") || !strcmp(command, "/quit")) {
 			printf("Terminating server...\n");
 			pthread_mutex_destroy(&clientlist_mutex); // delete the mutex
-			close(sockfd); // close the listening socket
+			for (int i = 0; i < nshards; i++) {
+				close(listenfds[i]); // close the listening sockets
+			}
 			exit(0);
 		}
 		/* Print a dump of the current client list */
 		else if(!strcmp(command, "/list")) {
-			pthread_mutex_lock(&clientlist_mutex);
+			lock_clientlist();
 			list_dump(&client_list);
 			pthread_mutex_unlock(&clientlist_mutex);
 		}
+		/* Print the memory used by the connection records */
+		else if(!strcmp(command, "/mem")) {
+			size_t conns, nodes;
+			size_t conn_bytes = conn_footprint(&conns);
+			size_t node_bytes = slab_footprint(&client_list.nodes, &nodes);
+			printf("Connection records: %zu in use, %zu KiB allocated\n",
+				conns, conn_bytes / 1024);
+			printf("Client list nodes: %zu in use, %zu KiB allocated\n",
+				nodes, node_bytes / 1024);
+			size_t mail, spilled;
+			size_t mail_bytes = mailbox_footprint(&mail, &spilled);
+			printf("Mailboxes: %zu messages waiting, %zu KiB allocated, "
+				"%zu KiB spilled\n", mail, mail_bytes / 1024, spilled / 1024);
+			size_t terms, postings;
+			size_t search_bytes = search_footprint(&terms, &postings);
+			printf("Search index: %lu messages indexed, %zu terms, "
+				"%zu postings, %zu KiB allocated\n", search_indexed(), terms,
+				postings, search_bytes / 1024);
+		}
+		/* Print the counters and the latencies of the server */
+		else if(!strcmp(command, "/stats")) {
+			print_stats();
+		}
+		/* Change the sampling rate of the traces */
+		else if(!strcmp(command, "/sample")) {
+			int rate;
+			if (scanf("%d", &rate) != 1 || rate < 0) {
+				fprintf(stderr, "Usage: /sample <reads per trace, 0 to "
+					"disable>\n");
+				continue;
+			}
+			atomic_store(&trace_rate, rate);
+			printf("Tracing %s\n", rate > 0 ? "enabled" : "disabled");
+		}
+		/* Write the latest traces */
+		else if(!strcmp(command, "/trace")) {
+			long spans = trace_dump(TRACEFILE);
+			if (spans == -1) {
+				perror("server: trace_dump");
+			}
+			else {
+				printf("%ld spans written to %s\n", spans, TRACEFILE);
+			}
+		}
 		/* Print an help text */
 		else if(!strcmp(command, "/help")) {
 			displayhelp();
@@ -272,160 +578,773 @@ void *server_handler(void *param) {
 }
 
 /**
- * @brief Routine that handles the connection with a client.
+ * @brief Returns the rate of a counter over an interval.
+ *
+ * @param now Current value of the counter.
+ * @param before Value of the counter at the beginning of the interval.
+ * @param seconds Length of the interval, \c 0 if there is no interval.
+ *
+ * @return The increment per second, \c 0 if there is no interval.
+ */
+static double rate(unsigned long now, unsigned long before, double seconds) {
+	return seconds > 0 ? (now - before) / seconds : 0.0;
+}
+
+/**
+ * @brief Print the statistics of the server, added up over the shards.
+ *
+ * The rates are computed over the interval since the previous report.
+ */
+static void print_stats(void) {
+	static const char *actions[STATSACTIONS + 1] = { "EXIT", "ALIAS", "MSG",
+		"WHISPER", "SHOUT", "LIST_Q", "LIST_A", "UNF", "AIU", "SEARCH_Q",
+		"SEARCH_A", "JOIN", "PART", "PING", "PONG", "SESSION", "MULTICAST",
+		"other" };
+	/* the reports of the console and of the dumper must not interleave */
+	static pthread_mutex_t report_mutex = PTHREAD_MUTEX_INITIALIZER;
+	static struct Stats total, last;
+	static uint64_t last_time;
+	uint64_t now;
+	double seconds;
+	unsigned long in = 0, out = 0, depth;
+
+	pthread_mutex_lock(&report_mutex);
+	last = total;
+	stats_init(&total);
+	for (int i = 0; i < nshards; i++) {
+		stats_merge(&total, &loops[i].stats);
+	}
+	stats_merge(&total, stats_shared());
+	now = stats_now();
+	seconds = last_time > 0 ? (now - last_time) / 1e9 : 0.0;
+	last_time = now;
+
+	flockfile(stdout);
+	printf("Connections: %lu open, %lu accepted (%.1f/s), %lu closed "
+		"(%lu timed out)\n", total.accepts - total.closes, total.accepts,
+		rate(total.accepts, last.accepts, seconds), total.closes,
+		total.timeouts);
+	printf("Packets in:");
+	for (int i = 0; i <= STATSACTIONS; i++) {
+		printf(" %s %lu", actions[i], total.packets_in[i]);
+		in += total.packets_in[i] - last.packets_in[i];
+	}
+	printf(" (%.1f/s)\nPackets out:", seconds > 0 ? in / seconds : 0.0);
+	for (int i = 0; i <= STATSACTIONS; i++) {
+		printf(" %s %lu", actions[i], total.packets_out[i]);
+		out += total.packets_out[i] - last.packets_out[i];
+	}
+	printf(" (%.1f/s)\n", seconds > 0 ? out / seconds : 0.0);
+	printf("Bytes: %lu in (%.1f KiB/s), %lu out (%.1f KiB/s)\n",
+		total.bytes_in, rate(total.bytes_in, last.bytes_in, seconds) / 1024,
+		total.bytes_out, rate(total.bytes_out, last.bytes_out, seconds) / 1024);
+	/* a message leaves its queue when written or when its connection closes */
+	printf("Output queues: %lu messages waiting (",
+		total.queued - total.written - total.discarded - total.dropped);
+	for (int i = 0; i < nshards; i++) {
+		depth = loops[i].stats.queued - loops[i].stats.written
+			- loops[i].stats.discarded - loops[i].stats.dropped;
+		printf("%sshard %d: %lu", i > 0 ? ", " : "", i, depth);
+	}
+	printf("), %lu discarded, %lu refused\n", total.discarded, total.refused);
+	/* the oldest messages of a slow consumer are dropped, or the newest
+	refused, until it reads again or is disconnected */
+	printf("Slow consumers: %lu stalls, %lu messages dropped, "
+		"%lu disconnected\n", total.stalls, total.dropped, total.evicted);
+	printf("Client list lock: %lu acquisitions, %lu contended, "
+		"%.3f ms waited\n", total.lock_acquired, total.lock_contended,
+		total.lock_wait / 1e6);
+	stats_print_histogram(stdout, "Receive to handled", &total.dispatch);
+	stats_print_histogram(stdout, "Queued to written", &total.send);
+	printf("Log records dropped: %lu\n", log_dropped());
+	fflush(stdout);
+	funlockfile(stdout);
+	pthread_mutex_unlock(&report_mutex);
+}
+
+/**
+ * @brief Routine that prints the statistics every \c stats_interval seconds.
  *
- * @param info Pointer to the \c ClientInfo structure relative to the connection
- * that has to be handled.
+ * @param param Pointer to a structure containing execution parameters
+ * (currently unused, it can be safely set as \c NULL pointer).
  *
  * @return Always a \c NULL pointer.
  */
-void *client_handler(void *info) {
-	struct ClientInfo client_info = *(struct ClientInfo *)info;
-	struct Packet packet;
-	struct LLNode *curr;
-	while(1) {
-		/* Receive a packet of data from the client */
-		if(!recv(client_info.sockfd, (void *)&packet, sizeof(struct Packet),
-			0)) {
-			/* Connection with the client lost */
-			fprintf(stderr, "Connection lost from [%d] %s\n",
-				client_info.sockfd, client_info.alias);
-			/* Remove the client from the client list */
-			pthread_mutex_lock(&clientlist_mutex);
-			/* remove the client from the linked list */
-			list_delete(&client_list, &client_info);
+static void *stats_dumper(void *param) {
+	(void)param;
+	while (1) {
+		sleep(stats_interval);
+		print_stats();
+	}
+	return NULL;
+}
+
+/**
+ * @brief Acquire the lock of the client list, counting the time waited for
+ * it.
+ */
+static void lock_clientlist(void) {
+	struct Stats *stats = stats_current();
+	uint64_t start = trace_begin();
+	stats_add(&stats->lock_acquired, 1);
+	/* the clock is only read when the lock is contended or traced */
+	if (pthread_mutex_trylock(&clientlist_mutex) == 0) {
+		trace_end("lock", start);
+		return;
+	}
+	if (start == 0) start = stats_now();
+	pthread_mutex_lock(&clientlist_mutex);
+	stats_add(&stats->lock_contended, 1);
+	stats_add(&stats->lock_wait, stats_now() - start);
+	trace_end("lock", start);
+}
+
+/**
+ * @brief Register a newly accepted connection.
+ *
+ * @param conn Pointer to the new connection.
+ * @param addr Address of the client.
+ *
+ * @return \c 0 if successful, \c -1 if the connection has to be refused.
+ */
+static int client_accept(struct Connection *conn, struct sockaddr_storage *addr) {
+	/* convert the client address to a printable format, then print a
+	message */
+	char s[INET6_ADDRSTRLEN];
+	inet_ntop(addr->ss_family, get_in_addr((struct sockaddr *)addr), s,
+		sizeof s);
+	LOG(LOGINFO, "Got connection from %s\n", s);
+
+	/* Add the new client to the client list */
+	lock_clientlist();
+	int ret = list_insert(&client_list, &conn->client_info);
+	pthread_mutex_unlock(&clientlist_mutex);
+	if (ret == -1) {
+		LOG(LOGERROR, "server: out of memory, connection refused\n");
+		return ret;
+	}
+
+	/* The client addresses the others by the ID of their session as well */
+	char id[12];
+	struct Packet session_packet;
+	memset(&session_packet, 0, sizeof(struct Packet));
+	session_packet.action = SESSION;
+	session_packet.payload = id;
+	session_packet.len = sprintf(id, "%u", conn->client_info.id);
+	if (conn_send_packet(conn, &session_packet) == -1) {
+		LOG(LOGWARN, "server: send: %m\n");
+	}
+
+	/* Without a handshake timeout, the client is idle since it connected */
+	if (handshake_ms > 0) {
+		eventloop_set_timer(conn->loop, conn, handshake_ms);
+	}
+	else if (idle_ms > 0) {
+		conn->last_active = eventloop_now();
+		eventloop_set_timer(conn->loop, conn, idle_ms / 3);
+	}
+
+	/* Replay the latest messages shouted, straight from the history */
+	struct MsgBuf *views[HISTMAXSEGMENTS];
+	int nviews = history_last(replay_count, views);
+	for (int i = 0; i < nviews; i++) {
+		if (conn_queue(conn, views[i]) == -1) {
+			LOG(LOGWARN, "server: send: %m\n");
+		}
+	}
+	return ret;
+}
+
+/**
+ * @brief Unregister a connection that is being closed.
+ *
+ * @param conn Pointer to the connection.
+ */
+static void client_close(struct Connection *conn) {
+	LOG(LOGINFO, "Connection closed with [%d] %s\n",
+		conn->client_info.sockfd, conn->client_info.alias);
+	/* Remove the client from the client list, after this no other thread can
+	reach the connection */
+	lock_clientlist();
+	list_delete(&client_list, &conn->client_info);
+	pthread_mutex_unlock(&clientlist_mutex);
+}
+
+/**
+ * @brief Publish the changes made to the client list.
+ *
+ * @return The number of milliseconds after which the changes not published
+ * yet have to be, \c -1 if every change has been published.
+ */
+static int client_batch(void) {
+	static struct timespec last_publish;
+	struct timespec now;
+	long elapsed;
+	if (!atomic_load(&client_list.dirty)) return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	lock_clientlist();
+	/* a single change is published at once, a burst of joins and leaves is
+	coalesced in a snapshot every PUBLISHMS milliseconds */
+	elapsed = (now.tv_sec - last_publish.tv_sec) * 1000
+		+ (now.tv_nsec - last_publish.tv_nsec) / 1000000;
+	if (atomic_load(&client_list.dirty) && elapsed < PUBLISHMS) {
+		pthread_mutex_unlock(&clientlist_mutex);
+		return PUBLISHMS - elapsed;
+	}
+	list_publish(&client_list);
+	last_publish = now;
+	pthread_mutex_unlock(&clientlist_mutex);
+	return -1;
+}
+
+/**
+ * @brief Check the timeouts of a connection whose timer has expired.
+ *
+ * A client idle for a third of the idle timeout is sent a PING, so that it
+ * answers before being disconnected.
+ *
+ * @param conn Pointer to the connection.
+ *
+ * @return The number of milliseconds after which the timeouts have to be
+ * checked again, \c 0 if never, \c -1 if the connection has to be closed.
+ */
+static int client_timer(struct Connection *conn) {
+	int heartbeat = idle_ms / 3;
+	uint64_t idle, left;
+	/* the timer set when the client connected has expired first */
+	if (conn->last_active == 0) {
+		LOG(LOGINFO, "Handshake timeout of [%d]\n", conn->client_info.sockfd);
+		stats_add(&conn->loop->stats.timeouts, 1);
+		return -1;
+	}
+	if (idle_ms == 0) return 0;
+	idle = eventloop_now() - conn->last_active;
+	if (idle >= (uint64_t)idle_ms) {
+		LOG(LOGINFO, "Idle timeout of [%d] %s\n", conn->client_info.sockfd,
+			conn->client_info.alias);
+		stats_add(&conn->loop->stats.timeouts, 1);
+		return -1;
+	}
+	if (idle < (uint64_t)heartbeat) return (int)((uint64_t)heartbeat - idle);
+	/* the answer, or any other packet, moves the next check forward */
+	struct Packet ping;
+	memset(&ping, 0, sizeof(struct Packet));
+	ping.action = PING;
+	if (conn_send_packet(conn, &ping) == -1 && errno != EPIPE
+		&& errno != ENOBUFS) {
+		LOG(LOGWARN, "server: send: %m\n");
+	}
+	left = (uint64_t)idle_ms - idle;
+	return left < (uint64_t)heartbeat ? (int)left : heartbeat;
+}
+
+/**
+ * @brief Handle a packet received from a client.
+ *
+ * @param conn Pointer to the connection the packet has been received from.
+ * @param packet Pointer to the received packet.
+ *
+ * @return \c 0 if successful, \c -1 if the connection has to be closed.
+ */
+static int client_handler(struct Connection *conn, struct Packet *packet) {
+	struct ClientInfo *client_info = &conn->client_info;
+	uint64_t start;
+	LOG(LOGDEBUG, "Packet received:[%d] action_code=%d | %s | %s\n",
+		client_info->sockfd, packet->action, packet->alias, packet->payload);
+	switch (packet->action) {
+		/* Change the client's alias */
+		case ALIAS :
+			LOG(LOGINFO,
+				"User #%d is changing his alias from '%s' to '%s'\n",
+				client_info->sockfd, client_info->alias, packet->alias);
+			lock_clientlist();
+			start = trace_begin();
+			int taken = list_set_alias(&client_list, client_info,
+				packet->alias);
+			trace_end("lookup", start);
 			pthread_mutex_unlock(&clientlist_mutex);
+			/* The alias gets a mailbox, and the whispers sent to it while
+			nobody used it are delivered in a single batch. A full output
+			queue refuses them, they are then kept for the next client
+			taking the alias */
+			if (taken == 0) {
+				size_t waiting;
+				struct MsgBuf *mail;
+				if (mailbox_register(client_info->alias) == -1) {
+					LOG(LOGWARN, "server: mailbox of %s: %m\n",
+						client_info->alias);
+				}
+				if ((mail = mailbox_take(client_info->alias, &waiting))
+					!= NULL) {
+					LOG(LOGINFO, "Delivering %zu messages waiting for %s\n",
+						waiting, client_info->alias);
+					if (conn_queue(conn, msgbuf_ref(mail)) == -1) {
+						LOG(LOGWARN, "server: send: %m\n");
+						if (mailbox_restore(client_info->alias, mail, waiting)
+							== -1) {
+							LOG(LOGERROR, "server: %zu messages for %s lost: "
+								"%m\n", waiting, client_info->alias);
+						}
+					}
+					msgbuf_unref(mail);
+				}
+			}
+			/* If the alias is used by another client, send back an AIU
+			(Alias In Use) packet containing the alias kept */
+			else {
+				struct Packet errpacket;
+				memset(&errpacket, 0, sizeof(struct Packet));
+				errpacket.action = AIU;
+				strcpy(errpacket.alias, packet->alias);
+				errpacket.payload = client_info->alias;
+				errpacket.len = strlen(client_info->alias);
+				if (conn_send_packet(conn, &errpacket) == -1) {
+					LOG(LOGWARN, "server: send: %m\n");
+				}
+			}
 			break;
-		}
-		printf("Packet received:[%d] action_code=%d | %s | %s\n",
-			client_info.sockfd, packet.action, packet.alias, packet.payload);
-		switch (packet.action) {
-			/* Change the client's alias */
-			case ALIAS :
-				printf("User #%d is changing his alias from '%s' to '%s'\n",
-					client_info.sockfd, client_info.alias, packet.alias);
-				pthread_mutex_lock(&clientlist_mutex);
-				/* Search the client in the list and edit his alias */
-				for(curr = client_list.head; curr != NULL; curr = curr->next) {
-					if(compare(&curr->client_info, &client_info) == 0) {
-						strcpy(curr->client_info.alias, packet.alias);
-						strcpy(client_info.alias, packet.alias);
+		/* Send a message to a specific client */
+		case WHISPER : ; // empty statement necessary to compile
+			/* Acquire the target client */
+			char target[ALIASLEN];
+			int i;
+			for(i = 0; i < packet->len && packet->payload[i] != ' '
+				&& i < ALIASLEN - 1; i++);
+			/* replace the space after the target's alias with a
+			termination */
+			if(i < packet->len) {
+				packet->payload[i++] = '\0';
+			}
+			memcpy(target, packet->payload, i);
+			target[i < ALIASLEN ? i : ALIASLEN - 1] = '\0';
+			/* Build a new packet only containing the message */
+			struct Packet msgpacket;
+			memset(&msgpacket, 0, sizeof(struct Packet));
+			msgpacket.action = MSG;
+			strcpy(msgpacket.alias, client_info->alias);
+			/* the payload of the new packet contains just the message */
+			msgpacket.payload = &packet->payload[i];
+			msgpacket.len = packet->len - i;
+			/* Find the target client in the table of the sessions or in the
+			latest snapshot of the list and send the message, a client
+			cannot whisper to himself */
+			epoch_enter();
+			start = trace_begin();
+			struct ClientInfo *recipient;
+			int by_id = packet->flags & FLAGSESSIONID;
+			if (by_id) {
+				char *end;
+				unsigned long id = strtoul(target, &end, 10);
+				recipient = *end == '\0' && id <= UINT32_MAX
+					? list_find_id(&client_list, id) : NULL;
+			}
+			else {
+				const struct ClientEntry *target_entry = snapshot_find_alias(
+					list_snapshot(&client_list), target);
+				recipient = target_entry != NULL ? target_entry->client_info
+					: NULL;
+			}
+			trace_end("lookup", start);
+			int found = recipient != NULL && recipient != client_info;
+			start = trace_begin();
+			if (found && conn_send_packet((struct Connection *)recipient,
+				&msgpacket) == -1
+				&& errno != EPIPE && errno != ENOBUFS) {
+				LOG(LOGWARN, "server: send: %m\n");
+			}
+			trace_end("fan-out", start);
+			/* A known alias nobody uses keeps the message in its mailbox.
+			The latest list is checked under its lock, so that a client
+			taking the alias meanwhile either is found or finds the message
+			in the mailbox. A closed session has no mailbox */
+			if (!by_id && recipient == NULL
+				&& strcmp(target, client_info->alias)) {
+				lock_clientlist();
+				struct ClientInfo *online = list_find_alias(&client_list,
+					target);
+				if (online != NULL) {
+					found = 1;
+					if (conn_send_packet((struct Connection *)online,
+						&msgpacket) == -1
+						&& errno != EPIPE && errno != ENOBUFS) {
+						LOG(LOGWARN, "server: send: %m\n");
 					}
 				}
+				else if (mailbox_store(target, &msgpacket) == 0) {
+					found = 1;
+				}
+				else if (errno != ENOENT) {
+					LOG(LOGWARN, "server: mailbox of %s: %m\n", target);
+				}
 				pthread_mutex_unlock(&clientlist_mutex);
+			}
+			epoch_exit();
+			/* If the specified user has not been found, send back to the
+			client an UNF (User Not Found) packet */
+			if (!found) {
+				struct Packet errpacket;
+				memset(&errpacket, 0, sizeof(struct Packet));
+				errpacket.action = UNF;
+				/* The alias field contains the client not found */
+				strcpy(errpacket.alias, target);
+				if (conn_send_packet(conn, &errpacket) == -1) {
+					LOG(LOGWARN, "server: send: %m\n");
+				}
+			}
+			break;
+		/* Send a message to a list of clients */
+		case MULTICAST : ;
+			/* Split the recipients, separated by commas and ending at the
+			first space, skipping the empty and the repeated ones */
+			char *mcastnames[MAXRECIPIENTS];
+			int nnames = 0;
+			if (packet->len == 0) break;
+			char *body = &packet->payload[strcspn(packet->payload, " ")];
+			if (*body != '\0') {
+				*body++ = '\0';
+			}
+			char *name = packet->payload;
+			while (*name != '\0' && nnames < MAXRECIPIENTS) {
+				size_t namelen = strcspn(name, ",");
+				char *next = name[namelen] != '\0' ? &name[namelen + 1]
+					: &name[namelen];
+				name[namelen < ALIASLEN ? namelen : ALIASLEN - 1] = '\0';
+				int repeated = namelen == 0;
+				for (int k = 0; !repeated && k < nnames; k++) {
+					repeated = !strcmp(mcastnames[k], name);
+				}
+				if (!repeated) {
+					mcastnames[nnames++] = name;
+				}
+				name = next;
+			}
+			/* name now points to the recipients exceeding MAXRECIPIENTS */
+			struct Packet mcastpacket;
+			memset(&mcastpacket, 0, sizeof(struct Packet));
+			mcastpacket.action = MSG;
+			strcpy(mcastpacket.alias, client_info->alias);
+			mcastpacket.payload = body;
+			mcastpacket.len = packet->len - (body - packet->payload);
+			struct MsgBuf *mcastbuf = msgbuf_encode(&mcastpacket);
+			if (mcastbuf == NULL) {
+				LOG(LOGERROR, "server: malloc: %m\n");
 				break;
-			/* Send a message to a specific client */
-			case WHISPER : ; // empty statement necessary to compile
-				/* Acquire the target client */
-				char target[ALIASLEN];
-				int i;
-				for(i = 0; packet.payload[i] != ' '; i++);
-				/* replace the space after the target's alias with a
-				termination */
-				packet.payload[i++] = '\0';
-				strcpy(target, packet.payload);
-				/* Find the target client and send the message */
-				int found = 0; // 1 if the client has been found
-				pthread_mutex_lock(&clientlist_mutex);
-				for(curr = client_list.head; curr != NULL; curr = curr->next) {
-					if(strcmp(target, curr->client_info.alias) == 0) {
-						/* If the found client is the sender, keep searching */
-						if(!compare(&curr->client_info, &client_info)) {
-							continue;
-						}
-						found = 1;
-						/* Build a new packet only containing the message */
-						struct Packet msgpacket;
-						memset(&msgpacket, 0, sizeof(struct Packet));
-						msgpacket.action = MSG;
-						strcpy(msgpacket.alias, packet.alias);
-						/* the payload of the new packet contains just the
-						message */
-						strcpy(msgpacket.payload, &packet.payload[i]);
-						if (send(curr->client_info.sockfd, (void *)&msgpacket,
-							sizeof(struct Packet), 0) == -1) {
-							perror("server: send");
-						}
+			}
+			/* Resolve every recipient in the table of the sessions or in a
+			single snapshot of the list, a client cannot whisper to
+			himself */
+			struct ClientInfo *mcastto[MAXRECIPIENTS];
+			int reached[MAXRECIPIENTS], misses = 0;
+			struct Fanout mcastfanout;
+			fanout_init(&mcastfanout, mcastbuf);
+			epoch_enter();
+			start = trace_begin();
+			struct ClientSnapshot *mcastsnap = list_snapshot(&client_list);
+			for (int k = 0; k < nnames; k++) {
+				char *end;
+				if (mcastnames[k][0] == '#') {
+					unsigned long id = strtoul(&mcastnames[k][1], &end, 10);
+					mcastto[k] = end != &mcastnames[k][1] && *end == '\0'
+						&& id <= UINT32_MAX
+						? list_find_id(&client_list, id) : NULL;
+				}
+				else {
+					const struct ClientEntry *entry = snapshot_find_alias(
+						mcastsnap, mcastnames[k]);
+					mcastto[k] = entry != NULL ? entry->client_info : NULL;
+				}
+				if (mcastto[k] == client_info) {
+					mcastto[k] = NULL;
+				}
+				reached[k] = mcastto[k] != NULL;
+				misses += !reached[k];
+			}
+			trace_end("lookup", start);
+			/* The known aliases nobody uses keep the message in their
+			mailboxes, they are all checked under a single lock of the
+			list as a whisper does */
+			if (misses > 0) {
+				lock_clientlist();
+				for (int k = 0; k < nnames; k++) {
+					if (reached[k] || mcastnames[k][0] == '#'
+						|| !strcmp(mcastnames[k], client_info->alias)) {
+						continue;
+					}
+					mcastto[k] = list_find_alias(&client_list, mcastnames[k]);
+					if (mcastto[k] != NULL) {
+						reached[k] = 1;
 					}
+					else if (mailbox_store(mcastnames[k], &mcastpacket) == 0) {
+						reached[k] = 1;
+					}
+					else if (errno != ENOENT) {
+						LOG(LOGWARN, "server: mailbox of %s: %m\n",
+							mcastnames[k]);
+					}
+					misses -= reached[k];
 				}
 				pthread_mutex_unlock(&clientlist_mutex);
-				/* If the specified user has not been found, send back to the
-				client an UNF (User Not Found) packet */
-				if (!found) {
-					struct Packet errpacket;
-					memset(&errpacket, 0, sizeof(struct Packet));
-					errpacket.action = UNF;
-					/* The alias field contains the client not found */
-					strcpy(errpacket.alias, target);
-					if (send(client_info.sockfd, (void *)&errpacket,
-						sizeof(struct Packet), 0) == -1) {
-						perror("server: send");
+			}
+			/* The message is queued once for every client, even if named
+			both by alias and by session ID */
+			start = trace_begin();
+			for (int k = 0; k < nnames; k++) {
+				int repeated = mcastto[k] == NULL;
+				for (int j = 0; !repeated && j < k; j++) {
+					repeated = mcastto[j] == mcastto[k];
+				}
+				if (!repeated && fanout_add(&mcastfanout,
+					(struct Connection *)mcastto[k]) == -1
+					&& errno != EPIPE && errno != ENOBUFS) {
+					LOG(LOGWARN, "server: send: %m\n");
+				}
+			}
+			fanout_flush(&mcastfanout);
+			epoch_exit();
+			trace_end("fan-out", start);
+			msgbuf_unref(mcastbuf);
+			/* Send back a single UNF packet listing the recipients not
+			found, one per line */
+			if (misses > 0 || *name != '\0') {
+				size_t size = strlen(name) + 2;
+				for (int k = 0; k < nnames; k++) {
+					if (!reached[k]) size += strlen(mcastnames[k]) + 1;
+				}
+				char *missing = malloc(size);
+				if (missing == NULL) {
+					LOG(LOGERROR, "server: malloc: %m\n");
+					break;
+				}
+				int len = 0;
+				for (int k = 0; k < nnames; k++) {
+					if (!reached[k]) {
+						len += sprintf(&missing[len], "%s\n", mcastnames[k]);
+					}
+				}
+				for (; *name != '\0'; name++) {
+					if (*name != ',') {
+						missing[len++] = *name;
 					}
+					else if (len > 0 && missing[len - 1] != '\n') {
+						missing[len++] = '\n';
+					}
+				}
+				if (len > 0 && missing[len - 1] != '\n') {
+					missing[len++] = '\n';
+				}
+				missing[len] = '\0';
+				struct Packet errpacket;
+				memset(&errpacket, 0, sizeof(struct Packet));
+				errpacket.action = UNF;
+				errpacket.payload = missing;
+				errpacket.len = len;
+				if (conn_send_packet(conn, &errpacket) == -1) {
+					LOG(LOGWARN, "server: send: %m\n");
 				}
+				free(missing);
+			}
+			break;
+		/* Send a message to every client connected */
+		case SHOUT : ;
+			/* Build a new packet containing the message, encoded once and
+			shared by every recipient */
+			struct Packet shoutpacket;
+			memset(&shoutpacket, 0, sizeof(struct Packet));
+			shoutpacket.action = MSG;
+			strcpy(shoutpacket.alias, client_info->alias);
+			shoutpacket.payload = packet->payload;
+			shoutpacket.len = packet->len;
+			struct MsgBuf *shoutbuf = msgbuf_encode(&shoutpacket);
+			if (shoutbuf == NULL) {
+				LOG(LOGERROR, "server: malloc: %m\n");
 				break;
-			/* Send a message to every client connected */
-			case SHOUT :
-				pthread_mutex_lock(&clientlist_mutex);
-				for(curr = client_list.head; curr != NULL; curr = curr->next) {
+			}
+			/* Walk the latest snapshot of the list without locking it, the
+			clients leaving meanwhile refuse the message. The recipients of
+			the other shards get a single delivery for every shard */
+			struct Fanout fanout;
+			fanout_init(&fanout, shoutbuf);
+			start = trace_begin();
+			epoch_enter();
+			/* The message of a member of a room only reaches the other
+			members, walking just their array */
+			struct RoomSnapshot *room_snap = conn->room != NULL
+				? room_snapshot(conn->room) : NULL;
+			if (room_snap != NULL && room_snap->size >= FANOUTPARALLEL) {
+				/* The members of a large room are grouped by shard, so every
+				shard gets the range of its own members and queues them in
+				parallel. The range of this shard is queued last */
+				for (int k = 1; k <= room_snap->nparts; k++) {
+					int p = (conn->loop->index + k) % room_snap->nparts;
+					int first = room_snap->part_start[p];
+					int count = room_snap->part_start[p + 1] - first;
+					if (count == 0) continue;
+					room_snapshot_ref(room_snap);
+					if (fanout_shared(shoutbuf, &loops[p],
+						&room_snap->members[first], count, client_info,
+						room_snapshot_unref, room_snap) == -1) {
+						LOG(LOGWARN, "server: send: %m\n");
+					}
+				}
+			}
+			else if (conn->room != NULL) {
+				for(int i = 0; room_snap != NULL && i < room_snap->size; i++) {
+					if(room_snap->members[i] == client_info) {
+						continue;
+					}
+					if (fanout_add(&fanout,
+						(struct Connection *)room_snap->members[i]) == -1
+						&& errno != EPIPE && errno != ENOBUFS) {
+						LOG(LOGWARN, "server: send: %m\n");
+					}
+				}
+			}
+			else {
+				struct ClientSnapshot *snap = list_snapshot(&client_list);
+				for(int i = 0; snap != NULL && i < snap->size; i++) {
 					/* If the found client is the sender, keep searching */
-					if(!compare(&curr->client_info, &client_info)) {
+					if(snap->entries[i].client_info == client_info) {
 						continue;
 					}
-					/* Build a new packet containing the message and send it */
-					struct Packet msgpacket;
-					memset(&msgpacket, 0, sizeof(struct Packet));
-					msgpacket.action = MSG;
-					strcpy(msgpacket.alias, packet.alias);
-					strcpy(msgpacket.payload, packet.payload);
-					if (send(curr->client_info.sockfd, (void *)&msgpacket,
-						sizeof(struct Packet), 0) == -1) {
-						perror("server: send");
+					if (fanout_add(&fanout,
+						(struct Connection *)snap->entries[i].client_info)
+						== -1
+						&& errno != EPIPE && errno != ENOBUFS) {
+						LOG(LOGWARN, "server: send: %m\n");
 					}
 				}
-				pthread_mutex_unlock(&clientlist_mutex);
-				break;
-			/* Client's list request */
-			case LIST_Q :
-				pthread_mutex_lock(&clientlist_mutex);
-				int size = list_size(&client_list);
-				char **list_str;
-				list_str = list_clients(&client_list);
-				/* Build a new packet containing the list */
+			}
+			fanout_flush(&fanout);
+			epoch_exit();
+			trace_end("fan-out", start);
+			/* the message is stored after being delivered, so that the
+			live recipients do not wait for it. Only the messages to every
+			client are kept */
+			start = trace_begin();
+			if (conn->room == NULL && history_append(shoutbuf) == -1) {
+				LOG(LOGWARN, "server: history: %m\n");
+			}
+			trace_end("history", start);
+			msgbuf_unref(shoutbuf);
+			break;
+		/* Move the client to a room */
+		case JOIN :
+			/* the name of the room ends at the first space */
+			if (packet->len == 0) break;
+			packet->payload[strcspn(packet->payload, " \t\n")] = '\0';
+			if (packet->payload[0] == '\0') break;
+			lock_clientlist();
+			start = trace_begin();
+			conn->room = list_join(&client_list, client_info,
+				packet->payload);
+			trace_end("lookup", start);
+			pthread_mutex_unlock(&clientlist_mutex);
+			if (conn->room == NULL) {
+				LOG(LOGERROR, "server: malloc: %m\n");
+			}
+			else {
+				LOG(LOGINFO, "%s joined #%s\n", client_info->alias,
+					conn->room->name);
+			}
+			/* The answer contains the room joined, none if the join failed
+			and the client has left its previous room */
+			struct Packet joined;
+			memset(&joined, 0, sizeof(struct Packet));
+			joined.action = JOIN;
+			if (conn->room != NULL) {
+				joined.payload = conn->room->name;
+				joined.len = strlen(conn->room->name);
+			}
+			if (conn_send_packet(conn, &joined) == -1) {
+				LOG(LOGWARN, "server: send: %m\n");
+			}
+			break;
+		/* Bring the client back to the whole server */
+		case PART :
+			lock_clientlist();
+			list_part(&client_list, client_info);
+			pthread_mutex_unlock(&clientlist_mutex);
+			conn->room = NULL;
+			break;
+		/* Client's list request */
+		case LIST_Q :
+			start = trace_begin();
+			epoch_enter();
+			/* A member of a room gets the other members only. The answer is
+			encoded once for every snapshot and shared until the list
+			changes */
+			struct ClientSnapshot *list_snap = conn->room == NULL
+				? list_snapshot(&client_list) : NULL;
+			struct RoomSnapshot *members = conn->room != NULL
+				? room_snapshot(conn->room) : NULL;
+			struct MsgBuf *roster = list_snap != NULL
+				? snapshot_roster(list_snap) : members != NULL
+				? room_snapshot_roster(members) : NULL;
+			if (roster != NULL) {
+				msgbuf_ref(roster);
+			}
+			epoch_exit();
+			trace_end("lookup", start);
+			/* A list not published yet is empty */
+			if (roster == NULL && list_snap == NULL && members == NULL) {
 				struct Packet answer_packet;
 				memset(&answer_packet, 0, sizeof(struct Packet));
 				answer_packet.action = LIST_A;
-				answer_packet.len = size; // number of clients in the list
-				strcpy(answer_packet.alias, packet.alias);
-				/* Insert the client's aliases in the packet's payload */
-				for(int i = 0; i < size; i++) {
-					memcpy(&answer_packet.payload[ALIASLEN*i], list_str[i],
-						ALIASLEN*sizeof(char));
-				}
-				/* Send the packet */
-				if (send(client_info.sockfd, (void *)&answer_packet,
-					sizeof(struct Packet), 0) == -1) {
-					perror("server: send");
-				}
-				free(list_str); // deallocate the memory used for the list
-				pthread_mutex_unlock(&clientlist_mutex);
-				break;
-			/* Terminate the connection */
-			case EXIT :
-				printf("[%d] %s has disconnected\n", client_info.sockfd,
-					client_info.alias);
-				pthread_mutex_lock(&clientlist_mutex);
-				list_delete(&client_list, &client_info);
-				pthread_mutex_unlock(&clientlist_mutex);
+				roster = msgbuf_encode(&answer_packet);
+			}
+			if (roster == NULL) {
+				LOG(LOGERROR, "server: malloc: %m\n");
+			}
+			/* Send the packet */
+			else if (conn_queue(conn, roster) == -1) {
+				LOG(LOGWARN, "server: send: %m\n");
+			}
+			break;
+		/* Search the history, the latest messages found are sent back */
+		case SEARCH_Q : ;
+			char *results = malloc(MAXPAYLEN);
+			if (results == NULL) {
+				LOG(LOGERROR, "server: malloc: %m\n");
 				break;
-			default :
-				fprintf(stderr,
-					"Unidentified packet from [%d] %s : action_code=%d\n",
-					client_info.sockfd, client_info.alias, packet.action);
-		}
+			}
+			start = trace_begin();
+			struct Packet search_packet;
+			memset(&search_packet, 0, sizeof(struct Packet));
+			search_packet.action = SEARCH_A;
+			strcpy(search_packet.alias, packet->alias);
+			search_packet.payload = results;
+			search_packet.len = search_query(packet->len > 0 ? packet->payload
+				: "", results, MAXPAYLEN);
+			trace_end("search", start);
+			if (conn_send_packet(conn, &search_packet) == -1) {
+				LOG(LOGWARN, "server: send: %m\n");
+			}
+			free(results);
+			break;
+		/* Answer a heartbeat, the client may use it to complete its
+		handshake */
+		case PING : ;
+			struct Packet pong;
+			memset(&pong, 0, sizeof(struct Packet));
+			pong.action = PONG;
+			if (conn_send_packet(conn, &pong) == -1) {
+				LOG(LOGWARN, "server: send: %m\n");
+			}
+			break;
+		/* The client is alive, its timeouts already count from now */
+		case PONG :
+			break;
+		/* Terminate the connection */
+		case EXIT :
+			LOG(LOGINFO, "[%d] %s has disconnected\n", client_info->sockfd,
+				client_info->alias);
+			/* the event loop removes the client from the list and closes
+			the socket */
+			return -1;
+		default :
+			LOG(LOGWARN,
+				"Unidentified packet from [%d] %s : action_code=%d\n",
+				client_info->sockfd, client_info->alias, packet->action);
 	}
-
-	/* Close the client socket */
-	close(client_info.sockfd);
-
-	return NULL;
+	return 0;
 }
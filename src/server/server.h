@@ -13,5 +13,19 @@
 #define SERVERIP "localhost"
 /** Port used by the server for incoming connections */
 #define SERVERPORT "3495"
-/** How many pending connections queue will hold */
-#define BACKLOG 8
+/** How many pending connections queue will hold, capped by the kernel's
+somaxconn */
+#define BACKLOG 4096
+/** Number of shards used when the CPUs online cannot be counted, every
+shard is an event loop thread with its own listening socket */
+#define DEFAULTSHARDS 4
+/** Minimum interval between two snapshots of the client list, in
+milliseconds */
+#define PUBLISHMS 10
+/** Default number of seconds after which a silent client is disconnected, it
+is sent a PING every third of them */
+#define IDLETIMEOUT 90
+/** Default number of seconds a new client has to send its first packet */
+#define HANDSHAKETIMEOUT 10
+/** File written by the \c /trace command, in the trace event format */
+#define TRACEFILE "server-trace.json"
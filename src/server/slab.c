@@ -0,0 +1,139 @@
+/**
+ * @file slab.c
+ * @brief Pool allocator of fixed-size records, grown in chunks.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#include "slab.h"
+
+/* Standard libraries */
+#include <stdlib.h>
+
+/**
+ * @brief Initialize an empty pool.
+ *
+ * @param slab
+ * Pointer to the pool.
+ * @param size
+ * Size of a record.
+ * @param count
+ * Number of records of a chunk.
+ */
+void slab_init(struct Slab *slab, size_t size, size_t count) {
+	slab->objsize = (size + SLABALIGN - 1) & ~(size_t)(SLABALIGN - 1);
+	slab->perchunk = count;
+	slab->freelist = NULL;
+	slab->chunks = NULL;
+	slab->nchunks = slab->chunkcap = 0;
+	slab->used = 0;
+	pthread_mutex_init(&slab->mutex, NULL);
+}
+
+/**
+ * @brief Release all the memory of a pool, the records must not be used
+ * anymore.
+ *
+ * @param slab
+ * Pointer to the pool.
+ */
+void slab_release(struct Slab *slab) {
+	for(size_t i = 0; i < slab->nchunks; i++) {
+		free(slab->chunks[i]);
+	}
+	free(slab->chunks);
+	pthread_mutex_destroy(&slab->mutex);
+	slab_init(slab, slab->objsize, slab->perchunk);
+}
+
+/**
+ * @brief Add a chunk to a pool, linking its records in the free list.
+ *
+ * @param slab
+ * Pointer to the pool, its mutex must be held.
+ *
+ * @return \c 0 if successful, \c -1 if the memory could not be allocated.
+ */
+static int grow(struct Slab *slab) {
+	char *chunk;
+	if(slab->nchunks == slab->chunkcap) {
+		size_t newcap = slab->chunkcap ? slab->chunkcap * 2 : 16;
+		char **chunks = realloc(slab->chunks, newcap * sizeof(char *));
+		if(chunks == NULL) return -1;
+		slab->chunks = chunks;
+		slab->chunkcap = newcap;
+	}
+	if((chunk = malloc(slab->objsize * slab->perchunk)) == NULL) return -1;
+	slab->chunks[slab->nchunks++] = chunk;
+	/* link the records so that they are handed out in address order */
+	for(size_t i = slab->perchunk; i > 0; i--) {
+		void *obj = chunk + (i - 1) * slab->objsize;
+		*(void **)obj = slab->freelist;
+		slab->freelist = obj;
+	}
+	return 0;
+}
+
+/**
+ * @brief Allocate a record, growing the pool by a chunk if there are no free
+ * ones.
+ *
+ * @param slab
+ * Pointer to the pool.
+ *
+ * @return A pointer to the record, \c NULL if the memory could not be
+ * allocated.
+ */
+void *slab_alloc(struct Slab *slab) {
+	void *obj;
+	pthread_mutex_lock(&slab->mutex);
+	if(slab->freelist == NULL && grow(slab) == -1) {
+		pthread_mutex_unlock(&slab->mutex);
+		return NULL;
+	}
+	obj = slab->freelist;
+	slab->freelist = *(void **)obj;
+	slab->used++;
+	pthread_mutex_unlock(&slab->mutex);
+	return obj;
+}
+
+/**
+ * @brief Return a record to its pool.
+ *
+ * @param slab
+ * Pointer to the pool.
+ * @param obj
+ * Pointer to the record, allocated from the same pool.
+ */
+void slab_free(struct Slab *slab, void *obj) {
+	if(obj == NULL) return;
+	pthread_mutex_lock(&slab->mutex);
+	*(void **)obj = slab->freelist;
+	slab->freelist = obj;
+	slab->used--;
+	pthread_mutex_unlock(&slab->mutex);
+}
+
+/**
+ * @brief Returns the memory allocated by a pool.
+ *
+ * @param slab
+ * Pointer to the pool.
+ * @param used
+ * If not \c NULL, set to the number of records in use.
+ *
+ * @return The number of bytes of the chunks allocated.
+ */
+size_t slab_footprint(struct Slab *slab, size_t *used) {
+	size_t bytes;
+	pthread_mutex_lock(&slab->mutex);
+	bytes = slab->nchunks * slab->perchunk * slab->objsize;
+	if(used != NULL) *used = slab->used;
+	pthread_mutex_unlock(&slab->mutex);
+	return bytes;
+}
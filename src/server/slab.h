@@ -0,0 +1,134 @@
+/**
+ * @file slab.h
+ * @brief Pool allocator of fixed-size records, grown in chunks.
+ *
+ * The records are carved from large chunks allocated on demand, and the
+ * freed ones are recycled through a free list, so that allocating a record
+ * costs neither a call to \c malloc() nor a per-object header, and the
+ * records of many connections are packed together. The chunks are never
+ * returned to the system.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+/* Standard libraries */
+#include <stddef.h>
+
+/* Thread library */
+#include <pthread.h>
+
+/** Default number of records of a chunk */
+#define SLABCHUNK 256
+/** Alignment of the records */
+#define SLABALIGN 16
+
+/**
+ * @struct Slab
+ *
+ * @brief Pool of records of the same size.
+ *
+ * @var Slab::objsize
+ * Size of a record, rounded up to \c SLABALIGN.
+ * @var Slab::perchunk
+ * Number of records of a chunk.
+ * @var Slab::freelist
+ * First free record, the following ones are linked through their first
+ * bytes.
+ * @var Slab::chunks
+ * Chunks allocated.
+ * @var Slab::nchunks
+ * Number of chunks allocated.
+ * @var Slab::chunkcap
+ * Allocated size of \c chunks.
+ * @var Slab::used
+ * Number of records in use.
+ * @var Slab::mutex
+ * Mutual exclusion variable protecting the pool.
+ */
+struct Slab {
+	size_t objsize;
+	size_t perchunk;
+	void *freelist;
+	char **chunks;
+	size_t nchunks, chunkcap;
+	size_t used;
+	pthread_mutex_t mutex;
+};
+
+/**
+ * @brief Static initializer of an empty pool.
+ *
+ * @param size
+ * Size of a record.
+ * @param count
+ * Number of records of a chunk.
+ */
+#define SLAB_INITIALIZER(size, count) { \
+	.objsize = ((size) + SLABALIGN - 1) & ~(size_t)(SLABALIGN - 1), \
+	.perchunk = (count), \
+	.mutex = PTHREAD_MUTEX_INITIALIZER \
+}
+
+/**
+ * @brief Initialize an empty pool.
+ *
+ * @param slab
+ * Pointer to the pool.
+ * @param size
+ * Size of a record.
+ * @param count
+ * Number of records of a chunk.
+ */
+void slab_init(struct Slab *slab, size_t size, size_t count);
+
+/**
+ * @brief Release all the memory of a pool, the records must not be used
+ * anymore.
+ *
+ * @param slab
+ * Pointer to the pool.
+ */
+void slab_release(struct Slab *slab);
+
+/**
+ * @brief Allocate a record, growing the pool by a chunk if there are no free
+ * ones.
+ *
+ * @param slab
+ * Pointer to the pool.
+ *
+ * @return A pointer to the record, \c NULL if the memory could not be
+ * allocated.
+ */
+void *slab_alloc(struct Slab *slab);
+
+/**
+ * @brief Return a record to its pool.
+ *
+ * @param slab
+ * Pointer to the pool.
+ * @param obj
+ * Pointer to the record, allocated from the same pool.
+ */
+void slab_free(struct Slab *slab, void *obj);
+
+/**
+ * @brief Returns the memory allocated by a pool.
+ *
+ * @param slab
+ * Pointer to the pool.
+ * @param used
+ * If not \c NULL, set to the number of records in use.
+ *
+ * @return The number of bytes of the chunks allocated.
+ */
+size_t slab_footprint(struct Slab *slab, size_t *used);
+
+#endif
@@ -0,0 +1,243 @@
+/**
+ * @file stats.c
+ * @brief Counters and latency histograms of the server.
+ *
+ * Every event loop updates a \c Stats structure of its own, without atomic
+ * read-modify-write instructions nor shared cache lines, and the structures
+ * are only added together when the statistics are read. The threads that
+ * are not event loops share a further structure.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#include "stats.h"
+
+/* Standard libraries */
+#include <string.h>
+#include <time.h>
+
+/**
+ * Counters of the threads without a structure of their own, their updates
+ * may be lost if two of them race.
+ */
+static struct Stats shared;
+
+/**
+ * Counters of the calling thread, \c NULL for the shared ones.
+ */
+static _Thread_local struct Stats *own;
+
+/**
+ * @brief Returns the current time in nanoseconds.
+ */
+uint64_t stats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Initialize the counters of a thread to zero.
+ *
+ * @param stats
+ * Pointer to the counters.
+ */
+void stats_init(struct Stats *stats) {
+	memset(stats, 0, sizeof(struct Stats));
+}
+
+/**
+ * @brief Make the calling thread update a given structure.
+ *
+ * @param stats
+ * Pointer to the counters of the thread.
+ */
+void stats_attach(struct Stats *stats) {
+	own = stats;
+}
+
+/**
+ * @brief Returns the counters of the calling thread.
+ *
+ * @return The structure attached to the thread, or the one shared by the
+ * threads without a structure of their own.
+ */
+struct Stats *stats_current(void) {
+	return own != NULL ? own : &shared;
+}
+
+/**
+ * @brief Returns the counters shared by the threads without a structure of
+ * their own.
+ */
+struct Stats *stats_shared(void) {
+	return &shared;
+}
+
+/**
+ * @brief Returns the bucket of a histogram containing a sample.
+ *
+ * @param ns
+ * Sample in nanoseconds.
+ *
+ * @return The index of the bucket.
+ */
+static size_t bucket_of(uint64_t ns) {
+	int power = 0;
+	size_t index;
+	/* the values below 2 * HISTSUB are stored exactly */
+	while((ns >> power) >= 2 * HISTSUB) power++;
+	index = power == 0 ? ns
+		: (power + 1) * HISTSUB + ((ns >> power) - HISTSUB);
+	return index < HISTPOWERS * HISTSUB ? index : HISTPOWERS * HISTSUB - 1;
+}
+
+/**
+ * @brief Returns the largest sample stored in a bucket of a histogram.
+ *
+ * @param index
+ * Index of the bucket.
+ *
+ * @return The upper bound of the bucket, in nanoseconds.
+ */
+static uint64_t bucket_max(size_t index) {
+	int power = index / HISTSUB - 1;
+	if(index < 2 * HISTSUB) return index;
+	return ((uint64_t)(index % HISTSUB + HISTSUB + 1) << power) - 1;
+}
+
+/**
+ * @brief Add a sample to a histogram written by a single thread.
+ *
+ * @param hist
+ * Pointer to the histogram.
+ * @param ns
+ * Latency in nanoseconds.
+ */
+void stats_record(struct Histogram *hist, uint64_t ns) {
+	stats_add(&hist->buckets[bucket_of(ns)], 1);
+	stats_add(&hist->count, 1);
+	stats_add(&hist->sum, ns);
+	if(ns > atomic_load_explicit(&hist->max, memory_order_relaxed)) {
+		atomic_store_explicit(&hist->max, ns, memory_order_relaxed);
+	}
+}
+
+/**
+ * @brief Add a counter to a total.
+ *
+ * @param total
+ * Pointer to the counter of the total.
+ * @param counter
+ * Pointer to the counter added.
+ */
+static void merge_counter(atomic_ulong *total, const atomic_ulong *counter) {
+	stats_add(total, atomic_load_explicit(counter, memory_order_relaxed));
+}
+
+/**
+ * @brief Add a histogram to a total.
+ *
+ * @param total
+ * Pointer to the histogram of the total.
+ * @param hist
+ * Pointer to the histogram added.
+ */
+static void merge_histogram(struct Histogram *total,
+	const struct Histogram *hist) {
+	unsigned long max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+	for(size_t i = 0; i < HISTPOWERS * HISTSUB; i++) {
+		merge_counter(&total->buckets[i], &hist->buckets[i]);
+	}
+	merge_counter(&total->count, &hist->count);
+	merge_counter(&total->sum, &hist->sum);
+	if(max > atomic_load_explicit(&total->max, memory_order_relaxed)) {
+		atomic_store_explicit(&total->max, max, memory_order_relaxed);
+	}
+}
+
+/**
+ * @brief Add the counters of a thread to a total.
+ *
+ * @param total
+ * Pointer to the total, not accessed by other threads.
+ * @param stats
+ * Pointer to the counters of a thread.
+ */
+void stats_merge(struct Stats *total, const struct Stats *stats) {
+	merge_counter(&total->accepts, &stats->accepts);
+	merge_counter(&total->closes, &stats->closes);
+	for(int i = 0; i <= STATSACTIONS; i++) {
+		merge_counter(&total->packets_in[i], &stats->packets_in[i]);
+		merge_counter(&total->packets_out[i], &stats->packets_out[i]);
+	}
+	merge_counter(&total->bytes_in, &stats->bytes_in);
+	merge_counter(&total->bytes_out, &stats->bytes_out);
+	merge_counter(&total->queued, &stats->queued);
+	merge_counter(&total->written, &stats->written);
+	merge_counter(&total->discarded, &stats->discarded);
+	merge_counter(&total->refused, &stats->refused);
+	merge_counter(&total->dropped, &stats->dropped);
+	merge_counter(&total->stalls, &stats->stalls);
+	merge_counter(&total->evicted, &stats->evicted);
+	merge_counter(&total->timeouts, &stats->timeouts);
+	merge_counter(&total->lock_acquired, &stats->lock_acquired);
+	merge_counter(&total->lock_contended, &stats->lock_contended);
+	merge_counter(&total->lock_wait, &stats->lock_wait);
+	merge_histogram(&total->dispatch, &stats->dispatch);
+	merge_histogram(&total->send, &stats->send);
+}
+
+/**
+ * @brief Returns a percentile of a histogram.
+ *
+ * @param hist
+ * Pointer to the histogram.
+ * @param percentile
+ * Percentile requested, between \c 0 and \c 100.
+ *
+ * @return The upper bound of the bucket containing the percentile, in
+ * nanoseconds, \c 0 if the histogram is empty.
+ */
+uint64_t stats_percentile(const struct Histogram *hist, double percentile) {
+	unsigned long count = atomic_load_explicit(&hist->count,
+		memory_order_relaxed);
+	unsigned long max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+	unsigned long rank = count * percentile / 100.0, seen = 0;
+	if(count == 0) return 0;
+	if(rank >= count) rank = count - 1;
+	for(size_t i = 0; i < HISTPOWERS * HISTSUB; i++) {
+		seen += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+		if(seen > rank) {
+			return bucket_max(i) < max ? bucket_max(i) : max;
+		}
+	}
+	return max;
+}
+
+/**
+ * @brief Print the summary of a histogram on a line.
+ *
+ * @param stream
+ * Stream written.
+ * @param name
+ * Name of the histogram.
+ * @param hist
+ * Pointer to the histogram.
+ */
+void stats_print_histogram(FILE *stream, const char *name,
+	const struct Histogram *hist) {
+	unsigned long count = atomic_load_explicit(&hist->count,
+		memory_order_relaxed);
+	unsigned long sum = atomic_load_explicit(&hist->sum, memory_order_relaxed);
+	fprintf(stream, "%s (us): %lu samples, mean %.1f, p50 %.1f, p90 %.1f, "
+		"p99 %.1f, p99.9 %.1f, max %.1f\n", name, count,
+		count > 0 ? (double)sum / count / 1e3 : 0.0,
+		stats_percentile(hist, 50) / 1e3, stats_percentile(hist, 90) / 1e3,
+		stats_percentile(hist, 99) / 1e3, stats_percentile(hist, 99.9) / 1e3,
+		atomic_load_explicit(&hist->max, memory_order_relaxed) / 1e3);
+}
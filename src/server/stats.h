@@ -0,0 +1,220 @@
+/**
+ * @file stats.h
+ * @brief Counters and latency histograms of the server.
+ *
+ * Every event loop updates a \c Stats structure of its own, without atomic
+ * read-modify-write instructions nor shared cache lines, and the structures
+ * are only added together when the statistics are read. The threads that
+ * are not event loops share a further structure.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+/** Action codes counted separately, the higher ones are counted together */
+#define STATSACTIONS 17
+/** Sub-buckets of every power of two of a histogram, the percentiles are
+accurate within 1/HISTSUB */
+#define HISTSUB 32
+/** Powers of two covered by a histogram, in nanoseconds */
+#define HISTPOWERS 40
+
+/**
+ * @struct Histogram
+ *
+ * @brief Distribution of latencies, with a bucket for every 1/HISTSUB of
+ * every power of two of nanoseconds, like an HDR histogram.
+ *
+ * @var Histogram::buckets
+ * Number of samples in every bucket.
+ * @var Histogram::count
+ * Total number of samples.
+ * @var Histogram::sum
+ * Sum of the samples.
+ * @var Histogram::max
+ * Largest sample.
+ */
+struct Histogram {
+	atomic_ulong buckets[HISTPOWERS * HISTSUB];
+	atomic_ulong count;
+	atomic_ulong sum;
+	atomic_ulong max;
+};
+
+/**
+ * @struct Stats
+ *
+ * @brief Counters of a thread, only written by the thread.
+ *
+ * @var Stats::accepts
+ * Connections accepted.
+ * @var Stats::closes
+ * Connections closed.
+ * @var Stats::packets_in
+ * Packets received, for every action code.
+ * @var Stats::packets_out
+ * Packets queued to be sent, for every action code.
+ * @var Stats::bytes_in
+ * Bytes received.
+ * @var Stats::bytes_out
+ * Bytes sent.
+ * @var Stats::queued
+ * Messages queued on the output queues.
+ * @var Stats::written
+ * Messages of the output queues completely written.
+ * @var Stats::discarded
+ * Messages discarded from the output queues of the connections closed.
+ * @var Stats::refused
+ * Messages refused because an output queue was full.
+ * @var Stats::dropped
+ * Oldest messages dropped from a full output queue to make room for new ones.
+ * @var Stats::stalls
+ * Times a connection has filled its output queue, a slow consumer.
+ * @var Stats::evicted
+ * Slow consumers disconnected after their grace period.
+ * @var Stats::timeouts
+ * Connections closed because they were idle or did not complete their
+ * handshake in time.
+ * @var Stats::lock_acquired
+ * Acquisitions of the client list's lock.
+ * @var Stats::lock_contended
+ * Acquisitions of the client list's lock that had to wait.
+ * @var Stats::lock_wait
+ * Nanoseconds waited for the client list's lock.
+ * @var Stats::dispatch
+ * Latency from the reception of the data of a packet to the end of its
+ * handling.
+ * @var Stats::send
+ * Latency from the encoding of a message to the end of its writing.
+ */
+struct Stats {
+	atomic_ulong accepts;
+	atomic_ulong closes;
+	atomic_ulong packets_in[STATSACTIONS + 1];
+	atomic_ulong packets_out[STATSACTIONS + 1];
+	atomic_ulong bytes_in;
+	atomic_ulong bytes_out;
+	atomic_ulong queued;
+	atomic_ulong written;
+	atomic_ulong discarded;
+	atomic_ulong refused;
+	atomic_ulong dropped;
+	atomic_ulong stalls;
+	atomic_ulong evicted;
+	atomic_ulong timeouts;
+	atomic_ulong lock_acquired;
+	atomic_ulong lock_contended;
+	atomic_ulong lock_wait;
+	struct Histogram dispatch;
+	struct Histogram send;
+};
+
+/**
+ * @brief Add to a counter written by a single thread.
+ *
+ * A plain load and store, the readers may see the old value for a while but
+ * never a torn one.
+ *
+ * @param counter
+ * Pointer to the counter.
+ * @param n
+ * Value added.
+ */
+static inline void stats_add(atomic_ulong *counter, unsigned long n) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter,
+		memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * @brief Returns the current time in nanoseconds.
+ */
+uint64_t stats_now(void);
+
+/**
+ * @brief Initialize the counters of a thread to zero.
+ *
+ * @param stats
+ * Pointer to the counters.
+ */
+void stats_init(struct Stats *stats);
+
+/**
+ * @brief Make the calling thread update a given structure.
+ *
+ * @param stats
+ * Pointer to the counters of the thread.
+ */
+void stats_attach(struct Stats *stats);
+
+/**
+ * @brief Returns the counters of the calling thread.
+ *
+ * @return The structure attached to the thread, or the one shared by the
+ * threads without a structure of their own.
+ */
+struct Stats *stats_current(void);
+
+/**
+ * @brief Returns the counters shared by the threads without a structure of
+ * their own.
+ */
+struct Stats *stats_shared(void);
+
+/**
+ * @brief Add a sample to a histogram written by a single thread.
+ *
+ * @param hist
+ * Pointer to the histogram.
+ * @param ns
+ * Latency in nanoseconds.
+ */
+void stats_record(struct Histogram *hist, uint64_t ns);
+
+/**
+ * @brief Add the counters of a thread to a total.
+ *
+ * @param total
+ * Pointer to the total, not accessed by other threads.
+ * @param stats
+ * Pointer to the counters of a thread.
+ */
+void stats_merge(struct Stats *total, const struct Stats *stats);
+
+/**
+ * @brief Returns a percentile of a histogram.
+ *
+ * @param hist
+ * Pointer to the histogram.
+ * @param percentile
+ * Percentile requested, between \c 0 and \c 100.
+ *
+ * @return The upper bound of the bucket containing the percentile, in
+ * nanoseconds, \c 0 if the histogram is empty.
+ */
+uint64_t stats_percentile(const struct Histogram *hist, double percentile);
+
+/**
+ * @brief Print the summary of a histogram on a line.
+ *
+ * @param stream
+ * Stream written.
+ * @param name
+ * Name of the histogram.
+ * @param hist
+ * Pointer to the histogram.
+ */
+void stats_print_histogram(FILE *stream, const char *name,
+	const struct Histogram *hist);
+
+#endif
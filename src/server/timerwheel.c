@@ -0,0 +1,223 @@
+/**
+ * @file timerwheel.c
+ * @brief Hierarchical timing wheel holding the timers of an event loop.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#include "timerwheel.h"
+
+/* Standard libraries */
+#include <string.h>
+
+/** Mask selecting the slot in a level */
+#define WHEELMASK (WHEELSLOTS - 1)
+/** Farthest expiration, in ticks from the current one */
+#define WHEELSPAN (((uint64_t)1 << (WHEELBITS * WHEELLEVELS)) - 1)
+
+/**
+ * @brief Link a timer in the slot covering its expiration.
+ *
+ * @param w
+ * Pointer to the wheel.
+ * @param t
+ * Pointer to the timer, expiring at the current tick or later.
+ */
+static void place(struct TimerWheel *w, struct Timer *t) {
+	uint64_t delta = t->expires - w->now;
+	int level = 0;
+	while(level < WHEELLEVELS - 1
+		&& delta >> (WHEELBITS * (level + 1)) != 0) {
+		level++;
+	}
+	struct Timer **slot = &w->slots[level]
+		[(t->expires >> (WHEELBITS * level)) & WHEELMASK];
+	t->next = *slot;
+	if(t->next != NULL) t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+/**
+ * @brief Unlink a pending timer.
+ *
+ * @param t
+ * Pointer to the timer.
+ */
+static void unlink_timer(struct Timer *t) {
+	*t->pprev = t->next;
+	if(t->next != NULL) t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/**
+ * @brief Move the timers of the slots of the upper levels starting at the
+ * current tick to the levels below.
+ *
+ * @param w
+ * Pointer to the wheel.
+ */
+static void cascade(struct TimerWheel *w) {
+	int top = 0;
+	/* a level is moved down once the one below it has made a revolution */
+	while(top < WHEELLEVELS - 1
+		&& (w->now & (((uint64_t)1 << (WHEELBITS * (top + 1))) - 1)) == 0) {
+		top++;
+	}
+	for(int level = top; level > 0; level--) {
+		struct Timer **slot = &w->slots[level]
+			[(w->now >> (WHEELBITS * level)) & WHEELMASK];
+		struct Timer *t = *slot, *next;
+		*slot = NULL;
+		for(; t != NULL; t = next) {
+			next = t->next;
+			place(w, t);
+		}
+	}
+}
+
+/**
+ * @brief Initialize an empty wheel.
+ *
+ * @param w
+ * Pointer to the wheel.
+ * @param now_ms
+ * Current time, in milliseconds.
+ */
+void timerwheel_init(struct TimerWheel *w, uint64_t now_ms) {
+	memset(w->slots, 0, sizeof w->slots);
+	w->now = now_ms / TIMERTICKMS;
+	w->count = 0;
+}
+
+/**
+ * @brief Initialize a timer not pending.
+ *
+ * @param t
+ * Pointer to the timer.
+ * @param fn
+ * Called when the timer expires.
+ */
+void timer_init(struct Timer *t, void (*fn)(struct Timer *timer)) {
+	t->next = NULL;
+	t->pprev = NULL;
+	t->expires = 0;
+	t->fn = fn;
+}
+
+/**
+ * @brief Schedule a timer, replacing its previous expiration if it is
+ * pending.
+ *
+ * The expiration is rounded up to the next tick, and the timers farther
+ * than the span of the wheel expire at its end.
+ *
+ * @param w
+ * Pointer to the wheel.
+ * @param t
+ * Pointer to the timer.
+ * @param expires_ms
+ * Time the timer expires at, in milliseconds.
+ */
+void timer_schedule(struct TimerWheel *w, struct Timer *t,
+	uint64_t expires_ms) {
+	uint64_t expires = (expires_ms + TIMERTICKMS - 1) / TIMERTICKMS;
+	timer_cancel(w, t);
+	/* the current tick has already expired */
+	if(expires <= w->now) expires = w->now + 1;
+	else if(expires - w->now > WHEELSPAN) expires = w->now + WHEELSPAN;
+	t->expires = expires;
+	place(w, t);
+	w->count++;
+}
+
+/**
+ * @brief Cancel a timer, nothing happens if it is not pending.
+ *
+ * @param w
+ * Pointer to the wheel.
+ * @param t
+ * Pointer to the timer.
+ */
+void timer_cancel(struct TimerWheel *w, struct Timer *t) {
+	if(t->pprev == NULL) return;
+	unlink_timer(t);
+	w->count--;
+}
+
+/**
+ * @brief Returns whether a timer is pending.
+ *
+ * @param t
+ * Pointer to the timer.
+ *
+ * @return \c 1 if the timer is pending, \c 0 otherwise.
+ */
+int timer_pending(const struct Timer *t) {
+	return t->pprev != NULL;
+}
+
+/**
+ * @brief Expire the timers up to the current time.
+ *
+ * The callbacks may schedule and cancel any timer.
+ *
+ * @param w
+ * Pointer to the wheel.
+ * @param now_ms
+ * Current time, in milliseconds.
+ *
+ * @return The number of timers expired.
+ */
+size_t timerwheel_advance(struct TimerWheel *w, uint64_t now_ms) {
+	uint64_t target = now_ms / TIMERTICKMS;
+	size_t expired = 0;
+	struct Timer **slot, *t;
+	while(w->now < target) {
+		/* an empty wheel has nothing to move down nor to expire */
+		if(w->count == 0) {
+			w->now = target;
+			break;
+		}
+		w->now++;
+		cascade(w);
+		/* a timer scheduled by a callback expires at a later tick, so it is
+		never added to the slot expiring */
+		slot = &w->slots[0][w->now & WHEELMASK];
+		while((t = *slot) != NULL) {
+			unlink_timer(t);
+			w->count--;
+			expired++;
+			t->fn(t);
+		}
+	}
+	return expired;
+}
+
+/**
+ * @brief Returns how long a thread can wait before advancing the wheel.
+ *
+ * @param w
+ * Pointer to the wheel.
+ * @param now_ms
+ * Current time, in milliseconds.
+ *
+ * @return The number of milliseconds until the next slot holding timers
+ * expires or the next level has to be moved down, \c -1 if no timer is
+ * pending.
+ */
+int timerwheel_timeout(const struct TimerWheel *w, uint64_t now_ms) {
+	uint64_t tick = w->now;
+	if(w->count == 0) return -1;
+	do {
+		tick++;
+	} while((tick & WHEELMASK) != 0
+		&& w->slots[0][tick & WHEELMASK] == NULL);
+	if(tick * TIMERTICKMS <= now_ms) return 0;
+	return (int)(tick * TIMERTICKMS - now_ms);
+}
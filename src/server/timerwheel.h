@@ -0,0 +1,163 @@
+/**
+ * @file timerwheel.h
+ * @brief Hierarchical timing wheel holding the timers of an event loop.
+ *
+ * The time is divided in ticks of \c TIMERTICKMS milliseconds. A timer is
+ * linked in a slot of the level whose span covers its expiration: the first
+ * level has a slot per tick, every following one a slot per revolution of
+ * the level below it. Scheduling and cancelling a timer cost a constant
+ * time, and every tick only visits the slot expiring; the slots of the upper
+ * levels are moved down once a revolution, so each timer is moved at most
+ * once per level.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stddef.h>
+
+/** Length of a tick of the wheels, in milliseconds */
+#define TIMERTICKMS 100
+/** Logarithm of the number of slots of every level */
+#define WHEELBITS 6
+/** Number of slots of every level */
+#define WHEELSLOTS (1 << WHEELBITS)
+/** Number of levels, the farthest expiration is WHEELSLOTS^WHEELLEVELS
+ticks away */
+#define WHEELLEVELS 4
+
+/**
+ * @struct Timer
+ *
+ * @brief Timer embedded in the structure it belongs to.
+ *
+ * A timer filled with zeroes is initialized and not pending.
+ *
+ * @var Timer::next
+ * Next timer in the same slot.
+ * @var Timer::pprev
+ * Link pointing to this timer, \c NULL if the timer is not pending.
+ * @var Timer::expires
+ * Tick the timer expires at.
+ * @var Timer::fn
+ * Called when the timer expires, with the timer already unlinked.
+ */
+struct Timer {
+	struct Timer *next;
+	struct Timer **pprev;
+	uint64_t expires;
+	void (*fn)(struct Timer *timer);
+};
+
+/**
+ * @struct TimerWheel
+ *
+ * @brief Timers of a single thread.
+ *
+ * @var TimerWheel::now
+ * Latest tick whose timers have expired.
+ * @var TimerWheel::count
+ * Number of timers pending.
+ * @var TimerWheel::slots
+ * Timers pending, by level and slot.
+ */
+struct TimerWheel {
+	uint64_t now;
+	size_t count;
+	struct Timer *slots[WHEELLEVELS][WHEELSLOTS];
+};
+
+/**
+ * @brief Initialize an empty wheel.
+ *
+ * @param w
+ * Pointer to the wheel.
+ * @param now_ms
+ * Current time, in milliseconds.
+ */
+void timerwheel_init(struct TimerWheel *w, uint64_t now_ms);
+
+/**
+ * @brief Initialize a timer not pending.
+ *
+ * @param t
+ * Pointer to the timer.
+ * @param fn
+ * Called when the timer expires.
+ */
+void timer_init(struct Timer *t, void (*fn)(struct Timer *timer));
+
+/**
+ * @brief Schedule a timer, replacing its previous expiration if it is
+ * pending.
+ *
+ * The expiration is rounded up to the next tick, and the timers farther
+ * than the span of the wheel expire at its end.
+ *
+ * @param w
+ * Pointer to the wheel.
+ * @param t
+ * Pointer to the timer.
+ * @param expires_ms
+ * Time the timer expires at, in milliseconds.
+ */
+void timer_schedule(struct TimerWheel *w, struct Timer *t,
+	uint64_t expires_ms);
+
+/**
+ * @brief Cancel a timer, nothing happens if it is not pending.
+ *
+ * @param w
+ * Pointer to the wheel.
+ * @param t
+ * Pointer to the timer.
+ */
+void timer_cancel(struct TimerWheel *w, struct Timer *t);
+
+/**
+ * @brief Returns whether a timer is pending.
+ *
+ * @param t
+ * Pointer to the timer.
+ *
+ * @return \c 1 if the timer is pending, \c 0 otherwise.
+ */
+int timer_pending(const struct Timer *t);
+
+/**
+ * @brief Expire the timers up to the current time.
+ *
+ * The callbacks may schedule and cancel any timer.
+ *
+ * @param w
+ * Pointer to the wheel.
+ * @param now_ms
+ * Current time, in milliseconds.
+ *
+ * @return The number of timers expired.
+ */
+size_t timerwheel_advance(struct TimerWheel *w, uint64_t now_ms);
+
+/**
+ * @brief Returns how long a thread can wait before advancing the wheel.
+ *
+ * @param w
+ * Pointer to the wheel.
+ * @param now_ms
+ * Current time, in milliseconds.
+ *
+ * @return The number of milliseconds until the next slot holding timers
+ * expires or the next level has to be moved down, \c -1 if no timer is
+ * pending.
+ */
+int timerwheel_timeout(const struct TimerWheel *w, uint64_t now_ms);
+
+#endif
@@ -0,0 +1,225 @@
+/**
+ * @file trace.c
+ * @brief Sampled tracing of the stages a message goes through.
+ *
+ * One read out of every \c trace_rate is traced: the spans of its stages,
+ * from the reception to the writing of the messages it produced, are
+ * recorded with the same identifier in a ring of the thread executing them.
+ * The rings keep the latest spans and are dumped on demand in the trace
+ * event format of Chrome, which Perfetto reads as well.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#include "trace.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/* Thread library */
+#include <pthread.h>
+
+/**
+ * @struct TraceSpan
+ *
+ * @brief Stage of a traced read.
+ *
+ * @var TraceSpan::name
+ * Name of the stage.
+ * @var TraceSpan::id
+ * Identifier of the read.
+ * @var TraceSpan::start
+ * Beginning of the stage, in nanoseconds.
+ * @var TraceSpan::end
+ * End of the stage, in nanoseconds.
+ */
+struct TraceSpan {
+	const char *name;
+	uint32_t id;
+	uint64_t start;
+	uint64_t end;
+};
+
+/**
+ * @struct TraceRing
+ *
+ * @brief Latest spans of a thread, written by the thread and read by the
+ * dumps.
+ *
+ * @var TraceRing::spans
+ * Slots of the ring, the oldest span is overwritten by the newest.
+ * @var TraceRing::tail
+ * Number of spans recorded by the thread.
+ * @var TraceRing::tid
+ * Kernel identifier of the thread.
+ */
+struct TraceRing {
+	struct TraceSpan spans[TRACESPANS];
+	atomic_ulong tail;
+	long tid;
+};
+
+/**
+ * Number of reads out of which one is traced.
+ */
+atomic_int trace_rate;
+
+/**
+ * Identifier of the read being traced by the calling thread.
+ */
+_Thread_local uint32_t trace_id;
+
+/**
+ * Reads left before the next one traced by the calling thread.
+ */
+static _Thread_local int countdown;
+
+/**
+ * Last identifier given to a read.
+ */
+static atomic_uint last_id;
+
+/**
+ * Rings of the threads that have recorded a span.
+ */
+static struct TraceRing *rings[TRACETHREADS];
+
+/**
+ * Number of rings in \c rings.
+ */
+static atomic_int nrings;
+
+/**
+ * Mutual exclusion variable protecting the creation of the rings.
+ */
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Ring of the calling thread.
+ */
+static _Thread_local struct TraceRing *own_ring;
+
+/**
+ * Whether the calling thread could not get a ring and drops its spans.
+ */
+static _Thread_local int no_ring;
+
+/**
+ * @brief Returns the identifier of the next read, counting it towards the
+ * sampling rate.
+ *
+ * @return A new identifier if the read has to be traced, \c 0 otherwise.
+ */
+uint32_t trace_next(void) {
+	uint32_t id;
+	if(--countdown > 0) return 0;
+	countdown = atomic_load_explicit(&trace_rate, memory_order_relaxed);
+	/* the identifier 0 means that the read is not traced */
+	while((id = atomic_fetch_add_explicit(&last_id, 1,
+		memory_order_relaxed) + 1) == 0);
+	return id;
+}
+
+/**
+ * @brief Returns the ring of the calling thread, creating it the first time.
+ *
+ * @return A pointer to the ring, \c NULL if there are too many threads or
+ * the memory could not be allocated.
+ */
+static struct TraceRing *thread_ring(void) {
+	struct TraceRing *ring;
+	if(own_ring != NULL || no_ring) return own_ring;
+	pthread_mutex_lock(&rings_mutex);
+	int n = atomic_load(&nrings);
+	if(n < TRACETHREADS
+		&& (ring = malloc(sizeof(struct TraceRing))) != NULL) {
+		atomic_init(&ring->tail, 0);
+		ring->tid = syscall(SYS_gettid);
+		rings[n] = ring;
+		atomic_store_explicit(&nrings, n + 1, memory_order_release);
+		own_ring = ring;
+	}
+	else {
+		no_ring = 1;
+	}
+	pthread_mutex_unlock(&rings_mutex);
+	return own_ring;
+}
+
+/**
+ * @brief Record a span in the ring of the calling thread.
+ *
+ * @param name
+ * Name of the stage, a string literal.
+ * @param id
+ * Identifier of the read the stage belongs to.
+ * @param start
+ * Beginning of the stage, as returned by \c stats_now().
+ * @param end
+ * End of the stage, as returned by \c stats_now().
+ */
+void trace_span(const char *name, uint32_t id, uint64_t start, uint64_t end) {
+	struct TraceRing *ring = thread_ring();
+	if(ring == NULL) return;
+	unsigned long tail = atomic_load_explicit(&ring->tail,
+		memory_order_relaxed);
+	struct TraceSpan *span = &ring->spans[tail & (TRACESPANS - 1)];
+	span->name = name;
+	span->id = id;
+	span->start = start;
+	span->end = end;
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/**
+ * @brief Write the spans kept by the rings in the trace event format.
+ *
+ * The rings keep being written during the dump: a span is copied before
+ * being formatted and discarded if the thread may have overwritten it
+ * meanwhile.
+ *
+ * @param path
+ * Path of the file written.
+ *
+ * @return The number of spans written, \c -1 if the file cannot be written.
+ */
+long trace_dump(const char *path) {
+	FILE *file = fopen(path, "w");
+	int n = atomic_load_explicit(&nrings, memory_order_acquire);
+	long written = 0;
+	pid_t pid = getpid();
+	if(file == NULL) return -1;
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for(int r = 0; r < n; r++) {
+		struct TraceRing *ring = rings[r];
+		unsigned long tail = atomic_load_explicit(&ring->tail,
+			memory_order_acquire);
+		unsigned long first = tail > TRACESPANS ? tail - TRACESPANS : 0;
+		for(unsigned long i = first; i < tail; i++) {
+			struct TraceSpan span = ring->spans[i & (TRACESPANS - 1)];
+			atomic_thread_fence(memory_order_acquire);
+			/* the slot is reused by the span TRACESPANS positions later */
+			if(i + TRACESPANS <= atomic_load_explicit(&ring->tail,
+				memory_order_relaxed)) {
+				continue;
+			}
+			fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"chat\",\"ph\":\"X\","
+				"\"pid\":%d,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f,"
+				"\"args\":{\"trace\":%u}}", written > 0 ? "," : "", span.name,
+				(int)pid, ring->tid, span.start / 1e3,
+				(span.end - span.start) / 1e3, span.id);
+			written++;
+		}
+	}
+	fprintf(file, "\n]}\n");
+	if(fclose(file) == EOF) return -1;
+	return written;
+}
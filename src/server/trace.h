@@ -0,0 +1,120 @@
+/**
+ * @file trace.h
+ * @brief Sampled tracing of the stages a message goes through.
+ *
+ * One read out of every \c trace_rate is traced: the spans of its stages,
+ * from the reception to the writing of the messages it produced, are
+ * recorded with the same identifier in a ring of the thread executing them.
+ * The rings keep the latest spans and are dumped on demand in the trace
+ * event format of Chrome, which Perfetto reads as well.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Clock of the spans */
+#include "stats.h"
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdatomic.h>
+
+/** Spans kept by the ring of every thread, a power of two */
+#define TRACESPANS 4096
+/** Maximum number of threads with a ring */
+#define TRACETHREADS 64
+
+/**
+ * Number of reads out of which one is traced, \c 0 if tracing is disabled.
+ */
+extern atomic_int trace_rate;
+
+/**
+ * Identifier of the read being traced by the calling thread, \c 0 if the
+ * thread is not tracing.
+ */
+extern _Thread_local uint32_t trace_id;
+
+/**
+ * @brief Returns the identifier of the next read, counting it towards the
+ * sampling rate.
+ *
+ * @return A new identifier if the read has to be traced, \c 0 otherwise.
+ */
+uint32_t trace_next(void);
+
+/**
+ * @brief Record a span in the ring of the calling thread.
+ *
+ * @param name
+ * Name of the stage, a string literal.
+ * @param id
+ * Identifier of the read the stage belongs to.
+ * @param start
+ * Beginning of the stage, as returned by \c stats_now().
+ * @param end
+ * End of the stage, as returned by \c stats_now().
+ */
+void trace_span(const char *name, uint32_t id, uint64_t start, uint64_t end);
+
+/**
+ * @brief Write the spans kept by the rings in the trace event format.
+ *
+ * @param path
+ * Path of the file written.
+ *
+ * @return The number of spans written, \c -1 if the file cannot be written.
+ */
+long trace_dump(const char *path);
+
+/**
+ * @brief Returns whether tracing is enabled.
+ */
+static inline int trace_enabled(void) {
+	return atomic_load_explicit(&trace_rate, memory_order_relaxed) > 0;
+}
+
+/**
+ * @brief Decide whether the read about to be made by the calling thread is
+ * traced.
+ */
+static inline void trace_sample(void) {
+	trace_id = trace_enabled() ? trace_next() : 0;
+}
+
+/**
+ * @brief Stop tracing on the calling thread, once the read has been
+ * handled.
+ */
+static inline void trace_stop(void) {
+	trace_id = 0;
+}
+
+/**
+ * @brief Returns the beginning of a stage of the read being traced.
+ *
+ * @return The current time, \c 0 if the calling thread is not tracing.
+ */
+static inline uint64_t trace_begin(void) {
+	return trace_id != 0 ? stats_now() : 0;
+}
+
+/**
+ * @brief Record the end of a stage of the read being traced, if any.
+ *
+ * @param name
+ * Name of the stage, a string literal.
+ * @param start
+ * Value returned by \c trace_begin() at the beginning of the stage.
+ */
+static inline void trace_end(const char *name, uint64_t start) {
+	if(trace_id != 0) trace_span(name, trace_id, start, stats_now());
+}
+
+#endif
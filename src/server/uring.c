@@ -0,0 +1,371 @@
+/**
+ * @file uring.c
+ * @brief Minimal io_uring instance driven through the raw system calls.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#include "uring.h"
+
+/* Standard libraries */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+/* System calls and memory mappings */
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+/**
+ * @brief Invoke the io_uring_enter() system call.
+ */
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+	unsigned flags, void *arg, size_t argsz) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		arg, argsz);
+}
+
+/**
+ * @brief Invoke the io_uring_register() system call.
+ */
+static int uring_register(int fd, unsigned opcode, void *arg,
+	unsigned nr_args) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * @brief Publish the entries prepared to the kernel.
+ *
+ * @param ring
+ * Pointer to the instance.
+ *
+ * @return The number of entries the kernel has not consumed yet.
+ */
+static unsigned publish(struct Uring *ring) {
+	__atomic_store_n(ring->sq_tail, ring->sq_pending, __ATOMIC_RELEASE);
+	return ring->sq_pending - __atomic_load_n(ring->sq_head,
+		__ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Create an io_uring instance.
+ *
+ * @param ring
+ * Structure that will describe the instance.
+ * @param entries
+ * Capacity of the submission queue, a power of two.
+ * @param cq_entries
+ * Capacity of the completion queue, a power of two at least \c entries.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours (\c errno is set
+ * accordingly).
+ */
+int uring_init(struct Uring *ring, unsigned entries, unsigned cq_entries) {
+	struct io_uring_params p;
+	char *sq, *cq;
+	memset(ring, 0, sizeof(struct Uring));
+	memset(&p, 0, sizeof p);
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = cq_entries;
+	if((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1) {
+		return -1;
+	}
+	/* the waits with a timeout and the completions kept when the queue
+	overflows are needed by the event loops */
+	if(!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+		close(ring->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+	ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_map_len = p.cq_off.cqes
+		+ p.cq_entries * sizeof(struct io_uring_cqe);
+	/* recent kernels map both queues at once */
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(ring->cq_map_len > ring->sq_map_len) {
+			ring->sq_map_len = ring->cq_map_len;
+		}
+		ring->cq_map_len = ring->sq_map_len;
+	}
+	ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if(ring->sq_map == MAP_FAILED) goto fail;
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_map = ring->sq_map;
+	}
+	else {
+		ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if(ring->cq_map == MAP_FAILED) goto fail;
+	}
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED) goto fail;
+
+	sq = ring->sq_map;
+	cq = ring->cq_map;
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_pending = *ring->sq_tail;
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+
+fail:
+	uring_release(ring);
+	return -1;
+}
+
+/**
+ * @brief Destroy an io_uring instance.
+ *
+ * @param ring
+ * Pointer to the instance.
+ */
+void uring_release(struct Uring *ring) {
+	int err = errno;
+	if(ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_len);
+	}
+	if(ring->cq_map != NULL && ring->cq_map != MAP_FAILED
+		&& ring->cq_map != ring->sq_map) {
+		munmap(ring->cq_map, ring->cq_map_len);
+	}
+	if(ring->sq_map != NULL && ring->sq_map != MAP_FAILED) {
+		munmap(ring->sq_map, ring->sq_map_len);
+	}
+	close(ring->fd);
+	memset(ring, 0, sizeof(struct Uring));
+	ring->fd = -1;
+	errno = err;
+}
+
+/**
+ * @brief Check that an io_uring instance supports some operations.
+ *
+ * @param ring
+ * Pointer to the instance.
+ * @param ops
+ * Array of \c IORING_OP_ codes.
+ * @param count
+ * Number of elements of \c ops.
+ *
+ * @return \c 1 if every operation is supported, \c 0 otherwise.
+ */
+int uring_probe(struct Uring *ring, const int *ops, int count) {
+	const int nops = 256;
+	struct io_uring_probe *probe;
+	int supported = 1;
+	probe = calloc(1, sizeof(struct io_uring_probe)
+		+ nops * sizeof(struct io_uring_probe_op));
+	if(probe == NULL) return 0;
+	if(uring_register(ring->fd, IORING_REGISTER_PROBE, probe, nops) == -1) {
+		free(probe);
+		return 0;
+	}
+	for(int i = 0; i < count; i++) {
+		if(ops[i] > probe->last_op
+			|| !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			supported = 0;
+		}
+	}
+	free(probe);
+	return supported;
+}
+
+/**
+ * @brief Returns a cleared submission queue entry to prepare.
+ *
+ * If the queue is full, the submissions prepared are published to the kernel
+ * first.
+ *
+ * @param ring
+ * Pointer to the instance.
+ *
+ * @return A pointer to the entry, \c NULL if the queue is still full.
+ */
+struct io_uring_sqe *uring_get_sqe(struct Uring *ring) {
+	struct io_uring_sqe *sqe;
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned index;
+	if(ring->sq_pending - head >= ring->sq_entries) {
+		uring_enter(ring->fd, publish(ring), 0, 0, NULL, 0);
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if(ring->sq_pending - head >= ring->sq_entries) return NULL;
+	}
+	index = ring->sq_pending & *ring->sq_mask;
+	ring->sq_array[index] = index;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sq_pending++;
+	return sqe;
+}
+
+/**
+ * @brief Submit the entries prepared and wait for a completion.
+ *
+ * @param ring
+ * Pointer to the instance.
+ * @param timeout
+ * Maximum number of milliseconds to wait, \c -1 to wait indefinitely.
+ *
+ * @return \c 0 if successful or the time has expired, \c -1 if an error
+ * occours (\c errno is set accordingly).
+ */
+int uring_submit_wait(struct Uring *ring, int timeout) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	memset(&arg, 0, sizeof arg);
+	arg.sigmask_sz = _NSIG / 8;
+	if(timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+	if(uring_enter(ring->fd, publish(ring), 1,
+		IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg)
+		== -1) {
+		/* the completions pending are processed before waiting again */
+		if(errno == ETIME || errno == EBUSY) return 0;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Returns the first completion not consumed yet.
+ *
+ * @param ring
+ * Pointer to the instance.
+ *
+ * @return A pointer to the completion, \c NULL if there is none.
+ */
+struct io_uring_cqe *uring_peek_cqe(struct Uring *ring) {
+	unsigned head = *ring->cq_head;
+	if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+/**
+ * @brief Consume the first completion, returned by uring_peek_cqe().
+ *
+ * @param ring
+ * Pointer to the instance.
+ */
+void uring_cqe_seen(struct Uring *ring) {
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Allocate a ring of buffers and provide it to the kernel.
+ *
+ * @param ring
+ * Pointer to the instance.
+ * @param br
+ * Structure that will describe the ring of buffers.
+ * @param entries
+ * Number of buffers, a power of two.
+ * @param size
+ * Length of every buffer.
+ * @param group
+ * Identifier of the group of buffers.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours (\c errno is set
+ * accordingly).
+ */
+int uring_bufring_init(struct Uring *ring, struct UringBufRing *br,
+	unsigned entries, size_t size, int group) {
+	struct io_uring_buf_reg reg;
+	size_t len = entries * sizeof(struct io_uring_buf);
+	br->entries = entries;
+	br->size = size;
+	br->group = group;
+	/* the ring shared with the kernel must be aligned to a page */
+	br->ring = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(br->ring == MAP_FAILED) return -1;
+	if((br->mem = malloc(entries * size)) == NULL) {
+		munmap(br->ring, len);
+		return -1;
+	}
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (uint64_t)(uintptr_t)br->ring;
+	reg.ring_entries = entries;
+	reg.bgid = group;
+	if(uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		int err = errno;
+		free(br->mem);
+		munmap(br->ring, len);
+		errno = err;
+		return -1;
+	}
+	br->ring->tail = 0;
+	for(unsigned i = 0; i < entries; i++) {
+		uring_bufring_recycle(br, i);
+	}
+	return 0;
+}
+
+/**
+ * @brief Release a ring of buffers.
+ *
+ * @param ring
+ * Pointer to the instance the buffers were provided to.
+ * @param br
+ * Pointer to the ring of buffers.
+ */
+void uring_bufring_release(struct Uring *ring, struct UringBufRing *br) {
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof reg);
+	reg.bgid = br->group;
+	uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	munmap(br->ring, br->entries * sizeof(struct io_uring_buf));
+	free(br->mem);
+}
+
+/**
+ * @brief Returns the memory of a buffer selected by the kernel.
+ *
+ * @param br
+ * Pointer to the ring of buffers.
+ * @param id
+ * Identifier of the buffer, from the flags of the completion.
+ *
+ * @return A pointer to the buffer.
+ */
+char *uring_bufring_get(struct UringBufRing *br, unsigned id) {
+	return br->mem + (size_t)id * br->size;
+}
+
+/**
+ * @brief Provide a buffer to the kernel again, once its data has been used.
+ *
+ * @param br
+ * Pointer to the ring of buffers.
+ * @param id
+ * Identifier of the buffer.
+ */
+void uring_bufring_recycle(struct UringBufRing *br, unsigned id) {
+	unsigned short tail = br->ring->tail;
+	struct io_uring_buf *buf = &br->ring->bufs[tail & (br->entries - 1)];
+	buf->addr = (uint64_t)(uintptr_t)uring_bufring_get(br, id);
+	buf->len = br->size;
+	buf->bid = id;
+	/* the kernel sees the buffer only once it is completely described */
+	__atomic_store_n(&br->ring->tail, (unsigned short)(tail + 1),
+		__ATOMIC_RELEASE);
+}
@@ -0,0 +1,235 @@
+/**
+ * @file uring.h
+ * @brief Minimal io_uring instance driven through the raw system calls.
+ *
+ * Only what the event loops need is provided: a submission and a completion
+ * queue mapped in memory, a wait with timeout, the probe of the supported
+ * operations and a ring of provided buffers for the multishot receives.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef URING_H
+#define URING_H
+
+/* Kernel interface */
+#include <linux/io_uring.h>
+
+/* Standard libraries */
+#include <stddef.h>
+
+/**
+ * @struct Uring
+ *
+ * @brief An io_uring instance and its queues mapped in memory.
+ *
+ * @var Uring::fd
+ * File descriptor of the instance.
+ * @var Uring::sq_head
+ * Position of the first submission not consumed by the kernel.
+ * @var Uring::sq_tail
+ * Position following the last submission published to the kernel.
+ * @var Uring::sq_mask
+ * Mask of the positions of the submission queue.
+ * @var Uring::sq_array
+ * Indexes of the submissions in \c sqes.
+ * @var Uring::sqes
+ * Submission queue entries.
+ * @var Uring::sq_pending
+ * Position following the last submission prepared, not published yet.
+ * @var Uring::sq_entries
+ * Capacity of the submission queue.
+ * @var Uring::cq_head
+ * Position of the first completion not consumed yet.
+ * @var Uring::cq_tail
+ * Position following the last completion posted by the kernel.
+ * @var Uring::cq_mask
+ * Mask of the positions of the completion queue.
+ * @var Uring::cqes
+ * Completion queue entries.
+ * @var Uring::sq_map
+ * Memory mapping of the submission queue.
+ * @var Uring::sq_map_len
+ * Length of the submission queue mapping.
+ * @var Uring::cq_map
+ * Memory mapping of the completion queue, the same as \c sq_map if the
+ * kernel maps both queues at once.
+ * @var Uring::cq_map_len
+ * Length of the completion queue mapping.
+ * @var Uring::sqes_len
+ * Length of the mapping of the submission queue entries.
+ */
+struct Uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_pending, sq_entries;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len, sqes_len;
+};
+
+/**
+ * @struct UringBufRing
+ *
+ * @brief Ring of buffers provided to the kernel, filled by the receives
+ * selecting a buffer of its group.
+ *
+ * @var UringBufRing::ring
+ * Ring shared with the kernel.
+ * @var UringBufRing::mem
+ * Memory of the buffers, one after the other.
+ * @var UringBufRing::entries
+ * Number of buffers, a power of two.
+ * @var UringBufRing::size
+ * Length of every buffer.
+ * @var UringBufRing::group
+ * Identifier of the group of buffers.
+ */
+struct UringBufRing {
+	struct io_uring_buf_ring *ring;
+	char *mem;
+	unsigned entries;
+	size_t size;
+	int group;
+};
+
+/**
+ * @brief Create an io_uring instance.
+ *
+ * @param ring
+ * Structure that will describe the instance.
+ * @param entries
+ * Capacity of the submission queue, a power of two.
+ * @param cq_entries
+ * Capacity of the completion queue, a power of two at least \c entries.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours (\c errno is set
+ * accordingly).
+ */
+int uring_init(struct Uring *ring, unsigned entries, unsigned cq_entries);
+
+/**
+ * @brief Destroy an io_uring instance.
+ *
+ * @param ring
+ * Pointer to the instance.
+ */
+void uring_release(struct Uring *ring);
+
+/**
+ * @brief Check that an io_uring instance supports some operations.
+ *
+ * @param ring
+ * Pointer to the instance.
+ * @param ops
+ * Array of \c IORING_OP_ codes.
+ * @param count
+ * Number of elements of \c ops.
+ *
+ * @return \c 1 if every operation is supported, \c 0 otherwise.
+ */
+int uring_probe(struct Uring *ring, const int *ops, int count);
+
+/**
+ * @brief Returns a cleared submission queue entry to prepare.
+ *
+ * If the queue is full, the submissions prepared are published to the kernel
+ * first.
+ *
+ * @param ring
+ * Pointer to the instance.
+ *
+ * @return A pointer to the entry, \c NULL if the queue is still full.
+ */
+struct io_uring_sqe *uring_get_sqe(struct Uring *ring);
+
+/**
+ * @brief Submit the entries prepared and wait for a completion.
+ *
+ * @param ring
+ * Pointer to the instance.
+ * @param timeout
+ * Maximum number of milliseconds to wait, \c -1 to wait indefinitely.
+ *
+ * @return \c 0 if successful or the time has expired, \c -1 if an error
+ * occours (\c errno is set accordingly).
+ */
+int uring_submit_wait(struct Uring *ring, int timeout);
+
+/**
+ * @brief Returns the first completion not consumed yet.
+ *
+ * @param ring
+ * Pointer to the instance.
+ *
+ * @return A pointer to the completion, \c NULL if there is none.
+ */
+struct io_uring_cqe *uring_peek_cqe(struct Uring *ring);
+
+/**
+ * @brief Consume the first completion, returned by uring_peek_cqe().
+ *
+ * @param ring
+ * Pointer to the instance.
+ */
+void uring_cqe_seen(struct Uring *ring);
+
+/**
+ * @brief Allocate a ring of buffers and provide it to the kernel.
+ *
+ * @param ring
+ * Pointer to the instance.
+ * @param br
+ * Structure that will describe the ring of buffers.
+ * @param entries
+ * Number of buffers, a power of two.
+ * @param size
+ * Length of every buffer.
+ * @param group
+ * Identifier of the group of buffers.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours (\c errno is set
+ * accordingly).
+ */
+int uring_bufring_init(struct Uring *ring, struct UringBufRing *br,
+	unsigned entries, size_t size, int group);
+
+/**
+ * @brief Release a ring of buffers.
+ *
+ * @param ring
+ * Pointer to the instance the buffers were provided to.
+ * @param br
+ * Pointer to the ring of buffers.
+ */
+void uring_bufring_release(struct Uring *ring, struct UringBufRing *br);
+
+/**
+ * @brief Returns the memory of a buffer selected by the kernel.
+ *
+ * @param br
+ * Pointer to the ring of buffers.
+ * @param id
+ * Identifier of the buffer, from the flags of the completion.
+ *
+ * @return A pointer to the buffer.
+ */
+char *uring_bufring_get(struct UringBufRing *br, unsigned id);
+
+/**
+ * @brief Provide a buffer to the kernel again, once its data has been used.
+ *
+ * @param br
+ * Pointer to the ring of buffers.
+ * @param id
+ * Identifier of the buffer.
+ */
+void uring_bufring_recycle(struct UringBufRing *br, unsigned id);
+
+#endif
@@ -0,0 +1,521 @@
+/**
+ * @file uringloop.c
+ * @brief Event loop backend submitting the I/O to an io_uring instance.
+ *
+ * Every loop keeps a multishot accept armed on its listener and a receive on
+ * every connection, filling the buffers of a ring provided to the kernel.
+ * Like an epoll loop reading a socket once per event, a connection has a
+ * single receive in progress, so a client cannot get further ahead of the
+ * messages it generates than the data of one buffer. The writes of all the
+ * connections flushed in a batch, such as the recipients of a broadcast,
+ * are submitted together with the next wait, so a batch costs a single
+ * system call however many sockets it writes.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#include "eventloop.h"
+
+/* Kernel interface */
+#include "uring.h"
+
+/* Asynchronous logging */
+#include "log.h"
+
+/* Sampled tracing of the reads */
+#include "trace.h"
+
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+/* Networking libraries */
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/** Identifier of the group of buffers used for the receives */
+#define URINGGROUP 0
+
+/**
+ * Kind of a request, stored in the lowest bits of its user data, the other
+ * bits point to the loop or to the connection.
+ */
+enum UringTag {
+	TAG_ACCEPT = 1,
+	TAG_WAKE,
+	TAG_RECV,
+	TAG_SEND,
+	TAG_MASK = 7
+};
+
+/**
+ * @struct UringLoop
+ *
+ * @brief State of the io_uring backend of an event loop.
+ *
+ * @var UringLoop::ring
+ * io_uring instance of the loop.
+ * @var UringLoop::bufs
+ * Buffers provided to the kernel for the receives.
+ */
+struct UringLoop {
+	struct Uring ring;
+	struct UringBufRing bufs;
+};
+
+/**
+ * @struct UringSend
+ *
+ * @brief Send request in progress on a connection.
+ *
+ * @var UringSend::msg
+ * Message describing the frames sent.
+ * @var UringSend::trace
+ * Identifier of the traced read that produced one of the frames, \c 0 if
+ * none is traced.
+ * @var UringSend::start
+ * Time the request has been prepared at, if traced.
+ * @var UringSend::iov
+ * Frames sent, they stay in the output queue until the request completes.
+ */
+struct UringSend {
+	struct msghdr msg;
+	uint32_t trace;
+	uint64_t start;
+	struct iovec iov[];
+};
+
+/**
+ * @brief Check that the kernel supports every operation used by the backend.
+ *
+ * The rings of provided buffers have been introduced together with the
+ * multishot accepts, registering one detects both.
+ *
+ * @return \c 1 if the backend can be used, \c 0 otherwise.
+ */
+static int uring_supported(void) {
+	static const int ops[] = {
+		IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG,
+		IORING_OP_POLL_ADD
+	};
+	struct Uring ring;
+	struct UringBufRing bufs;
+	int supported;
+	if(uring_init(&ring, 8, 16) == -1) return 0;
+	supported = uring_probe(&ring, ops, sizeof ops / sizeof ops[0])
+		&& uring_bufring_init(&ring, &bufs, 1, URINGBUFLEN, URINGGROUP) == 0;
+	if(supported) uring_bufring_release(&ring, &bufs);
+	uring_release(&ring);
+	return supported;
+}
+
+/**
+ * @brief Create the io_uring instance of a loop and provide its buffers.
+ *
+ * @param loop
+ * Event loop being initialized.
+ *
+ * @return \c 0 if successful, \c -1 if an error occours.
+ */
+static int uring_loop_init(struct EventLoop *loop) {
+	struct UringLoop *u = malloc(sizeof(struct UringLoop));
+	if(u == NULL) {
+		perror("server: malloc");
+		return -1;
+	}
+	if(uring_init(&u->ring, URINGENTRIES, URINGCQENTRIES) == -1) {
+		perror("server: io_uring_setup");
+		free(u);
+		return -1;
+	}
+	if(uring_bufring_init(&u->ring, &u->bufs, URINGBUFS, URINGBUFLEN,
+		URINGGROUP) == -1) {
+		perror("server: io_uring_register");
+		uring_release(&u->ring);
+		free(u);
+		return -1;
+	}
+	/* the kernel waits for the connections itself, a non-blocking listener
+	would make the accepts fail instead */
+	if(loop->listenfd != -1) {
+		int flags = fcntl(loop->listenfd, F_GETFL);
+		if(flags == -1
+			|| fcntl(loop->listenfd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+			perror("server: fcntl");
+		}
+	}
+	loop->uring = u;
+	return 0;
+}
+
+/**
+ * @brief Returns a submission queue entry for a request.
+ *
+ * @param loop
+ * Event loop submitting the request.
+ * @param ptr
+ * Loop or connection the request refers to.
+ * @param tag
+ * Kind of the request.
+ *
+ * @return A pointer to the entry, \c NULL if the queue is full.
+ */
+static struct io_uring_sqe *get_sqe(struct EventLoop *loop, void *ptr,
+	enum UringTag tag) {
+	struct io_uring_sqe *sqe = uring_get_sqe(&loop->uring->ring);
+	if(sqe == NULL) {
+		LOG(LOGERROR, "server: io_uring submission queue full\n");
+		return NULL;
+	}
+	sqe->user_data = (uint64_t)(uintptr_t)ptr | tag;
+	return sqe;
+}
+
+/**
+ * @brief Accept the connections of the loop's listener until cancelled.
+ *
+ * @param loop
+ * Event loop owning the listener.
+ */
+static void arm_accept(struct EventLoop *loop) {
+	struct io_uring_sqe *sqe = get_sqe(loop, loop, TAG_ACCEPT);
+	if(sqe == NULL) return;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = loop->listenfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/**
+ * @brief Report every wake up of the loop until cancelled.
+ *
+ * @param loop
+ * Event loop to wake up.
+ */
+static void arm_wake(struct EventLoop *loop) {
+	struct io_uring_sqe *sqe = get_sqe(loop, loop, TAG_WAKE);
+	if(sqe == NULL) return;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = loop->wakefd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+/**
+ * @brief Receive the next data of a connection into one of the provided
+ * buffers.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection.
+ *
+ * @return \c 0 if successful, \c -1 if the request cannot be submitted.
+ */
+static int arm_recv(struct EventLoop *loop, struct Connection *conn) {
+	struct io_uring_sqe *sqe = get_sqe(loop, conn, TAG_RECV);
+	if(sqe == NULL) return -1;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->client_info.sockfd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URINGGROUP;
+	conn->pending_ops++;
+	return 0;
+}
+
+/**
+ * @brief Flush a connection again in the next batch, after its send could
+ * not be prepared.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection.
+ */
+static void retry_flush(struct EventLoop *loop, struct Connection *conn) {
+	if(!conn->flush_scheduled) {
+		conn->flush_scheduled = 1;
+		eventloop_schedule_flush(loop, conn);
+	}
+}
+
+/**
+ * @brief Start writing the messages queued for a connection.
+ *
+ * A single send is in progress on a connection at any time, so the messages
+ * are written in order: the ones queued meanwhile are sent when it
+ * completes. If the send cannot be prepared the connection stays in the
+ * flush list, and is flushed again once the pending requests have been
+ * submitted.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection.
+ */
+static void uring_flush(struct EventLoop *loop, struct Connection *conn) {
+	struct UringSend *send;
+	struct io_uring_sqe *sqe;
+	size_t len = outqueue_len(&conn->outq);
+	int cnt;
+	if(conn->sending != NULL || len == 0) return;
+	if(len > WRITEVLEN) len = WRITEVLEN;
+	send = malloc(sizeof(struct UringSend) + len * sizeof(struct iovec));
+	if(send == NULL) {
+		LOG(LOGERROR, "server: malloc: %m\n");
+		retry_flush(loop, conn);
+		return;
+	}
+	cnt = outqueue_iov(&conn->outq, send->iov, len);
+	memset(&send->msg, 0, sizeof(struct msghdr));
+	send->msg.msg_iov = send->iov;
+	send->msg.msg_iovlen = cnt;
+	/* the send is traced if it carries a traced message */
+	send->trace = trace_enabled() ? outqueue_trace(&conn->outq, cnt) : 0;
+	send->start = send->trace != 0 ? stats_now() : 0;
+	if((sqe = get_sqe(loop, conn, TAG_SEND)) == NULL) {
+		free(send);
+		retry_flush(loop, conn);
+		return;
+	}
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = conn->client_info.sockfd;
+	sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	conn->sending = send;
+	conn->inflight = cnt;
+	conn->pending_ops++;
+}
+
+/**
+ * @brief Close the socket of a connection.
+ *
+ * The requests in progress hold the socket open: shutting it down makes them
+ * complete, the connection is released after the last one.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection.
+ */
+static void uring_close(struct EventLoop *loop, struct Connection *conn) {
+	(void)loop;
+	shutdown(conn->client_info.sockfd, SHUT_RDWR);
+	close(conn->client_info.sockfd);
+}
+
+/**
+ * @brief Release a connection retired while some requests were pending,
+ * once they have all completed.
+ *
+ * @param conn
+ * Pointer to the connection.
+ */
+static void release_if_done(struct Connection *conn) {
+	if(conn->released && conn->pending_ops == 0) {
+		conn_destroy(conn);
+	}
+}
+
+/**
+ * @brief Handle a connection accepted by the listener.
+ *
+ * @param loop
+ * Event loop owning the listener.
+ * @param cqe
+ * Completion of the accept.
+ */
+static void on_accept(struct EventLoop *loop, const struct io_uring_cqe *cqe) {
+	struct sockaddr_storage client_addr;
+	socklen_t sin_size = sizeof client_addr;
+	struct Connection *conn;
+	if(cqe->res >= 0) {
+		if(getpeername(cqe->res, (struct sockaddr *)&client_addr,
+			&sin_size) == -1) {
+			memset(&client_addr, 0, sizeof client_addr);
+		}
+		conn = eventloop_accept(loop, cqe->res, &client_addr);
+		if(conn != NULL && arm_recv(loop, conn) == -1) {
+			eventloop_close(loop, conn);
+		}
+	}
+	else if(cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+		errno = -cqe->res;
+		LOG(LOGERROR, "server: accept: %m\n");
+	}
+	/* the kernel may stop a multishot request, it is submitted again */
+	if(!(cqe->flags & IORING_CQE_F_MORE)) {
+		arm_accept(loop);
+	}
+}
+
+/**
+ * @brief Reset the wake up file descriptor of the loop, the inbox is read
+ * after the completions.
+ *
+ * @param loop
+ * Event loop woken up.
+ * @param cqe
+ * Completion of the poll.
+ */
+static void on_wake(struct EventLoop *loop, const struct io_uring_cqe *cqe) {
+	uint64_t count;
+	if(read(loop->wakefd, &count, sizeof count) == -1 && errno != EAGAIN) {
+		LOG(LOGERROR, "server: eventfd read: %m\n");
+	}
+	if(!(cqe->flags & IORING_CQE_F_MORE)) {
+		arm_wake(loop);
+	}
+}
+
+/**
+ * @brief Dispatch the data received on a connection.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection.
+ * @param cqe
+ * Completion of the receive.
+ */
+static void on_recv(struct EventLoop *loop, struct Connection *conn,
+	const struct io_uring_cqe *cqe) {
+	struct UringBufRing *bufs = &loop->uring->bufs;
+	conn->pending_ops--;
+	if(cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+		unsigned id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		stats_add(&loop->stats.bytes_in, cqe->res);
+		if(!conn->closed) {
+			/* the kernel has already received the data, the span only
+			covers its copy into the decoder */
+			trace_sample();
+			uint64_t start = trace_begin();
+			int ret = decoder_feed(&conn->decoder,
+				uring_bufring_get(bufs, id), cqe->res);
+			trace_end("receive", start);
+			if(ret == -1 || eventloop_dispatch(loop, conn) == -1) {
+				eventloop_close(loop, conn);
+			}
+			trace_stop();
+		}
+		uring_bufring_recycle(bufs, id);
+	}
+	/* the buffers are exhausted, the ones consumed meanwhile have been
+	provided again */
+	else if(!conn->closed && cqe->res != -ENOBUFS) {
+		if(cqe->res < 0) {
+			errno = -cqe->res;
+			LOG(LOGERROR, "server: recv: %m\n");
+		}
+		/* Connection with the client lost */
+		eventloop_close(loop, conn);
+	}
+	if(!conn->closed && arm_recv(loop, conn) == -1) {
+		eventloop_close(loop, conn);
+	}
+	release_if_done(conn);
+}
+
+/**
+ * @brief Remove the messages sent from the output queue of a connection and
+ * send the following ones.
+ *
+ * @param loop
+ * Event loop owning the connection.
+ * @param conn
+ * Pointer to the connection.
+ * @param cqe
+ * Completion of the send.
+ */
+static void on_send(struct EventLoop *loop, struct Connection *conn,
+	const struct io_uring_cqe *cqe) {
+	if(conn->sending->trace != 0) {
+		trace_span("write", conn->sending->trace, conn->sending->start,
+			stats_now());
+	}
+	free(conn->sending);
+	conn->sending = NULL;
+	conn->inflight = 0;
+	conn->pending_ops--;
+	if(!conn->closed) {
+		if(cqe->res < 0) {
+			/* the connection is broken, the receive will notice it and
+			close it */
+			stats_add(&loop->stats.discarded,
+				outqueue_release(&conn->outq));
+		}
+		else {
+			stats_add(&loop->stats.bytes_out, cqe->res);
+			stats_add(&loop->stats.written, outqueue_consume(&conn->outq,
+				cqe->res, &loop->stats.send));
+			uring_flush(loop, conn);
+		}
+	}
+	release_if_done(conn);
+}
+
+/**
+ * @brief Routine executed by every event loop thread.
+ *
+ * @param param Pointer to the \c EventLoop structure of the thread.
+ *
+ * @return Always a \c NULL pointer.
+ */
+static void *uring_run(void *param) {
+	struct EventLoop *loop = param;
+	struct Uring *ring = &loop->uring->ring;
+	struct io_uring_cqe *cqe, c;
+	int timeout = -1, n;
+	if(eventloop_begin(loop) == -1) return NULL;
+	if(loop->listenfd != -1) arm_accept(loop);
+	arm_wake(loop);
+	while(1) {
+		/* the requests prepared in the previous batch are submitted
+		together with the wait */
+		if(uring_submit_wait(ring, timeout) == -1) {
+			if(errno == EINTR) continue;
+			LOG(LOGERROR, "server: io_uring_enter: %m\n");
+			break;
+		}
+		/* like a batch of epoll events, the batch is bounded so that the
+		messages produced are written before receiving more */
+		for(n = 0; n < MAXEVENTS && (cqe = uring_peek_cqe(ring)) != NULL;
+			n++) {
+			/* the slot is given back before handling the completion, which
+			may prepare new requests */
+			c = *cqe;
+			uring_cqe_seen(ring);
+			void *ptr = (void *)(uintptr_t)(c.user_data & ~(uint64_t)TAG_MASK);
+			switch(c.user_data & TAG_MASK) {
+				case TAG_ACCEPT : on_accept(loop, &c); break;
+				case TAG_WAKE : on_wake(loop, &c); break;
+				case TAG_RECV : on_recv(loop, ptr, &c); break;
+				case TAG_SEND : on_send(loop, ptr, &c); break;
+			}
+		}
+		timeout = eventloop_end_batch(loop);
+	}
+	return NULL;
+}
+
+/**
+ * Backend submitting the I/O to an io_uring instance.
+ */
+const struct LoopBackend uring_backend = {
+	.name = "io_uring",
+	.supported = uring_supported,
+	.init = uring_loop_init,
+	.run = uring_run,
+	.flush = uring_flush,
+	.close = uring_close
+};
@@ -10,8 +10,11 @@
  * @copyright Copyright (c) 2016-2017, Enrico Vianello
  */
 
-/* Necessary for the definition of pthread_t */
-#include <pthread.h>
+#ifndef NETWORKDEF_H
+#define NETWORKDEF_H
+
+/* Standard libraries */
+#include <stdint.h>
 
 /*************************
  * Connection parameters *
@@ -23,11 +26,28 @@
 #define CMDLEN 32
 /** Default alias for new clients */
 #define DEFAULTALIAS "Anonymous"
-/** Payload size of a single packet.
-To contain the alias list, it should be at least ALIASLEN*MAXCLIENTS */
-#define PAYLEN 2048
-/** maximum number of clients connected */
-#define MAXCLIENTS 64
+/** Maximum number of recipients of a MULTICAST packet, the following ones
+are reported as not found */
+#define MAXRECIPIENTS 64
+
+/*******************
+ * Frame structure *
+ *******************/
+
+/** Version of the wire format, sent as first byte of every frame */
+#define PROTOVERSION 1
+/** Size of the fixed header preceding every frame:
+version (1 byte), action (1 byte), flags (1 byte), alias length (1 byte),
+payload length (4 bytes, network byte order) */
+#define HEADERLEN 8
+/** Maximum payload length accepted for a single frame */
+#define MAXPAYLEN 65536
+/** Flag of a WHISPER packet whose target is a session ID, written in
+decimal, instead of an alias */
+#define FLAGSESSIONID 0x01
+/** Flag of a LIST_A packet continued by the next LIST_A packet, for a list
+longer than \c MAXPAYLEN */
+#define FLAGMORE 0x02
 
 /******************************************************
  * Possible contenents of the packet's "action" field *
@@ -44,10 +64,42 @@ To contain the alias list, it should be at least ALIASLEN*MAXCLIENTS */
 #define SHOUT 4
 /** request to the server to obtain the client list */
 #define LIST_Q 5
-/** packet containing the client list, is often sent in response to LIST_Q */
+/** packet containing the client list, one "alias\tsession ID" per line, is
+often sent in response to LIST_Q. Its alias field is empty. A list longer
+than \c MAXPAYLEN is split in several packets, all but the last flagged with
+\c FLAGMORE */
 #define LIST_A 6
-/** User Not Found, error packet */
+/** User Not Found, error packet. The alias field contains the client not
+found, or the payload contains the recipients of a MULTICAST not found, one
+per line */
 #define UNF 7
+/** Alias In Use, error packet sent in response to an ALIAS request, the
+payload contains the alias kept by the client */
+#define AIU 8
+/** request to search the history, the payload contains the terms searched */
+#define SEARCH_Q 9
+/** packet containing the latest messages found, one "alias\tmessage" per line
+from the oldest to the newest, sent in response to SEARCH_Q */
+#define SEARCH_A 10
+/** request to join a room, the payload contains its name. The following
+SHOUT and LIST_Q packets only concern the members of the room. The server
+answers with a JOIN packet containing the name of the room joined, or no
+payload if the join failed and the client is in no room */
+#define JOIN 11
+/** request to leave the room joined */
+#define PART 12
+/** heartbeat, sent by the server to a client that has been idle for a while
+and by a client to complete its handshake, answered with PONG */
+#define PING 13
+/** answer to a PING packet */
+#define PONG 14
+/** packet sent by the server to a new client, the payload contains the ID
+of its session in decimal */
+#define SESSION 15
+/** request to send a message to a list of clients, the payload contains
+their aliases separated by commas, or the IDs of their sessions after a '#',
+followed by a space and the message */
+#define MULTICAST 16
 
 /*************************
  * Structure definitions *
@@ -61,17 +113,18 @@ To contain the alias list, it should be at least ALIASLEN*MAXCLIENTS */
  *
  * This structure is used by the server application
  *
- * @var ClientInfo::thread_ID
- * Pointer to the server's thread associated to this connection.
  * @var ClientInfo::sockfd
  * Socket file descriptor associated with this connection.
  * @var ClientInfo::alias
  * Alias of the client associated to this connection.
+ * @var ClientInfo::id
+ * ID of the session assigned by the server, \c 0 if none. Unlike the
+ * socket, it is not reused as soon as the connection is closed.
  */
 struct ClientInfo {
-	pthread_t thread_ID;
 	int sockfd;
 	char alias[ALIASLEN];
+	uint32_t id;
 };
 
 /**
@@ -80,21 +133,31 @@ struct ClientInfo {
  * @brief Structure representing a single packet exchanged between the server
  * and the clients.
  *
+ * The packet is not sent as it is: only the used part of the alias and of the
+ * payload is transmitted after a header of \c HEADERLEN bytes, see
+ * \c packetcodec.h
+ *
  * @var Packet::action
  * Action code of this packet. The possible values can be found in the
  * definitions of the file \c networkdef.h
+ * @var Packet::flags
+ * Bit field of options of the packet, \c 0 if none: \c FLAGSESSIONID for a
+ * WHISPER packet, \c FLAGMORE for a LIST_A packet.
  * @var Packet::alias
  * Field that can contain an alias. Its use is explained in the protocol
  * description.
  * @var Packet::len
- * Field that can contain an integer. Its use is explained in the protocol
- * description.
+ * Length of the payload, the terminating null character excluded.
  * @var Packet::payload
- * Packet's main body.
+ * Packet's main body, a null-terminated string of \c len characters. It
+ * points to memory owned by whoever built or decoded the packet.
  */
 struct Packet {
 	unsigned char action;
+	unsigned char flags;
 	char alias[ALIASLEN];
 	int len;
-	char payload[PAYLEN];
+	char *payload;
 };
+
+#endif
@@ -11,6 +11,9 @@
 
 #include "networkutil.h"
 
+/* File control options */
+#include <fcntl.h>
+
 /**
 * @brief Get the address structure correctly formatted: IPv4 or IPv6 from a
 * generic \c sockaddr structure.
@@ -27,3 +30,18 @@ void *get_in_addr(struct sockaddr *sa) {
 
 	return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
+
+/**
+* @brief Put a file descriptor in non-blocking mode.
+*
+* @param fd The file descriptor.
+*
+* @return \c 0 if successful, \c -1 if an error occurred.
+*/
+int set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1) {
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
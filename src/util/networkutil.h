@@ -9,6 +9,9 @@
  * @copyright Copyright (c) 2016-2017, Enrico Vianello
  */
 
+#ifndef NETWORKUTIL_H
+#define NETWORKUTIL_H
+
 /* Networking libraries */
 #include <netdb.h>
 #include <sys/types.h>
@@ -26,3 +29,14 @@
 * IPv4) or \c sin6_addr (if the address is IPv6).
 */
 void *get_in_addr(struct sockaddr *sa);
+
+/**
+* @brief Put a file descriptor in non-blocking mode.
+*
+* @param fd The file descriptor.
+*
+* @return \c 0 if successful, \c -1 if an error occurred.
+*/
+int set_nonblocking(int fd);
+
+#endif
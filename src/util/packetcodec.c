@@ -0,0 +1,302 @@
+/**
+ * @file packetcodec.c
+ * @brief Encoding and decoding of the packets exchanged between the server and
+ * the clients.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#include "packetcodec.h"
+
+/* Standard libraries */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+/* Networking libraries */
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+/**
+ * Payload of the packets decoded from a frame without payload.
+ */
+static char empty_payload[1] = "";
+
+/**
+ * @brief Compute the length of a whole frame from its header.
+ *
+ * @param buf
+ * Buffer containing at least \c HEADERLEN bytes of the frame.
+ *
+ * @return The length of the frame, header included, or \c -1 if the header
+ * is malformed.
+ */
+ssize_t packet_framelen(const char *buf) {
+	const unsigned char *header = (const unsigned char *)buf;
+	uint32_t paylen;
+	if(header[0] != PROTOVERSION) return -1;
+	if(header[3] > ALIASLEN - 1) return -1;
+	memcpy(&paylen, &header[4], sizeof(uint32_t));
+	paylen = ntohl(paylen);
+	/* the payload length includes the terminating null character */
+	if(paylen > MAXPAYLEN + 1) return -1;
+	return HEADERLEN + header[3] + paylen;
+}
+
+/**
+ * @brief Decode a frame into a packet.
+ *
+ * The payload is not copied: the packet's payload points inside \c buf, that
+ * must stay valid as long as the packet is used.
+ *
+ * @param buf
+ * Buffer containing the frame.
+ * @param len
+ * Number of bytes available in \c buf.
+ * @param packet
+ * Pointer to the packet that will contain the decoded data.
+ *
+ * @return The number of bytes consumed, \c 0 if \c buf does not contain a
+ * whole frame yet, \c -1 if the frame is malformed.
+ */
+ssize_t packet_decode(char *buf, size_t len, struct Packet *packet) {
+	ssize_t framelen;
+	size_t aliaslen, paylen;
+	if(len < HEADERLEN) return 0;
+	if((framelen = packet_framelen(buf)) == -1) return -1;
+	if(len < (size_t)framelen) return 0;
+	aliaslen = (unsigned char)buf[3];
+	paylen = framelen - HEADERLEN - aliaslen;
+	packet->action = buf[1];
+	packet->flags = buf[2];
+	memcpy(packet->alias, &buf[HEADERLEN], aliaslen);
+	packet->alias[aliaslen] = '\0';
+	if(paylen == 0) {
+		packet->len = 0;
+		packet->payload = empty_payload;
+	} else {
+		/* the payload must be a proper string */
+		if(buf[framelen - 1] != '\0') return -1;
+		packet->len = paylen - 1;
+		packet->payload = &buf[HEADERLEN + aliaslen];
+	}
+	return framelen;
+}
+
+/**
+ * @brief Compute the length of the frame encoding a packet.
+ *
+ * @param packet
+ * Pointer to the packet.
+ *
+ * @return The number of bytes necessary to encode the packet.
+ */
+size_t packet_size(const struct Packet *packet) {
+	size_t size = HEADERLEN + strnlen(packet->alias, ALIASLEN - 1);
+	if(packet->len > 0) {
+		size += packet->len + 1;
+	}
+	return size;
+}
+
+/**
+ * @brief Encode a packet into a frame.
+ *
+ * @param packet
+ * Pointer to the packet.
+ * @param buf
+ * Buffer of at least \c packet_size(packet) bytes where the frame will be
+ * written.
+ *
+ * @return The number of bytes written.
+ */
+size_t packet_encode(const struct Packet *packet, char *buf) {
+	size_t aliaslen = strnlen(packet->alias, ALIASLEN - 1);
+	uint32_t paylen = packet->len > 0 ? packet->len + 1 : 0;
+	uint32_t netpaylen = htonl(paylen);
+	buf[0] = PROTOVERSION;
+	buf[1] = packet->action;
+	buf[2] = packet->flags;
+	buf[3] = aliaslen;
+	memcpy(&buf[4], &netpaylen, sizeof(uint32_t));
+	memcpy(&buf[HEADERLEN], packet->alias, aliaslen);
+	if(paylen > 0) {
+		memcpy(&buf[HEADERLEN + aliaslen], packet->payload, packet->len);
+		buf[HEADERLEN + aliaslen + packet->len] = '\0';
+	}
+	return HEADERLEN + aliaslen + paylen;
+}
+
+/**
+ * @brief Send a packet through a blocking socket.
+ *
+ * @param sockfd
+ * Socket file descriptor.
+ * @param packet
+ * Pointer to the packet.
+ *
+ * @return \c 0 if successful, \c -1 if an error occurred.
+ */
+int packet_send(int sockfd, const struct Packet *packet) {
+	size_t size = packet_size(packet), sent = 0;
+	char *buf = malloc(size);
+	if(buf == NULL) return -1;
+	packet_encode(packet, buf);
+	while(sent < size) {
+		ssize_t n = send(sockfd, buf + sent, size - sent, MSG_NOSIGNAL);
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			free(buf);
+			return -1;
+		}
+		sent += n;
+	}
+	free(buf);
+	return 0;
+}
+
+/**
+ * @brief Initialize a frame decoder.
+ *
+ * @param dec
+ * Pointer to the decoder.
+ */
+void decoder_init(struct FrameDecoder *dec) {
+	ringbuf_init(&dec->ring);
+	dec->scratch = NULL;
+	dec->scratchcap = 0;
+	dec->pending = 0;
+}
+
+/**
+ * @brief Release the memory used by a frame decoder.
+ *
+ * @param dec
+ * Pointer to the decoder.
+ */
+void decoder_release(struct FrameDecoder *dec) {
+	ringbuf_release(&dec->ring);
+	free(dec->scratch);
+	decoder_init(dec);
+}
+
+/**
+ * @brief Receive from a socket as many bytes as the decoder can store with a
+ * single system call.
+ *
+ * The packets received must be extracted with decoder_next() before calling
+ * this method again.
+ *
+ * @param dec
+ * Pointer to the decoder.
+ * @param sockfd
+ * Socket file descriptor.
+ *
+ * @return The number of bytes received, \c 0 if the connection has been
+ * closed, \c -1 if an error occurred (\c errno is set accordingly).
+ */
+ssize_t decoder_recv(struct FrameDecoder *dec, int sockfd) {
+	struct RingBuffer *ring = &dec->ring;
+	ssize_t n;
+	/* the memory is allocated only while some data is stored, and grown if
+	the packets have not been extracted */
+	if(ringbuf_reserve(ring, ring->cap == 0 ? DECODERBUFLEN :
+		ringbuf_len(ring) + 1) == -1) {
+		errno = ENOMEM;
+		return -1;
+	}
+	n = ringbuf_read(ring, sockfd);
+	/* do not keep memory for a connection that has nothing to decode */
+	if(n <= 0 && ringbuf_len(ring) == 0) {
+		ringbuf_release(ring);
+	}
+	return n;
+}
+
+/**
+ * @brief Append bytes already received to a frame decoder.
+ *
+ * Used when the bytes are received by other means than decoder_recv(). The
+ * packets received must be extracted with decoder_next() before calling this
+ * method again.
+ *
+ * @param dec
+ * Pointer to the decoder.
+ * @param data
+ * Bytes received.
+ * @param len
+ * Number of bytes received.
+ *
+ * @return \c 0 if successful, \c -1 if the memory could not be allocated.
+ */
+int decoder_feed(struct FrameDecoder *dec, const char *data, size_t len) {
+	struct RingBuffer *ring = &dec->ring;
+	/* the previous packet is not used anymore, its bytes make room for the
+	new ones */
+	ringbuf_consume(ring, dec->pending);
+	dec->pending = 0;
+	if(ringbuf_reserve(ring, ringbuf_len(ring) + len > DECODERBUFLEN ?
+		ringbuf_len(ring) + len : DECODERBUFLEN) == -1) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ringbuf_write(ring, data, len);
+	return 0;
+}
+
+/**
+ * @brief Extract the next complete packet from a frame decoder.
+ *
+ * The payload of the packet points to memory owned by the decoder, valid
+ * until the following call on the same decoder.
+ *
+ * @param dec
+ * Pointer to the decoder.
+ * @param packet
+ * Pointer to the packet that will contain the decoded data.
+ *
+ * @return \c 1 if a packet has been decoded, \c 0 if more data is needed,
+ * \c -1 if the stream contains a malformed frame.
+ */
+int decoder_next(struct FrameDecoder *dec, struct Packet *packet) {
+	struct RingBuffer *ring = &dec->ring;
+	char header[HEADERLEN];
+	ssize_t framelen;
+	size_t len, contiguous;
+	char *frame;
+	/* the previous packet is not used anymore */
+	ringbuf_consume(ring, dec->pending);
+	dec->pending = 0;
+	len = ringbuf_len(ring);
+	if(len < HEADERLEN) {
+		if(len == 0) ringbuf_release(ring);
+		return 0;
+	}
+	ringbuf_peek(ring, header, HEADERLEN);
+	if((framelen = packet_framelen(header)) == -1) return -1;
+	if(len < (size_t)framelen) {
+		/* make sure the rest of the frame will fit in the ring */
+		if(ringbuf_reserve(ring, framelen) == -1) return -1;
+		return 0;
+	}
+	frame = ringbuf_data(ring, &contiguous);
+	/* a frame wrapping around the end of the ring is copied to be decoded */
+	if(contiguous < (size_t)framelen) {
+		if(dec->scratchcap < (size_t)framelen) {
+			char *newbuf = realloc(dec->scratch, framelen);
+			if(newbuf == NULL) return -1;
+			dec->scratch = newbuf;
+			dec->scratchcap = framelen;
+		}
+		ringbuf_peek(ring, dec->scratch, framelen);
+		frame = dec->scratch;
+	}
+	if(packet_decode(frame, framelen, packet) != framelen) return -1;
+	dec->pending = framelen;
+	return 1;
+}
@@ -0,0 +1,197 @@
+/**
+ * @file packetcodec.h
+ * @brief Encoding and decoding of the packets exchanged between the server and
+ * the clients.
+ *
+ * Every packet is transmitted as a frame made of a fixed header of
+ * \c HEADERLEN bytes followed by the alias (without terminator) and the
+ * payload (with its terminating null character, omitted if the payload is
+ * empty):
+ *
+ * | version | action | flags | alias length | payload length | alias | payload |
+ * |---------|--------|-------|--------------|----------------|-------|---------|
+ * | 1 byte  | 1 byte | 1 byte| 1 byte       | 4 bytes        | ...   | ...     |
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef PACKETCODEC_H
+#define PACKETCODEC_H
+
+/* Necessary for the definition of the struct Packet */
+#include "networkdef.h"
+
+/* Buffer storing the received bytes */
+#include "ringbuffer.h"
+
+/* Standard libraries */
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * @brief Compute the length of a whole frame from its header.
+ *
+ * @param buf
+ * Buffer containing at least \c HEADERLEN bytes of the frame.
+ *
+ * @return The length of the frame, header included, or \c -1 if the header
+ * is malformed.
+ */
+ssize_t packet_framelen(const char *buf);
+
+/**
+ * @brief Decode a frame into a packet.
+ *
+ * The payload is not copied: the packet's payload points inside \c buf, that
+ * must stay valid as long as the packet is used.
+ *
+ * @param buf
+ * Buffer containing the frame.
+ * @param len
+ * Number of bytes available in \c buf.
+ * @param packet
+ * Pointer to the packet that will contain the decoded data.
+ *
+ * @return The number of bytes consumed, \c 0 if \c buf does not contain a
+ * whole frame yet, \c -1 if the frame is malformed.
+ */
+ssize_t packet_decode(char *buf, size_t len, struct Packet *packet);
+
+/**
+ * @brief Compute the length of the frame encoding a packet.
+ *
+ * @param packet
+ * Pointer to the packet.
+ *
+ * @return The number of bytes necessary to encode the packet.
+ */
+size_t packet_size(const struct Packet *packet);
+
+/**
+ * @brief Encode a packet into a frame.
+ *
+ * @param packet
+ * Pointer to the packet.
+ * @param buf
+ * Buffer of at least \c packet_size(packet) bytes where the frame will be
+ * written.
+ *
+ * @return The number of bytes written.
+ */
+size_t packet_encode(const struct Packet *packet, char *buf);
+
+/**
+ * @brief Send a packet through a blocking socket.
+ *
+ * @param sockfd
+ * Socket file descriptor.
+ * @param packet
+ * Pointer to the packet.
+ *
+ * @return \c 0 if successful, \c -1 if an error occurred.
+ */
+int packet_send(int sockfd, const struct Packet *packet);
+
+/** Initial size of the buffer of a frame decoder */
+#define DECODERBUFLEN 16384
+
+/**
+ * @struct FrameDecoder
+ *
+ * @brief Streaming decoder extracting the frames from the bytes received
+ * through a connection.
+ *
+ * The received bytes are stored in a ring buffer, filled with a single large
+ * read, from which every complete frame is decoded; the bytes of a partial
+ * frame are kept until the rest arrives. The memory is released whenever the
+ * buffer becomes empty, so idle connections do not hold any.
+ *
+ * @var FrameDecoder::ring
+ * Bytes received and not yet decoded.
+ * @var FrameDecoder::scratch
+ * Memory used to decode the frames wrapping around the end of the ring.
+ * @var FrameDecoder::scratchcap
+ * Allocated size of \c scratch.
+ * @var FrameDecoder::pending
+ * Length of the last frame decoded, that is removed from the ring only at the
+ * following call, since the decoded packet points inside it.
+ */
+struct FrameDecoder {
+	struct RingBuffer ring;
+	char *scratch;
+	size_t scratchcap;
+	size_t pending;
+};
+
+/**
+ * @brief Initialize a frame decoder.
+ *
+ * @param dec
+ * Pointer to the decoder.
+ */
+void decoder_init(struct FrameDecoder *dec);
+
+/**
+ * @brief Release the memory used by a frame decoder.
+ *
+ * @param dec
+ * Pointer to the decoder.
+ */
+void decoder_release(struct FrameDecoder *dec);
+
+/**
+ * @brief Receive from a socket as many bytes as the decoder can store with a
+ * single system call.
+ *
+ * The packets received must be extracted with decoder_next() before calling
+ * this method again.
+ *
+ * @param dec
+ * Pointer to the decoder.
+ * @param sockfd
+ * Socket file descriptor.
+ *
+ * @return The number of bytes received, \c 0 if the connection has been
+ * closed, \c -1 if an error occurred (\c errno is set accordingly).
+ */
+ssize_t decoder_recv(struct FrameDecoder *dec, int sockfd);
+
+/**
+ * @brief Append bytes already received to a frame decoder.
+ *
+ * Used when the bytes are received by other means than decoder_recv(). The
+ * packets received must be extracted with decoder_next() before calling this
+ * method again.
+ *
+ * @param dec
+ * Pointer to the decoder.
+ * @param data
+ * Bytes received.
+ * @param len
+ * Number of bytes received.
+ *
+ * @return \c 0 if successful, \c -1 if the memory could not be allocated.
+ */
+int decoder_feed(struct FrameDecoder *dec, const char *data, size_t len);
+
+/**
+ * @brief Extract the next complete packet from a frame decoder.
+ *
+ * The payload of the packet points to memory owned by the decoder, valid
+ * until the following call on the same decoder.
+ *
+ * @param dec
+ * Pointer to the decoder.
+ * @param packet
+ * Pointer to the packet that will contain the decoded data.
+ *
+ * @return \c 1 if a packet has been decoded, \c 0 if more data is needed,
+ * \c -1 if the stream contains a malformed frame.
+ */
+int decoder_next(struct FrameDecoder *dec, struct Packet *packet);
+
+#endif
@@ -0,0 +1,202 @@
+/**
+ * @file ringbuffer.c
+ * @brief Growable byte ring buffer used to receive data from the sockets.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#include "ringbuffer.h"
+
+/* Standard libraries */
+#include <stdlib.h>
+#include <string.h>
+
+/* Scatter/gather I/O */
+#include <sys/uio.h>
+
+/**
+ * @brief Initialize an empty ring buffer without allocating memory.
+ *
+ * @param rb
+ * Pointer to the ring buffer.
+ */
+void ringbuf_init(struct RingBuffer *rb) {
+	rb->buf = NULL;
+	rb->cap = 0;
+	rb->head = rb->tail = 0;
+}
+
+/**
+ * @brief Release the memory of a ring buffer, discarding its content.
+ *
+ * The buffer can be used again after this call.
+ *
+ * @param rb
+ * Pointer to the ring buffer.
+ */
+void ringbuf_release(struct RingBuffer *rb) {
+	free(rb->buf);
+	ringbuf_init(rb);
+}
+
+/**
+ * @brief Returns the number of bytes stored in a ring buffer.
+ *
+ * @param rb
+ * Pointer to the ring buffer.
+ *
+ * @return The number of bytes stored.
+ */
+size_t ringbuf_len(const struct RingBuffer *rb) {
+	return rb->tail - rb->head;
+}
+
+/**
+ * @brief Make sure a ring buffer can hold at least \c size bytes.
+ *
+ * The content of the buffer is preserved.
+ *
+ * @param rb
+ * Pointer to the ring buffer.
+ * @param size
+ * Minimum capacity required.
+ *
+ * @return \c 0 if successful, \c -1 if the memory could not be allocated.
+ */
+int ringbuf_reserve(struct RingBuffer *rb, size_t size) {
+	size_t newcap = rb->cap ? rb->cap : 1;
+	size_t len = ringbuf_len(rb);
+	char *newbuf;
+	if(size <= rb->cap) return 0;
+	while(newcap < size) newcap *= 2;
+	if((newbuf = malloc(newcap)) == NULL) return -1;
+	/* move the content to the beginning of the new memory */
+	ringbuf_peek(rb, newbuf, len);
+	free(rb->buf);
+	rb->buf = newbuf;
+	rb->cap = newcap;
+	rb->head = 0;
+	rb->tail = len;
+	return 0;
+}
+
+/**
+ * @brief Fill the free space of a ring buffer with a single read from a file
+ * descriptor.
+ *
+ * @param rb
+ * Pointer to the ring buffer, it must have some free space.
+ * @param fd
+ * File descriptor to read from.
+ *
+ * @return The number of bytes read, \c 0 at the end of the stream, \c -1 if
+ * an error occurred (\c errno is set by \c readv()).
+ */
+ssize_t ringbuf_read(struct RingBuffer *rb, int fd) {
+	size_t mask = rb->cap - 1;
+	size_t free_space = rb->cap - ringbuf_len(rb);
+	size_t start = rb->tail & mask;
+	struct iovec iov[2];
+	int iovcnt = 1;
+	ssize_t n;
+	/* the free space can wrap around the end of the memory */
+	iov[0].iov_base = rb->buf + start;
+	iov[0].iov_len = free_space;
+	if(start + free_space > rb->cap) {
+		iov[0].iov_len = rb->cap - start;
+		iov[1].iov_base = rb->buf;
+		iov[1].iov_len = free_space - iov[0].iov_len;
+		iovcnt = 2;
+	}
+	if((n = readv(fd, iov, iovcnt)) > 0) {
+		rb->tail += n;
+	}
+	return n;
+}
+
+/**
+ * @brief Append bytes to a ring buffer.
+ *
+ * @param rb
+ * Pointer to the ring buffer, it must have at least \c len bytes of free
+ * space.
+ * @param src
+ * Bytes to append.
+ * @param len
+ * Number of bytes to append.
+ */
+void ringbuf_write(struct RingBuffer *rb, const void *src, size_t len) {
+	size_t mask = rb->cap - 1;
+	size_t start = rb->tail & mask;
+	size_t first = len;
+	if(len == 0) return;
+	/* the free space can wrap around the end of the memory */
+	if(start + len > rb->cap) {
+		first = rb->cap - start;
+	}
+	memcpy(rb->buf + start, src, first);
+	memcpy(rb->buf, (const char *)src + first, len - first);
+	rb->tail += len;
+}
+
+/**
+ * @brief Copy bytes from a ring buffer without removing them.
+ *
+ * @param rb
+ * Pointer to the ring buffer.
+ * @param dst
+ * Destination of the copy.
+ * @param len
+ * Number of bytes to copy, at most \c ringbuf_len(rb).
+ */
+void ringbuf_peek(const struct RingBuffer *rb, void *dst, size_t len) {
+	size_t contiguous;
+	char *data;
+	if(len == 0) return;
+	data = ringbuf_data(rb, &contiguous);
+	if(len <= contiguous) {
+		memcpy(dst, data, len);
+	} else {
+		memcpy(dst, data, contiguous);
+		memcpy((char *)dst + contiguous, rb->buf, len - contiguous);
+	}
+}
+
+/**
+ * @brief Returns a pointer to the first byte stored in a ring buffer.
+ *
+ * @param rb
+ * Pointer to the ring buffer.
+ * @param contiguous
+ * Will contain the number of bytes that can be read from the returned
+ * pointer before the end of the memory wraps around.
+ *
+ * @return A pointer to the first byte stored.
+ */
+char *ringbuf_data(const struct RingBuffer *rb, size_t *contiguous) {
+	size_t start = rb->head & (rb->cap - 1);
+	size_t len = ringbuf_len(rb);
+	*contiguous = start + len > rb->cap ? rb->cap - start : len;
+	return rb->buf + start;
+}
+
+/**
+ * @brief Remove bytes from the beginning of a ring buffer.
+ *
+ * @param rb
+ * Pointer to the ring buffer.
+ * @param len
+ * Number of bytes to remove, at most \c ringbuf_len(rb).
+ */
+void ringbuf_consume(struct RingBuffer *rb, size_t len) {
+	rb->head += len;
+	/* restart from the beginning of the memory when possible, so that the
+	following data is less likely to wrap around */
+	if(rb->head == rb->tail) {
+		rb->head = rb->tail = 0;
+	}
+}
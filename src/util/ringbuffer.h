@@ -0,0 +1,147 @@
+/**
+ * @file ringbuffer.h
+ * @brief Growable byte ring buffer used to receive data from the sockets.
+ *
+ * @author Enrico Vianello (<enrico.vianello.1@studenti.unipd.it>)
+ * @version 1.0
+ * @since 1.0
+ *
+ * @copyright Copyright (c) 2016-2017, Enrico Vianello
+ */
+
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+/* Standard libraries */
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * @struct RingBuffer
+ *
+ * @brief Byte ring buffer whose capacity is always a power of two.
+ *
+ * The positions \c head and \c tail grow indefinitely and are reduced modulo
+ * the capacity only when the memory is accessed, so the buffer is empty when
+ * they are equal.
+ *
+ * @var RingBuffer::buf
+ * Memory of the buffer, \c NULL when no memory is allocated.
+ * @var RingBuffer::cap
+ * Capacity of the buffer.
+ * @var RingBuffer::head
+ * Position of the first byte stored.
+ * @var RingBuffer::tail
+ * Position following the last byte stored.
+ */
+struct RingBuffer {
+	char *buf;
+	size_t cap;
+	size_t head, tail;
+};
+
+/**
+ * @brief Initialize an empty ring buffer without allocating memory.
+ *
+ * @param rb
+ * Pointer to the ring buffer.
+ */
+void ringbuf_init(struct RingBuffer *rb);
+
+/**
+ * @brief Release the memory of a ring buffer, discarding its content.
+ *
+ * The buffer can be used again after this call.
+ *
+ * @param rb
+ * Pointer to the ring buffer.
+ */
+void ringbuf_release(struct RingBuffer *rb);
+
+/**
+ * @brief Returns the number of bytes stored in a ring buffer.
+ *
+ * @param rb
+ * Pointer to the ring buffer.
+ *
+ * @return The number of bytes stored.
+ */
+size_t ringbuf_len(const struct RingBuffer *rb);
+
+/**
+ * @brief Make sure a ring buffer can hold at least \c size bytes.
+ *
+ * The content of the buffer is preserved.
+ *
+ * @param rb
+ * Pointer to the ring buffer.
+ * @param size
+ * Minimum capacity required.
+ *
+ * @return \c 0 if successful, \c -1 if the memory could not be allocated.
+ */
+int ringbuf_reserve(struct RingBuffer *rb, size_t size);
+
+/**
+ * @brief Fill the free space of a ring buffer with a single read from a file
+ * descriptor.
+ *
+ * @param rb
+ * Pointer to the ring buffer, it must have some free space.
+ * @param fd
+ * File descriptor to read from.
+ *
+ * @return The number of bytes read, \c 0 at the end of the stream, \c -1 if
+ * an error occurred (\c errno is set by \c readv()).
+ */
+ssize_t ringbuf_read(struct RingBuffer *rb, int fd);
+
+/**
+ * @brief Append bytes to a ring buffer.
+ *
+ * @param rb
+ * Pointer to the ring buffer, it must have at least \c len bytes of free
+ * space.
+ * @param src
+ * Bytes to append.
+ * @param len
+ * Number of bytes to append.
+ */
+void ringbuf_write(struct RingBuffer *rb, const void *src, size_t len);
+
+/**
+ * @brief Copy bytes from a ring buffer without removing them.
+ *
+ * @param rb
+ * Pointer to the ring buffer.
+ * @param dst
+ * Destination of the copy.
+ * @param len
+ * Number of bytes to copy, at most \c ringbuf_len(rb).
+ */
+void ringbuf_peek(const struct RingBuffer *rb, void *dst, size_t len);
+
+/**
+ * @brief Returns a pointer to the first byte stored in a ring buffer.
+ *
+ * @param rb
+ * Pointer to the ring buffer.
+ * @param contiguous
+ * Will contain the number of bytes that can be read from the returned
+ * pointer before the end of the memory wraps around.
+ *
+ * @return A pointer to the first byte stored.
+ */
+char *ringbuf_data(const struct RingBuffer *rb, size_t *contiguous);
+
+/**
+ * @brief Remove bytes from the beginning of a ring buffer.
+ *
+ * @param rb
+ * Pointer to the ring buffer.
+ * @param len
+ * Number of bytes to remove, at most \c ringbuf_len(rb).
+ */
+void ringbuf_consume(struct RingBuffer *rb, size_t len);
+
+#endif